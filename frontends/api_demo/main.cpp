@@ -1,60 +1,554 @@
+/* Headless reference renderer for the shader.
+ * Renders the uv square of a pattern with fixed light and camera directions
+ * in the tangent frame of the surface, and writes it to a png. The image is
+ * split into tiles which are rendered by one thread per core. Each thread
+ * starts with its own share of the tiles, and takes tiles from the other
+ * shares when its own runs out.
+ * With --bench nothing is written. Instead the image is rendered a number
+ * of times for each thread count, and the throughput and timings are
+ * reported. Run with --help for the options.
+ */
 #include "woven_cloth.h"
 #include "stdlib.h"
+#include "string.h"
+#include "stdio.h"
+#include "math.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
-int main(int argc, char **argv)
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#endif
+
+#define MAX_THREADS 256
+
+typedef struct
 {
-    wcWeaveParameters params;
-    wcWeavePatternFromFile(&params, "test.wif");
-    if(params.pattern){
-        params.uscale = 1.f;
-        params.vscale = 1.f;
-        params.intensity_fineness = 0.f;
-        params.realworld_uv = 0;
-        wcFinalizeWeaveParameters(&params);
-
-        int w =500, h=500;
-        unsigned char *pixels = (unsigned char*)calloc(w*h,3);
-        float inv_w = 1.f/(float)w;
-        float inv_h = 1.f/(float)h;
-
-        wcIntersectionData intersection;
-        intersection.wi_x = 0.f;
-        intersection.wi_y = 0.f;
-        intersection.wi_z = 1.f;
-
-        intersection.wo_x = 0.f;
-        intersection.wo_y = 0.f;
-        intersection.wo_z = -1.f;
-
-        intersection.context = NULL;
-
-        printf("w: %d h: %d\n", params.pattern_width, params.pattern_height);
-        printf("yarn types: %d\n", params.num_yarn_types);
-
-        int y; int x;
-        for(y=0;y<h;y++){
-            intersection.uv_y = (float)y*inv_h;
-            for(x=0;x<w;x++){
-                intersection.uv_x = (float)x*inv_w;
-                wcPatternData pattern_data = wcGetPatternData(intersection, 
-                        &params);
-                wcColor col = wcShade(intersection, &params);
-                float pattern_type = (float) pattern_data.yarn_type /
-                    (float)(params.num_yarn_types - 1);
-                pixels[3*(x + y*h) + 0] = (unsigned char)(255.f * col.r);
-                pixels[3*(x + y*w) + 1] = (unsigned char)(255.f * col.g);
-                pixels[3*(x + y*w) + 2] = (unsigned char)(255.f * col.b);
+    const char *pattern_file;
+    const char *out_file;
+    int width, height;
+    int samples_per_pixel;
+    int tile_size;
+    int num_threads; // 0 for one per core
+    int bench;
+    int repeat; // Renders per thread count with --bench
+    int batch; // Shade the rows of a tile with wcShadeBatch
+    float wi[3]; // Direction to the light
+    float wo[3]; // Direction to the camera
+} Options;
+
+//Tiles of one thread. Both the owner and the other threads take tiles from
+// the front, so next is only changed atomically
+typedef struct
+{
+    volatile long next;
+    long end;
+    char padding[64 - sizeof(long)*2]; //Own cache line
+} TileQueue;
+
+typedef struct Render Render;
+
+typedef struct
+{
+    Render *render;
+    int index;
+    long tiles_rendered;
+    long tiles_stolen;
+} Worker;
+
+struct Render
+{
+    const Options *options;
+    const wcWeaveParameters *params;
+    float *pixels; // rgb
+    int tiles_x, tiles_y;
+    int num_threads;
+    TileQueue queues[MAX_THREADS];
+    Worker workers[MAX_THREADS];
+    double *tile_times; // Seconds per tile, if not 0
+};
+
+static long atomic_fetch_increment(volatile long *value)
+{
+#ifdef _MSC_VER
+    return InterlockedExchangeAdd(value, 1);
+#else
+    return __sync_fetch_and_add(value, 1);
+#endif
+}
+
+static double get_time()
+{
+#ifdef _WIN32
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (double)count.QuadPart/(double)frequency.QuadPart;
+#else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + 1e-9*(double)t.tv_nsec;
+#endif
+}
+
+static int number_of_cpus()
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return num_cpus > 0 ? (int)num_cpus : 1;
+#endif
+}
+
+//Uniform random numbers in [0,1), with one state per tile so that the
+// image does not depend on the order of the tiles
+static float random_float(uint32_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return (float)(*state >> 8)*(1.f/16777216.f);
+}
+
+static void render_tile(Render *render, long tile)
+{
+    const Options *options = render->options;
+    const wcWeaveParameters *params = render->params;
+    int tile_x = (int)(tile % render->tiles_x);
+    int tile_y = (int)(tile / render->tiles_x);
+    int x0 = tile_x*options->tile_size, y0 = tile_y*options->tile_size;
+    int x1 = x0 + options->tile_size, y1 = y0 + options->tile_size;
+    x1 = x1 < options->width ? x1 : options->width;
+    y1 = y1 < options->height ? y1 : options->height;
+    float inv_w = 1.f/(float)options->width;
+    float inv_h = 1.f/(float)options->height;
+    int spp = options->samples_per_pixel;
+    uint32_t random_state = 2463534242u + 747796405u*(uint32_t)tile;
+
+    wcIntersectionData intersection;
+    intersection.wi_x = options->wi[0];
+    intersection.wi_y = options->wi[1];
+    intersection.wi_z = options->wi[2];
+    intersection.wo_x = options->wo[0];
+    intersection.wo_y = options->wo[1];
+    intersection.wo_z = options->wo[2];
+    intersection.context = NULL;
+
+    //The first sample of a pixel is in its center, the others are jittered
+    int x, y, s;
+    if(options->batch){
+        //One row of the tile at a time
+        int n = (x1 - x0)*spp;
+        float *values = (float*)malloc(11*n*sizeof(float));
+        float *uv_x = values, *uv_y = values + n;
+        float *wi_x = values + 2*n, *wi_y = values + 3*n,
+            *wi_z = values + 4*n;
+        float *wo_x = values + 5*n, *wo_y = values + 6*n,
+            *wo_z = values + 7*n;
+        float *r = values + 8*n, *g = values + 9*n, *b = values + 10*n;
+        wcIntersectionDataBatch batch = {uv_x, uv_y, wi_x, wi_y, wi_z,
+            wo_x, wo_y, wo_z, NULL};
+        wcColorBatch colors = {r, g, b};
+        int i;
+        for(i = 0; i < n; i++){
+            wi_x[i] = options->wi[0]; wi_y[i] = options->wi[1];
+            wi_z[i] = options->wi[2];
+            wo_x[i] = options->wo[0]; wo_y[i] = options->wo[1];
+            wo_z[i] = options->wo[2];
+        }
+        for(y = y0; y < y1; y++){
+            i = 0;
+            for(x = x0; x < x1; x++){
+                for(s = 0; s < spp; s++){
+                    float jx = s ? random_float(&random_state) : 0.5f;
+                    float jy = s ? random_float(&random_state) : 0.5f;
+                    uv_x[i] = ((float)x + jx)*inv_w;
+                    uv_y[i] = ((float)y + jy)*inv_h;
+                    i++;
+                }
+            }
+            wcShadeBatch(&batch, (uint32_t)n, &colors, params);
+            i = 0;
+            for(x = x0; x < x1; x++){
+                float *pixel = render->pixels + 3*(x + y*options->width);
+                pixel[0] = pixel[1] = pixel[2] = 0.f;
+                for(s = 0; s < spp; s++){
+                    pixel[0] += r[i]; pixel[1] += g[i]; pixel[2] += b[i];
+                    i++;
+                }
+                pixel[0] /= (float)spp; pixel[1] /= (float)spp;
+                pixel[2] /= (float)spp;
             }
         }
-        stbi_write_png("out.png", w, h, 3, pixels, 0);
+        free(values);
+        return;
+    }
 
+    for(y = y0; y < y1; y++){
+        for(x = x0; x < x1; x++){
+            float *pixel = render->pixels + 3*(x + y*options->width);
+            pixel[0] = pixel[1] = pixel[2] = 0.f;
+            for(s = 0; s < spp; s++){
+                float jx = s ? random_float(&random_state) : 0.5f;
+                float jy = s ? random_float(&random_state) : 0.5f;
+                intersection.uv_x = ((float)x + jx)*inv_w;
+                intersection.uv_y = ((float)y + jy)*inv_h;
+                wcColor col = wcShade(intersection, params);
+                pixel[0] += col.r; pixel[1] += col.g; pixel[2] += col.b;
+            }
+            pixel[0] /= (float)spp; pixel[1] /= (float)spp;
+            pixel[2] /= (float)spp;
+        }
     }
+}
 
-    wcFreeWeavePattern(&params);
+//Takes the next tile from queue, or returns -1 if it is empty
+static long take_tile(TileQueue *queue)
+{
+    if(queue->next >= queue->end){
+        return -1;
+    }
+    long tile = atomic_fetch_increment(&queue->next);
+    return tile < queue->end ? tile : -1;
+}
 
+static void run_worker(Worker *worker)
+{
+    Render *render = worker->render;
+    int i;
+    //Own tiles first, then the other queues, starting with the next thread
+    for(i = 0; i < render->num_threads; i++){
+        TileQueue *queue =
+            &render->queues[(worker->index + i) % render->num_threads];
+        long tile;
+        while((tile = take_tile(queue)) >= 0){
+            double start = render->tile_times ? get_time() : 0.0;
+            render_tile(render, tile);
+            if(render->tile_times){
+                render->tile_times[tile] = get_time() - start;
+            }
+            worker->tiles_rendered++;
+            if(i > 0){
+                worker->tiles_stolen++;
+            }
+        }
+    }
+}
 
+#ifdef _WIN32
+static DWORD WINAPI worker_thread(LPVOID worker)
+{
+    run_worker((Worker*)worker);
+    return 0;
+}
+#else
+static void *worker_thread(void *worker)
+{
+    run_worker((Worker*)worker);
+    return 0;
+}
+#endif
+
+//Renders the image with num_threads threads, and returns the time in seconds
+static double render_image(Render *render, int num_threads)
+{
+    long num_tiles = (long)render->tiles_x*render->tiles_y;
+    int t;
+    render->num_threads = num_threads;
+    for(t = 0; t < num_threads; t++){
+        render->queues[t].next = num_tiles*t/num_threads;
+        render->queues[t].end = num_tiles*(t + 1)/num_threads;
+        render->workers[t].render = render;
+        render->workers[t].index = t;
+        render->workers[t].tiles_rendered = 0;
+        render->workers[t].tiles_stolen = 0;
+    }
+    double start = get_time();
+    //The calling thread is worker 0. If a thread can not be started, its
+    // tiles are stolen by the others
+#ifdef _WIN32
+    HANDLE threads[MAX_THREADS];
+    for(t = 1; t < num_threads; t++){
+        threads[t] = CreateThread(0, 0, worker_thread, &render->workers[t],
+            0, 0);
+    }
+    run_worker(&render->workers[0]);
+    for(t = 1; t < num_threads; t++){
+        if(threads[t]){
+            WaitForSingleObject(threads[t], INFINITE);
+            CloseHandle(threads[t]);
+        }
+    }
+#else
+    pthread_t threads[MAX_THREADS];
+    int started[MAX_THREADS];
+    for(t = 1; t < num_threads; t++){
+        started[t] = pthread_create(&threads[t], 0, worker_thread,
+            &render->workers[t]) == 0;
+    }
+    run_worker(&render->workers[0]);
+    for(t = 1; t < num_threads; t++){
+        if(started[t]){
+            pthread_join(threads[t], 0);
+        }
+    }
+#endif
+    return get_time() - start;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+//p in [0,1] of the n sorted values
+static double percentile(const double *sorted, long n, double p)
+{
+    long i = (long)(p*(double)(n - 1) + 0.5);
+    return sorted[i];
+}
+
+static void print_usage(const char *program)
+{
+    printf("Usage: %s [options] [pattern.wif]\n"
+        "  --width W, --height H  Image size (500x500)\n"
+        "  --spp N                Samples per pixel (1)\n"
+        "  --wi X,Y,Z             Direction to the light (0,0,1)\n"
+        "  --wo X,Y,Z             Direction to the camera (0,0,1)\n"
+        "  --threads N            Number of threads, 0 for one per core (0)\n"
+        "  --tile N               Tile size in pixels (32)\n"
+        "  --batch                Shade the tiles with wcShadeBatch\n"
+        "  --out FILE             Output png (out.png)\n"
+        "  --bench                Report throughput instead of writing the "
+        "image\n"
+        "  --repeat N             Renders per thread count with --bench (5)\n"
+        "The directions are given in the tangent frame of the surface, with\n"
+        "x along increasing u, y along increasing v and z along the normal.\n",
+        program);
+}
+
+//Parses "x,y,z" into a normalized direction
+static int parse_direction(const char *str, float *dir)
+{
+    if(sscanf(str, "%f,%f,%f", &dir[0], &dir[1], &dir[2]) != 3){
+        return 0;
+    }
+    float length = sqrtf(dir[0]*dir[0] + dir[1]*dir[1] + dir[2]*dir[2]);
+    if(length <= 0.f){
+        return 0;
+    }
+    dir[0] /= length; dir[1] /= length; dir[2] /= length;
+    return 1;
+}
+
+static int parse_options(int argc, char **argv, Options *options)
+{
+    options->pattern_file = "test.wif";
+    options->out_file = "out.png";
+    options->width = options->height = 500;
+    options->samples_per_pixel = 1;
+    options->tile_size = 32;
+    options->num_threads = 0;
+    options->bench = 0;
+    options->repeat = 5;
+    options->batch = 0;
+    options->wi[0] = 0.f; options->wi[1] = 0.f; options->wi[2] = 1.f;
+    options->wo[0] = 0.f; options->wo[1] = 0.f; options->wo[2] = 1.f;
+    int i;
+    for(i = 1; i < argc; i++){
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : 0;
+        int ok = 1;
+        if(strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0){
+            print_usage(argv[0]);
+            exit(0);
+        } else if(strcmp(arg, "--bench") == 0){
+            options->bench = 1;
+            continue;
+        } else if(strcmp(arg, "--batch") == 0){
+            options->batch = 1;
+            continue;
+        } else if(arg[0] != '-'){
+            options->pattern_file = arg;
+            continue;
+        } else if(!value){
+            ok = 0;
+        } else if(strcmp(arg, "--width") == 0){
+            options->width = atoi(value);
+            ok = options->width > 0;
+        } else if(strcmp(arg, "--height") == 0){
+            options->height = atoi(value);
+            ok = options->height > 0;
+        } else if(strcmp(arg, "--spp") == 0){
+            options->samples_per_pixel = atoi(value);
+            ok = options->samples_per_pixel > 0;
+        } else if(strcmp(arg, "--threads") == 0){
+            options->num_threads = atoi(value);
+            ok = options->num_threads >= 0
+                && options->num_threads <= MAX_THREADS;
+        } else if(strcmp(arg, "--tile") == 0){
+            options->tile_size = atoi(value);
+            ok = options->tile_size > 0;
+        } else if(strcmp(arg, "--repeat") == 0){
+            options->repeat = atoi(value);
+            ok = options->repeat > 0;
+        } else if(strcmp(arg, "--out") == 0){
+            options->out_file = value;
+        } else if(strcmp(arg, "--wi") == 0){
+            ok = parse_direction(value, options->wi);
+        } else if(strcmp(arg, "--wo") == 0){
+            ok = parse_direction(value, options->wo);
+        } else{
+            ok = 0;
+        }
+        if(!ok){
+            fprintf(stderr, "Invalid option %s %s\n", arg, value ? value : "");
+            print_usage(argv[0]);
+            return 0;
+        }
+        i++;
+    }
+    return 1;
+}
+
+static void write_image(const Options *options, const float *pixels)
+{
+    int n = options->width*options->height*3;
+    unsigned char *bytes = (unsigned char*)malloc(n);
+    int i;
+    for(i = 0; i < n; i++){
+        float value = pixels[i];
+        value = value < 0.f ? 0.f : (value > 1.f ? 1.f : value);
+        bytes[i] = (unsigned char)(255.f*value + 0.5f);
+    }
+    stbi_write_png(options->out_file, options->width, options->height, 3,
+        bytes, 0);
+    free(bytes);
+}
+
+static void run_benchmark(Render *render, int max_threads)
+{
+    const Options *options = render->options;
+    long num_tiles = (long)render->tiles_x*render->tiles_y;
+    double shades = (double)options->width*options->height
+        *options->samples_per_pixel;
+    double *times = (double*)malloc(options->repeat*sizeof(double));
+    double *tile_times = (double*)malloc(num_tiles*options->repeat
+        *sizeof(double));
+    double single_thread_time = 0.0;
+    int num_threads, r;
+
+    printf("%dx%d, %d spp, %ld tiles of %d pixels, %s\n", options->width,
+        options->height, options->samples_per_pixel, num_tiles,
+        options->tile_size, options->batch ? "wcShadeBatch" : "wcShade");
+    printf("%8s %12s %12s %10s %10s %8s\n", "threads", "median ms",
+        "Mshades/s", "speedup", "efficiency", "stolen");
+    //Warm up the caches and the cpu clock
+    render_image(render, max_threads);
+    num_threads = 1;
+    while(1){
+        long stolen = 0;
+        for(r = 0; r < options->repeat; r++){
+            int t;
+            //The tile timings of the last thread count are kept
+            render->tile_times = num_threads == max_threads
+                ? tile_times + num_tiles*r : 0;
+            times[r] = render_image(render, num_threads);
+            for(t = 0; t < num_threads; t++){
+                stolen += render->workers[t].tiles_stolen;
+            }
+        }
+        render->tile_times = 0;
+        qsort(times, options->repeat, sizeof(double), compare_doubles);
+        double median = percentile(times, options->repeat, 0.5);
+        if(num_threads == 1){
+            single_thread_time = median;
+        }
+        double speedup = single_thread_time/median;
+        printf("%8d %12.2f %12.2f %10.2f %9.0f%% %8ld\n", num_threads,
+            1e3*median, 1e-6*shades/median, speedup,
+            100.0*speedup/num_threads, stolen/options->repeat);
+        if(num_threads == max_threads){
+            break;
+        }
+        num_threads = 2*num_threads < max_threads ? 2*num_threads
+            : max_threads;
+    }
+
+    long n = num_tiles*options->repeat;
+    qsort(tile_times, n, sizeof(double), compare_doubles);
+    printf("Tile times with %d threads (us): p50 %.1f  p90 %.1f  p99 %.1f  "
+        "max %.1f\n", max_threads, 1e6*percentile(tile_times, n, 0.5),
+        1e6*percentile(tile_times, n, 0.9),
+        1e6*percentile(tile_times, n, 0.99), 1e6*tile_times[n - 1]);
+    printf("Render times with %d threads (ms): min %.2f  p50 %.2f  max "
+        "%.2f\n", max_threads, 1e3*times[0],
+        1e3*percentile(times, options->repeat, 0.5),
+        1e3*times[options->repeat - 1]);
+    free(times);
+    free(tile_times);
+}
+
+int main(int argc, char **argv)
+{
+    Options options;
+    if(!parse_options(argc, argv, &options)){
+        return 1;
+    }
+    wcWeaveParameters params;
+    wcInitWeaveParameters(&params);
+    wcWeavePatternFromFile(&params, options.pattern_file);
+    if(!params.pattern){
+        fprintf(stderr, "Could not load %s\n", options.pattern_file);
+        return 1;
+    }
+    params.uscale = 1.f;
+    params.vscale = 1.f;
+    params.intensity_fineness = 0.f;
+    params.realworld_uv = 0;
+    wcFinalizeWeaveParameters(&params);
+
+    printf("w: %d h: %d\n", params.pattern_width, params.pattern_height);
+    printf("yarn types: %d\n", params.num_yarn_types);
+
+    int max_threads = options.num_threads > 0 ? options.num_threads
+        : number_of_cpus();
+    max_threads = max_threads < MAX_THREADS ? max_threads : MAX_THREADS;
+
+    Render *render = (Render*)calloc(1, sizeof(Render));
+    render->options = &options;
+    render->params = &params;
+    render->pixels = (float*)calloc(options.width*options.height*3,
+        sizeof(float));
+    render->tiles_x = (options.width + options.tile_size - 1)
+        /options.tile_size;
+    render->tiles_y = (options.height + options.tile_size - 1)
+        /options.tile_size;
+
+    if(options.bench){
+        run_benchmark(render, max_threads);
+    } else{
+        double time = render_image(render, max_threads);
+        printf("Rendered %dx%d with %d spp on %d threads in %.1f ms\n",
+            options.width, options.height, options.samples_per_pixel,
+            max_threads, 1e3*time);
+        write_image(&options, render->pixels);
+    }
+
+    free(render->pixels);
+    free(render);
+    wcFreeWeavePattern(&params);
     return 0;
 }
 
@@ -68,4 +562,3 @@ wcColor wc_eval_texmap_color(void *texmap, void *context)
     wcColor ret = {1.f,1.f,1.f};
     return ret;
 }
-
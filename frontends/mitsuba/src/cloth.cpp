@@ -54,9 +54,24 @@ wcColor wc_eval_texmap_color(void *texmap, void *context) {
                             : "diffuseReflectance", Spectrum(.5f)));*/
 
                     //Set main paramaters
+                    wcInitWeaveParameters(&m_weave_params);
                     m_weave_params.uscale = props.getFloat("uscale", 1.f);
                     m_weave_params.vscale = props.getFloat("vscale", 1.f);
                     m_weave_params.realworld_uv = 0;
+                    // Optional file keeping the specular normalization
+                    // between renders
+                    m_normalization_cache =
+                        props.getString("normalization_cache", "");
+                    m_weave_params.normalization_cache =
+                        m_normalization_cache.empty() ? 0
+                        : m_normalization_cache.c_str();
+                    m_weave_params.normalization_tolerance =
+                        props.getFloat("normalization_tolerance", 0.f);
+                    // Entries in each specular table, 0 for none
+                    m_weave_params.specular_table_size =
+                        props.getInteger("specular_table_size", 0);
+                    m_weave_params.fast_math =
+                        props.getBoolean("fast_math", false) ? 1 : 0;
                     
 #ifdef USE_WIFFILE
                     // LOAD WIF FILE
@@ -96,6 +111,11 @@ wcColor wc_eval_texmap_color(void *texmap, void *context) {
                     printf("--------Before Finalize!---------\n");
                     printf("m_weave_params.pattern: %d\n", m_weave_params.pattern);
                     wcFinalizeWeaveParameters(&m_weave_params);
+                    if(m_weave_params.specular_table){
+                        printf("Specular table error: max %f mean %f\n",
+                            m_weave_params.specular_table_max_error,
+                            m_weave_params.specular_table_mean_error);
+                    }
 
                     printf("--------Managed init!---------\n");
         }
@@ -165,26 +185,12 @@ wcColor wc_eval_texmap_color(void *texmap, void *context) {
             return col;
         }
 
-        Spectrum eval(const BSDFSamplingRecord &bRec, EMeasure measure) const {
-            if (!(bRec.typeMask & EDiffuseReflection) || measure != ESolidAngle
-                    || Frame::cosTheta(bRec.wi) <= 0
-                    || Frame::cosTheta(bRec.wo) <= 0)
-                return Spectrum(0.0f);
-
-            wcIntersectionData intersection_data;
-            intersection_data.uv_x = bRec.its.uv.x;
-            intersection_data.uv_y = bRec.its.uv.y;
-            intersection_data.wi_x = bRec.wi.x;
-            intersection_data.wi_y = bRec.wi.y;
-            intersection_data.wi_z = bRec.wi.z;
-            intersection_data.wo_x = bRec.wo.x;
-            intersection_data.wo_y = bRec.wo.y;
-            intersection_data.wo_z = bRec.wo.z;
-
-            wcPatternData pattern_data = wcGetPatternData(intersection_data,
-                    &m_weave_params);
+        //Evaluates bRec at a point prepared with wcPrepareShadingPoint, so
+        // that sample() does not have to look up the pattern data again
+        Spectrum evalShadingPoint(const wcShadingPoint &point,
+                const BSDFSamplingRecord &bRec) const {
             //Intersection perturbed(bRec.its);
-            //perturbed.shFrame = getPerturbedFrame(pattern_data, bRec.its);
+            //perturbed.shFrame = getPerturbedFrame(point.data, bRec.its);
 
             //With normal displacement
             //Vector perturbed_wo = perturbed.toLocal(bRec.its.toWorld(bRec.wo));
@@ -197,21 +203,30 @@ wcColor wc_eval_texmap_color(void *texmap, void *context) {
                 diffuse_mask = 0.f;
             }
 
-            int yrntype = pattern_data.yarn_type;
-            Float sstrength=wc_yarn_type_get_specular_strength(
-                        &m_weave_params, yrntype, NULL);
-            Spectrum specular(sstrength * wcEvalSpecular(intersection_data,
-                    pattern_data, &m_weave_params));
-            wcColor diffuse = wcEvalDiffuse(intersection_data, pattern_data,
-                &m_weave_params);
+            Float sstrength = point.specular_strength;
+            Spectrum specular(sstrength * wcEvalShadingPointSpecular(&point,
+                    bRec.wi.x, bRec.wi.y, bRec.wi.z,
+                    bRec.wo.x, bRec.wo.y, bRec.wo.z, &m_weave_params));
+            //The color of the point is the diffuse color for wi.z = 1
             Spectrum col;
-            col.fromSRGB((1.f-sstrength)*diffuse.r,
-                    (1.f-sstrength)*diffuse.g,
-                    (1.f-sstrength)*diffuse.b);
+            col.fromSRGB((1.f-sstrength)*bRec.wi.z*point.color.r,
+                    (1.f-sstrength)*bRec.wi.z*point.color.g,
+                    (1.f-sstrength)*bRec.wi.z*point.color.b);
             return diffuse_mask * col*(INV_PI * Frame::cosTheta(perturbed_wo)) +
                 specular * Frame::cosTheta(bRec.wo);
         }
 
+        Spectrum eval(const BSDFSamplingRecord &bRec, EMeasure measure) const {
+            if (!(bRec.typeMask & EDiffuseReflection) || measure != ESolidAngle
+                    || Frame::cosTheta(bRec.wi) <= 0
+                    || Frame::cosTheta(bRec.wo) <= 0)
+                return Spectrum(0.0f);
+
+            wcShadingPoint point = wcPrepareShadingPoint(bRec.its.uv.x,
+                bRec.its.uv.y, 0, &m_weave_params);
+            return evalShadingPoint(point, bRec);
+        }
+
         Float pdf(const BSDFSamplingRecord &bRec, EMeasure measure) const {
             if (!(bRec.typeMask & EDiffuseReflection) || measure != ESolidAngle
                     || Frame::cosTheta(bRec.wi) <= 0
@@ -228,67 +243,17 @@ wcColor wc_eval_texmap_color(void *texmap, void *context) {
             intersection_data.wo_x = bRec.wo.x;
             intersection_data.wo_y = bRec.wo.y;
             intersection_data.wo_z = bRec.wo.z;
+            intersection_data.context = 0;
 
             wcPatternData pattern_data = wcGetPatternData(intersection_data,
                     &m_weave_params);
 
-            return warp::squareToCosineHemispherePdf(bRec.wo);
-            /*Intersection perturbed(its);
-            perturbed.shFrame = getPerturbedFrame(pattern_data, its);
-
-            return warp::squareToCosineHemispherePdf(perturbed.toLocal(
-                        its.toWorld(bRec.wo)));*/
-
+            return wcPdf(intersection_data, pattern_data, &m_weave_params);
         }
 
         Spectrum sample(BSDFSamplingRecord &bRec, const Point2 &sample) const {
-            if (!(bRec.typeMask & EDiffuseReflection)
-                    || Frame::cosTheta(bRec.wi) <= 0) return Spectrum(0.0f);
-            const Intersection& its = bRec.its;
-            wcIntersectionData intersection_data;
-            intersection_data.uv_x = its.uv.x;
-            intersection_data.uv_y = its.uv.y;
-            intersection_data.wi_x = bRec.wi.x;
-            intersection_data.wi_y = bRec.wi.y;
-            intersection_data.wi_z = bRec.wi.z;
-            intersection_data.wo_x = bRec.wo.x;
-            intersection_data.wo_y = bRec.wo.y;
-            intersection_data.wo_z = bRec.wo.z;
-
-            wcPatternData pattern_data = wcGetPatternData(intersection_data,
-                    &m_weave_params);
-            //Intersection perturbed(its);
-            //perturbed.shFrame = getPerturbedFrame(pattern_data, its);
-            //bRec.wi = perturbed.toLocal(its.toWorld(bRec.wi));
-            bRec.wo = warp::squareToCosineHemisphere(sample);
-            //With normal displacement
-            //Vector perturbed_wo = perturbed.toLocal(bRec.its.toWorld(bRec.wo));
-            //No normal displacement
-            Vector perturbed_wo = bRec.wo;
-
-            bRec.sampledComponent = 0;
-            bRec.sampledType = EDiffuseReflection;
-            bRec.eta = 1.f;
-            float diffuse_mask = 0.f;
-            if (Frame::cosTheta(perturbed_wo)
-                    * Frame::cosTheta(bRec.wo) > 0){
-                //We sample based on bRec.wo, take account of this
-                diffuse_mask = Frame::cosTheta(perturbed_wo)/
-                    Frame::cosTheta(bRec.wo);
-            }
-            
-            int yrntype = pattern_data.yarn_type;
-            Float sstrength=wc_yarn_type_get_specular_strength(
-                        &m_weave_params, yrntype, NULL);
-            Spectrum specular(sstrength * wcEvalSpecular(intersection_data,
-                    pattern_data, &m_weave_params));
-            wcColor diffuse = wcEvalDiffuse(intersection_data, pattern_data,
-                &m_weave_params);
-            Spectrum col;
-            col.fromSRGB((1.f-sstrength)*diffuse.r,
-                    (1.f-sstrength)*diffuse.g,
-                    (1.f-sstrength)*diffuse.b);
-            return diffuse_mask * col + specular;
+            Float pdf;
+            return Cloth::sample(bRec, pdf, sample);
         }
 
         Spectrum sample(BSDFSamplingRecord &bRec, Float &pdf, const Point2 &sample) const {
@@ -302,46 +267,25 @@ wcColor wc_eval_texmap_color(void *texmap, void *context) {
             intersection_data.wi_x = bRec.wi.x;
             intersection_data.wi_y = bRec.wi.y;
             intersection_data.wi_z = bRec.wi.z;
-            intersection_data.wo_x = bRec.wo.x;
-            intersection_data.wo_y = bRec.wo.y;
-            intersection_data.wo_z = bRec.wo.z;
-
-            wcPatternData pattern_data = wcGetPatternData(intersection_data,
-                    &m_weave_params);
-            //Intersection perturbed(its);
-            //perturbed.shFrame = getPerturbedFrame(pattern_data, its);
-            //bRec.wi = perturbed.toLocal(its.toWorld(bRec.wi));
-            bRec.wo = warp::squareToCosineHemisphere(sample);
-            //With normal displacement
-            //Vector perturbed_wo = perturbed.toLocal(bRec.its.toWorld(bRec.wo));
-            //No normal displacement
-            Vector perturbed_wo = bRec.wo;
-            pdf = warp::squareToCosineHemispherePdf(bRec.wo);
+            intersection_data.context = 0;
+
+            wcShadingPoint point = wcPrepareShadingPoint(its.uv.x, its.uv.y,
+                0, &m_weave_params);
+            //Samples along the specular highlight of the yarn, and cosine
+            // weighted for the diffuse part
+            pdf = wcSample(&intersection_data, point.data, &m_weave_params,
+                sample.x, sample.y);
+            if (pdf <= 0.f)
+                return Spectrum(0.0f);
+            bRec.wo = Vector(intersection_data.wo_x, intersection_data.wo_y,
+                intersection_data.wo_z);
 
             bRec.sampledComponent = 0;
             bRec.sampledType = EDiffuseReflection;
             bRec.eta = 1.f;
-            float diffuse_mask = 0.f;
-            if (Frame::cosTheta(perturbed_wo)
-                    * Frame::cosTheta(bRec.wo) > 0){
-                //We sample based on bRec.wo, take account of this
-                diffuse_mask = Frame::cosTheta(perturbed_wo)/
-                    Frame::cosTheta(bRec.wo);
-            }
-
-            int yrntype = pattern_data.yarn_type;
-            Float sstrength=wc_yarn_type_get_specular_strength(
-                        &m_weave_params, yrntype, NULL);
-            //Log(EDebug, "SPECULARSTRENGTH \"%f\"", specular_strength);
-            Spectrum specular(sstrength * wcEvalSpecular(intersection_data,
-                    pattern_data, &m_weave_params));
-            wcColor diffuse = wcEvalDiffuse(intersection_data, pattern_data,
-                &m_weave_params);
-            Spectrum col;
-            col.fromSRGB((1.f-sstrength)*diffuse.r,
-                    (1.f-sstrength)*diffuse.g,
-                    (1.f-sstrength)*diffuse.b);
-            return diffuse_mask * col + specular;
+            if (Frame::cosTheta(bRec.wo) <= 0)
+                return Spectrum(0.0f);
+            return evalShadingPoint(point, bRec) / pdf;
         }
 
         void addChild(const std::string &name, ConfigurableObject *child) {
@@ -375,6 +319,7 @@ wcColor wc_eval_texmap_color(void *texmap, void *context) {
     private:
             //ref<Texture> m_reflectance;
             wcWeaveParameters m_weave_params;
+            std::string m_normalization_cache;
 };
 
 
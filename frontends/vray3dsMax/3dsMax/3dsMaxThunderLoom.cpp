@@ -244,7 +244,7 @@ public:
 							case BN_CLICKED:
 							{
 								wchar_t *filters=
-									L"Weave Files | *.WIF\0*.WIF\0"
+									L"Weave Files | *.WIF;*.WCB\0*.WIF;*.WCB\0"
 									L"All Files | *.*\0*.*\0"
 									;
 								wchar_t buffer[512]={0};
@@ -601,7 +601,7 @@ INT_PTR YarnTypeDlgProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam)
 
 void ThunderLoomMtl::Reset() {
     //TODO(Vidar): Load default pattern...
-    memset(&m_weave_parameters,0,sizeof(wcWeaveParameters));
+    wcInitWeaveParameters(&m_weave_parameters);
     m_weave_parameters.num_yarn_types = 1;
     m_weave_parameters.yarn_types = (wcYarnType*)calloc(sizeof(wcYarnType),1);
     m_weave_parameters.yarn_types[0] = wc_default_yarn_type;
@@ -745,7 +745,26 @@ TSTR ThunderLoomMtl::GetSubTexmapTVName(int i) {
 \*===========================================================================*/
 
 #define MTL_HDR_CHUNK 0x4000
-#define YARN_TYPE_CHUNK 0x0200
+#define YARN_TYPE_CHUNK 0x0200 //Raw parameters, only read from old scenes
+#define PATTERN_CHUNK 0x0300 //Compiled pattern, see wcCompilePattern
+
+//The layout of wcWeaveParameters in YARN_TYPE_CHUNK, which was written
+//before PATTERN_CHUNK replaced it. Do not change.
+typedef struct
+{
+	float uscale;
+	float vscale;
+	float intensity_fineness;
+	uint8_t realworld_uv;
+	uint32_t pattern_height;
+	uint32_t pattern_width;
+	uint32_t num_yarn_types;
+	PatternEntry *pattern;
+	wcYarnType *yarn_types;
+	float specular_normalization;
+	float pattern_realheight;
+	float pattern_realwidth;
+} LegacyWeaveParameters;
 
 IOResult ThunderLoomMtl::Save(ISave *isave)
 {
@@ -754,20 +773,19 @@ IOResult ThunderLoomMtl::Save(ISave *isave)
 	res=MtlBase::Save(isave);
 	if(res!=IO_OK) return res;
 	isave->EndChunk();
-	isave->BeginChunk(YARN_TYPE_CHUNK);
-	//NOTE(Vidar):Save yarn types
-	ULONG nb;
-	isave->Write((unsigned char*)&PLUGIN_VERSION,
-		sizeof(int),&nb);
-
-	isave->Write((unsigned char*)&m_weave_parameters,
-		sizeof(wcWeaveParameters), &nb);
-    isave->Write((unsigned char*)m_weave_parameters.yarn_types,
-		sizeof(wcYarnType)*m_weave_parameters.num_yarn_types, &nb);
-    isave->Write((unsigned char*)m_weave_parameters.pattern,
-		sizeof(PatternEntry)*m_weave_parameters.pattern_width
-		*m_weave_parameters.pattern_height, &nb);
-    isave->EndChunk();
+	//Save the pattern and the yarn types
+	size_t size=wcCompilePattern(&m_weave_parameters,0,0);
+	if(size>0){
+		void *buffer=malloc(size);
+		if(!buffer) return IO_ERROR;
+		wcCompilePattern(&m_weave_parameters,buffer,size);
+		ULONG nb;
+		isave->BeginChunk(PATTERN_CHUNK);
+		res=isave->Write(buffer,(ULONG)size,&nb);
+		isave->EndChunk();
+		free(buffer);
+		if(res!=IO_OK) return res;
+	}
 	return IO_OK;
 }	
 
@@ -781,27 +799,93 @@ IOResult ThunderLoomMtl::Load(ILoad *iload) {
 			case MTL_HDR_CHUNK:
 				res = MtlBase::Load(iload);
 				break;
+			case PATTERN_CHUNK:
+			{
+				ULONG size=(ULONG)iload->CurChunkLength();
+				void *buffer=malloc(size);
+				if(!buffer) return IO_ERROR;
+				res=iload->Read(buffer,size,&nb);
+				if(res==IO_OK){
+					wcFreeWeavePattern(&m_weave_parameters);
+					wcWeavePatternFromWCBData(&m_weave_parameters,buffer,
+						size);
+				}
+				free(buffer);
+				break;
+			}
             case YARN_TYPE_CHUNK:
 			{
 				int version;
 				iload->Read((unsigned char*)&version,
 					sizeof(int), &nb);
 				//NOTE(Vidar):Load m_weave_parameters
-				int num_yarn_types;
-				wcWeaveParameters params;
-				iload->Read((unsigned char*)&params,
-					sizeof(wcWeaveParameters), &nb);
-				m_weave_parameters.yarn_types =
-                    (wcYarnType*)calloc(m_weave_parameters.num_yarn_types,
-					sizeof(wcYarnType));
-				iload->Read((unsigned char*)m_weave_parameters.yarn_types,
-					m_weave_parameters.num_yarn_types * sizeof(wcYarnType), &nb);
-				int num_entries = params.pattern_width * params.pattern_height;
-				m_weave_parameters.pattern = (PatternEntry*)calloc(num_entries,
+				LegacyWeaveParameters params;
+				res=iload->Read((unsigned char*)&params,
+					sizeof(LegacyWeaveParameters), &nb);
+				if(res!=IO_OK) break;
+				size_t num_entries=(size_t)params.pattern_width
+					*params.pattern_height;
+				//Chunks of another layout are skipped, rather than misread
+				if((size_t)iload->CurChunkLength()!=sizeof(int)
+					+sizeof(LegacyWeaveParameters)
+					+params.num_yarn_types*sizeof(wcYarnType)
+					+num_entries*sizeof(PatternEntry)
+					|| params.num_yarn_types==0 || num_entries==0){
+					break;
+				}
+				wcYarnType *yarn_types=(wcYarnType*)calloc(
+					params.num_yarn_types,sizeof(wcYarnType));
+				PatternEntry *pattern=(PatternEntry*)calloc(num_entries,
 					sizeof(PatternEntry));
-				iload->Read((unsigned char*)m_weave_parameters.pattern,
-					num_entries * sizeof(PatternEntry), &nb);
-				m_weave_parameters = params;
+				if(!yarn_types || !pattern){
+					free(yarn_types);
+					free(pattern);
+					return IO_ERROR;
+				}
+				iload->Read((unsigned char*)yarn_types,
+					params.num_yarn_types*sizeof(wcYarnType),&nb);
+				res=iload->Read((unsigned char*)pattern,
+					num_entries*sizeof(PatternEntry),&nb);
+				for(size_t i=0;i<num_entries;i++){
+					if(pattern[i].yarn_type>=params.num_yarn_types){
+						pattern[i].yarn_type=0;
+					}
+				}
+				//The texmaps are set again in renderBegin
+				for(uint32_t i=0;i<params.num_yarn_types;i++){
+				#define WC_FLOAT_PARAM(name) yarn_types[i].name##_texmap=0;
+				#define WC_INT_PARAM(name) yarn_types[i].name##_texmap=0;
+				#define WC_COLOR_PARAM(name) yarn_types[i].name##_texmap=0;
+					WC_YARN_PARAMETERS
+				#undef WC_FLOAT_PARAM
+				#undef WC_INT_PARAM
+				#undef WC_COLOR_PARAM
+				}
+				wcFreeWeavePattern(&m_weave_parameters);
+				m_weave_parameters.uscale=params.uscale;
+				m_weave_parameters.vscale=params.vscale;
+				m_weave_parameters.intensity_fineness=
+					params.intensity_fineness;
+				m_weave_parameters.realworld_uv=params.realworld_uv;
+				m_weave_parameters.pattern_height=params.pattern_height;
+				m_weave_parameters.pattern_width=params.pattern_width;
+				m_weave_parameters.num_yarn_types=params.num_yarn_types;
+				m_weave_parameters.pattern=pattern;
+				m_weave_parameters.yarn_types=yarn_types;
+				m_weave_parameters.specular_normalization=
+					params.specular_normalization;
+				m_weave_parameters.pattern_realheight=
+					params.pattern_realheight;
+				m_weave_parameters.pattern_realwidth=
+					params.pattern_realwidth;
+				m_weave_parameters.segment_table = 0;
+				m_weave_parameters.run_length_index = 0;
+				m_weave_parameters.bitplane_index = 0;
+				m_weave_parameters.resolved_yarn_types = 0;
+				m_weave_parameters.specular_table = 0;
+				m_weave_parameters.compiled_pattern = 0;
+				m_weave_parameters.compiled_pattern_size = 0;
+				m_weave_parameters.pattern_cache_entry = 0;
 				break;
 			}
 		}
@@ -822,6 +906,15 @@ RefTargetHandle ThunderLoomMtl::Clone(RemapDir &remap) {
 	mnew->ReplaceReference(0, remap.CloneRef(pblock));
 	mnew->ivalid.SetEmpty();	
 	mnew->m_weave_parameters=m_weave_parameters;
+	mnew->m_weave_parameters.segment_table=0;
+	mnew->m_weave_parameters.run_length_index=0;
+	mnew->m_weave_parameters.bitplane_index=0;
+	mnew->m_weave_parameters.resolved_yarn_types=0;
+	mnew->m_weave_parameters.specular_table=0;
+	mnew->m_weave_parameters.normalization_cache=0;
+	mnew->m_weave_parameters.compiled_pattern=0;
+	mnew->m_weave_parameters.compiled_pattern_size=0;
+	mnew->m_weave_parameters.pattern_cache_entry=0;
 	if(m_weave_parameters.pattern){
 		int num_entries=m_weave_parameters.pattern_width *
 			m_weave_parameters.pattern_height;
@@ -896,14 +989,28 @@ float ThunderLoomMtl::WireSize(int mtlNum, BOOL backFace) {
  |	Render intialization and deinitialization (From VUtils::VRenderMtl)
 \*===========================================================================*/
 
+//All materials share one normalization cache in the temp directory
+static const char *normalizationCacheFile() {
+	static char filename[MAX_PATH]={0};
+	if(!filename[0]){
+		char dir[MAX_PATH];
+		DWORD len=GetTempPathA(MAX_PATH,dir);
+		if(len==0 || len+32>=MAX_PATH){
+			return 0;
+		}
+		sprintf(filename,"%sthunderloom_normalization.cache",dir);
+	}
+	return filename;
+}
+
 void ThunderLoomMtl::renderBegin(TimeValue t, VR::VRayRenderer *vray) {
 	ivalid.SetInfinite();
 
 	//default values for the time being.
 	//these paramters will be removed later, is the plan
 
-	wcFinalizeWeaveParameters(&m_weave_parameters);
-    
+    //The texmaps are set before finalizing, since the finalized parameters
+    //hold a copy of them
     if(m_weave_parameters.pattern){
 		for(int i=0;i<m_weave_parameters.num_yarn_types;i++){
 			wcYarnType *yarn_type=&m_weave_parameters.yarn_types[i];
@@ -915,6 +1022,16 @@ void ThunderLoomMtl::renderBegin(TimeValue t, VR::VRayRenderer *vray) {
 		}
 	}
 
+	//The fabric parameters are not saved with the pattern
+	int realworld;
+	pblock->GetValue(mtl_realworld,t,realworld,ivalid);
+	m_weave_parameters.realworld_uv=realworld;
+	pblock->GetValue(mtl_uscale,t,m_weave_parameters.uscale,ivalid);
+	pblock->GetValue(mtl_vscale,t,m_weave_parameters.vscale,ivalid);
+
+	m_weave_parameters.normalization_cache=normalizationCacheFile();
+	wcFinalizeWeaveParameters(&m_weave_parameters);
+
 	const VR::VRaySequenceData &sdata=vray->getSequenceData();
 	bsdfPool.init(sdata.maxRenderThreads);
 }
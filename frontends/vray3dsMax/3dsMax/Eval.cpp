@@ -10,7 +10,8 @@ using namespace VUtils;
 
 void EvalDiffuseFunc (const VUtils::VRayContext &rc,
     wcWeaveParameters *weave_parameters, VUtils::Color *diffuse_color,
-	wcYarnType* yarn_type, int* yarn_type_id)
+	wcYarnType* yarn_type, int* yarn_type_id, wcShadingPoint *shading_point,
+    Point3 *frame)
 {
     if(weave_parameters->pattern == 0){ //Invalid pattern
         *diffuse_color = VUtils::Color(1.f,1.f,0.f);
@@ -18,7 +19,6 @@ void EvalDiffuseFunc (const VUtils::VRayContext &rc,
 		*yarn_type_id = 0;
         return;
     }
-    wcIntersectionData intersection_data;
    
     const VR::VRayInterface &vri_const=static_cast<const VR::VRayInterface&>(rc);
 	VR::VRayInterface &vri=const_cast<VR::VRayInterface&>(vri_const);
@@ -26,29 +26,37 @@ void EvalDiffuseFunc (const VUtils::VRayContext &rc,
 
     Point3 uv = sc.UVW(1);
 
-    intersection_data.uv_x = uv.x;
-    intersection_data.uv_y = uv.y;
-    intersection_data.wi_z = 1.f;
+    //The pattern data and the texmaps are evaluated once here,
+    // and reused by EvalSpecularFunc for all light directions
+    *shading_point = wcPrepareShadingPoint(uv.x, uv.y, &sc,
+        weave_parameters);
+	*yarn_type_id = shading_point->data.yarn_type;
+	*yarn_type = weave_parameters->yarn_types[shading_point->data.yarn_type];
 
-    intersection_data.context = &sc;
+    // UVW derivatives
+    Point3 dpdUVW[3];
+    sc.DPdUVW(dpdUVW,1);
 
-    wcPatternData pattern_data = wcGetPatternData(intersection_data,
-        weave_parameters);
-	*yarn_type_id = pattern_data.yarn_type;
-	*yarn_type = weave_parameters->yarn_types[pattern_data.yarn_type];
-    float specular_strength = wc_yarn_type_get_specular_strength(
-        weave_parameters,pattern_data.yarn_type,&sc);
-    wcColor d = 
-        wcEvalDiffuse( intersection_data, pattern_data, weave_parameters);
-    float factor = (1.f - specular_strength);
-    diffuse_color->r = factor*d.r;
-    diffuse_color->g = factor*d.g;
-    diffuse_color->b = factor*d.b;
+    Point3 n_vec = sc.Normal().Normalize();
+    Point3 u_vec = dpdUVW[0].Normalize();
+    Point3 v_vec = dpdUVW[1].Normalize();
+    u_vec = v_vec ^ n_vec;
+    v_vec = n_vec ^ u_vec;
+    frame[0] = u_vec;
+    frame[1] = v_vec;
+    frame[2] = n_vec;
+
+    //The color of the shading point is the diffuse color for wi_z = 1
+    float factor = (1.f - shading_point->specular_strength);
+    diffuse_color->r = factor*shading_point->color.r;
+    diffuse_color->g = factor*shading_point->color.g;
+    diffuse_color->b = factor*shading_point->color.b;
 }
 
 void EvalSpecularFunc ( const VUtils::VRayContext &rc,
 const VUtils::Vector &direction, wcWeaveParameters *weave_parameters,
-VUtils::Matrix nm, VUtils::Color *reflection_color)
+const wcShadingPoint *shading_point, const Point3 *frame,
+VUtils::Color *reflection_color)
 {
     if(weave_parameters->pattern == 0){ //Invalid pattern
 		float s = 0.1f;
@@ -57,14 +65,11 @@ VUtils::Matrix nm, VUtils::Color *reflection_color)
 		reflection_color->b = s;
 		return;
     }
-    wcIntersectionData intersection_data;
    
     const VR::VRayInterface &vri_const=static_cast<const VR::VRayInterface&>(rc);
 	VR::VRayInterface &vri=const_cast<VR::VRayInterface&>(vri_const);
 	ShadeContext &sc=static_cast<ShadeContext&>(vri);
 
-    Point3 uv = sc.UVW(1);
-
     //Convert the view and light directions to the correct coordinate system
     Point3 viewDir, lightDir;
     viewDir.x = -rc.rayparams.viewDir.x;
@@ -79,36 +84,16 @@ VUtils::Matrix nm, VUtils::Color *reflection_color)
     lightDir = sc.VectorFrom(lightDir,REF_WORLD);
     lightDir = lightDir.Normalize();
 
-    // UVW derivatives
-    Point3 dpdUVW[3];
-    sc.DPdUVW(dpdUVW,1);
-
-    Point3 n_vec = sc.Normal().Normalize();
-    Point3 u_vec = dpdUVW[0].Normalize();
-    Point3 v_vec = dpdUVW[1].Normalize();
-    u_vec = v_vec ^ n_vec;
-    v_vec = n_vec ^ u_vec;
-
-    intersection_data.wi_x = DotProd(lightDir, u_vec);
-    intersection_data.wi_y = DotProd(lightDir, v_vec);
-    intersection_data.wi_z = DotProd(lightDir, n_vec);
-
-    intersection_data.wo_x = DotProd(viewDir, u_vec);
-    intersection_data.wo_y = DotProd(viewDir, v_vec);
-    intersection_data.wo_z = DotProd(viewDir, n_vec);
+    const Point3 &u_vec = frame[0];
+    const Point3 &v_vec = frame[1];
+    const Point3 &n_vec = frame[2];
 
-    intersection_data.uv_x = uv.x;
-    intersection_data.uv_y = uv.y;
-
-    intersection_data.context = &sc;
-
-    wcPatternData pattern_data = wcGetPatternData(intersection_data,
-        weave_parameters);
-	//DBOUT("pattern_data.yarn_hit: "<< pattern_data.yarn_hit);
-    float specular_strength = wc_yarn_type_get_specular_strength(
-        weave_parameters,pattern_data.yarn_type,&sc);
-    float s = specular_strength *
-        wcEvalSpecular(intersection_data, pattern_data, weave_parameters);
+    float s = shading_point->specular_strength *
+        wcEvalShadingPointSpecular(shading_point,
+            DotProd(lightDir, u_vec), DotProd(lightDir, v_vec),
+            DotProd(lightDir, n_vec),
+            DotProd(viewDir, u_vec), DotProd(viewDir, v_vec),
+            DotProd(viewDir, n_vec), weave_parameters);
     reflection_color->r = s;
     reflection_color->g = s;
     reflection_color->b = s;
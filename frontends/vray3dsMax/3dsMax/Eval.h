@@ -13,10 +13,14 @@
 #include "render.h"
 #include "shadedata_new.h"
 
+//Prepares the shading point and the tangent frame (u, v, normal) of the
+// intersection in rc, which are then used by EvalSpecularFunc for each light
 void EvalDiffuseFunc (const VUtils::VRayContext &rc,
     wcWeaveParameters *weave_parameters, VUtils::Color *diffuse_color,
-	wcYarnType *yarn_type, int *yarn_type_id);
+	wcYarnType *yarn_type, int *yarn_type_id, wcShadingPoint *shading_point,
+    Point3 *frame);
 
 void EvalSpecularFunc ( const VUtils::VRayContext &rc,
     const VUtils::Vector &direction, wcWeaveParameters *weave_parameters,
-    VUtils::Matrix nm, VUtils::Color *reflection_color);
\ No newline at end of file
+    const wcShadingPoint *shading_point, const Point3 *frame,
+    VUtils::Color *reflection_color);
\ No newline at end of file
@@ -19,6 +19,8 @@ protected:
 	Texmap **m_texmaps;
 	wcYarnType m_yarn_type;
 	int m_yarn_type_id;
+	wcShadingPoint m_shading_point;
+	Point3 m_frame[3]; // Tangent frame of the pattern: u, v and the normal
 
 public:
 
@@ -0,0 +1,252 @@
+/* Converts WIF files to compiled patterns (.wcb), see the compiled patterns
+ * section of woven_cloth.h.
+ * Each argument is a WIF file, or a directory of which all .wif files are
+ * converted. The directories are not searched recursively. Each .wcb file is
+ * written next to its WIF file, or to the directory given with --out.
+ * The patterns are finalized with the default yarn parameters, so the
+ * stored specular normalization is used as long as a material keeps those.
+ * Run with --help for the options.
+ */
+#include "woven_cloth.h"
+#include "stdlib.h"
+#include "string.h"
+#include "stdio.h"
+#include "ctype.h"
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#define PATH_SEPARATOR '\\'
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#define PATH_SEPARATOR '/'
+#endif
+
+#define MAX_PATH_LENGTH 4096
+
+typedef struct
+{
+    const char *out_dir; // 0 to write next to the WIF files
+    int segment_lookup; // One of the WC_SEGMENT_LOOKUP_* values
+    float normalization_tolerance;
+    int num_threads; // 0 for one per core
+    int quiet;
+} Options;
+
+float wc_eval_texmap_mono(void *texmap, void *context) { return 1.f; }
+wcColor wc_eval_texmap_color(void *texmap, void *context)
+{
+    wcColor ret = {1.f, 1.f, 1.f};
+    return ret;
+}
+
+static void print_usage(const char *program)
+{
+    printf("Usage: %s [options] file.wif|directory...\n", program);
+    printf("  --out dir         Write the .wcb files to dir\n");
+    printf("  --lookup kind     Segment lookup to store: default, walk, "
+        "table,\n");
+    printf("                    run_length or bitplane (default)\n");
+    printf("  --tolerance t     Error at which the sampling of the specular\n");
+    printf("                    normalization stops (%g)\n",
+        WC_NORMALIZATION_DEFAULT_TOLERANCE);
+    printf("  --threads n       Threads used to finalize, 0 for one per core "
+        "(0)\n");
+    printf("  --quiet           Only print errors\n");
+}
+
+static int parse_lookup(const char *value, int *lookup)
+{
+    const char *names[] = {"default", "walk", "table", "run_length",
+        "bitplane"};
+    int i;
+    for(i = 0; i < 5; i++){
+        if(strcmp(value, names[i]) == 0){
+            *lookup = i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int is_wif_file(const char *filename)
+{
+    size_t len = strlen(filename);
+    return len >= 4 && filename[len - 4] == '.'
+        && tolower(filename[len - 3]) == 'w'
+        && tolower(filename[len - 2]) == 'i'
+        && tolower(filename[len - 1]) == 'f';
+}
+
+//Returns 1 if the file was converted
+static int compile_file(const char *wif_file, const Options *options)
+{
+    char wcb_file[MAX_PATH_LENGTH];
+    const char *name = wif_file;
+    const char *p;
+    for(p = wif_file; *p; p++){
+        if(*p == '/' || *p == PATH_SEPARATOR){
+            name = p + 1;
+        }
+    }
+    int len;
+    if(options->out_dir){
+        len = snprintf(wcb_file, MAX_PATH_LENGTH, "%s%c%.*s.wcb",
+            options->out_dir, PATH_SEPARATOR, (int)strlen(name) - 4, name);
+    } else{
+        len = snprintf(wcb_file, MAX_PATH_LENGTH, "%.*s.wcb",
+            (int)strlen(wif_file) - 4, wif_file);
+    }
+    if(len < 0 || len >= MAX_PATH_LENGTH){
+        fprintf(stderr, "Path too long: %s\n", wif_file);
+        return 0;
+    }
+
+    wcWeaveParameters params;
+    wcInitWeaveParameters(&params);
+    params.segment_lookup = (uint8_t)options->segment_lookup;
+    params.normalization_tolerance = options->normalization_tolerance;
+    params.finalize_threads = options->num_threads;
+    params.uscale = params.vscale = 1.f;
+    wcWeavePatternFromWIF(&params, wif_file);
+    int ok = params.pattern != 0;
+    if(!ok){
+        fprintf(stderr, "Could not load %s\n", wif_file);
+    } else if(!wcWriteCompiledPattern(&params, wcb_file)){
+        fprintf(stderr, "Could not write %s\n", wcb_file);
+        ok = 0;
+    } else if(!options->quiet){
+        printf("%s -> %s (%ux%u, %u yarn types, %.1f kB)\n", wif_file,
+            wcb_file, params.pattern_width, params.pattern_height,
+            params.num_yarn_types,
+            (double)wcCompilePattern(&params, 0, 0)/1024.0);
+    }
+    wcFreeWeavePattern(&params);
+    return ok;
+}
+
+//Converts all WIF files in the directory. Returns the number of failures
+static int compile_directory(const char *dir, const Options *options)
+{
+    char path[MAX_PATH_LENGTH];
+    int failures = 0;
+#ifdef _WIN32
+    WIN32_FIND_DATAA find_data;
+    snprintf(path, MAX_PATH_LENGTH, "%s\\*", dir);
+    HANDLE find = FindFirstFileA(path, &find_data);
+    if(find == INVALID_HANDLE_VALUE){
+        fprintf(stderr, "Could not open %s\n", dir);
+        return 1;
+    }
+    do{
+        if(!(find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+                && is_wif_file(find_data.cFileName)){
+            snprintf(path, MAX_PATH_LENGTH, "%s\\%s", dir,
+                find_data.cFileName);
+            failures += !compile_file(path, options);
+        }
+    } while(FindNextFileA(find, &find_data));
+    FindClose(find);
+#else
+    DIR *d = opendir(dir);
+    struct dirent *entry;
+    if(!d){
+        fprintf(stderr, "Could not open %s\n", dir);
+        return 1;
+    }
+    while((entry = readdir(d))){
+        struct stat st;
+        snprintf(path, MAX_PATH_LENGTH, "%s/%s", dir, entry->d_name);
+        if(is_wif_file(entry->d_name) && stat(path, &st) == 0
+                && S_ISREG(st.st_mode)){
+            failures += !compile_file(path, options);
+        }
+    }
+    closedir(d);
+#endif
+    return failures;
+}
+
+static int is_directory(const char *path)
+{
+#ifdef _WIN32
+    DWORD attributes = GetFileAttributesA(path);
+    return attributes != INVALID_FILE_ATTRIBUTES
+        && (attributes & FILE_ATTRIBUTE_DIRECTORY);
+#else
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+#endif
+}
+
+int main(int argc, char **argv)
+{
+    Options options;
+    options.out_dir = 0;
+    options.segment_lookup = WC_SEGMENT_LOOKUP_DEFAULT;
+    options.normalization_tolerance = 0.f;
+    options.num_threads = 0;
+    options.quiet = 0;
+    int num_paths = 0, failures = 0;
+    int i;
+    for(i = 1; i < argc; i++){
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : 0;
+        int ok = 1;
+        if(strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0){
+            print_usage(argv[0]);
+            return 0;
+        } else if(strcmp(arg, "--quiet") == 0){
+            options.quiet = 1;
+            continue;
+        } else if(arg[0] != '-'){
+            num_paths++;
+            continue;
+        } else if(!value){
+            ok = 0;
+        } else if(strcmp(arg, "--out") == 0){
+            options.out_dir = value;
+            ok = is_directory(value);
+        } else if(strcmp(arg, "--lookup") == 0){
+            ok = parse_lookup(value, &options.segment_lookup);
+        } else if(strcmp(arg, "--tolerance") == 0){
+            options.normalization_tolerance = (float)atof(value);
+            ok = options.normalization_tolerance > 0.f;
+        } else if(strcmp(arg, "--threads") == 0){
+            options.num_threads = atoi(value);
+            ok = options.num_threads >= 0;
+        } else{
+            ok = 0;
+        }
+        if(!ok){
+            fprintf(stderr, "Invalid option %s %s\n", arg, value ? value : "");
+            print_usage(argv[0]);
+            return 1;
+        }
+        i++;
+    }
+    if(num_paths == 0){
+        print_usage(argv[0]);
+        return 1;
+    }
+    //The options are all read before any file is converted
+    for(i = 1; i < argc; i++){
+        const char *arg = argv[i];
+        if(strcmp(arg, "--quiet") == 0){
+            continue;
+        } else if(arg[0] == '-'){
+            i++;
+        } else if(is_directory(arg)){
+            failures += compile_directory(arg, &options);
+        } else if(is_wif_file(arg)){
+            failures += !compile_file(arg, &options);
+        } else{
+            fprintf(stderr, "Not a WIF file: %s\n", arg);
+            failures++;
+        }
+    }
+    return failures > 0 ? 1 : 0;
+}
@@ -1,7 +1,25 @@
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifndef WC_NO_THREADS
+#include <pthread.h>
+#endif
+#endif
 #include "wif.h"
-#include "ini.h" //TODO(Vidar): Write this ourselves
 
 //TODO(Vidar):Report errors in a proper way, not by printf
 
@@ -35,12 +53,19 @@ const uint32_t DATA_ALL_SECTIONS = DATA_WARP_SECTION | DATA_WEFT_SECTION |
     DATA_COLOR_TABLE_SECTION | DATA_WARP_COLORS_SECTION | 
     DATA_WEFT_COLORS_SECTION;
 
-static int string_to_float(const char *str, float *val)
+//A string in the mapped file, which is not null terminated
+typedef struct
 {
+    const char *str, *end;
+} WifToken;
+
+static int string_to_float(WifToken token, float *val)
+{
+    const char *str = token.str;
     uint32_t accum  = 0;
     uint32_t scale = 10;
     char dot_encountered = 0;
-    while(*str){
+    while(str < token.end){
         if(*str == '.'){
             dot_encountered = 1;
         }else{
@@ -61,6 +86,59 @@ static int string_to_float(const char *str, float *val)
     return 1;
 }
 
+static int is_space(char c)
+{
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+//Same as atoi, but stops at the end of the token. *next is set
+// to the first character after the number.
+static int32_t token_to_int(const char *str, const char *end,
+    const char **next)
+{
+    uint32_t accum = 0;
+    uint8_t negative = 0;
+    while(str < end && is_space(*str)){
+        str++;
+    }
+    if(str < end && (*str == '-' || *str == '+')){
+        negative = *str == '-';
+        str++;
+    }
+    while(str < end && (uint32_t)(*str - '0') <= 9){
+        accum = 10*accum + (uint32_t)(*str - '0');
+        str++;
+    }
+    *next = str;
+    return (int32_t)(negative ? 0u - accum : accum);
+}
+
+static uint32_t token_to_uint(WifToken token)
+{
+    const char *next;
+    return (uint32_t)token_to_int(token.str, token.end, &next);
+}
+
+static int token_equals(WifToken token, const char *str, size_t length)
+{
+    return (size_t)(token.end - token.str) == length
+        && memcmp(token.str, str, length) == 0;
+}
+#define TOKEN_EQUALS(token,str) token_equals(token, str, sizeof(str) - 1)
+
+//Prints an error, unless the file is being parsed in parallel. Then the
+// file is parsed again on one thread if there was an error, to print the
+// errors in order.
+static void wif_error(const WeaveData *data, const char *format, ...)
+{
+    if(!data->quiet){
+        va_list args;
+        va_start(args, format);
+        vprintf(format, args);
+        va_end(args);
+    }
+}
+
 static const char *get_section_name(uint32_t section)
 {
     switch(section){
@@ -90,14 +168,15 @@ static const char *get_section_name(uint32_t section)
 }
 
 #define CHECK_KEY(key,section,name) if(!(data->read_keys & key)){ \
-    printf("ERROR! Missing key \"" name "\" in section \"" section "\"\n");\
+    wif_error(data, "ERROR! Missing key \"" name "\" in section \"" \
+        section "\"\n");\
     return 1;}
 //NOTE(Vidar): Returns 1 if there was an error
 static uint8_t set_section(WeaveData *data, uint32_t section)
 {
     if(section != data->current_section){
         if(section & data->read_sections){
-            printf("ERROR! section \"%s\" appeared twice!\n",
+            wif_error(data, "ERROR! section \"%s\" appeared twice!\n",
                     get_section_name(section));
             return 1;
         }
@@ -126,244 +205,895 @@ static uint8_t set_section(WeaveData *data, uint32_t section)
     return 0;
 }
 
-static int32_t handler(void* user_data, const char* section, const char* name,
-                   const char* value)
+//Returns the section with the given name, or 0 if it is not one
+// of the sections we read
+static uint32_t section_from_name(WifToken name)
 {
-    WeaveData *data = (WeaveData*)user_data;
-    WarpOrWeftData *wdata = 0;
-    if(strcmp("WARP",section)==0){
-        if(set_section(data, DATA_WARP_SECTION)) return 0;
-        wdata = &data->warp;
-    }
-    if(strcmp("WEFT",section)==0){
-        if(set_section(data, DATA_WEFT_SECTION)) return 0;
-        wdata = &data->weft;
+    switch(name.end - name.str){
+        case 4:
+            if(TOKEN_EQUALS(name, "WARP")) return DATA_WARP_SECTION;
+            if(TOKEN_EQUALS(name, "WEFT")) return DATA_WEFT_SECTION;
+            break;
+        case 5:
+            if(TOKEN_EQUALS(name, "TIEUP")) return DATA_TIEUP_SECTION;
+            break;
+        case 7:
+            if(TOKEN_EQUALS(name, "WEAVING")) return DATA_WEAVING_SECTION;
+            break;
+        case 9:
+            if(TOKEN_EQUALS(name, "THREADING")) return DATA_THREADING_SECTION;
+            if(TOKEN_EQUALS(name, "TREADLING")) return DATA_TREADLING_SECTION;
+            break;
+        case 11:
+            if(TOKEN_EQUALS(name, "COLOR TABLE")){
+                return DATA_COLOR_TABLE_SECTION;
+            }
+            if(TOKEN_EQUALS(name, "WARP COLORS")){
+                return DATA_WARP_COLORS_SECTION;
+            }
+            if(TOKEN_EQUALS(name, "WEFT COLORS")){
+                return DATA_WEFT_COLORS_SECTION;
+            }
+            break;
+        case 13:
+            if(TOKEN_EQUALS(name, "COLOR PALETTE")){
+                return DATA_COLOR_PALETTE_SECTION;
+            }
+            break;
     }
-    if(wdata){
-        if(strcmp("Threads",name)==0){
+    return 0;
+}
+
+#define TOKEN_ARG(token) (int)((token).end - (token).str), (token).str
+//Reads one key of the given section, without checking the order of the
+// sections. Returns 0 if there was an error
+static int32_t handle_key(WeaveData *data, uint32_t section, WifToken name,
+                   WifToken value)
+{
+    switch(section){
+    case DATA_WARP_SECTION:
+    case DATA_WEFT_SECTION: {
+        WarpOrWeftData *wdata = section == DATA_WARP_SECTION ? &data->warp
+            : &data->weft;
+        if(TOKEN_EQUALS(name, "Threads")){
             data->read_keys |= WARP_OR_WEFT_THREADS_KEY;
-            uint32_t v = (uint32_t)atoi(value);
+            uint32_t v = token_to_uint(value);
             if(v == 0){
-                printf("ERROR! Threads cannot be 0\n");
+                wif_error(data, "ERROR! Threads cannot be 0\n");
                 return 0;
             }
             wdata->num_threads = v;
-        }
-        if(strcmp("Spacing",name)==0){
+        } else if(TOKEN_EQUALS(name, "Spacing")){
             data->read_keys |= WARP_OR_WEFT_SPACING_KEY;
             if(!string_to_float(value,&wdata->spacing)){
-                printf("could not read %s in [%s]!\n",name,section);
+                wif_error(data, "could not read %.*s in [%s]!\n",
+                    TOKEN_ARG(name), get_section_name(section));
                 return 0;
             }
-        }
-        if(strcmp("Thickness",name)==0){
+        } else if(TOKEN_EQUALS(name, "Thickness")){
             data->read_keys |= WARP_OR_WEFT_THICKNESS_KEY;
             if(!string_to_float(value,&wdata->thickness)){
-                printf("could not read %s in [%s]!\n",name,section);
+                wif_error(data, "could not read %.*s in [%s]!\n",
+                    TOKEN_ARG(name), get_section_name(section));
                 return 0;
             }
         }
+        break;
     }
-    if(strcmp("WEAVING",section)==0){
-        if(set_section(data, DATA_WEAVING_SECTION)) return 0;
-        if(strcmp("Shafts",name)==0){
+    case DATA_WEAVING_SECTION:
+        if(TOKEN_EQUALS(name, "Shafts")){
             data->read_keys |= WEAVING_SHAFTS_KEY;
-            uint32_t v = (uint32_t)atoi(value);
+            uint32_t v = token_to_uint(value);
             if(v == 0){
-                printf("ERROR! Shafts cannot be 0\n");
+                wif_error(data, "ERROR! Shafts cannot be 0\n");
                 return 0;
             }
             data->num_shafts = v;
-        }
-        if(strcmp("Treadles",name)==0){
+        } else if(TOKEN_EQUALS(name, "Treadles")){
             data->read_keys |= WEAVING_TREADLES_KEY;
-            uint32_t v = (uint32_t)atoi(value);
+            uint32_t v = token_to_uint(value);
             if(v == 0){
-                printf("ERROR! Treadles cannot be 0\n");
+                wif_error(data, "ERROR! Treadles cannot be 0\n");
                 return 0;
             }
             data->num_treadles = v;
         }
-    }
-    if(strcmp("TIEUP",section)==0){
-        if(set_section(data, DATA_TIEUP_SECTION)) return 0;
+        break;
+    case DATA_TIEUP_SECTION: {
         const char *p;
         uint32_t x;
         uint32_t num_tieup_entries = data->num_treadles * data->num_shafts;
         if(num_tieup_entries <= 0){
-            printf("Tieup section appeared before specification of "
+            wif_error(data, "Tieup section appeared before specification of "
                     "Shafts and Treadles!\n");
             return 0;
         }
         if(data->tieup == 0){
             data->tieup = (uint8_t*)calloc(num_tieup_entries,sizeof(uint8_t));
         }
-        uint32_t index = (uint32_t)atoi(name);
+        uint32_t index = token_to_uint(name);
         if(index > data->num_treadles || index == 0){
-            printf("ERROR! Tieup entry %s is invalid\n", name);
+            wif_error(data, "ERROR! Tieup entry %.*s is invalid\n",
+                TOKEN_ARG(name));
             return 0;
         }
         x = data->num_treadles - index;
-        for(p = value; p != NULL && *p != '\0';){
-            uint32_t entry = (uint32_t)atoi(p);
+        //Each entry is read once, continuing from where the
+        // previous number ended
+        for(p = value.str; p < value.end;){
+            uint32_t entry = (uint32_t)token_to_int(p, value.end, &p);
             if(entry > data->num_shafts || entry == 0){
-                printf("ERROR! Tieup entry %s contains the invalid value %d\n",
-                        name, entry);
+                wif_error(data, "ERROR! Tieup entry %.*s contains the "
+                        "invalid value %d\n", TOKEN_ARG(name), entry);
                 return 0;
             }
             uint32_t y = data->num_shafts - entry;
             data->tieup[x + y*data->num_treadles] = 1;
-            p = (const char*)strchr(p, ',');
-            p = (p == NULL)? NULL: p+1;
+            while(p < value.end && *p != ','){
+                p++;
+            }
+            if(p == value.end){
+                break;
+            }
+            p++;
         }
+        break;
     }
-    if(strcmp("THREADING",section)==0){
-        if(set_section(data, DATA_THREADING_SECTION)) return 0;
-        uint32_t w = data->warp.num_threads ;
-        if(w <= 0){
-            printf("ERROR! Threading section appeared before specification of "
-                    "warp threads!\n");
-            return 0;
-        }
-        if(data->threading == 0){
-            data->threading = (uint32_t*)calloc(w,sizeof(uint32_t));
-        }
-        //TODO(Vidar): Generalize this?
-        uint32_t index = (uint32_t)atoi(name);
-        if(index > w || index == 0){
-            printf("ERROR! Threading entry %s is out of bounds\n",name);
-            return 0;
-        }
-        uint32_t entry = (uint32_t)atoi(value);
-        if(entry > data->num_shafts || entry == 0){
-            printf("ERROR! Threading value %s at entry %s is out of bounds\n",
-                    name, value);
-            return 0;
+    case DATA_THREADING_SECTION:
+    case DATA_TREADLING_SECTION:
+    case DATA_WARP_COLORS_SECTION:
+    case DATA_WEFT_COLORS_SECTION: {
+        //These sections map each warp or weft thread to a
+        // shaft, treadle or color
+        uint8_t warp = section == DATA_THREADING_SECTION
+            || section == DATA_WARP_COLORS_SECTION;
+        uint32_t w = warp ? data->warp.num_threads : data->weft.num_threads;
+        uint32_t **entries;
+        uint32_t max_entry;
+        const char *entry_name, *section_title;
+        switch(section){
+            case DATA_THREADING_SECTION:
+                entries = &data->threading;
+                max_entry = data->num_shafts;
+                entry_name = "Threading";
+                section_title = "Threading";
+                break;
+            case DATA_TREADLING_SECTION:
+                entries = &data->treadling;
+                max_entry = data->num_treadles;
+                entry_name = "Treadling";
+                section_title = "Treadling";
+                break;
+            case DATA_WARP_COLORS_SECTION:
+                entries = &data->warp.colors;
+                max_entry = data->num_colors;
+                entry_name = "Warp color";
+                section_title = "WARP COLORS";
+                break;
+            default:
+                entries = &data->weft.colors;
+                max_entry = data->num_colors;
+                entry_name = "Weft color";
+                section_title = "WEFT COLORS";
+                break;
         }
-        data->threading[index-1] = data->num_shafts - entry;
-    }
-    if(strcmp("TREADLING",section)==0){
-        if(set_section(data, DATA_TREADLING_SECTION)) return 0;
-        uint32_t w = data->weft.num_threads ;
         if(w <= 0){
-            printf("ERROR! Treadling section appeared before specification of "
-                    "weft threads!\n");
+            wif_error(data, "ERROR! %s section appeared before "
+                    "specification of %s threads!\n", section_title,
+                    warp ? "warp" : "weft");
             return 0;
         }
-        if(data->treadling == 0){
-            data->treadling = (uint32_t*)calloc(w,sizeof(uint32_t));
+        if(*entries == 0){
+            *entries = (uint32_t*)calloc(w,sizeof(uint32_t));
         }
-        uint32_t index = (uint32_t)atoi(name);
+        uint32_t index = token_to_uint(name);
         if(index > w || index == 0){
-            printf("ERROR! Treadling entry %s is out of bounds\n",name);
+            wif_error(data, "ERROR! %s entry %.*s is out of bounds\n",
+                entry_name, TOKEN_ARG(name));
             return 0;
         }
-        uint32_t entry = (uint32_t)atoi(value);
-        if(entry > data->num_treadles || entry == 0){
-            printf("ERROR! Treadling value %s at entry %s is out of bounds\n",
-                    name, value);
+        uint32_t entry = token_to_uint(value);
+        if(entry > max_entry || entry == 0){
+            wif_error(data, "ERROR! %s value %.*s at entry %.*s is out of "
+                    "bounds\n", entry_name, TOKEN_ARG(name), TOKEN_ARG(value));
             return 0;
         }
-        data->treadling[(index-1)] = data->num_treadles - entry;
+        if(section == DATA_WARP_COLORS_SECTION
+                || section == DATA_WEFT_COLORS_SECTION){
+            (*entries)[index-1] = entry-1;
+        } else{
+            (*entries)[index-1] = max_entry - entry;
+        }
+        break;
     }
-    if(strcmp("COLOR PALETTE",section)==0){
-        if(set_section(data, DATA_COLOR_PALETTE_SECTION)) return 0;
-        if(strcmp("Entries",name)==0){
+    case DATA_COLOR_PALETTE_SECTION:
+        if(TOKEN_EQUALS(name, "Entries")){
             data->read_keys |= COLOR_PALETTE_ENTRIES_KEY;
-            data->num_colors = (uint32_t)atoi(value);
+            data->num_colors = token_to_uint(value);
         }
-    }
-    if(strcmp("COLOR TABLE",section)==0){
-        if(set_section(data, DATA_COLOR_TABLE_SECTION)) return 0;
+        break;
+    case DATA_COLOR_TABLE_SECTION: {
         if(data->num_colors==0){
-            printf("ERROR! COLOR TABLE appeared before specification of "
-                    "COLOR PALETTE\n");
+            wif_error(data, "ERROR! COLOR TABLE appeared before "
+                    "specification of COLOR PALETTE\n");
             return 0;
         }
         if(data->colors == 0){
             data->colors = (float*)calloc(data->num_colors,sizeof(float)*3);
         }
-        uint32_t i = (uint32_t)atoi(name)-1;
+        uint32_t i = token_to_uint(name)-1;
         //TODO(Vidar):Handle different formats
         if(i<data->num_colors){
-            const char *p = value;
-            data->colors[i*3+0] = (float)(atoi(p))/255.0f;
-            p = strchr(p, ',')+1;
-            if(p == (void*)1){
-                printf("Invalid color at color table entry %s\n",name);
-                return 0;
+            const char *p = value.str;
+            uint32_t c;
+            for(c = 0; c < 3; c++){
+                if(c > 0){
+                    while(p < value.end && *p != ','){
+                        p++;
+                    }
+                    if(p == value.end){
+                        wif_error(data, "Invalid color at color table "
+                            "entry %.*s\n", TOKEN_ARG(name));
+                        return 0;
+                    }
+                    p++;
+                }
+                data->colors[i*3+c] =
+                    (float)(token_to_int(p, value.end, &p))/255.0f;
             }
-            data->colors[i*3+1] = (float)(atoi(p))/255.0f;
-            p = strchr(p, ',')+1;
-            if(p == (void*)1){
-                printf("Invalid color at color table entry %s\n",name);
-                return 0;
+        }
+        break;
+    }
+    }
+    return 1;
+}
+
+//Reads one key of the file. Returns 0 if there was an error
+static int32_t handler(WeaveData *data, uint32_t section, WifToken name,
+                   WifToken value)
+{
+    if(section == 0){
+        return 1;
+    }
+    if(set_section(data, section)) return 0;
+    return handle_key(data, section, name, value);
+}
+
+//Returns a pointer to the first a or b, or to an inline
+// comment (a ';' after whitespace), or end if there is neither. Pass a = 0 to
+// only look for comments.
+static const char *find_chars_or_comment(const char *p, const char *end,
+    char a, char b)
+{
+    int was_space = 0;
+    while(p < end && (a == 0 || (*p != a && *p != b))
+            && !(was_space && *p == ';')){
+        was_space = is_space(*p);
+        p++;
+    }
+    return p;
+}
+
+static void wif_free_arrays(WeaveData *data)
+{
+#define FREE_IF_NOT_NULL(a) if(a!=0) free(a)
+    FREE_IF_NOT_NULL(data->tieup);
+    FREE_IF_NOT_NULL(data->treadling);
+    FREE_IF_NOT_NULL(data->threading);
+    FREE_IF_NOT_NULL(data->colors);
+    FREE_IF_NOT_NULL(data->warp.colors);
+    FREE_IF_NOT_NULL(data->weft.colors);
+}
+
+//Returns 1 if the file starts with a UTF-8 byte order mark
+static int wif_has_bom(const char *p, const char *end)
+{
+    return end - p >= 3 && (unsigned char)p[0] == 0xEF
+        && (unsigned char)p[1] == 0xBB && (unsigned char)p[2] == 0xBF;
+}
+
+//Widens the range of thread indices read by a job to include name
+static void wif_update_job_indices(uint32_t *job_indices, WifToken name)
+{
+    uint32_t index = token_to_uint(name);
+    if(index < job_indices[0]){
+        job_indices[0] = index;
+    }
+    if(index > job_indices[1]){
+        job_indices[1] = index;
+    }
+}
+
+/* Parses a whole WIF file in one pass, without copying it. Follows the same
+ * INI syntax as inih did: ';' and '#' comments, inline ';' comments after
+ * whitespace, name=value and name:value pairs, and indented lines which
+ * continue the value of the previous name. Lines can be of any length.
+ * Returns the line number of the first error, or 0. Like inih, parsing
+ * continues after an error, so that all errors are reported.
+ * If job_section is not 0, the lines are a part of that section, without
+ * its header, and are read with handle_key. This is used by the parallel
+ * parser below, which also gets the smallest and largest thread index read
+ * in job_indices.
+ */
+static int wif_parse(WeaveData *data, const char *p, const char *end,
+    uint32_t job_section, uint32_t *job_indices)
+{
+    uint32_t section = job_section;
+    WifToken prev_name = {0, 0};
+    int lineno = 0;
+    int error = 0;
+    if(wif_has_bom(p, end)){
+        p += 3;
+    }
+    while(p < end){
+        const char *line = p;
+        const char *line_end = (const char*)memchr(p, '\n', end - p);
+        if(line_end == 0){
+            line_end = end;
+        }
+        p = line_end < end ? line_end + 1 : end;
+        lineno++;
+
+        const char *start = line;
+        while(line_end > start && is_space(line_end[-1])){
+            line_end--;
+        }
+        while(start < line_end && is_space(*start)){
+            start++;
+        }
+        if(start == line_end || *start == ';' || *start == '#'){
+            continue;
+        }
+        if(prev_name.str && start > line){
+            //Indented line, continues the previous value
+            WifToken value = {start, line_end};
+            int32_t ok = job_section ? handle_key(data, section, prev_name,
+                value) : handler(data, section, prev_name, value);
+            if(!ok && !error){
+                error = lineno;
+            }
+            if(ok && job_indices){
+                wif_update_job_indices(job_indices, prev_name);
+            }
+        } else if(*start == '[' && !job_section){
+            const char *close = find_chars_or_comment(start + 1, line_end,
+                ']', ']');
+            if(close < line_end && *close == ']'){
+                WifToken name = {start + 1, close};
+                section = section_from_name(name);
+                prev_name.str = 0;
+            } else if(!error){
+                error = lineno;
+            }
+        } else{
+            const char *equals = find_chars_or_comment(start, line_end, '=',
+                ':');
+            if(equals < line_end && (*equals == '=' || *equals == ':')){
+                WifToken name = {start, equals};
+                WifToken value = {equals + 1, line_end};
+                while(name.end > name.str && is_space(name.end[-1])){
+                    name.end--;
+                }
+                while(value.str < value.end && is_space(*value.str)){
+                    value.str++;
+                }
+                value.end = find_chars_or_comment(value.str, value.end, 0, 0);
+                while(value.end > value.str && is_space(value.end[-1])){
+                    value.end--;
+                }
+                prev_name = name;
+                int32_t ok = job_section ? handle_key(data, section, name,
+                    value) : handler(data, section, name, value);
+                if(!ok && !error){
+                    error = lineno;
+                }
+                if(ok && job_indices){
+                    wif_update_job_indices(job_indices, name);
+                }
+            } else if(!error){
+                error = lineno;
             }
-            data->colors[i*3+2] = (float)(atoi(p))/255.0f;
         }
     }
-    if(strcmp("WARP COLORS",section)==0){
-        if(set_section(data, DATA_WARP_COLORS_SECTION)) return 0;
-        uint32_t w = data->warp.num_threads ;
-        if(w <= 0){
-            printf("ERROR! WARP COLORS section appeared before specification of "
-                    "warp threads!\n");
-            return 0;
+    return error;
+}
+
+//Maps the whole file into memory. Returns 0 if the file could
+// not be opened. Empty files give a valid pointer and *size = 0.
+#ifdef _WIN32
+static const char *wif_map_handle(HANDLE file, size_t *size)
+{
+    const char *ret = 0;
+    LARGE_INTEGER file_size;
+    if(file == INVALID_HANDLE_VALUE){
+        return 0;
+    }
+    if(GetFileSizeEx(file, &file_size)){
+        *size = (size_t)file_size.QuadPart;
+        if(*size == 0){
+            ret = "";
+        } else{
+            HANDLE mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0,
+                0);
+            if(mapping){
+                ret = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0,
+                    0);
+                CloseHandle(mapping);
+            }
         }
-        if(data->warp.colors == 0){
-            data->warp.colors = (uint32_t*)calloc(w,sizeof(uint32_t));
+    }
+    CloseHandle(file);
+    return ret;
+}
+
+static const char *wif_map_file(const char *filename, size_t *size)
+{
+    return wif_map_handle(CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ,
+        0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0), size);
+}
+
+static void wif_unmap_file(const char *file, size_t size)
+{
+    if(size > 0){
+        UnmapViewOfFile(file);
+    }
+}
+#else
+static const char *wif_map_file(const char *filename, size_t *size)
+{
+    const char *ret = 0;
+    struct stat st;
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0){
+        return 0;
+    }
+    if(fstat(fd, &st) == 0){
+        *size = (size_t)st.st_size;
+        if(*size == 0){
+            ret = "";
+        } else{
+            void *map = mmap(0, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(map != MAP_FAILED){
+                madvise(map, *size, MADV_SEQUENTIAL);
+                ret = (const char*)map;
+            }
         }
-        uint32_t index = (uint32_t)atoi(name);
-        if(index > w || index == 0){
-            printf("ERROR! Warp color entry %s is out of bounds\n",name);
+    }
+    close(fd);
+    return ret;
+}
+
+static void wif_unmap_file(const char *file, size_t size)
+{
+    if(size > 0){
+        munmap((void*)file, size);
+    }
+}
+#endif
+
+/* --- Parallel parsing ---
+ * Large files are parsed on several threads. The file is first indexed by
+ * finding the section headers. The THREADING, TREADLING, WARP COLORS and
+ * WEFT COLORS sections, which have one line per thread, are then split into
+ * jobs at line boundaries, and the jobs are parsed on separate threads into
+ * the WeaveData arrays. The other sections are small and are parsed on the
+ * calling thread first, in file order, together with the checks in
+ * set_section. The result is the same as with wif_parse. Files which
+ * wif_parse would read differently, such as files with repeated sections or
+ * with the thread sections before the sizes they need, are parsed on one
+ * thread. So are files with errors, which are parsed again on one thread
+ * to report the errors in order, and files where two jobs read the same
+ * thread index, since the value kept would depend on which job ran last.
+ * The thread sections are normally in index order, so that the jobs read
+ * separate ranges of indices.
+ */
+#ifndef WIF_PARALLEL_MIN_BYTES
+#define WIF_PARALLEL_MIN_BYTES (1024*1024)
+#endif
+#define WIF_MAX_SECTIONS       64
+#define WIF_MAX_THREADS        64
+#define WIF_JOBS_PER_THREAD    4
+//Splitting at line ends gives at most one more job per section
+#define WIF_MAX_JOBS (WIF_MAX_THREADS*WIF_JOBS_PER_THREAD + 4)
+
+#define DATA_THREAD_SECTIONS (DATA_THREADING_SECTION | DATA_TREADLING_SECTION\
+    | DATA_WARP_COLORS_SECTION | DATA_WEFT_COLORS_SECTION)
+
+typedef struct
+{
+    uint32_t section; //0 for the lines before the first header
+    const char *header, *begin, *end; //The body is from begin to end
+} WifSection;
+
+typedef struct
+{
+    uint32_t section;
+    const char *begin, *end;
+    int error;
+    uint32_t indices[2]; //Smallest and largest thread index read
+} WifJob;
+
+typedef struct
+{
+    WeaveData *data;
+    WifJob *jobs;
+    uint32_t num_jobs, first_job, job_stride;
+} WifWork;
+
+static uint32_t wif_number_of_cpus()
+{
+#if defined(WC_NO_THREADS)
+    return 1;
+#elif defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return num_cpus > 0 ? (uint32_t)num_cpus : 1;
+#endif
+}
+
+//Finds the section headers. Returns the number of sections, or 0 if the
+// file can not be indexed this way, because it has indented or unclosed
+// section headers, which depend on the lines before them, or too many
+// sections.
+static uint32_t wif_index_sections(const char *p, const char *end,
+    WifSection *sections)
+{
+    const char *file = p;
+    uint32_t num_sections = 1;
+    sections[0].section = 0;
+    sections[0].header = sections[0].begin = p;
+    while(p < end){
+        const char *bracket = (const char*)memchr(p, '[', end - p);
+        if(bracket == 0){
+            break;
+        }
+        p = bracket + 1;
+        const char *line = bracket;
+        while(line > file && line[-1] != '\n' && is_space(line[-1])){
+            line--;
+        }
+        if(line > file && line[-1] != '\n'
+                && !(line - file == 3 && wif_has_bom(file, end))){
+            //Inside a line
+            continue;
+        }
+        if(line != bracket || num_sections == WIF_MAX_SECTIONS){
             return 0;
         }
-        uint32_t entry = (uint32_t)atoi(value);
-        if(entry > data->num_colors || entry == 0){
-            printf("ERROR! Warp color value %s at entry %s is out of bounds\n",
-                    name, value);
+        const char *line_end = (const char*)memchr(p, '\n', end - p);
+        if(line_end == 0){
+            line_end = end;
+        }
+        const char *close = find_chars_or_comment(p, line_end, ']', ']');
+        if(close == line_end){
             return 0;
         }
-        data->warp.colors[(index-1)] = entry-1;
+        WifToken name = {p, close};
+        sections[num_sections - 1].end = line;
+        sections[num_sections].section = section_from_name(name);
+        sections[num_sections].header = line;
+        sections[num_sections].begin = line_end < end ? line_end + 1 : end;
+        num_sections++;
+        p = sections[num_sections - 1].begin;
     }
-    if(strcmp("WEFT COLORS",section)==0){
-        if(set_section(data, DATA_WEFT_COLORS_SECTION)) return 0;
-        //TODO(Vidar): Join with the case above...
-        uint32_t w = data->weft.num_threads ;
-        if(w <= 0){
-            printf("ERROR! WEFT COLORS section appeared before specification of "
-                    "weft threads!\n");
+    sections[num_sections - 1].end = end;
+    return num_sections;
+}
+
+//Returns 1 if the section has any line which is not blank or a comment
+static int wif_section_has_keys(const WifSection *section)
+{
+    const char *p = section->begin;
+    while(p < section->end){
+        while(p < section->end && is_space(*p)){
+            p++;
+        }
+        if(p == section->end){
             return 0;
         }
-        if(data->weft.colors == 0){
-            data->weft.colors = (uint32_t*)calloc(w,sizeof(uint32_t));
+        if(*p != ';' && *p != '#'){
+            return 1;
         }
-        uint32_t index = (uint32_t)atoi(name);
-        if(index > w || index == 0){
-            printf("ERROR! Weft color entry %s is out of bounds\n",name);
+        p = (const char*)memchr(p, '\n', section->end - p);
+        if(p == 0){
             return 0;
         }
-        uint32_t entry = (uint32_t)atoi(value);
-        if(entry > data->num_colors || entry == 0){
-            printf("ERROR! Weft color value %s at entry %s is out of bounds\n",
-                    name, value);
+    }
+    return 0;
+}
+
+//Returns 1 if the sections can be parsed in parallel with the same result
+// as wif_parse. Each section may appear once, and the thread sections must
+// come after the sections with the sizes that they are checked against.
+static int wif_can_parse_in_parallel(const WifSection *sections,
+    uint32_t num_sections)
+{
+    uint32_t seen = 0;
+    uint32_t i;
+    for(i = 1; i < num_sections; i++){
+        uint32_t section = sections[i].section;
+        uint32_t needed = 0;
+        switch(section){
+            case DATA_THREADING_SECTION:
+                needed = DATA_WARP_SECTION | DATA_WEAVING_SECTION;
+                break;
+            case DATA_TREADLING_SECTION:
+                needed = DATA_WEFT_SECTION | DATA_WEAVING_SECTION;
+                break;
+            case DATA_WARP_COLORS_SECTION:
+                needed = DATA_WARP_SECTION | DATA_COLOR_PALETTE_SECTION;
+                break;
+            case DATA_WEFT_COLORS_SECTION:
+                needed = DATA_WEFT_SECTION | DATA_COLOR_PALETTE_SECTION;
+                break;
+        }
+        if((seen & section) || (seen & needed) != needed){
             return 0;
         }
-        data->weft.colors[(index-1)] = entry-1;
+        seen |= section;
     }
     return 1;
 }
 
+static void wif_run_jobs(WifWork *work)
+{
+    uint32_t i;
+    for(i = work->first_job; i < work->num_jobs; i += work->job_stride){
+        WifJob *job = &work->jobs[i];
+        job->error = wif_parse(work->data, job->begin, job->end,
+            job->section, job->indices);
+    }
+}
 
-WeaveData *wif_read(const char *filename)
+#ifndef WC_NO_THREADS
+#ifdef _WIN32
+static DWORD WINAPI wif_thread(LPVOID work)
 {
-    WeaveData *data;
-    data = (WeaveData*)calloc(1,sizeof(WeaveData));
-    if (ini_parse(filename, handler, data) != 0) {
-        printf("Error reading file \"%s\"\n",filename);
-        wif_free_weavedata(data);
-        return 0;
+    wif_run_jobs((WifWork*)work);
+    return 0;
+}
+#else
+static void *wif_thread(void *work)
+{
+    wif_run_jobs((WifWork*)work);
+    return 0;
+}
+#endif
+#endif
+
+//Splits the body of a thread section into jobs of about job_size bytes.
+// Jobs start at lines which are not indented, since indented lines continue
+// the line before them.
+static uint32_t wif_split_section(const WifSection *section, size_t job_size,
+    WifJob *jobs, uint32_t max_jobs)
+{
+    uint32_t num_jobs = 0;
+    const char *p = section->begin;
+    while(p < section->end && num_jobs < max_jobs){
+        const char *split = section->end;
+        if((size_t)(section->end - p) > job_size && num_jobs + 1 < max_jobs){
+            split = p + job_size;
+            while(split < section->end){
+                split = (const char*)memchr(split, '\n', section->end - split);
+                if(split == 0){
+                    split = section->end;
+                    break;
+                }
+                split++;
+                if(split < section->end && !is_space(*split)){
+                    break;
+                }
+            }
+        }
+        jobs[num_jobs].section = section->section;
+        jobs[num_jobs].begin = p;
+        jobs[num_jobs].end = split;
+        jobs[num_jobs].error = 0;
+        jobs[num_jobs].indices[0] = 0xffffffff;
+        jobs[num_jobs].indices[1] = 0;
+        num_jobs++;
+        p = split;
+    }
+    return num_jobs;
+}
+
+//Allocates the array that a thread section is read into, so that its jobs
+// do not race to do it in handle_key
+static void wif_allocate_thread_section(WeaveData *data, uint32_t section)
+{
+    switch(section){
+        case DATA_THREADING_SECTION:
+            if(data->warp.num_threads > 0 && data->threading == 0){
+                data->threading = (uint32_t*)calloc(data->warp.num_threads,
+                    sizeof(uint32_t));
+            }
+            break;
+        case DATA_TREADLING_SECTION:
+            if(data->weft.num_threads > 0 && data->treadling == 0){
+                data->treadling = (uint32_t*)calloc(data->weft.num_threads,
+                    sizeof(uint32_t));
+            }
+            break;
+        case DATA_WARP_COLORS_SECTION:
+            if(data->warp.num_threads > 0 && data->warp.colors == 0){
+                data->warp.colors = (uint32_t*)calloc(data->warp.num_threads,
+                    sizeof(uint32_t));
+            }
+            break;
+        case DATA_WEFT_COLORS_SECTION:
+            if(data->weft.num_threads > 0 && data->weft.colors == 0){
+                data->weft.colors = (uint32_t*)calloc(data->weft.num_threads,
+                    sizeof(uint32_t));
+            }
+            break;
     }
+}
+
+//Returns 1 if no two jobs read the same thread index. Then the order in
+// which the jobs ran does not matter. Each job covers a range of the
+// indices, and the ranges of the jobs of a section must be in file order.
+// Otherwise a repeated index, which wif_parse would set to the last value
+// in the file, might have been set by another job.
+static int wif_jobs_are_disjoint(const WifJob *jobs, uint32_t num_jobs)
+{
+    uint32_t i, prev = 0;
+    for(i = 0; i < num_jobs; i++){
+        if(i > 0 && jobs[i].section != jobs[i - 1].section){
+            prev = 0;
+        }
+        if(jobs[i].indices[0] > jobs[i].indices[1]){
+            //No keys
+            continue;
+        }
+        if(jobs[i].indices[0] <= prev){
+            return 0;
+        }
+        prev = jobs[i].indices[1];
+    }
+    return 1;
+}
+
+//Parses the file on num_threads threads. Returns 0 on success, and 1 if
+// the file has to be parsed with wif_parse instead, because it can not be
+// split, or because there were errors. Then data is left cleared.
+static int wif_parse_parallel(WeaveData *data, const char *file,
+    const char *end, uint32_t num_threads)
+{
+    WifSection sections[WIF_MAX_SECTIONS];
+    uint32_t num_sections = wif_index_sections(file, end, sections);
+    if(num_sections == 0
+            || !wif_can_parse_in_parallel(sections, num_sections)){
+        return 1;
+    }
+
+    //The small sections, and the order checks of all sections
+    int error = 0;
+    size_t thread_section_bytes = 0;
+    uint32_t i;
+    data->quiet = 1;
+    for(i = 0; i < num_sections; i++){
+        const WifSection *section = &sections[i];
+        if(section->section & DATA_THREAD_SECTIONS){
+            if(wif_section_has_keys(section)){
+                error |= set_section(data, section->section);
+                wif_allocate_thread_section(data, section->section);
+                thread_section_bytes += section->end - section->begin;
+            }
+        } else{
+            error |= wif_parse(data, section->header, section->end, 0, 0) != 0;
+        }
+    }
+
+    if(!error){
+        WifJob jobs[WIF_MAX_JOBS];
+        uint32_t num_jobs = 0;
+        size_t job_size = thread_section_bytes
+            /(num_threads*WIF_JOBS_PER_THREAD) + 1;
+        for(i = 0; i < num_sections; i++){
+            if((sections[i].section & DATA_THREAD_SECTIONS)
+                    && wif_section_has_keys(&sections[i])){
+                num_jobs += wif_split_section(&sections[i], job_size,
+                    jobs + num_jobs, WIF_MAX_JOBS - num_jobs);
+            }
+        }
+        if(num_threads > num_jobs){
+            num_threads = num_jobs;
+        }
+        WifWork work[WIF_MAX_THREADS];
+        uint32_t t;
+        for(t = 0; t < num_threads; t++){
+            work[t].data = data;
+            work[t].jobs = jobs;
+            work[t].num_jobs = num_jobs;
+            work[t].first_job = t;
+            work[t].job_stride = num_threads;
+        }
+        //The calling thread does the first share. If a thread can not be
+        // started, its share is done here as well.
+#ifndef WC_NO_THREADS
+#ifdef _WIN32
+        HANDLE threads[WIF_MAX_THREADS];
+        for(t = 1; t < num_threads; t++){
+            threads[t] = CreateThread(0, 0, wif_thread, &work[t], 0, 0);
+        }
+        if(num_threads > 0){
+            wif_run_jobs(&work[0]);
+        }
+        for(t = 1; t < num_threads; t++){
+            if(threads[t]){
+                WaitForSingleObject(threads[t], INFINITE);
+                CloseHandle(threads[t]);
+            } else{
+                wif_run_jobs(&work[t]);
+            }
+        }
+#else
+        pthread_t threads[WIF_MAX_THREADS];
+        uint8_t started[WIF_MAX_THREADS];
+        for(t = 1; t < num_threads; t++){
+            started[t] = pthread_create(&threads[t], 0, wif_thread,
+                &work[t]) == 0;
+        }
+        if(num_threads > 0){
+            wif_run_jobs(&work[0]);
+        }
+        for(t = 1; t < num_threads; t++){
+            if(started[t]){
+                pthread_join(threads[t], 0);
+            } else{
+                wif_run_jobs(&work[t]);
+            }
+        }
+#endif
+#else
+        for(t = 0; t < num_threads; t++){
+            wif_run_jobs(&work[t]);
+        }
+#endif
+        for(i = 0; i < num_jobs; i++){
+            error |= jobs[i].error != 0;
+        }
+        error |= !wif_jobs_are_disjoint(jobs, num_jobs);
+    }
+    data->quiet = 0;
+
+    if(error){
+        wif_free_arrays(data);
+        memset(data, 0, sizeof(WeaveData));
+        return 1;
+    }
+    return 0;
+}
+
+//Returns 0 on success, the line number of the first error, or
+// -1 if the file could not be read. num_threads = 0 uses one thread per CPU.
+static int wif_parse_file(WeaveData *data, const char *file, size_t size,
+    uint32_t num_threads)
+{
+    if(file == 0){
+        return -1;
+    }
+    if(num_threads == 0){
+        num_threads = wif_number_of_cpus();
+    }
+    if(num_threads > WIF_MAX_THREADS){
+        num_threads = WIF_MAX_THREADS;
+    }
+    int error = 0;
+    if(num_threads < 2 || size < WIF_PARALLEL_MIN_BYTES
+            || wif_parse_parallel(data, file, file + size, num_threads)){
+        error = wif_parse(data, file, file + size, 0, 0);
+    }
+    wif_unmap_file(file, size);
+    return error;
+}
+
+//Reports missing sections. Returns 0 if any was missing.
+static int check_sections(WeaveData *data)
+{
     data->read_sections |= data->current_section;
     if(data->read_sections != DATA_ALL_SECTIONS){
         //NOTE(Vidar): One of the sections was missing from the file.
@@ -384,6 +1114,28 @@ WeaveData *wif_read(const char *filename)
             DATA_WARP_COLORS_SECTION, "WARP COLORS")
         CHECK_SECTION(data->read_sections,
             DATA_WEFT_COLORS_SECTION, "WEFT COLORS")
+        return 0;
+    }
+    return 1;
+}
+
+WeaveData *wif_read(const char *filename)
+{
+    return wif_read_threads(filename, 0);
+}
+
+WeaveData *wif_read_threads(const char *filename, uint32_t num_threads)
+{
+    WeaveData *data;
+    size_t size = 0;
+    data = (WeaveData*)calloc(1,sizeof(WeaveData));
+    const char *file = wif_map_file(filename, &size);
+    if (wif_parse_file(data, file, size, num_threads) != 0) {
+        printf("Error reading file \"%s\"\n",filename);
+        wif_free_weavedata(data);
+        return 0;
+    }
+    if(!check_sections(data)){
         wif_free_weavedata(data);
         return 0;
     }
@@ -395,15 +1147,12 @@ WeaveData *wif_read_wchar(const wchar_t *filename)
 {
     WeaveData *data;
     data = (WeaveData*)calloc(1,sizeof(WeaveData));
-    #ifdef WIN32
-    FILE* file;
-    int error = -1;
-
-    file = _wfopen(filename, L"rt");
-    if(file){
-        error = ini_parse_file(file, handler, data);
-        fclose(file);
-    }
+    #ifdef _WIN32
+    size_t size = 0;
+    const char *file = wif_map_handle(CreateFileW(filename, GENERIC_READ,
+        FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0),
+        &size);
+    int error = wif_parse_file(data, file, size, 0);
     if (error < 0) {
         wprintf(L"Error reading file \"%s\"\n",filename);
     }
@@ -415,14 +1164,8 @@ WeaveData *wif_read_wchar(const wchar_t *filename)
 void wif_free_weavedata(WeaveData *data)
 {
     if(data){
-#define FREE_IF_NOT_NULL(a) if(a!=0) free(a)
-        FREE_IF_NOT_NULL(data->tieup);
-        FREE_IF_NOT_NULL(data->treadling);
-        FREE_IF_NOT_NULL(data->threading);
-        FREE_IF_NOT_NULL(data->colors);
-        FREE_IF_NOT_NULL(data->warp.colors);
-        FREE_IF_NOT_NULL(data->weft.colors);
-        FREE_IF_NOT_NULL(data);
+        wif_free_arrays(data);
+        free(data);
     }
 }
 
@@ -476,7 +1219,8 @@ void wif_get_pattern(wcWeaveParameters *param, WeaveData *data, uint32_t *w,
             yarn_types[c].name##_enabled = 0;
 		#define WC_COLOR_PARAM(name)
             WC_YARN_PARAMETERS
-		#undef YARN_TYPE_PARAM
+		#undef WC_FLOAT_PARAM
+		#undef WC_COLOR_PARAM
         }
         for(y=0;y<*h;y++){
             for(x=0;x<*w;x++){
@@ -21,10 +21,14 @@ typedef struct
     uint8_t *tieup;
     uint32_t *treadling, *threading; //TODO(Vidar): Move to WarpOrWeftData?
     float *colors;
+    uint8_t quiet; //Set while parsing in parallel, errors are not printed
 }WeaveData;
 
 // Read a WIF file from disk
 WeaveData *wif_read(const char *filename);
+// Same as wif_read, but large files are parsed on num_threads threads.
+// wif_read uses one thread per CPU, which is the same as num_threads = 0.
+WeaveData *wif_read_threads(const char *filename, uint32_t num_threads);
 WeaveData *wif_read_wchar(const wchar_t *filename);
 // Free the WeaveData data structure
 void wif_free_weavedata(WeaveData *data);
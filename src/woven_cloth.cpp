@@ -2,7 +2,6 @@
 #ifndef WC_NO_FILES
 #define REALWORLD_UV_WIF_TO_MM 10.0
 #include "wif/wif.cpp"
-#include "wif/ini.cpp"
 #endif
 
 // For M_PI etc.
@@ -10,6 +9,23 @@
 #define _USE_MATH_DEFINES
 #endif
 #include <math.h>
+#include <ctype.h>
+
+#ifndef WC_NO_THREADS
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+#endif
+
+#include "woven_cloth_stats.cpp"
 
 // -- 3D Vector data structure -- //
 typedef struct
@@ -218,96 +234,723 @@ static void halton_4(int n, float val[]){
 }
 
 
-void wcFinalizeWeaveParameters(wcWeaveParameters *params)
+static void wcFreeSegmentLookup(wcWeaveParameters *params);
+static void wcBuildSegmentLookup(wcWeaveParameters *params);
+static void wcFreeSpecularTable(wcWeaveParameters *params);
+static void wcBuildSpecularTable(wcWeaveParameters *params);
+static float wcEvalTabulatedSpecular(wcIntersectionData intersection_data,
+    wcPatternData data, const wcWeaveParameters *params);
+
+//Frees p, unless it points into the compiled pattern that params were
+// loaded from
+static void wcFreePatternMemory(const wcWeaveParameters *params, void *p)
 {
-    //Calculate normalization factor for the specular reflection
-	if (params->pattern) {
-		size_t nLocationSamples = 100;
-		size_t nDirectionSamples = 1000;
-		params->specular_normalization = 1.f;
-
-		float highest_result = 0.f;
-
-		// Temporarily disable speuclar noise...
-		float tmp_specular_noise[WC_MAX_YARN_TYPES];
-		for(int i=0;i<params->num_yarn_types;i++){
-			tmp_specular_noise[i] = params->yarn_types[i].specular_noise;
-			params->yarn_types[i].specular_noise = 0.f;
-		}
-
-		// Normalize by the largest reflection across all uv coords and
-		// incident directions
-		for( uint32_t yarn_type = 0; yarn_type < params->num_yarn_types;
-			yarn_type++){
-			for (size_t i = 0; i < nLocationSamples; i++) {
-				float result = 0.0f;
-				float halton_point[4];
-				halton_4(i + 50, halton_point);
-				wcPatternData pattern_data;
-				// Pick a random location on a segment rectangle...
-				pattern_data.x = -1.f + 2.f*halton_point[0];
-				pattern_data.y = -1.f + 2.f*halton_point[1];
-				pattern_data.length = 1.f;
-				pattern_data.width = 1.f;
-				pattern_data.warp_above = 0;
-				pattern_data.yarn_type = yarn_type;
-				pattern_data.yarn_hit = 1;
-				wcIntersectionData intersection_data;
-				intersection_data.context=0;
-				calculate_segment_uv_and_normal(&pattern_data, params,
-					&intersection_data);
-				pattern_data.total_index_x = 0;
-				pattern_data.total_index_y = 0;
-
-				sample_uniform_hemisphere(halton_point[2], halton_point[3],
-					&intersection_data.wi_x, &intersection_data.wi_y,
-					&intersection_data.wi_z);
-
-				for (size_t j = 0; j < nDirectionSamples; j++) {
-					float halton_direction[4];
-					halton_4(j + 50 + nLocationSamples, halton_direction);
-					// Since we use cosine sampling here, we can ignore the cos term
-					// in the integral
-					sample_cosine_hemisphere(halton_direction[0], halton_direction[1],
-						&intersection_data.wo_x, &intersection_data.wo_y,
-						&intersection_data.wo_z);
-					result += wcEvalSpecular(intersection_data, pattern_data, params);
-				}
-				if (result > highest_result) {
-					highest_result = result;
-				}
-			}
-		}
-
-		if (highest_result <= 0.0001f) {
-			params->specular_normalization = 0.f;
-		}
-		else {
-			params->specular_normalization =
-				(float)nDirectionSamples / highest_result;
-		}
-		for(int i=0;i<params->num_yarn_types;i++){
-			params->yarn_types[i].specular_noise = tmp_specular_noise[i];
-		}
-	}
+    const uint8_t *compiled = (const uint8_t*)params->compiled_pattern;
+    if(compiled && (const uint8_t*)p >= compiled
+            && (const uint8_t*)p < compiled + params->compiled_pattern_size){
+        return;
+    }
+    free(p);
+}
+
+static void wcFreeResolvedYarnTypes(wcWeaveParameters *params)
+{
+    if(params->resolved_yarn_types){
+        free(params->resolved_yarn_types);
+        params->resolved_yarn_types = 0;
+    }
+}
+
+//Each array starts on a new cache line
+#define WC_RESOLVED_ALIGNMENT 64
+static size_t wcResolvedArraySize(size_t size)
+{
+    return (size + WC_RESOLVED_ALIGNMENT - 1)/WC_RESOLVED_ALIGNMENT
+        *WC_RESOLVED_ALIGNMENT;
+}
+
+/* The derived constants of WC_DERIVED_PARAMETERS, computed from the value of
+ * the parameter they depend on
+ */
+static float wcDerive_von_mises_log_norm(float beta)
+{
+    //I0 is approximated by one polynomial for |beta| <= 3.75, and by
+    // exp(|beta|)/sqrt(|beta|) times another above that. The log is taken
+    // before the exp, so that it does not overflow for large beta
+    double absB = fabs(beta);
+    double log_I0;
+    if (absB <= 3.75) {
+        double t = absB / 3.75;
+        t = t * t;
+        log_I0 = log(1.0 + t*(3.5156229 + t*(3.0899424 + t*(1.2067492
+            + t*(0.2659732 + t*(0.0360768 + t*0.0045813))))));
+    } else {
+        double t = 3.75 / absB;
+        log_I0 = absB - 0.5*log(absB) + log(0.39894228 + t*(0.01328592
+            + t*(0.00225319 + t*(-0.00157565 + t*(0.00916281
+            + t*(-0.02057706 + t*(0.02635537 + t*(-0.01647633
+            + t*0.00392377))))))));
+    }
+    return (float)(log(2.0*M_PI) + log_I0);
+}
+
+static float wcDerive_radius(float umax)
+{
+    return 1.f/(sin(umax));
+}
+
+static float wcDerive_tan_psi(float psi)
+{
+    return tanf(psi);
+}
+
+static float wcDerive_sin_psi(float psi)
+{
+    return fabsf(sinf(psi));
+}
+
+static float wcDerive_inv_delta_x(float delta_x)
+{
+    return 1.f/delta_x;
+}
+
+static void wcBuildResolvedYarnTypes(wcWeaveParameters *params)
+{
+    uint32_t num_yarn_types = params->num_yarn_types;
+    if(num_yarn_types == 0 || params->yarn_types == 0){
+        return;
+    }
+    //The struct and all arrays are allocated together, the values first,
+    // then the derived constants and the texmaps last
+    size_t size = wcResolvedArraySize(sizeof(wcResolvedYarnTypes));
+#define WC_FLOAT_PARAM(name) size += wcResolvedArraySize(\
+        num_yarn_types*sizeof(float));
+#define WC_INT_PARAM(name)
+#define WC_COLOR_PARAM(name) size += wcResolvedArraySize(\
+        num_yarn_types*sizeof(wcColor));
+WC_YARN_PARAMETERS
+#undef WC_FLOAT_PARAM
+#undef WC_COLOR_PARAM
+#define WC_DERIVED_PARAM(name, param) size += wcResolvedArraySize(\
+        num_yarn_types*sizeof(float));
+WC_DERIVED_PARAMETERS
+#undef WC_DERIVED_PARAM
+#define WC_FLOAT_PARAM(name) size += wcResolvedArraySize(\
+        num_yarn_types*sizeof(void*));
+#define WC_COLOR_PARAM(name) WC_FLOAT_PARAM(name)
+WC_YARN_PARAMETERS
+#undef WC_FLOAT_PARAM
+#undef WC_INT_PARAM
+#undef WC_COLOR_PARAM
+    //The struct is placed first, so that the whole block is freed through
+    // resolved_yarn_types. The arrays after it are aligned by hand.
+    uint8_t *memory = (uint8_t*)calloc(1, size + WC_RESOLVED_ALIGNMENT);
+    wcResolvedYarnTypes *resolved = (wcResolvedYarnTypes*)memory;
+    uint8_t *current = memory + sizeof(wcResolvedYarnTypes);
+    current += (WC_RESOLVED_ALIGNMENT
+        - (uintptr_t)current%WC_RESOLVED_ALIGNMENT)%WC_RESOLVED_ALIGNMENT;
+
+    wcYarnType *yarn_type_0 = &params->yarn_types[0];
+    uint32_t i;
+#define WC_FLOAT_PARAM(name) resolved->name = (float*)current;\
+    current += wcResolvedArraySize(num_yarn_types*sizeof(float));\
+    for(i = 0; i < num_yarn_types; i++){\
+        wcYarnType *yarn_type = &params->yarn_types[i];\
+        resolved->name[i] = yarn_type->name##_enabled ? yarn_type->name\
+            : yarn_type_0->name;\
+    }
+#define WC_INT_PARAM(name)
+#define WC_COLOR_PARAM(name) resolved->name = (wcColor*)current;\
+    current += wcResolvedArraySize(num_yarn_types*sizeof(wcColor));\
+    for(i = 0; i < num_yarn_types; i++){\
+        wcYarnType *yarn_type = &params->yarn_types[i];\
+        resolved->name[i] = yarn_type->name##_enabled ? yarn_type->name\
+            : yarn_type_0->name;\
+    }
+WC_YARN_PARAMETERS
+#undef WC_FLOAT_PARAM
+#undef WC_COLOR_PARAM
+#define WC_DERIVED_PARAM(name, param) resolved->name = (float*)current;\
+    current += wcResolvedArraySize(num_yarn_types*sizeof(float));\
+    for(i = 0; i < num_yarn_types; i++){\
+        resolved->name[i] = wcDerive_##name(resolved->param[i]);\
+    }
+WC_DERIVED_PARAMETERS
+#undef WC_DERIVED_PARAM
+#define WC_FLOAT_PARAM(name) resolved->name##_texmap = (void**)current;\
+    current += wcResolvedArraySize(num_yarn_types*sizeof(void*));\
+    for(i = 0; i < num_yarn_types; i++){\
+        wcYarnType *yarn_type = &params->yarn_types[i];\
+        resolved->name##_texmap[i] = yarn_type->name##_enabled ?\
+            yarn_type->name##_texmap : yarn_type_0->name##_texmap;\
+        if(resolved->name##_texmap[i]){\
+            resolved->name##_has_texmap = 1;\
+            resolved->has_texmaps = 1;\
+        }\
+    }
+#define WC_COLOR_PARAM(name) WC_FLOAT_PARAM(name)
+WC_YARN_PARAMETERS
+#undef WC_FLOAT_PARAM
+#undef WC_INT_PARAM
+#undef WC_COLOR_PARAM
+    params->resolved_yarn_types = resolved;
+}
+
+/* Getters for the derived constants, named like the yarn type parameters.
+ * Besides the context they take the value of the parameter, which was
+ * already read by the caller. That is used when the parameter has a texmap
+ * for the yarn type, or before wcFinalizeWeaveParameters.
+ */
+#define WC_DERIVED_PARAM(name, param) static float wc_yarn_type_get_##name\
+    (const wcWeaveParameters *p, uint32_t i, void *context, float param){\
+	const wcResolvedYarnTypes *resolved = p->resolved_yarn_types;\
+	if(resolved && !(resolved->param##_has_texmap\
+			&& resolved->param##_texmap[i])){\
+		return resolved->name[i];\
+	}\
+	return wcDerive_##name(param);}\
+static float wc_yarn_type_value_##name\
+    (const wcWeaveParameters *p, uint32_t i, void *context, float param){\
+	return p->resolved_yarn_types->name[i];}
+WC_DERIVED_PARAMETERS
+#undef WC_DERIVED_PARAM
+
+/* --- Specular normalization ---
+ * The specular reflection is normalized by the largest mean over outgoing
+ * directions, over all yarn types and WC_NORMALIZATION_LOCATIONS locations
+ * on a segment. Each pair of yarn type and location is a job, and the jobs
+ * are spread over threads.
+ * With a negative normalization_tolerance, each job sums
+ * WC_NORMALIZATION_DIRECTIONS directions. Otherwise the jobs are sampled in
+ * rounds, doubling the number of directions each round. A job that is
+ * clearly below the largest mean is dropped, and a job that is known within
+ * the tolerance is not sampled again. Sampling stops when no jobs are left
+ * to sample, or when they reach WC_NORMALIZATION_MAX_DIRECTIONS.
+ * A job always sums its directions in the same order, and the maximum does
+ * not depend on the order of the jobs, so the result is the same for any
+ * number of threads.
+ */
+#define WC_NORMALIZATION_LOCATIONS 100
+#define WC_NORMALIZATION_DIRECTIONS 1000
+#define WC_NORMALIZATION_MIN_DIRECTIONS 256
+#define WC_NORMALIZATION_MAX_DIRECTIONS (256*1024)
+#define WC_NORMALIZATION_CONFIDENCE 2.f // Standard errors in an error bound
+#define WC_MAX_FINALIZE_THREADS 64
+
+float wcEvalFilamentSpecular(wcIntersectionData intersection_data,
+    wcPatternData data, const wcWeaveParameters *params);
+float wcEvalStapleSpecular(wcIntersectionData intersection_data,
+    wcPatternData data, const wcWeaveParameters *params);
+
+typedef struct
+{
+    float sum;
+    double sum_sq;
+    uint32_t num_directions;
+} wcNormalizationJobState;
+
+typedef struct
+{
+    const wcWeaveParameters *params;
+    const float *directions; //Outgoing directions, x y z for each
+    wcNormalizationJobState *states; //One for each job
+    const uint32_t *jobs; //The jobs to run
+    uint32_t num_jobs;
+    uint32_t first_job, job_stride;
+    uint32_t num_directions; //The jobs are run until they have this many
+} wcNormalizationWork;
+
+static void wcNormalizationJob(const wcWeaveParameters *params,
+    const float *directions, uint32_t job, uint32_t num_directions,
+    wcNormalizationJobState *state)
+{
+    uint32_t yarn_type = job / WC_NORMALIZATION_LOCATIONS;
+    uint32_t i = job % WC_NORMALIZATION_LOCATIONS;
+    float result = state->sum;
+    double result_sq = state->sum_sq;
+    float halton_point[4];
+    halton_4(i + 50, halton_point);
+    wcPatternData pattern_data;
+    // Pick a random location on a segment rectangle...
+    pattern_data.x = -1.f + 2.f*halton_point[0];
+    pattern_data.y = -1.f + 2.f*halton_point[1];
+    pattern_data.length = 1.f;
+    pattern_data.width = 1.f;
+    pattern_data.warp_above = 0;
+    pattern_data.yarn_type = yarn_type;
+    pattern_data.yarn_hit = 1;
+    pattern_data.ext_between_parallel = 0;
+    wcIntersectionData intersection_data;
+    intersection_data.context=0;
+    calculate_segment_uv_and_normal(&pattern_data, params,
+        &intersection_data);
+    pattern_data.total_index_x = 0;
+    pattern_data.total_index_y = 0;
+
+    sample_uniform_hemisphere(halton_point[2], halton_point[3],
+        &intersection_data.wi_x, &intersection_data.wi_y,
+        &intersection_data.wi_z);
+
+    //Same as wcEvalSpecular, but without the specular noise
+    uint8_t filament = wc_yarn_type_get_psi(params, yarn_type, 0) <= 0.001f;
+    uint32_t j;
+    for (j = state->num_directions; j < num_directions; j++) {
+        intersection_data.wo_x = directions[j*3 + 0];
+        intersection_data.wo_y = directions[j*3 + 1];
+        intersection_data.wo_z = directions[j*3 + 2];
+        float value;
+        if(filament){
+            value = wcEvalFilamentSpecular(intersection_data, pattern_data,
+                params);
+        } else{
+            value = wcEvalStapleSpecular(intersection_data, pattern_data,
+                params);
+        }
+        result += value;
+        result_sq += (double)value*value;
+    }
+    state->sum = result;
+    state->sum_sq = result_sq;
+    state->num_directions = num_directions;
+}
+
+static double wcNormalizationJobMean(const wcNormalizationJobState *state)
+{
+    return (double)state->sum/(double)state->num_directions;
 }
 
+//Error bound of the mean of a job, relative to the mean
+static double wcNormalizationJobError(const wcNormalizationJobState *state)
+{
+    double n = (double)state->num_directions;
+    double mean = wcNormalizationJobMean(state);
+    if(mean <= 0.0 || n < 2.0){
+        return 0.0;
+    }
+    double variance = (state->sum_sq/n - mean*mean)*n/(n - 1.0);
+    if(variance < 0.0){
+        variance = 0.0;
+    }
+    return WC_NORMALIZATION_CONFIDENCE*sqrt(variance/n)/mean;
+}
+
+static void wcRunNormalizationJobs(wcNormalizationWork *work)
+{
+    uint32_t i;
+    for(i = work->first_job; i < work->num_jobs; i += work->job_stride){
+        uint32_t job = work->jobs[i];
+        wcNormalizationJob(work->params, work->directions, job,
+            work->num_directions, &work->states[job]);
+    }
+}
+
+#ifndef WC_NO_THREADS
+#ifdef _WIN32
+static DWORD WINAPI wcNormalizationThread(LPVOID work)
+{
+    wcRunNormalizationJobs((wcNormalizationWork*)work);
+    return 0;
+}
+#else
+static void *wcNormalizationThread(void *work)
+{
+    wcRunNormalizationJobs((wcNormalizationWork*)work);
+    return 0;
+}
+#endif
+#endif
+
+//The tolerance used by wcCalculateSpecularNormalization, 0 for a fixed
+// number of directions
+static float wcNormalizationTolerance(const wcWeaveParameters *params)
+{
+    if(params->normalization_tolerance < 0.f){
+        return 0.f;
+    }
+    if(params->normalization_tolerance == 0.f){
+        return WC_NORMALIZATION_DEFAULT_TOLERANCE;
+    }
+    return params->normalization_tolerance;
+}
+
+//Runs the listed jobs until they have num_directions directions
+static void wcRunNormalizationWork(const wcWeaveParameters *params,
+    const float *directions, wcNormalizationJobState *states,
+    const uint32_t *jobs, uint32_t num_jobs, uint32_t num_directions,
+    uint32_t num_threads)
+{
+    if(num_threads > num_jobs){
+        num_threads = num_jobs;
+    }
+    wcNormalizationWork work[WC_MAX_FINALIZE_THREADS];
+    uint32_t t;
+    for(t = 0; t < num_threads; t++){
+        work[t].params = params;
+        work[t].directions = directions;
+        work[t].states = states;
+        work[t].jobs = jobs;
+        work[t].num_jobs = num_jobs;
+        work[t].first_job = t;
+        work[t].job_stride = num_threads;
+        work[t].num_directions = num_directions;
+    }
+    //The calling thread does the first share. If a thread can not be
+    // started, its share is done here as well.
+#ifndef WC_NO_THREADS
+#ifdef _WIN32
+    HANDLE threads[WC_MAX_FINALIZE_THREADS];
+    for(t = 1; t < num_threads; t++){
+        threads[t] = CreateThread(0, 0, wcNormalizationThread, &work[t], 0, 0);
+    }
+    wcRunNormalizationJobs(&work[0]);
+    for(t = 1; t < num_threads; t++){
+        if(threads[t]){
+            WaitForSingleObject(threads[t], INFINITE);
+            CloseHandle(threads[t]);
+        } else{
+            wcRunNormalizationJobs(&work[t]);
+        }
+    }
+#else
+    pthread_t threads[WC_MAX_FINALIZE_THREADS];
+    uint8_t started[WC_MAX_FINALIZE_THREADS];
+    for(t = 1; t < num_threads; t++){
+        started[t] = pthread_create(&threads[t], 0, wcNormalizationThread,
+            &work[t]) == 0;
+    }
+    wcRunNormalizationJobs(&work[0]);
+    for(t = 1; t < num_threads; t++){
+        if(started[t]){
+            pthread_join(threads[t], 0);
+        } else{
+            wcRunNormalizationJobs(&work[t]);
+        }
+    }
+#endif
+#else
+    for(t = 0; t < num_threads; t++){
+        wcRunNormalizationJobs(&work[t]);
+    }
+#endif
+}
+
+//Returns the normalization, and sets error to its error bound relative to
+// its value
+static float wcCalculateSpecularNormalization(const wcWeaveParameters *params,
+    float *error)
+{
+    uint32_t num_jobs = params->num_yarn_types*WC_NORMALIZATION_LOCATIONS;
+    uint32_t num_threads = params->finalize_threads;
+    if(num_threads == 0){
+        num_threads = wif_number_of_cpus();
+    }
+    if(num_threads > WC_MAX_FINALIZE_THREADS){
+        num_threads = WC_MAX_FINALIZE_THREADS;
+    }
+    *error = 0.f;
+    if(num_jobs == 0){
+        return 0.f;
+    }
+    float tolerance = wcNormalizationTolerance(params);
+    uint32_t num_directions = WC_NORMALIZATION_DIRECTIONS;
+    uint32_t max_directions = WC_NORMALIZATION_DIRECTIONS;
+    if(tolerance > 0.f){
+        num_directions = WC_NORMALIZATION_MIN_DIRECTIONS;
+        max_directions = WC_NORMALIZATION_MAX_DIRECTIONS;
+    }
+
+    // The outgoing directions are the same for all jobs, and are added
+    // before each round as they are needed.
+    float *directions = (float*)malloc(max_directions*3*sizeof(float));
+    uint32_t num_computed_directions = 0;
+    uint32_t i, j;
+
+    wcNormalizationJobState *states = (wcNormalizationJobState*)calloc(
+        num_jobs, sizeof(wcNormalizationJobState));
+    // candidates are the jobs that might hold the largest mean, and
+    // jobs the ones of those that are sampled in the next round
+    uint32_t *candidates = (uint32_t*)malloc(num_jobs*sizeof(uint32_t));
+    uint32_t *jobs = (uint32_t*)malloc(num_jobs*sizeof(uint32_t));
+    uint32_t num_candidates = num_jobs;
+    uint32_t num_round_jobs = num_jobs;
+    for(i = 0; i < num_jobs; i++){
+        candidates[i] = i;
+        jobs[i] = i;
+    }
+    uint32_t best = 0;
+    for(;;){
+        // Since we use cosine sampling here, we can ignore the cos term
+        // in the integral
+        //A scrambled Sobol sequence was tried for the directions, but it
+        // was not more accurate than this for the same number of samples
+        for (j = num_computed_directions; j < num_directions; j++) {
+            float halton_direction[4];
+            halton_4(j + 50 + WC_NORMALIZATION_LOCATIONS, halton_direction);
+            sample_cosine_hemisphere(halton_direction[0], halton_direction[1],
+                &directions[j*3 + 0], &directions[j*3 + 1],
+                &directions[j*3 + 2]);
+        }
+        num_computed_directions = num_directions;
+        wcRunNormalizationWork(params, directions, states, jobs,
+            num_round_jobs, num_directions, num_threads);
+
+        //Jobs are compared by their means, which is the same as comparing
+        // their sums when they have the same number of directions
+        best = candidates[0];
+        for(i = 1; i < num_candidates; i++){
+            const wcNormalizationJobState *a = &states[candidates[i]];
+            const wcNormalizationJobState *b = &states[best];
+            if((double)a->sum*b->num_directions
+                > (double)b->sum*a->num_directions){
+                best = candidates[i];
+            }
+        }
+        if(tolerance <= 0.f || num_directions >= max_directions){
+            break;
+        }
+
+        double best_mean = wcNormalizationJobMean(&states[best]);
+        double lowest_max = best_mean*(1.0 -
+            wcNormalizationJobError(&states[best]));
+        uint32_t num_kept = 0;
+        num_round_jobs = 0;
+        for(i = 0; i < num_candidates; i++){
+            uint32_t job = candidates[i];
+            double mean = wcNormalizationJobMean(&states[job]);
+            double job_error = wcNormalizationJobError(&states[job]);
+            if(job != best && mean*(1.0 + job_error) < lowest_max){
+                continue;
+            }
+            candidates[num_kept++] = job;
+            //A job without any specular reflection yet has no error bound,
+            // and is sampled as long as it is not dropped
+            if(job_error > tolerance || mean <= 0.0){
+                jobs[num_round_jobs++] = job;
+            }
+        }
+        num_candidates = num_kept;
+        if(num_round_jobs == 0){
+            break;
+        }
+        num_directions *= 2;
+        if(num_directions > max_directions){
+            num_directions = max_directions;
+        }
+    }
+
+    wcNormalizationJobState best_state = states[best];
+    *error = (float)wcNormalizationJobError(&best_state);
+    free(jobs);
+    free(candidates);
+    free(states);
+    free(directions);
+
+    if ((float)((double)best_state.sum*WC_NORMALIZATION_DIRECTIONS
+            /best_state.num_directions) <= 0.0001f) {
+        *error = 0.f;
+        return 0.f;
+    }
+    return (float)best_state.num_directions / best_state.sum;
+}
 
 #ifndef WC_NO_FILES
+/* The cache file starts with a header of four uint32_t: magic, version and
+ * the number of locations and directions used for the sampling. Each entry
+ * is an uint64_t hash of the key, the number of floats in the key as an
+ * uint32_t, the normalization and its error as floats and then the key
+ * itself.
+ * Everything is in the byte order of the machine. A file written on a
+ * machine with another byte order does not match the magic, and is started
+ * over.
+ */
+#define WC_NORMALIZATION_CACHE_MAGIC 0x434e4357 // "WCNC"
+#define WC_NORMALIZATION_KEY_PARAMS 5
+#define WC_NORMALIZATION_KEY_MAX \
+    (WC_MAX_YARN_TYPES*WC_NORMALIZATION_KEY_PARAMS + 2)
+
+// Fills key with the inputs of wcCalculateSpecularNormalization.
+// Returns the number of floats, or 0 if the normalization can not be cached
+static uint32_t wcNormalizationKey(const wcWeaveParameters *params,
+    float *key)
+{
+    const wcResolvedYarnTypes *resolved = params->resolved_yarn_types;
+    uint32_t i, n = 0;
+    if(!resolved || params->num_yarn_types == 0
+        || params->num_yarn_types > WC_MAX_YARN_TYPES){
+        return 0;
+    }
+    for(i = 0; i < params->num_yarn_types; i++){
+        if((resolved->umax_has_texmap && resolved->umax_texmap[i])
+            || (resolved->psi_has_texmap && resolved->psi_texmap[i])
+            || (resolved->alpha_has_texmap && resolved->alpha_texmap[i])
+            || (resolved->beta_has_texmap && resolved->beta_texmap[i])
+            || (resolved->delta_x_has_texmap && resolved->delta_x_texmap[i])){
+            return 0;
+        }
+        key[n++] = resolved->umax[i];
+        key[n++] = resolved->psi[i];
+        key[n++] = resolved->alpha[i];
+        key[n++] = resolved->beta[i];
+        key[n++] = resolved->delta_x[i];
+    }
+    key[n++] = wcNormalizationTolerance(params);
+    //The specular is evaluated with the fast math approximations if set
+    key[n++] = params->fast_math ? 1.f : 0.f;
+    return n;
+}
 
-//NOTE(Vidar): In case we add support for more file formats
-void wcWeavePatternFromFile(wcWeaveParameters *params, const char *filename)
+// FNV-1a
+static uint64_t wcHashNormalizationKey(const float *key, uint32_t n)
 {
-    wcWeavePatternFromWIF(params,filename);
+    const uint8_t *bytes = (const uint8_t*)key;
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+    for(i = 0; i < n*sizeof(float); i++){
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
 }
-#ifdef WC_WCHAR
-void wcWeavePatternFromFile_wchar(wcWeaveParameters *params,
-    const wchar_t *filename)
+
+static int wcReadNormalizationCacheHeader(FILE *f)
+{
+    uint32_t header[4];
+    return fread(header, sizeof(uint32_t), 4, f) == 4
+        && header[0] == WC_NORMALIZATION_CACHE_MAGIC
+        && header[1] == WC_NORMALIZATION_CACHE_VERSION
+        && header[2] == WC_NORMALIZATION_LOCATIONS
+        && header[3] == WC_NORMALIZATION_DIRECTIONS;
+}
+
+// Returns 1 and sets normalization if the key is in the cache
+static int wcLoadCachedNormalization(const char *filename, const float *key,
+    uint32_t n, uint64_t hash, float *normalization, float *error)
+{
+    FILE *f = fopen(filename, "rb");
+    if(!f){
+        return 0;
+    }
+    int found = 0;
+    if(wcReadNormalizationCacheHeader(f)){
+        float *entry_key = (float*)malloc(WC_NORMALIZATION_KEY_MAX
+            *sizeof(float));
+        uint64_t entry_hash;
+        uint32_t entry_n;
+        float entry_normalization, entry_error;
+        //A partly written entry at the end, from another process writing
+        // at the same time, just ends the search.
+        while(!found
+            && fread(&entry_hash, sizeof(uint64_t), 1, f) == 1
+            && fread(&entry_n, sizeof(uint32_t), 1, f) == 1
+            && fread(&entry_normalization, sizeof(float), 1, f) == 1
+            && fread(&entry_error, sizeof(float), 1, f) == 1
+            && entry_n <= WC_NORMALIZATION_KEY_MAX
+            && fread(entry_key, sizeof(float), entry_n, f) == entry_n){
+            if(entry_hash == hash && entry_n == n
+                && memcmp(entry_key, key, n*sizeof(float)) == 0){
+                *normalization = entry_normalization;
+                *error = entry_error;
+                found = 1;
+            }
+        }
+        free(entry_key);
+    }
+    fclose(f);
+    return found;
+}
+
+static void wcStoreCachedNormalization(const char *filename, const float *key,
+    uint32_t n, uint64_t hash, float normalization, float error)
 {
-    wcWeavePatternFromWIF_wchar(params,filename);
+    // Append to the file if it is a valid cache with room left,
+    // otherwise start it over
+    int append = 0;
+    FILE *f = fopen(filename, "rb");
+    if(f){
+        if(wcReadNormalizationCacheHeader(f) && fseek(f, 0, SEEK_END) == 0){
+            long size = ftell(f);
+            append = size >= 0 && size < WC_NORMALIZATION_CACHE_MAX_BYTES;
+        }
+        fclose(f);
+    }
+    f = fopen(filename, append ? "ab" : "wb");
+    if(!f){
+        return;
+    }
+    if(!append){
+        uint32_t header[4] = {WC_NORMALIZATION_CACHE_MAGIC,
+            WC_NORMALIZATION_CACHE_VERSION, WC_NORMALIZATION_LOCATIONS,
+            WC_NORMALIZATION_DIRECTIONS};
+        fwrite(header, sizeof(uint32_t), 4, f);
+    }
+    // Written with one call, so that processes appending at the same time
+    // do not interleave their entries
+    size_t entry_size = sizeof(uint64_t) + sizeof(uint32_t) + 2*sizeof(float)
+        + n*sizeof(float);
+    uint8_t *entry = (uint8_t*)malloc(entry_size);
+    memcpy(entry, &hash, sizeof(uint64_t));
+    memcpy(entry + 8, &n, sizeof(uint32_t));
+    memcpy(entry + 12, &normalization, sizeof(float));
+    memcpy(entry + 16, &error, sizeof(float));
+    memcpy(entry + 20, key, n*sizeof(float));
+    fwrite(entry, 1, entry_size, f);
+    free(entry);
+    fclose(f);
 }
 #endif
 
+#include "woven_cloth_wcb.cpp"
+#include "woven_cloth_pattern_cache.cpp"
+
+void wcFinalizeWeaveParameters(wcWeaveParameters *params)
+{
+    wcFreeSpecularTable(params);
+    wcFreeResolvedYarnTypes(params);
+    wcFreeSegmentLookup(params);
+    if(params->pattern && !wcUseCompiledSegmentLookup(params)){
+        wcBuildSegmentLookup(params);
+    }
+    wcBuildResolvedYarnTypes(params);
+    params->inv_pattern_realwidth = 1.f/params->pattern_realwidth;
+    params->inv_pattern_realheight = 1.f/params->pattern_realheight;
+
+    //Calculate normalization factor for the specular reflection
+    if (params->pattern) {
+#ifndef WC_NO_FILES
+        if(params->normalization_cache){
+            float *key = (float*)malloc(WC_NORMALIZATION_KEY_MAX
+                *sizeof(float));
+            uint32_t n = wcNormalizationKey(params, key);
+            uint64_t hash = wcHashNormalizationKey(key, n);
+            if(n == 0 || !wcLoadCachedNormalization(params->normalization_cache,
+                    key, n, hash, &params->specular_normalization,
+                    &params->specular_normalization_error)){
+                if(!wcUseCompiledNormalization(params)){
+                    params->specular_normalization =
+                        wcCalculateSpecularNormalization(params,
+                        &params->specular_normalization_error);
+                }
+                if(n > 0){
+                    wcStoreCachedNormalization(params->normalization_cache,
+                        key, n, hash, params->specular_normalization,
+                        params->specular_normalization_error);
+                }
+            }
+            free(key);
+        } else if(wcUseCompiledNormalization(params)){
+            //Stored in the compiled pattern
+        } else
+#endif
+        params->specular_normalization =
+            wcCalculateSpecularNormalization(params,
+            &params->specular_normalization_error);
+        wcBuildSpecularTable(params);
+    }
+}
+
+
+#ifndef WC_NO_FILES
+
 void wcWeavePatternFromWIF(wcWeaveParameters *params, const char *filename)
 {
     WeaveData *data = wif_read(filename);
@@ -315,6 +958,15 @@ void wcWeavePatternFromWIF(wcWeaveParameters *params, const char *filename)
         &params->pattern_width, &params->pattern_height,
         &params->pattern_realwidth, &params->pattern_realheight);
     wif_free_weavedata(data);
+    params->segment_table = 0;
+    params->run_length_index = 0;
+    params->bitplane_index = 0;
+    params->resolved_yarn_types = 0;
+    params->specular_table = 0;
+    params->compiled_pattern = 0;
+    params->compiled_pattern_size = 0;
+    params->pattern_cache_entry = 0;
+    params->inv_pattern_realwidth = params->inv_pattern_realheight = 0.f;
     wcFinalizeWeaveParameters(params);
 }
 
@@ -327,19 +979,39 @@ void wcWeavePatternFromWIF_wchar(wcWeaveParameters *params,
         &params->pattern_width, &params->pattern_height,
         &params->pattern_realwidth, &params->pattern_realheight);
     wif_free_weavedata(data);
+    params->segment_table = 0;
+    params->run_length_index = 0;
+    params->bitplane_index = 0;
+    params->resolved_yarn_types = 0;
+    params->specular_table = 0;
+    params->compiled_pattern = 0;
+    params->compiled_pattern_size = 0;
+    params->pattern_cache_entry = 0;
+    params->inv_pattern_realwidth = params->inv_pattern_realheight = 0.f;
     wcFinalizeWeaveParameters(params);
 }
 #endif
 #endif
 
+void wcInitWeaveParameters(wcWeaveParameters *params)
+{
+    //All options default to 0
+    memset(params, 0, sizeof(wcWeaveParameters));
+    params->uscale = params->vscale = 1.f;
+}
+
 void wcFreeWeavePattern(wcWeaveParameters *params)
 {
     if (params->yarn_types) {
         free(params->yarn_types);
     }
     if (params->pattern) {
-        free(params->pattern);
+        wcFreePatternMemory(params, params->pattern);
     }
+    wcFreeSegmentLookup(params);
+    wcFreeResolvedYarnTypes(params);
+    wcFreeSpecularTable(params);
+    wcFreeCompiledPattern(params);
 }
 
 static float intensityVariation(wcPatternData pattern_data)
@@ -393,7 +1065,7 @@ static void calculateLengthOfSegment(uint8_t warp_above, uint32_t pattern_x,
             *incremented_coord = 0;
         }
         if((pattern_entries[current_x +
-                current_y*pattern_width].warp_above) != warp_above){
+                (size_t)current_y*pattern_width].warp_above) != warp_above){
             break;
         }
         (*steps_right)++;
@@ -406,175 +1078,783 @@ static void calculateLengthOfSegment(uint8_t warp_above, uint32_t pattern_x,
         }
         (*incremented_coord)--;
         if((pattern_entries[current_x +
-                current_y*pattern_width].warp_above) != warp_above){
+                (size_t)current_y*pattern_width].warp_above) != warp_above){
             break;
         }
         (*steps_left)++;
     } while(*incremented_coord != initial_coord);
+    wcStatsCountSegmentWalk(*steps_left + *steps_right + 1);
 }
 
-static float vonMises(float cos_x, float b) {
+//log_norm is von_mises_log_norm of b, see WC_DERIVED_PARAMETERS
+static float vonMises(float cos_x, float b, float log_norm) {
     // assumes a = 0, b > 0 is a concentration parameter.
-    float I0, absB = fabsf(b);
-    if (fabsf(b) <= 3.75f) {
-        float t = absB / 3.75f;
-        t = t * t;
-        I0 = 1.0f + t*(3.5156229f + t*(3.0899424f + t*(1.2067492f
-            + t*(0.2659732f + t*(0.0360768f + t*0.0045813f)))));
-    } else {
-        float t = 3.75f / absB;
-        I0 = expf(absB) / sqrtf(absB) * (0.39894228f + t*(0.01328592f
-            + t*(0.00225319f + t*(-0.00157565f + t*(0.00916281f
-            + t*(-0.02057706f + t*(0.02635537f + t*(-0.01647633f
-            + t*0.00392377f))))))));
-    }
-
-    return expf(b * cos_x) / (2 * M_PI * I0);
+    return expf(b * cos_x - log_norm);
 }
 
-void lookupPatternEntry(PatternEntry* entry, const wcWeaveParameters* params, const int8_t x, const int8_t y) {
-    //function to get pattern entry. Takes care of coordinate wrapping!
-    int32_t tmpx = (int32_t)fmod(x,(float)params->pattern_width);
-    int32_t tmpy = (int32_t)fmod(y,(float)params->pattern_height);
-    if (tmpx < 0.f) {
-        tmpx = params->pattern_width + tmpx;
+//Wraps a pattern coordinate to [0, size). Coordinates less than one pattern
+// size outside of the pattern, which is almost all of them, and power of two
+// sizes are wrapped without any division.
+static uint32_t wcWrapPatternIndex(int64_t coord, uint32_t size)
+{
+    if(coord >= 0 && coord < (int64_t)size){
+        return (uint32_t)coord;
     }
-    if (tmpy < 0.f) {
-        tmpy = params->pattern_height + tmpy;
+    if((size & (size - 1)) == 0){
+        return (uint32_t)(coord & (int64_t)(size - 1));
     }
-    *entry = params->pattern[tmpx + tmpy*params->pattern_width];
+    if(coord < 0 && coord >= -(int64_t)size){
+        return (uint32_t)(coord + (int64_t)size);
+    }
+    int64_t wrapped = coord % (int64_t)size;
+    return (uint32_t)(wrapped < 0 ? wrapped + (int64_t)size : wrapped);
 }
 
-int32_t wcRepeatIndex(const int32_t coord, const int32_t size) {
-    int32_t tmpcoord = (int32_t)fmod(coord, (float)size);
-    if (tmpcoord < 0.f) {
-        tmpcoord = size + tmpcoord;
-    }
-    return tmpcoord;
+void lookupPatternEntry(PatternEntry* entry, const wcWeaveParameters* params, const int64_t x, const int64_t y) {
+    //function to get pattern entry. Takes care of coordinate wrapping!
+    uint32_t tmpx = wcWrapPatternIndex(x, params->pattern_width);
+    uint32_t tmpy = wcWrapPatternIndex(y, params->pattern_height);
+    *entry = params->pattern[tmpx + (size_t)tmpy*params->pattern_width];
 }
 
+int32_t wcRepeatIndex(const int32_t coord, const int32_t size) {
+    return (int32_t)wcWrapPatternIndex(coord, (uint32_t)size);
+}
 
-wcYarnSegment wcGetYarnSegment(float total_u, float total_v,
-       const wcWeaveParameters *params) {
-    float u = fmod(total_u,1.f);
-    float v = fmod(total_v,1.f);
-    if (u < 0.f) {
-        u = u - floor(u);
-    }
-    if (v < 0.f) {
-        v = v - floor(v);
+//Index of the pattern cell at the uv coordinate u, where the pattern repeats
+// every 1 in uv, and the coordinate within that cell.
+static uint32_t wcPatternCell(float u, uint32_t size, float *cell)
+{
+    float coord = u*(float)size;
+    float index = floorf(coord);
+    *cell = coord - index;
+    //coord so close below an integer that the difference was rounded up
+    if(*cell >= 1.f){
+        index += 1.f;
+        *cell = 0.f;
     }
+    return wcWrapPatternIndex((int64_t)index, size);
+}
 
-    PatternEntry *pattern_entries = params->pattern;
-    uint32_t pattern_width = params->pattern_width;
-    uint32_t pattern_height = params->pattern_height;
-    //TODO fmod repeat uvs, to avoiding the u or v == 1 check.
-    int32_t pattern_x = (u == 1.f) ? pattern_width-1 : (uint32_t)(u*(pattern_width));
-    int32_t pattern_y = (v == 1.f) ? pattern_height-1 : (uint32_t)(v*(pattern_height));
-    //The origin is the pattern entry from which size of segment is calculated. 
-    //The origin entry changes if we miss a thin yarn.
-    int32_t origin_x = pattern_x;
-    int32_t origin_y = pattern_y;
-    PatternEntry origin_entry = params->pattern[pattern_x + 
-        pattern_y*pattern_width];
-    uint8_t warp_above = origin_entry.warp_above;
-    
-    int32_t current_x = origin_x;
-    int32_t current_y = origin_y;
-    int32_t *incremented_coord_along = warp_above ? &current_y : &current_x;
-    int32_t *incremented_coord_across = warp_above ? &current_x : &current_y;
-    float cell_x = (u == 1.f) ? 1 : u*(float)(pattern_width) - pattern_x;
-    float cell_y = (v == 1.f) ? 1 : v*(float)(pattern_height) - pattern_y;
-    float *cell_coord_along = warp_above ? &cell_y : &cell_x;
-    float *cell_coord_across = warp_above ? &cell_x : &cell_y;
-    uint32_t max_size_along = warp_above ? pattern_height: pattern_width;
-    uint32_t max_size_across = warp_above ? pattern_width: pattern_height;
-    uint32_t initial_coord_along = warp_above ? pattern_y: pattern_x;
-    uint32_t initial_coord_across = warp_above ? pattern_x: pattern_y;
 
-    //Have we hit the yarn? (For later, are we between two directly parallel yarns?)
-    uint8_t yarn_hit = 0;
-    uint8_t between_parallel = 0;
-    uint8_t extension = 0;
-    int32_t origin_offset = 0;
-    if (fabsf(2*(*cell_coord_across)-1.f) <= params->yarn_types[origin_entry.yarn_type].yarnsize) {
-        yarn_hit = 1;
-    } else {
-        //Did not hit yarn, look for extension...
-        int8_t direction = (*cell_coord_across >= 0.5) ? 1 : -1;
-        PatternEntry tmp_pe; 
-        *incremented_coord_across = initial_coord_across;
-        uint8_t found_extension_entry = 1;
-        do{
-            (*incremented_coord_across) += direction;
-            lookupPatternEntry(&tmp_pe, params, current_x, current_y);
-            if ((*incremented_coord_across) == initial_coord_across +
-                    direction && tmp_pe.warp_above == warp_above) {
-                between_parallel = 1;
+//Counts the runs of cells with equal warp_above along one row (along_y = 0)
+// or column (along_y = 1) of the pattern, and stores for each cell how many
+// cells of its run lie to the left and right of it. The counts are the same
+// as the ones calculateLengthOfSegment would give, including the wrap around
+// at the pattern border.
+static void wcCountSegmentRuns(wcSegmentTableEntry *table,
+        const PatternEntry *pattern, uint32_t line, uint8_t along_y,
+        uint32_t pattern_width, uint32_t pattern_height)
+{
+    uint32_t n = along_y ? pattern_height : pattern_width;
+    size_t first = along_y ? line : (size_t)line*pattern_width;
+    size_t stride = along_y ? pattern_width : 1;
+    uint32_t i, j;
+
+    //Find a cell where a run starts
+    uint32_t run_start = n;
+    for(i = 0; i < n; i++){
+        uint32_t prev = (i == 0) ? n - 1 : i - 1;
+        if(pattern[first + i*stride].warp_above !=
+                pattern[first + prev*stride].warp_above){
+            run_start = i;
+            break;
+        }
+    }
+    if(run_start == n){
+        //The whole line has the same warp_above. The walk goes all the way
+        // around the pattern, in both directions.
+        for(i = 0; i < n; i++){
+            wcSegmentTableEntry *entry = table + first + i*stride;
+            if(along_y){
+                entry->steps_y_left = entry->steps_y_right = n;
+            } else{
+                entry->steps_x_left = entry->steps_x_right = n;
             }
-            if (abs((int)*incremented_coord_across - (int)initial_coord_across) == max_size_across) {
-                found_extension_entry = 0;
-                break;
+        }
+        return;
+    }
+    uint32_t count = 0;
+    while(count < n){
+        uint8_t warp_above = pattern[first + run_start*stride].warp_above;
+        uint32_t length = 1;
+        while(pattern[first + ((run_start + length)%n)*stride].warp_above
+                == warp_above){
+            length++;
+        }
+        for(j = 0; j < length; j++){
+            wcSegmentTableEntry *entry = table + first
+                + ((run_start + j)%n)*stride;
+            if(along_y){
+                entry->steps_y_left  = j;
+                entry->steps_y_right = length - 1 - j;
+            } else{
+                entry->steps_x_left  = j;
+                entry->steps_x_right = length - 1 - j;
             }
-        } while (tmp_pe.warp_above == warp_above);
-        
-        //Is there are yarn that can be used as extension. Did we hit it?
-        if (found_extension_entry && fabsf(2*(*cell_coord_along)-1.f) <=
-                params->yarn_types[tmp_pe.yarn_type].yarnsize) {
-            //Yes we hit an extention. Use this pattern entry as new origin!
-            origin_entry = tmp_pe;
-            origin_offset = ((!warp_above) ? ((int)origin_y - current_y) : ((int)origin_x - current_x));
-            warp_above = origin_entry.warp_above;
-            origin_x = wcRepeatIndex(current_x, pattern_width);
-            origin_y = wcRepeatIndex(current_y, pattern_height);
+        }
+        count += length;
+        run_start = (run_start + length)%n;
+    }
+}
 
-            extension = 1;
-            yarn_hit = 1;
+static void wcBuildSegmentTable(wcWeaveParameters *params)
+{
+    uint32_t w = params->pattern_width;
+    uint32_t h = params->pattern_height;
+    uint32_t x, y;
+    wcSegmentTableEntry *table =
+        (wcSegmentTableEntry*)calloc((size_t)w*h, sizeof(wcSegmentTableEntry));
+    if(!table){
+        return;
+    }
+    for(y = 0; y < h; y++){
+        wcCountSegmentRuns(table, params->pattern, y, 0, w, h);
+    }
+    for(x = 0; x < w; x++){
+        wcCountSegmentRuns(table, params->pattern, x, 1, w, h);
+    }
+    //The borders are the cells just outside the run, along the yarn
+    for(y = 0; y < h; y++){
+        for(x = 0; x < w; x++){
+            size_t row = (size_t)y*w;
+            wcSegmentTableEntry *entry = table + x + row;
+            size_t left, right;
+            if(params->pattern[x + row].warp_above){
+                left  = x + (size_t)wcWrapPatternIndex((int64_t)y
+                    - entry->steps_y_left - 1, h)*w;
+                right = x + (size_t)wcWrapPatternIndex((int64_t)y
+                    + entry->steps_y_right + 1, h)*w;
+            } else{
+                left  = wcWrapPatternIndex((int64_t)x
+                    - entry->steps_x_left - 1, w) + row;
+                right = wcWrapPatternIndex((int64_t)x
+                    + entry->steps_x_right + 1, w) + row;
+            }
+            entry->border_yarn_type_left  = params->pattern[left].yarn_type;
+            entry->border_yarn_type_right = params->pattern[right].yarn_type;
         }
     }
-    
-    //look right and left from origin until we hit cell that is not current yarn weft/warp.
-    PatternEntry border_yarn_left;
-    PatternEntry border_yarn_right;
-    uint32_t steps_right = 0;
-    uint32_t steps_left  = 0;
-    calculateLengthOfSegment(origin_entry.warp_above, origin_x,
-            origin_y, &steps_left, &steps_right,
-            params->pattern_width, params->pattern_height,
-            params->pattern);
+    params->segment_table = table;
+}
 
-    if (origin_entry.warp_above) {
-        lookupPatternEntry(&border_yarn_left, params, current_x,
-                (current_y - steps_left - 1));        
-        lookupPatternEntry(&border_yarn_right, params, current_x,
-                (current_y + steps_right + 1));        
-    } else {
-        lookupPatternEntry(&border_yarn_left, params,
-                (current_x - steps_left - 1), current_y);
-        lookupPatternEntry(&border_yarn_right, params,
-                (current_x + steps_right + 1), current_y);
-    
+//Stores the positions along each row (along_y = 0) or column (along_y = 1)
+// where warp_above differs from the previous cell, wrapping around at the
+// pattern border.
+static void wcCollectTransitions(const PatternEntry *pattern,
+        uint8_t along_y, uint32_t pattern_width, uint32_t pattern_height,
+        uint32_t **offsets_out, uint32_t **transitions_out)
+{
+    uint32_t num_lines = along_y ? pattern_width : pattern_height;
+    uint32_t n = along_y ? pattern_height : pattern_width;
+    size_t stride = along_y ? pattern_width : 1;
+    uint32_t line, i;
+    uint32_t *offsets = (uint32_t*)calloc(num_lines + 1, sizeof(uint32_t));
+    if(!offsets){
+        return;
     }
-    
+    for(line = 0; line < num_lines; line++){
+        size_t first = along_y ? line : (size_t)line*pattern_width;
+        uint32_t count = 0;
+        for(i = 0; i < n; i++){
+            uint32_t prev = (i == 0) ? n - 1 : i - 1;
+            count += pattern[first + i*stride].warp_above !=
+                pattern[first + prev*stride].warp_above;
+        }
+        if(count >= UINT32_MAX - offsets[line]){
+            //Too many transitions for the offsets
+            free(offsets);
+            return;
+        }
+        offsets[line + 1] = offsets[line] + count;
+    }
+    uint32_t *transitions = (uint32_t*)malloc(
+        ((size_t)offsets[num_lines] + 1)*sizeof(uint32_t));
+    if(!transitions){
+        free(offsets);
+        return;
+    }
+    for(line = 0; line < num_lines; line++){
+        size_t first = along_y ? line : (size_t)line*pattern_width;
+        uint32_t *t = transitions + offsets[line];
+        for(i = 0; i < n; i++){
+            uint32_t prev = (i == 0) ? n - 1 : i - 1;
+            if(pattern[first + i*stride].warp_above !=
+                    pattern[first + prev*stride].warp_above){
+                *t++ = i;
+            }
+        }
+    }
+    *offsets_out = offsets;
+    *transitions_out = transitions;
+}
+
+static void wcBuildRunLengthIndex(wcWeaveParameters *params)
+{
+    wcRunLengthIndex *index =
+        (wcRunLengthIndex*)calloc(1, sizeof(wcRunLengthIndex));
+    if(!index){
+        return;
+    }
+    wcCollectTransitions(params->pattern, 0, params->pattern_width,
+        params->pattern_height, &index->row_offsets, &index->row_transitions);
+    wcCollectTransitions(params->pattern, 1, params->pattern_width,
+        params->pattern_height, &index->column_offsets,
+        &index->column_transitions);
+    if(!index->row_transitions || !index->column_transitions){
+        free(index->row_offsets); free(index->row_transitions);
+        free(index->column_offsets); free(index->column_transitions);
+        free(index);
+        return;
+    }
+    params->run_length_index = index;
+}
+
+static void wcBuildBitplaneIndex(wcWeaveParameters *params)
+{
+    uint32_t pattern_width = params->pattern_width;
+    uint32_t pattern_height = params->pattern_height;
+    uint32_t words_per_row = (pattern_width + 63)/64;
+    uint32_t words_per_column = (pattern_height + 63)/64;
+    wcBitplaneIndex *index =
+        (wcBitplaneIndex*)calloc(1, sizeof(wcBitplaneIndex));
+    if(!index){
+        return;
+    }
+    index->words_per_row = words_per_row;
+    index->words_per_column = words_per_column;
+    index->rows = (uint64_t*)calloc((size_t)words_per_row*pattern_height,
+        sizeof(uint64_t));
+    index->columns = (uint64_t*)calloc((size_t)words_per_column*pattern_width,
+        sizeof(uint64_t));
+    index->yarn_types = (uint8_t*)malloc((size_t)pattern_width*pattern_height);
+    if(!index->rows || !index->columns || !index->yarn_types){
+        free(index->rows); free(index->columns); free(index->yarn_types);
+        free(index);
+        return;
+    }
+    uint32_t x, y;
+    for(y = 0; y < pattern_height; y++){
+        size_t row = (size_t)y*pattern_width;
+        for(x = 0; x < pattern_width; x++){
+            PatternEntry entry = params->pattern[row + x];
+            uint64_t bit = entry.warp_above ? 1 : 0;
+            index->rows[(size_t)y*words_per_row + x/64] |= bit << (x%64);
+            index->columns[(size_t)x*words_per_column + y/64]
+                |= bit << (y%64);
+            index->yarn_types[row + x] = entry.yarn_type;
+        }
+    }
+    params->bitplane_index = index;
+}
+
+static void wcFreeSegmentLookup(wcWeaveParameters *params)
+{
+    if(params->segment_table){
+        wcFreePatternMemory(params, params->segment_table);
+        params->segment_table = 0;
+    }
+    if(params->run_length_index){
+        wcRunLengthIndex *index = params->run_length_index;
+        wcFreePatternMemory(params, index->row_offsets);
+        wcFreePatternMemory(params, index->row_transitions);
+        wcFreePatternMemory(params, index->column_offsets);
+        wcFreePatternMemory(params, index->column_transitions);
+        free(index);
+        params->run_length_index = 0;
+    }
+    if(params->bitplane_index){
+        wcBitplaneIndex *index = params->bitplane_index;
+        wcFreePatternMemory(params, index->rows);
+        wcFreePatternMemory(params, index->columns);
+        wcFreePatternMemory(params, index->yarn_types);
+        free(index);
+        params->bitplane_index = 0;
+    }
+}
+
+static void wcBuildSegmentLookup(wcWeaveParameters *params)
+{
+    uint8_t lookup = params->segment_lookup;
+    if(lookup != WC_SEGMENT_LOOKUP_WALK && lookup != WC_SEGMENT_LOOKUP_TABLE
+            && lookup != WC_SEGMENT_LOOKUP_RUN_LENGTH
+            && lookup != WC_SEGMENT_LOOKUP_BITPLANE){
+        size_t table_size = (size_t)params->pattern_width
+            * params->pattern_height * sizeof(wcSegmentTableEntry);
+        lookup = table_size <= WC_SEGMENT_TABLE_MAX_BYTES
+            ? WC_SEGMENT_LOOKUP_TABLE : WC_SEGMENT_LOOKUP_RUN_LENGTH;
+    }
+    if(lookup == WC_SEGMENT_LOOKUP_TABLE){
+        wcBuildSegmentTable(params);
+    }
+    if(lookup == WC_SEGMENT_LOOKUP_RUN_LENGTH){
+        wcBuildRunLengthIndex(params);
+        if(params->segment_lookup != WC_SEGMENT_LOOKUP_RUN_LENGTH){
+            //Patterns with short floats have many transitions, use the
+            // bitplanes if they are smaller, or if there were too many
+            // transitions for the run length index
+            size_t bitplane_size = (size_t)params->pattern_width
+                * params->pattern_height + ((size_t)(params->pattern_width
+                + 63)/64*params->pattern_height + (size_t)(params->pattern_height
+                + 63)/64*params->pattern_width) * sizeof(uint64_t);
+            if(!params->run_length_index
+                    || bitplane_size < wcGetSegmentLookupMemory(params)){
+                wcFreeSegmentLookup(params);
+                lookup = WC_SEGMENT_LOOKUP_BITPLANE;
+            }
+        }
+    }
+    if(lookup == WC_SEGMENT_LOOKUP_BITPLANE){
+        wcBuildBitplaneIndex(params);
+    }
+}
+
+size_t wcGetSegmentLookupMemory(const wcWeaveParameters *params)
+{
+    size_t size = 0;
+    if(params->segment_table){
+        size += (size_t)params->pattern_width * params->pattern_height
+            * sizeof(wcSegmentTableEntry);
+    }
+    if(params->run_length_index){
+        const wcRunLengthIndex *index = params->run_length_index;
+        size += sizeof(wcRunLengthIndex);
+        size += (params->pattern_height + 1 + index->row_offsets[
+            params->pattern_height] + 1) * sizeof(uint32_t);
+        size += (params->pattern_width + 1 + index->column_offsets[
+            params->pattern_width] + 1) * sizeof(uint32_t);
+    }
+    if(params->bitplane_index){
+        const wcBitplaneIndex *index = params->bitplane_index;
+        size += sizeof(wcBitplaneIndex);
+        size += ((size_t)index->words_per_row*params->pattern_height
+            + (size_t)index->words_per_column*params->pattern_width)
+            * sizeof(uint64_t);
+        size += (size_t)params->pattern_width*params->pattern_height;
+    }
+    return size;
+}
+
+//Finds the run of cells with the same warp_above which contains position
+// pos, among the n cells of a row or column with the given transitions.
+// Gives the same counts as calculateLengthOfSegment.
+static void wcRunFromTransitions(const uint32_t *transitions,
+        uint32_t num_transitions, uint32_t n, uint32_t pos,
+        uint32_t *steps_left, uint32_t *steps_right)
+{
+    if(num_transitions == 0){
+        *steps_left = *steps_right = n;
+        return;
+    }
+    //Binary search for the number of transitions at or before pos
+    uint32_t lo = 0, hi = num_transitions;
+    while(lo < hi){
+        uint32_t mid = lo + (hi - lo)/2;
+        if(transitions[mid] <= pos){
+            lo = mid + 1;
+        } else{
+            hi = mid;
+        }
+    }
+    uint32_t run_start = (lo == 0) ? transitions[num_transitions - 1]
+        : transitions[lo - 1];
+    uint32_t run_end = (lo == num_transitions) ? transitions[0] + n
+        : transitions[lo];
+    *steps_left  = (lo == 0) ? pos + n - run_start : pos - run_start;
+    *steps_right = run_end - pos - 1;
+}
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+static uint32_t wcCountTrailingZeros64(uint64_t x)
+{
+    unsigned long i;
+    _BitScanForward64(&i, x);
+    return i;
+}
+static uint32_t wcCountLeadingZeros64(uint64_t x)
+{
+    unsigned long i;
+    _BitScanReverse64(&i, x);
+    return 63 - i;
+}
+#else
+#define wcCountTrailingZeros64(x) ((uint32_t)__builtin_ctzll(x))
+#define wcCountLeadingZeros64(x) ((uint32_t)__builtin_clzll(x))
+#endif
+
+//Finds the run of cells with the same warp_above which contains position
+// pos, among the n cells of a row or column stored as bits. The bits of
+// each word are flipped when the cell at pos is set, so that the ends of
+// the run are the first set bits on either side of pos.
+// Gives the same counts as calculateLengthOfSegment.
+static void wcRunFromBits(const uint64_t *bits, uint32_t n, uint32_t pos,
+        uint32_t *steps_left, uint32_t *steps_right)
+{
+    uint64_t flip = ((bits[pos/64] >> (pos%64)) & 1) ? ~(uint64_t)0 : 0;
+    uint32_t steps, p;
+
+    //Right, scanning towards higher positions and wrapping at n
+    steps = 0;
+    p = (pos + 1 == n) ? 0 : pos + 1;
+    while(steps < n - 1){
+        uint32_t bit = p%64;
+        uint32_t count = 64 - bit;
+        if(count > n - p)         count = n - p;
+        if(count > n - 1 - steps) count = n - 1 - steps;
+        uint64_t word = (bits[p/64] ^ flip) >> bit;
+        if(count < 64){
+            word &= ((uint64_t)1 << count) - 1;
+        }
+        if(word){
+            steps += wcCountTrailingZeros64(word);
+            break;
+        }
+        steps += count;
+        p += count;
+        if(p == n){
+            p = 0;
+        }
+    }
+    *steps_right = (steps == n - 1) ? n : steps;
+
+    //Left, scanning towards lower positions and wrapping at 0
+    steps = 0;
+    p = (pos == 0) ? n - 1 : pos - 1;
+    while(steps < n - 1){
+        uint32_t bit = p%64;
+        uint32_t count = bit + 1;
+        if(count > n - 1 - steps) count = n - 1 - steps;
+        uint64_t word = (bits[p/64] ^ flip) << (63 - bit);
+        if(count < 64){
+            word &= ~(uint64_t)0 << (64 - count);
+        }
+        if(word){
+            steps += wcCountLeadingZeros64(word);
+            break;
+        }
+        steps += count;
+        p = (p < count) ? n - 1 : p - count;
+    }
+    *steps_left = (steps == n - 1) ? n : steps;
+}
+
+//The origin is the pattern entry from which size of segment is calculated,
+//together with what is needed to measure the segment from it.
+typedef struct
+{
+    PatternEntry entry;
+    uint8_t border_yarn_type_left, border_yarn_type_right;
+    uint32_t steps_left, steps_right;
+    int32_t offset;
+    uint8_t between_parallel;
+    uint8_t yarn_hit;
+} wcSegmentOrigin;
+
+static void wcFindSegmentOriginWalk(int32_t pattern_x, int32_t pattern_y,
+        float cell_x, float cell_y, const wcWeaveParameters *params,
+        wcSegmentOrigin *origin)
+{
+    uint32_t pattern_width = params->pattern_width;
+    uint32_t pattern_height = params->pattern_height;
+    //The origin entry changes if we miss a thin yarn.
+    int32_t origin_x = pattern_x;
+    int32_t origin_y = pattern_y;
+    PatternEntry origin_entry = params->pattern[pattern_x +
+        (size_t)pattern_y*pattern_width];
+    uint8_t warp_above = origin_entry.warp_above;
+
+    int64_t current_x = origin_x;
+    int64_t current_y = origin_y;
+    int64_t *incremented_coord_across = warp_above ? &current_x : &current_y;
+    float *cell_coord_along = warp_above ? &cell_y : &cell_x;
+    float *cell_coord_across = warp_above ? &cell_x : &cell_y;
+    uint32_t max_size_across = warp_above ? pattern_width: pattern_height;
+    int64_t initial_coord_across = warp_above ? pattern_x: pattern_y;
+
+    //Have we hit the yarn? (For later, are we between two directly parallel yarns?)
+    uint8_t yarn_hit = 0;
+    uint8_t between_parallel = 0;
+    int32_t origin_offset = 0;
+    if (fabsf(2*(*cell_coord_across)-1.f) <= params->yarn_types[origin_entry.yarn_type].yarnsize) {
+        yarn_hit = 1;
+    } else {
+        //Did not hit yarn, look for extension...
+        WC_STATS_ADD(extension_searches, 1);
+        int8_t direction = (*cell_coord_across >= 0.5) ? 1 : -1;
+        PatternEntry tmp_pe;
+        *incremented_coord_across = initial_coord_across;
+        uint8_t found_extension_entry = 1;
+        do{
+            (*incremented_coord_across) += direction;
+            lookupPatternEntry(&tmp_pe, params, current_x, current_y);
+            if ((*incremented_coord_across) == initial_coord_across +
+                    direction && tmp_pe.warp_above == warp_above) {
+                between_parallel = 1;
+            }
+            if (*incremented_coord_across - initial_coord_across ==
+                    direction*(int64_t)max_size_across) {
+                found_extension_entry = 0;
+                break;
+            }
+        } while (tmp_pe.warp_above == warp_above);
+
+        //Is there are yarn that can be used as extension. Did we hit it?
+        if (found_extension_entry && fabsf(2*(*cell_coord_along)-1.f) <=
+                params->yarn_types[tmp_pe.yarn_type].yarnsize) {
+            //Yes we hit an extention. Use this pattern entry as new origin!
+            origin_entry = tmp_pe;
+            origin_offset = (int32_t)((!warp_above) ? (origin_y - current_y) : (origin_x - current_x));
+            warp_above = origin_entry.warp_above;
+            origin_x = wcWrapPatternIndex(current_x, pattern_width);
+            origin_y = wcWrapPatternIndex(current_y, pattern_height);
+
+            yarn_hit = 1;
+            WC_STATS_ADD(extension_hits, 1);
+        }
+        WC_STATS_ADD(between_parallel, between_parallel);
+    }
+
+    //look right and left from origin until we hit cell that is not current yarn weft/warp.
+    PatternEntry border_yarn_left;
+    PatternEntry border_yarn_right;
+    uint32_t steps_right = 0;
+    uint32_t steps_left  = 0;
+    calculateLengthOfSegment(origin_entry.warp_above, origin_x,
+            origin_y, &steps_left, &steps_right,
+            params->pattern_width, params->pattern_height,
+            params->pattern);
+
+    if (origin_entry.warp_above) {
+        lookupPatternEntry(&border_yarn_left, params, current_x,
+                (current_y - (int64_t)steps_left - 1));
+        lookupPatternEntry(&border_yarn_right, params, current_x,
+                (current_y + (int64_t)steps_right + 1));
+    } else {
+        lookupPatternEntry(&border_yarn_left, params,
+                (current_x - (int64_t)steps_left - 1), current_y);
+        lookupPatternEntry(&border_yarn_right, params,
+                (current_x + (int64_t)steps_right + 1), current_y);
+
+    }
+    origin->entry = origin_entry;
+    origin->border_yarn_type_left = border_yarn_left.yarn_type;
+    origin->border_yarn_type_right = border_yarn_right.yarn_type;
+    origin->steps_left = steps_left;
+    origin->steps_right = steps_right;
+    origin->offset = origin_offset;
+    origin->between_parallel = between_parallel;
+    origin->yarn_hit = yarn_hit;
+}
+
+//Number of cells with the same warp_above as (x, y) to the left and right of
+// it along a row (along_y = 0) or a column (along_y = 1), read from the segment
+// table, the bitplane index or the run length index.
+static void wcLookupSegmentSteps(const wcWeaveParameters *params, uint32_t x,
+        uint32_t y, uint8_t along_y, uint32_t *steps_left,
+        uint32_t *steps_right)
+{
+    if(params->segment_table){
+        const wcSegmentTableEntry *cell = params->segment_table + x
+            + (size_t)y*params->pattern_width;
+        *steps_left  = along_y ? cell->steps_y_left  : cell->steps_x_left;
+        *steps_right = along_y ? cell->steps_y_right : cell->steps_x_right;
+        return;
+    }
+    if(params->bitplane_index){
+        const wcBitplaneIndex *index = params->bitplane_index;
+        if(along_y){
+            wcRunFromBits(index->columns
+                + (size_t)x*index->words_per_column,
+                params->pattern_height, y, steps_left, steps_right);
+        } else{
+            wcRunFromBits(index->rows + (size_t)y*index->words_per_row,
+                params->pattern_width, x, steps_left, steps_right);
+        }
+        return;
+    }
+    const wcRunLengthIndex *index = params->run_length_index;
+    if(along_y){
+        uint32_t first = index->column_offsets[x];
+        wcRunFromTransitions(index->column_transitions + first,
+            index->column_offsets[x + 1] - first, params->pattern_height, y,
+            steps_left, steps_right);
+    } else{
+        uint32_t first = index->row_offsets[y];
+        wcRunFromTransitions(index->row_transitions + first,
+            index->row_offsets[y + 1] - first, params->pattern_width, x,
+            steps_left, steps_right);
+    }
+}
+
+//Yarn types of the cells just outside a segment along the given axis, where
+// (x, y) is a cell beside or inside the segment.
+static void wcLookupSegmentBorders(const wcWeaveParameters *params,
+        uint32_t x, uint32_t y, uint8_t along_y, uint32_t steps_left,
+        uint32_t steps_right, wcSegmentOrigin *origin)
+{
+    uint32_t pattern_width = params->pattern_width;
+    uint32_t pattern_height = params->pattern_height;
+    size_t left, right;
+    if(along_y){
+        left  = x + (size_t)wcWrapPatternIndex((int64_t)y - steps_left - 1,
+            pattern_height) * pattern_width;
+        right = x + (size_t)wcWrapPatternIndex((int64_t)y + steps_right + 1,
+            pattern_height) * pattern_width;
+    } else{
+        left  = wcWrapPatternIndex((int64_t)x - steps_left - 1,
+            pattern_width) + (size_t)y * pattern_width;
+        right = wcWrapPatternIndex((int64_t)x + steps_right + 1,
+            pattern_width) + (size_t)y * pattern_width;
+    }
+    if(params->bitplane_index){
+        origin->border_yarn_type_left  =
+            params->bitplane_index->yarn_types[left];
+        origin->border_yarn_type_right =
+            params->bitplane_index->yarn_types[right];
+    } else{
+        origin->border_yarn_type_left  = params->pattern[left].yarn_type;
+        origin->border_yarn_type_right = params->pattern[right].yarn_type;
+    }
+}
+
+//Fills in the segment steps and border yarn types of the segment which
+// contains the cell (x, y).
+static void wcLookupSegment(const wcWeaveParameters *params, uint32_t x,
+        uint32_t y, uint8_t warp_above, wcSegmentOrigin *origin)
+{
+    wcLookupSegmentSteps(params, x, y, warp_above, &origin->steps_left,
+        &origin->steps_right);
+    if(params->segment_table){
+        const wcSegmentTableEntry *cell = params->segment_table + x
+            + (size_t)y*params->pattern_width;
+        origin->border_yarn_type_left  = cell->border_yarn_type_left;
+        origin->border_yarn_type_right = cell->border_yarn_type_right;
+    } else{
+        wcLookupSegmentBorders(params, x, y, warp_above, origin->steps_left,
+            origin->steps_right, origin);
+    }
+}
+
+//Same as wcFindSegmentOriginWalk, but all walking along rows and columns is
+// replaced by reading the segment table, bitplane index or run length index
+// built by wcFinalizeWeaveParameters.
+static void wcFindSegmentOriginIndexed(int32_t pattern_x, int32_t pattern_y,
+        float cell_x, float cell_y, const wcWeaveParameters *params,
+        wcSegmentOrigin *origin)
+{
+    uint32_t pattern_width = params->pattern_width;
+    uint32_t pattern_height = params->pattern_height;
+    PatternEntry entry = params->pattern[pattern_x
+        + (size_t)pattern_y*pattern_width];
+    uint8_t warp_above = entry.warp_above;
+    float cell_coord_along  = warp_above ? cell_y : cell_x;
+    float cell_coord_across = warp_above ? cell_x : cell_y;
+
+    origin->entry = entry;
+    origin->offset = 0;
+    origin->between_parallel = 0;
+    if (fabsf(2*cell_coord_across-1.f) <=
+            params->yarn_types[entry.yarn_type].yarnsize) {
+        origin->yarn_hit = 1;
+        wcLookupSegment(params, pattern_x, pattern_y, warp_above, origin);
+        return;
+    }
+
+    //Did not hit yarn, the extension is the first cell across with a
+    // different warp_above.
+    WC_STATS_ADD(extension_searches, 1);
+    int32_t direction = (cell_coord_across >= 0.5) ? 1 : -1;
+    uint32_t max_size_across = warp_above ? pattern_width : pattern_height;
+    uint32_t steps_across_left, steps_across_right;
+    wcLookupSegmentSteps(params, pattern_x, pattern_y, !warp_above,
+        &steps_across_left, &steps_across_right);
+    uint32_t steps_across = direction > 0 ? steps_across_right
+        : steps_across_left;
+    uint8_t found_extension_entry = steps_across < max_size_across;
+    int32_t extension_distance = (int32_t)steps_across + 1;
+    origin->between_parallel = steps_across > 0;
+    origin->yarn_hit = 0;
+    WC_STATS_ADD(between_parallel, origin->between_parallel);
+
+    uint32_t ext_x = pattern_x;
+    uint32_t ext_y = pattern_y;
+    if(found_extension_entry){
+        if(warp_above){
+            ext_x = wcWrapPatternIndex((int64_t)pattern_x
+                + direction*extension_distance,
+                pattern_width);
+        } else{
+            ext_y = wcWrapPatternIndex((int64_t)pattern_y
+                + direction*extension_distance,
+                pattern_height);
+        }
+        PatternEntry ext_entry = params->pattern[ext_x
+            + (size_t)ext_y*pattern_width];
+        if(fabsf(2*cell_coord_along-1.f) <=
+                params->yarn_types[ext_entry.yarn_type].yarnsize) {
+            //Yes we hit an extention. Use this pattern entry as new origin!
+            origin->entry = ext_entry;
+            origin->offset = -direction*extension_distance;
+            origin->yarn_hit = 1;
+            WC_STATS_ADD(extension_hits, 1);
+            wcLookupSegment(params, ext_x, ext_y, ext_entry.warp_above, origin);
+            return;
+        }
+    }
+
+    //Missed both the yarn and the extension. The segment is still measured
+    // along the cell, but beside it in the cell where the search stopped.
+    wcLookupSegmentSteps(params, pattern_x, pattern_y, warp_above,
+        &origin->steps_left, &origin->steps_right);
+    wcLookupSegmentBorders(params, ext_x, ext_y, warp_above,
+        origin->steps_left, origin->steps_right, origin);
+}
+
+wcYarnSegment wcGetYarnSegment(float total_u, float total_v,
+       const wcWeaveParameters *params) {
+    uint32_t pattern_width = params->pattern_width;
+    uint32_t pattern_height = params->pattern_height;
+    float cell_x, cell_y;
+    int32_t pattern_x = wcPatternCell(total_u, pattern_width, &cell_x);
+    int32_t pattern_y = wcPatternCell(total_v, pattern_height, &cell_y);
+    uint8_t initial_warp_above = params->pattern[pattern_x +
+        (size_t)pattern_y*pattern_width].warp_above;
+    float cell_coord_across = initial_warp_above ? cell_x : cell_y;
+
+    wcSegmentOrigin origin;
+    if(params->segment_table || params->run_length_index
+            || params->bitplane_index){
+        wcFindSegmentOriginIndexed(pattern_x, pattern_y, cell_x, cell_y, params,
+            &origin);
+    } else{
+        wcFindSegmentOriginWalk(pattern_x, pattern_y, cell_x, cell_y, params,
+            &origin);
+    }
+    PatternEntry origin_entry = origin.entry;
+    uint8_t warp_above = origin_entry.warp_above;
+    uint8_t between_parallel = origin.between_parallel;
+    uint32_t steps_left = origin.steps_left;
+    uint32_t steps_right = origin.steps_right;
+
     float border_yarn_size_left = params->
-        yarn_types[border_yarn_left.yarn_type].yarnsize;
+        yarn_types[origin.border_yarn_type_left].yarnsize;
     float border_yarn_size_right = params->
-        yarn_types[border_yarn_right.yarn_type].yarnsize;
+        yarn_types[origin.border_yarn_type_right].yarnsize;
 
     float width = params->yarn_types[origin_entry.yarn_type].yarnsize;
     float length = steps_left + steps_right + 1.f +
         ((1.f-border_yarn_size_left) + (1.f-border_yarn_size_right))/2.f;
-    
+
     //If current segment is between two parallel yarns. Do not count self.
     if(between_parallel) length -= 1;
-    
+
     /* Debug */
     /*
     printf("--Debug calculateSegment--\n");
     printf("steps_left: %d, steps_right: %d\n", steps_left, steps_right);
-    printf("border_yarn_type_left: %d, border_yarn_type_right: %d\n", border_yarn_left.yarn_type, border_yarn_right.yarn_type);
+    printf("border_yarn_type_left: %d, border_yarn_type_right: %d\n", origin.border_yarn_type_left, origin.border_yarn_type_right);
     printf("border_yarn_size_left: %f, border_yarn_size_right: %f\n", border_yarn_size_left, border_yarn_size_right);
-    printf("border_yarn_left warp_above: %d, border_yarn_right warp_above: %d\n", border_yarn_left.warp_above, border_yarn_right.warp_above);
     printf("tmp width: %f, length: %f \n", width, length);
     printf("between parallel: %d\n", between_parallel);
     printf("cell_x: %f, cell_y: %f \n", cell_x, cell_y);
@@ -584,11 +1864,12 @@ wcYarnSegment wcGetYarnSegment(float total_u, float total_v,
     float start_u, start_v;
     {
         float distance_left = steps_left + (1.f - border_yarn_size_left)/2.f;
-        if (!between_parallel) distance_left += origin_offset;
-        if (between_parallel && *cell_coord_across >= 0.5) {
-            PatternEntry tmp_pe = params->pattern[pattern_x + pattern_y*pattern_width];
+        if (!between_parallel) distance_left += origin.offset;
+        if (between_parallel && cell_coord_across >= 0.5) {
+            PatternEntry tmp_pe = params->pattern[pattern_x
+                + (size_t)pattern_y*pattern_width];
             distance_left = -(0.5 + params->yarn_types[tmp_pe.yarn_type].yarnsize/2.f);
-        } 
+        }
 
         float distance_top = - (1.f-width)/2.f;
 
@@ -608,7 +1889,8 @@ wcYarnSegment wcGetYarnSegment(float total_u, float total_v,
     yarn.start_v = start_v;
     yarn.warp_above = origin_entry.warp_above;
     yarn.pattern_entry = origin_entry;
-    yarn.yarn_hit = yarn_hit;
+    yarn.yarn_hit = origin.yarn_hit;
+    WC_STATS_ADD(yarn_misses, !origin.yarn_hit);
     yarn.between_parallel = between_parallel;
     return yarn;
 }
@@ -620,8 +1902,73 @@ wcYarnSegment wcGetYarnSegment(float total_u, float total_v,
  * yarnsizes can vary. This results in a certain number of special cases.
  */
 
+void wcResetSegmentCache(wcSegmentCache *cache)
+{
+    memset(cache, 0, sizeof(wcSegmentCache));
+}
+
+//Only segments which are hit are cached. The extensions between parallel
+// yarns are left out since their bounds are not the rectangle below, and
+// so are yarns which never cross another yarn, since their start depends on
+// where they were hit.
+static void wcUpdateSegmentCache(wcSegmentCache *cache,
+        const wcYarnSegment *segment, const wcWeaveParameters *params)
+{
+    if(!segment->yarn_hit || segment->between_parallel){
+        return;
+    }
+    uint32_t size_along = segment->warp_above ? params->pattern_height
+        : params->pattern_width;
+    if(segment->length > size_along + 1.f){
+        return;
+    }
+    float size_u = segment->warp_above ? segment->width : segment->length;
+    float size_v = segment->warp_above ? segment->length : segment->width;
+    //Points right at the edge are left to wcGetYarnSegment, since the
+    // bounds are rounded differently than the segment search
+    float margin_u = (0.001f + fabsf(segment->start_u)*0.0001f)
+        /params->pattern_width;
+    float margin_v = (0.001f + fabsf(segment->start_v)*0.0001f)
+        /params->pattern_height;
+    cache->params = params;
+    cache->segment = *segment;
+    cache->min_u = segment->start_u + margin_u;
+    cache->max_u = segment->start_u + size_u/params->pattern_width - margin_u;
+    cache->min_v = segment->start_v + margin_v;
+    cache->max_v = segment->start_v + size_v/params->pattern_height
+        - margin_v;
+    cache->valid = 1;
+}
+
+//The number of pattern repeats per unit of uv
+static void wcUVScale(const wcWeaveParameters *params, float *u_scale,
+    float *v_scale)
+{
+    if (params->realworld_uv) {
+        //the user parameters uscale, vscale change roles when realworld_uv
+        // is true. If true they are then used to tweak the realworld scales
+        if (params->inv_pattern_realwidth > 0.f) {
+            *u_scale = params->uscale*params->inv_pattern_realwidth;
+            *v_scale = params->vscale*params->inv_pattern_realheight;
+        } else {
+            //Not finalized
+            *u_scale = params->uscale/params->pattern_realwidth;
+            *v_scale = params->vscale/params->pattern_realheight;
+        }
+    } else {
+        *u_scale = params->uscale;
+        *v_scale = params->vscale;
+    }
+}
+
 wcPatternData wcGetPatternData(wcIntersectionData intersection_data,
         const wcWeaveParameters *params) {
+    return wcGetPatternDataCached(intersection_data, params, 0);
+}
+
+wcPatternData wcGetPatternDataCached(wcIntersectionData intersection_data,
+        const wcWeaveParameters *params, wcSegmentCache *cache) {
+    WC_STATS_ADD(pattern_data_calls, 1);
     if(params->pattern == 0){
         wcPatternData data = {0};
         return data;
@@ -631,39 +1978,32 @@ wcPatternData wcGetPatternData(wcIntersectionData intersection_data,
     float uv_x = intersection_data.uv_x;
     float uv_y = intersection_data.uv_y;
     float u_scale, v_scale;
-    if (params->realworld_uv) {
-        //the user parameters uscale, vscale change roles when realworld_uv
-        // is true. If true they are then used to tweak the realworld scales
-        u_scale = params->uscale/params->pattern_realwidth; 
-        v_scale = params->vscale/params->pattern_realheight;
-    } else {
-        u_scale = params->uscale;
-        v_scale = params->vscale;
-    }
+    wcUVScale(params, &u_scale, &v_scale);
 
     float total_u = uv_x*u_scale;
     float total_v = uv_y*u_scale;
 
-    float u_repeat = fmod(uv_x*u_scale,1.f);
-    float v_repeat = fmod(uv_y*v_scale,1.f);
-    if (u_repeat < 0.f) {
-        u_repeat = u_repeat - floor(u_repeat);
-    }
-    if (v_repeat < 0.f) {
-        v_repeat = v_repeat - floor(v_repeat);
-    }
     //non-repeating pattern index (used for specular noise)
-    uint32_t total_pattern_x = uv_x*u_scale*params->pattern_width;
-    uint32_t total_pattern_y = uv_y*v_scale*params->pattern_height;
-    //pattern index
-    uint32_t pattern_x = (uint32_t)(u_repeat*(float)(params->pattern_width));
-    uint32_t pattern_y = (uint32_t)(v_repeat*(float)(params->pattern_height));
-    //Coordinate within the current pattern cell
-    float cell_x = ((u_repeat*(float)(params->pattern_width) - (float)pattern_x));
-    float cell_y = ((v_repeat*(float)(params->pattern_height) - (float)pattern_y));
+    //Converted through int64_t since uv can be negative
+    uint32_t total_pattern_x =
+        (uint32_t)(int64_t)(uv_x*u_scale*params->pattern_width);
+    uint32_t total_pattern_y =
+        (uint32_t)(int64_t)(uv_y*v_scale*params->pattern_height);
 
     //Get yarnsegment dimensions
-    wcYarnSegment yarnsegment = wcGetYarnSegment(total_u, total_v, params);
+    wcYarnSegment yarnsegment;
+    if(cache && cache->valid && cache->params == params
+            && total_u > cache->min_u && total_u < cache->max_u
+            && total_v > cache->min_v && total_v < cache->max_v){
+        yarnsegment = cache->segment;
+        cache->hits++;
+    } else{
+        yarnsegment = wcGetYarnSegment(total_u, total_v, params);
+        if(cache){
+            cache->misses++;
+            wcUpdateSegmentCache(cache, &yarnsegment, params);
+        }
+    }
     
     if (!yarnsegment.yarn_hit) {
         //No hit, No need to do more calculations.
@@ -695,10 +2035,8 @@ wcPatternData wcGetPatternData(wcIntersectionData intersection_data,
     printf("yarnsegment.width: %f, yarnsegment.length: %f\n", yarnsegment.width, yarnsegment.length);
     printf("w: %f, l: %f\n", w, l);
     printf("x: %f, y: %f\n", x, y);
-    printf("v_repeat: %f, u_repeat: %f\n", v_repeat, u_repeat);
     printf("total_u - yarnsegment.start_u: %f - %f = %f\n", total_u, yarnsegment.start_u, (total_u - yarnsegment.start_u));
     printf("total_v - yarnsegment.start_v: %f - %f = %f\n", total_v, yarnsegment.start_v, (total_v - yarnsegment.start_v));
-    printf("pattern_x: %d, pattern_y: %d\n", pattern_x, pattern_y);
     */
 
     //Swap X and Y for warp, so that we always have the yarn going along y.
@@ -724,264 +2062,1026 @@ wcPatternData wcGetPatternData(wcIntersectionData intersection_data,
     return ret_data;
 }
 
-float wcEvalFilamentSpecular(wcIntersectionData intersection_data,
-    wcPatternData data, const wcWeaveParameters *params)
-{
-    wcVector wi = wcvector(intersection_data.wi_x, intersection_data.wi_y,
-        intersection_data.wi_z);
-    wcVector wo = wcvector(intersection_data.wo_x, intersection_data.wo_y,
-        intersection_data.wo_z);
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) \
+    || defined(_M_IX86)
+#define WC_SIMD_X86
+#include <immintrin.h>
+#endif
 
-    if(!data.warp_above){
-        float tmp2 = wi.x;
-        float tmp3 = wo.x;
-        wi.x = -wi.y; wi.y = tmp2;
-        wo.x = -wo.y; wo.y = tmp3;
+//Number of points the batch functions handle at a time
+#define WC_BATCH_CHUNK 64
+
+#define WC_SIMD_ISA WC_SIMD_SCALAR
+#include "woven_cloth_simd.cpp"
+#undef WC_SIMD_ISA
+
+#ifdef WC_SIMD_X86
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("sse4.1"))), \
+    apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("sse4.1")
+#endif
+#define WC_SIMD_ISA WC_SIMD_SSE41
+#include "woven_cloth_simd.cpp"
+#undef WC_SIMD_ISA
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx2"))), \
+    apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#endif
+#define WC_SIMD_ISA WC_SIMD_AVX2
+#include "woven_cloth_simd.cpp"
+#undef WC_SIMD_ISA
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx512f"))), \
+    apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+//The avx512 intrinsics of some gcc versions give false warnings about
+// uninitialized values
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+#define WC_SIMD_ISA WC_SIMD_AVX512
+#include "woven_cloth_simd.cpp"
+#undef WC_SIMD_ISA
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC diagnostic pop
+#pragma GCC pop_options
+#endif
+#endif
+
+//Widest instruction set supported by the cpu and the os
+static uint8_t wcSupportedSimdLevel()
+{
+#if defined(WC_SIMD_X86) && defined(_MSC_VER)
+    int info[4];
+    uint8_t level = WC_SIMD_SCALAR;
+    __cpuid(info, 1);
+    if(info[2] & (1 << 19)){
+        level = WC_SIMD_SSE41;
+    }
+    //AVX needs os support for saving the ymm registers
+    if((info[2] & (1 << 27)) && (info[2] & (1 << 28))
+            && (_xgetbv(0) & 6) == 6){
+        __cpuidex(info, 7, 0);
+        if(info[1] & (1 << 5)){
+            level = WC_SIMD_AVX2;
+        }
+        //AVX-512 also needs the opmask and upper zmm registers saved
+        if((info[1] & (1 << 16)) && (_xgetbv(0) & 0xE6) == 0xE6){
+            level = WC_SIMD_AVX512;
+        }
+    }
+    return level;
+#elif defined(WC_SIMD_X86)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f")){
+        return WC_SIMD_AVX512;
+    }
+    if(__builtin_cpu_supports("avx2")){
+        return WC_SIMD_AVX2;
+    }
+    if(__builtin_cpu_supports("sse4.1")){
+        return WC_SIMD_SSE41;
     }
-    wcVector H = wcVector_normalize(wcVector_add(wi,wo));
+    return WC_SIMD_SCALAR;
+#else
+    return WC_SIMD_SCALAR;
+#endif
+}
 
-    float v = data.v;
-    float y = data.y;
+//The instruction set to use with params
+static uint8_t wcSimdLevel(const wcWeaveParameters *params)
+{
+    static int supported_level = -1;
+    if(supported_level < 0){
+        supported_level = wcSupportedSimdLevel();
+    }
+    if(params->simd_level == WC_SIMD_DEFAULT
+            || params->simd_level > supported_level){
+        return (uint8_t)supported_level;
+    }
+    return params->simd_level;
+}
 
-    //TODO(Peter): explain from where these expressions come.
-    //compute v from x using (11). Already done. We have it from data.
-    //compute u(wi,v,wr) -- u as function of v. using (4)...
-    float specular_u = atan2f(-H.z, H.y) + M_PI_2; //plus or minus in last t.
-    //TODO(Peter): check that it indeed is just v that should be used 
-    //to calculate Gu (6) in Irawans paper.
-    //calculate yarn tangent.
+void wcGetPatternDataBatch(const float *uv_x, const float *uv_y,
+    void * const *contexts, uint32_t count, wcPatternDataBatch *out,
+    const wcWeaveParameters *params)
+{
+    if(params->pattern == 0){
+        uint32_t i;
+        for(i = 0; i < count; i++){
+            out->yarn_type[i] = 0;
+            out->normal_x[i] = out->normal_y[i] = out->normal_z[i] = 0.f;
+            out->u[i] = out->v[i] = 0.f;
+            out->length[i] = out->width[i] = 0.f;
+            out->x[i] = out->y[i] = 0.f;
+            out->total_index_x[i] = out->total_index_y[i] = 0;
+            out->warp_above[i] = out->yarn_hit[i] = 0;
+            out->ext_between_parallel[i] = 0;
+        }
+        return;
+    }
+    switch(wcSimdLevel(params)){
+#ifdef WC_SIMD_X86
+        case WC_SIMD_AVX512:
+            wcGetPatternDataBatch_avx512(uv_x, uv_y, contexts, count, out,
+                params);
+            break;
+        case WC_SIMD_AVX2:
+            wcGetPatternDataBatch_avx2(uv_x, uv_y, contexts, count, out,
+                params);
+            break;
+        case WC_SIMD_SSE41:
+            wcGetPatternDataBatch_sse41(uv_x, uv_y, contexts, count, out,
+                params);
+            break;
+#endif
+        default:
+            wcGetPatternDataBatch_scalar(uv_x, uv_y, contexts, count, out,
+                params);
+            break;
+    }
+}
 
-    float reflection = 0.f;
-    float umax;
-    if (data.ext_between_parallel == 1){
-        //if segment is extension between to parallel yarns -> bend = 0
-        umax = 0.0001;
-    } else {
-        umax = wc_yarn_type_get_umax(params,data.yarn_type,
-                intersection_data.context);
+void wcShadeBatch(const wcIntersectionDataBatch *intersection_data,
+    uint32_t count, wcColorBatch *out, const wcWeaveParameters *params)
+{
+    if(params->pattern == 0){
+        uint32_t i;
+        for(i = 0; i < count; i++){
+            wcIntersectionData single;
+            single.uv_x = intersection_data->uv_x[i];
+            single.uv_y = intersection_data->uv_y[i];
+            single.wi_x = intersection_data->wi_x[i];
+            single.wi_y = intersection_data->wi_y[i];
+            single.wi_z = intersection_data->wi_z[i];
+            single.wo_x = intersection_data->wo_x[i];
+            single.wo_y = intersection_data->wo_y[i];
+            single.wo_z = intersection_data->wo_z[i];
+            single.context = intersection_data->context ?
+                intersection_data->context[i] : 0;
+            wcColor color = wcShade(single, params);
+            out->r[i] = color.r;
+            out->g[i] = color.g;
+            out->b[i] = color.b;
+        }
+        return;
     }
-    
-    if (fabsf(specular_u) < umax){
-        // Make normal for highlights, uses v and specular_u
-        wcVector highlight_normal = wcVector_normalize(wcvector(sinf(v),
-                    sinf(specular_u)*cosf(v),
-                    cosf(specular_u)*cosf(v)));
-
-        // Make tangent for highlights, uses v and specular_u
-        wcVector highlight_tangent = wcVector_normalize(wcvector(0.f, 
-                    cosf(specular_u), -sinf(specular_u)));
-
-        //get specular_y, using irawans transformation.
-        float specular_y = specular_u/umax;
-        // our transformation TODO(Peter): Verify!
-        //float specular_y = sinf(specular_u)/sinf(m_umax);
-
-        float delta_x = wc_yarn_type_get_delta_x(params, data.yarn_type,
-			intersection_data.context);
-        //Clamp specular_y TODO(Peter): change name of m_delta_x to m_delta_h
-        specular_y = specular_y < 1.f - delta_x ? specular_y :
-            1.f - delta_x;
-        specular_y = specular_y > -1.f + delta_x ? specular_y :
-            -1.f + delta_x;
-
-        //this takes the role of xi in the irawan paper.
-        if (fabsf(specular_y - y) < delta_x) {
-            // --- Set Gu, using (6)
-            float a = 1.f; //radius of yarn
-            float R = 1.f/(sin(umax)); //radius of curvature
-            float Gu = a*(R + a*cosf(v)) /(
-                wcVector_magnitude(wcVector_add(wi,wo)) *
-                fabsf((wcVector_cross(highlight_tangent,H)).x));
-
-            float alpha = wc_yarn_type_get_alpha(params, data.yarn_type,
-				intersection_data.context);
-            float beta = wc_yarn_type_get_beta(params, data.yarn_type,
-				intersection_data.context);
-            // --- Set fc
-            float cos_x = -wcVector_dot(wi, wo);
-            float fc = alpha + vonMises(cos_x, beta);
-
-            // --- Set A
-            float widotn = wcVector_dot(wi, highlight_normal);
-            float wodotn = wcVector_dot(wo, highlight_normal);
-            widotn = (widotn < 0.f) ? 0.f : widotn;   
-            wodotn = (wodotn < 0.f) ? 0.f : wodotn;   
-            float A = 0.f;
-            if(widotn > 0.f && wodotn > 0.f){
-                A = 1.f / (4.0 * M_PI) * (widotn*wodotn)/(widotn + wodotn);
-                //TODO(Peter): Explain from where the 1/4*PI factor comes from
-            }
-            float l = 2.f;
-            //TODO(Peter): Implement As, -- smoothes the dissapeares of the
-            // higlight near the ends. Described in (9)
-            reflection = 2.f*l*umax*fc*Gu*A/delta_x;
+    switch(wcSimdLevel(params)){
+#ifdef WC_SIMD_X86
+        case WC_SIMD_AVX512:
+            wcShadeBatch_avx512(intersection_data, count, out, params);
+            break;
+        case WC_SIMD_AVX2:
+            wcShadeBatch_avx2(intersection_data, count, out, params);
+            break;
+        case WC_SIMD_SSE41:
+            wcShadeBatch_sse41(intersection_data, count, out, params);
+            break;
+#endif
+        default:
+            wcShadeBatch_scalar(intersection_data, count, out, params);
+            break;
+    }
+}
+
+/* --- Fast math ---
+ * Scalar versions of the libm functions used by the shading functions that
+ * are worth replacing, for wcWeaveParameters.fast_math. atan2 uses the same
+ * Cephes polynomial as the batch kernels in woven_cloth_simd.cpp, with no
+ * branches, and the inverse square root in the normalizations is estimated
+ * with rsqrtss and refined with one Newton step where it is available. See
+ * tests/benchmark_fast_math for their accuracy and speed.
+ */
+
+//The selects and sign changes below are done on the bits of the floats,
+// since branches on the inputs are hard to predict
+typedef union
+{
+    uint32_t u;
+    float f;
+} wcFloatBits;
+
+static float wcSelectFloat(int condition, float a, float b)
+{
+    wcFloatBits bits_a, bits_b;
+    bits_a.f = a;
+    bits_b.f = b;
+    uint32_t mask = (uint32_t)0 - (uint32_t)(condition != 0);
+    bits_a.u = (bits_a.u & mask) | (bits_b.u & ~mask);
+    return bits_a.f;
+}
+
+//x with its sign flipped if the sign bit is set in sign
+static float wcFlipSign(float x, uint32_t sign)
+{
+    wcFloatBits bits;
+    bits.f = x;
+    bits.u ^= sign & 0x80000000u;
+    return bits.f;
+}
+
+float wcFastAtan2(float y, float x)
+{
+    wcFloatBits bits_y;
+    bits_y.f = y;
+    float ax = fabsf(x);
+    float ay = fabsf(y);
+    //Reduce the argument to [-tan(pi/8), tan(pi/8)], with one division
+    int big = ay > 2.414213562373095f*ax;
+    int mid = ay > 0.4142135623730950f*ax;
+    float numerator = wcSelectFloat(big, -ax, wcSelectFloat(mid, ay - ax,
+        ay));
+    float denominator = wcSelectFloat(big, ay, wcSelectFloat(mid, ay + ax,
+        ax));
+    float offset = wcSelectFloat(big, (float)M_PI_2,
+        wcSelectFloat(mid, (float)M_PI_4, 0.f));
+    //atan2(0,0) is 0
+    float t = numerator/wcSelectFloat(denominator > 0.f, denominator, 1.f);
+    float z = t*t;
+    float a = (((8.05374449538e-2f*z - 1.38776856032e-1f)*z
+        + 1.99777106478e-1f)*z - 3.33329491539e-1f)*z*t + t + offset;
+    a = wcSelectFloat(x < 0.f, (float)M_PI - a, a);
+    return wcFlipSign(a, bits_y.u);
+}
+
+float wcFastRsqrt(float x)
+{
+#ifdef WC_SIMD_X86
+    float r = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+    return r*(1.5f - 0.5f*x*r*r);
+#else
+    return 1.f/sqrtf(x);
+#endif
+}
+
+static wcVector wcFastNormalize(wcVector v)
+{
+    float inv_mag = wcFastRsqrt(v.x*v.x + v.y*v.y + v.z*v.z);
+    return wcvector(v.x*inv_mag, v.y*inv_mag, v.z*inv_mag);
+}
+
+//Reads the resolved yarn type parameters, for materials without texmaps
+#define WC_FLOAT_PARAM(param) static float wc_yarn_type_value_##param\
+    (const wcWeaveParameters *p, uint32_t i, void* context){\
+	return p->resolved_yarn_types->param[i];}
+#define WC_INT_PARAM(param)
+#define WC_COLOR_PARAM(param) static wcColor wc_yarn_type_value_##param\
+    (const wcWeaveParameters *p, uint32_t i, void* context){\
+	return p->resolved_yarn_types->param[i];}
+WC_YARN_PARAMETERS
+#undef WC_FLOAT_PARAM
+#undef WC_INT_PARAM
+#undef WC_COLOR_PARAM
+
+#define WC_TEXMAPS 1
+#include "woven_cloth_shade.cpp"
+#undef WC_TEXMAPS
+#define WC_TEXMAPS 0
+#include "woven_cloth_shade.cpp"
+#define WC_FAST_MATH 1
+#include "woven_cloth_shade.cpp"
+#undef WC_FAST_MATH
+
+//Reads the yarn type parameters from the wcShadingPoint in the context
+#define WC_FLOAT_PARAM(param) static float wc_yarn_type_point_##param\
+    (const wcWeaveParameters *p, uint32_t i, void* context){\
+	return ((const wcShadingPoint*)context)->param;}
+#define WC_INT_PARAM(param)
+#define WC_COLOR_PARAM(param) static wcColor wc_yarn_type_point_##param\
+    (const wcWeaveParameters *p, uint32_t i, void* context){\
+	return ((const wcShadingPoint*)context)->param;}
+WC_YARN_PARAMETERS
+#undef WC_FLOAT_PARAM
+#undef WC_INT_PARAM
+#undef WC_COLOR_PARAM
+#define WC_DERIVED_PARAM(name, param) static float wc_yarn_type_point_##name\
+    (const wcWeaveParameters *p, uint32_t i, void *context, float param){\
+	return ((const wcShadingPoint*)context)->name;}
+WC_DERIVED_PARAMETERS
+#undef WC_DERIVED_PARAM
+
+#define WC_SHADING_POINT 1
+#include "woven_cloth_shade.cpp"
+#undef WC_SHADING_POINT
+#undef WC_TEXMAPS
+
+//True if the shading functions without texmaps can be used with params
+static int wcNoTexmaps(const wcWeaveParameters *params)
+{
+    return params->resolved_yarn_types
+        && !params->resolved_yarn_types->has_texmaps;
+}
+
+float wcEvalFilamentSpecular(wcIntersectionData intersection_data,
+    wcPatternData data, const wcWeaveParameters *params)
+{
+    if(wcNoTexmaps(params)){
+        if(params->fast_math){
+            return wcEvalFilamentSpecular_fast_math(intersection_data, data,
+                params);
         }
+        return wcEvalFilamentSpecular_no_texmaps(intersection_data, data,
+            params);
     }
-    return reflection;
+    return wcEvalFilamentSpecular_texmaps(intersection_data, data, params);
 }
 
 float wcEvalStapleSpecular(wcIntersectionData intersection_data,
     wcPatternData data, const wcWeaveParameters *params)
 {
-    wcVector wi = wcvector(intersection_data.wi_x, intersection_data.wi_y,
-        intersection_data.wi_z);
-    wcVector wo = wcvector(intersection_data.wo_x, intersection_data.wo_y,
-        intersection_data.wo_z);
+    if(wcNoTexmaps(params)){
+        if(params->fast_math){
+            return wcEvalStapleSpecular_fast_math(intersection_data, data,
+                params);
+        }
+        return wcEvalStapleSpecular_no_texmaps(intersection_data, data,
+            params);
+    }
+    return wcEvalStapleSpecular_texmaps(intersection_data, data, params);
+}
 
-    if(!data.warp_above){
-        float tmp2 = wi.x;
-        float tmp3 = wo.x;
-        wi.x = -wi.y; wi.y = tmp2;
-        wo.x = -wo.y; wo.y = tmp3;
+wcColor wcEvalDiffuse(wcIntersectionData intersection_data,
+        wcPatternData data, const wcWeaveParameters *params)
+{
+    if(wcNoTexmaps(params)){
+        if(params->fast_math){
+            return wcEvalDiffuse_fast_math(intersection_data, data, params);
+        }
+        return wcEvalDiffuse_no_texmaps(intersection_data, data, params);
     }
-    wcVector H = wcVector_normalize(wcVector_add(wi, wo));
+    return wcEvalDiffuse_texmaps(intersection_data, data, params);
+}
 
-    float psi = wc_yarn_type_get_psi(params,data.yarn_type,
-		intersection_data.context);
+float wcEvalSpecular(wcIntersectionData intersection_data,
+        wcPatternData data, const wcWeaveParameters *params)
+{
+    if(wcNoTexmaps(params)){
+        if(params->fast_math){
+            return wcEvalSpecular_fast_math(intersection_data, data, params);
+        }
+        return wcEvalSpecular_no_texmaps(intersection_data, data, params);
+    }
+    return wcEvalSpecular_texmaps(intersection_data, data, params);
+}
 
-    float u = data.u;
-    float x = data.x;
-    float D;
-    {
-        float a = H.y*sinf(u) + H.z*cosf(u);
-        D = (H.y*cosf(u)-H.z*sinf(u))/(sqrtf(H.x*H.x + a*a))/
-			tanf(psi);
-    }
-    float reflection = 0.f;
-            
-    //Plus eller minus i sista termen?
-    float specular_v = atan2f(-H.y*sinf(u) - H.z*cosf(u), H.x) + acosf(D);
-    //TODO(Vidar): Clamp specular_v, do we need it?
-    // Make normal for highlights, uses u and specular_v
-    wcVector highlight_normal = wcVector_normalize(wcvector(sinf(specular_v),
-        sinf(u)*cosf(specular_v), cosf(u)*cosf(specular_v)));
-
-    if (fabsf(specular_v) < M_PI_2 && fabsf(D) < 1.f) {
-        //we have specular reflection
-        //get specular_x, using irawans transformation.
-        float specular_x = specular_v/M_PI_2;
-        // our transformation
-        //float specular_x = sinf(specular_v);
-
-        float delta_x = wc_yarn_type_get_delta_x(params,data.yarn_type,
-			intersection_data.context);
-        float umax;
-        if (data.ext_between_parallel){
-            //if segment is extension between to parallel yarns -> bend = 0
-            umax = 0.001;
-        } else {
-            umax = wc_yarn_type_get_umax(params,data.yarn_type,
-                    intersection_data.context);
-        }
-
-        //Clamp specular_x
-        specular_x = specular_x < 1.f - delta_x ? specular_x :
-            1.f - delta_x;
-        specular_x = specular_x > -1.f + delta_x ? specular_x :
-            -1.f + delta_x;
-
-        if (fabsf(specular_x - x) < delta_x) {
-
-            float alpha = wc_yarn_type_get_alpha(params,data.yarn_type,
-				intersection_data.context);
-            float beta  = wc_yarn_type_get_beta( params,data.yarn_type,
-				intersection_data.context);
-
-            // --- Set Gv
-            float a = 1.f; //radius of yarn
-            float R = 1.f/(sin(umax)); //radius of curvature
-            float Gv = a*(R + a*cosf(specular_v))/(
-                wcVector_magnitude(wcVector_add(wi,wo)) *
-                wcVector_dot(highlight_normal,H) * fabsf(sinf(psi)));
-            // --- Set fc
-            float cos_x = -wcVector_dot(wi, wo);
-            float fc = alpha + vonMises(cos_x, beta);
-            // --- Set A
-            float widotn = wcVector_dot(wi, highlight_normal);
-            float wodotn = wcVector_dot(wo, highlight_normal);
-            widotn = (widotn < 0.f) ? 0.f : widotn;   
-            wodotn = (wodotn < 0.f) ? 0.f : wodotn;   
-            //TODO(Vidar): This is where we get the NAN
-            float A = 0.f;
-            if(widotn > 0.f && wodotn > 0.f){
-                A = 1.f / (4.0 * M_PI) * (widotn*wodotn)/(widotn + wodotn);
-                //TODO(Peter): Explain from where the 1/4*PI factor comes from
-            }
-            float w = 2.f;
-            reflection = 2.f*w*umax*fc*Gv*A/delta_x;
+wcColor wcShade(wcIntersectionData intersection_data,
+        const wcWeaveParameters *params)
+{
+    return wcShadeCached(intersection_data, params, 0);
+}
+
+wcColor wcShadeCached(wcIntersectionData intersection_data,
+        const wcWeaveParameters *params, wcSegmentCache *cache)
+{
+    if(wcNoTexmaps(params)){
+        if(params->fast_math){
+            return wcShadeCached_fast_math(intersection_data, params, cache);
         }
+        return wcShadeCached_no_texmaps(intersection_data, params, cache);
     }
-    return reflection;
+    return wcShadeCached_texmaps(intersection_data, params, cache);
 }
 
-wcColor wcEvalDiffuse(wcIntersectionData intersection_data,
-        wcPatternData data, const wcWeaveParameters *params)
+wcShadingPoint wcPrepareShadingPoint(float uv_x, float uv_y, void *context,
+    const wcWeaveParameters *params)
 {
-    float value = intersection_data.wi_z;
+    wcShadingPoint point;
+    memset(&point, 0, sizeof(point));
+    point.context = context;
+    wcIntersectionData intersection_data;
+    memset(&intersection_data, 0, sizeof(intersection_data));
+    intersection_data.uv_x = uv_x;
+    intersection_data.uv_y = uv_y;
+    intersection_data.context = context;
+    point.data = wcGetPatternData(intersection_data, params);
+
+    uint32_t yarn_type = point.data.yarn_type;
+    //The color of yarn type 0 is used between the yarns
+    uint32_t color_yarn_type = point.data.yarn_hit ? yarn_type : 0;
+    if(wcNoTexmaps(params)){
+        const wcResolvedYarnTypes *resolved = params->resolved_yarn_types;
+#define WC_FLOAT_PARAM(param) point.param = resolved->param[yarn_type];
+#define WC_INT_PARAM(param)
+#define WC_COLOR_PARAM(param) point.param = resolved->param[color_yarn_type];
+WC_YARN_PARAMETERS
+#undef WC_FLOAT_PARAM
+#undef WC_INT_PARAM
+#undef WC_COLOR_PARAM
+#define WC_DERIVED_PARAM(name, param) point.name = resolved->name[yarn_type];
+WC_DERIVED_PARAMETERS
+#undef WC_DERIVED_PARAM
+    } else{
+#define WC_FLOAT_PARAM(param) point.param\
+        = wc_yarn_type_get_##param(params, yarn_type, context);
+#define WC_INT_PARAM(param)
+#define WC_COLOR_PARAM(param) point.param\
+        = wc_yarn_type_get_##param(params, color_yarn_type, context);
+WC_YARN_PARAMETERS
+#undef WC_FLOAT_PARAM
+#undef WC_INT_PARAM
+#undef WC_COLOR_PARAM
+#define WC_DERIVED_PARAM(name, param) point.name\
+        = wc_yarn_type_get_##name(params, yarn_type, context, point.param);
+WC_DERIVED_PARAMETERS
+#undef WC_DERIVED_PARAM
+    }
 
-	wcYarnType *yarn_type = params->yarn_types + data.yarn_type;
-    if(!yarn_type->color_enabled || !data.yarn_hit){
-        yarn_type = &params->yarn_types[0];
+    point.noise = 1.f;
+    //There is no specular reflection between the yarns
+    if(point.data.yarn_hit && point.specular_noise > 0.001f){
+        point.noise = (1.f - point.specular_noise)
+            + point.specular_noise*intensityVariation(point.data);
     }
+    return point;
+}
 
-    wcColor color = {
-        yarn_type->color.r * value,
-        yarn_type->color.g * value,
-        yarn_type->color.b * value
-    };
-	if(yarn_type->color_texmap){
-		color = wc_eval_texmap_color(yarn_type->color_texmap,
-            intersection_data.context);
-		color.r*=value; color.g*=value; color.b*=value;
-	}
+//The intersection data for a direction pair at point. The shading point
+// functions find the point through the context
+static wcIntersectionData wcShadingPointIntersectionData(
+    const wcShadingPoint *point, float wi_x, float wi_y, float wi_z,
+    float wo_x, float wo_y, float wo_z)
+{
+    wcIntersectionData intersection_data;
+    intersection_data.uv_x = 0.f;
+    intersection_data.uv_y = 0.f;
+    intersection_data.wi_x = wi_x;
+    intersection_data.wi_y = wi_y;
+    intersection_data.wi_z = wi_z;
+    intersection_data.wo_x = wo_x;
+    intersection_data.wo_y = wo_y;
+    intersection_data.wo_z = wo_z;
+    intersection_data.context = (void*)point;
+    return intersection_data;
+}
 
-    return color;
+float wcEvalShadingPointSpecular(const wcShadingPoint *point, float wi_x,
+    float wi_y, float wi_z, float wo_x, float wo_y, float wo_z,
+    const wcWeaveParameters *params)
+{
+    wcIntersectionData intersection_data = wcShadingPointIntersectionData(
+        point, wi_x, wi_y, wi_z, wo_x, wo_y, wo_z);
+    return wcEvalSpecular_shading_point(intersection_data, point->data,
+        params);
 }
 
-float wcEvalSpecular(wcIntersectionData intersection_data,
-        wcPatternData data, const wcWeaveParameters *params)
+wcColor wcEvalShadingPoint(const wcShadingPoint *point, float wi_x,
+    float wi_y, float wi_z, float wo_x, float wo_y, float wo_z,
+    const wcWeaveParameters *params)
 {
-    // Depending on the given psi parameter the yarn is considered
-    // staple or filament. They are treated differently in order
-    // to work better numerically. 
-    float reflection = 0.f;
-    if(params->pattern == 0){
+    wcIntersectionData intersection_data = wcShadingPointIntersectionData(
+        point, wi_x, wi_y, wi_z, wo_x, wo_y, wo_z);
+    wcColor ret = wcEvalDiffuse_shading_point(intersection_data, point->data,
+        params);
+    float spec = wcEvalSpecular_shading_point(intersection_data, point->data,
+        params);
+    float specular_strength = point->specular_strength;
+    ret.r = ret.r*(1.f-specular_strength) + specular_strength*spec;
+    ret.g = ret.g*(1.f-specular_strength) + specular_strength*spec;
+    ret.b = ret.b*(1.f-specular_strength) + specular_strength*spec;
+    return ret;
+}
+
+void wcEvalSpecularMultiDir(const wcShadingPoint *point, const float *wi_x,
+    const float *wi_y, const float *wi_z, const float *wo_x,
+    const float *wo_y, const float *wo_z, uint32_t count, float *out,
+    const wcWeaveParameters *params)
+{
+    if(params->pattern == 0 || !point->data.yarn_hit){
+        uint32_t i;
+        for(i = 0; i < count; i++){
+            out[i] = 0.f;
+        }
+        return;
+    }
+    switch(wcSimdLevel(params)){
+#ifdef WC_SIMD_X86
+        case WC_SIMD_AVX512:
+            wcEvalSpecularMultiDir_avx512(point, wi_x, wi_y, wi_z, wo_x,
+                wo_y, wo_z, count, out, params);
+            break;
+        case WC_SIMD_AVX2:
+            wcEvalSpecularMultiDir_avx2(point, wi_x, wi_y, wi_z, wo_x,
+                wo_y, wo_z, count, out, params);
+            break;
+        case WC_SIMD_SSE41:
+            wcEvalSpecularMultiDir_sse41(point, wi_x, wi_y, wi_z, wo_x,
+                wo_y, wo_z, count, out, params);
+            break;
+#endif
+        default:
+            wcEvalSpecularMultiDir_scalar(point, wi_x, wi_y, wi_z, wo_x,
+                wo_y, wo_z, count, out, params);
+            break;
+    }
+}
+
+/* --- Importance sampling ---
+ * The specular reflection is only nonzero when the half vector H is the
+ * highlight normal at some point of the yarn segment, close enough to the
+ * shading point. The half vector is sampled over those normals, and the
+ * outgoing direction is the reflection of wi in it.
+ * For filament yarns H = (sin t, cos t sin u, cos t cos u), with u in the
+ * window given by y, umax and delta_x, see wcEvalFilamentSpecular. u and t
+ * are sampled uniformly, which cancels the Gu term of the reflection.
+ * For staple yarns the fibers are twisted by psi around the yarn. In
+ * coordinates rotated by the u of the segment, H = (rho cos g, h, rho sin g)
+ * with rho = sqrt(1 - h*h), and the fiber position is v = acos(D) - g with
+ * D = h/(rho tan(psi)), see wcEvalStapleSpecular. v is sampled uniformly in
+ * the window given by x and delta_x, and h uniformly in [-sin(psi),
+ * sin(psi)], which makes H uniform over the band of possible half vectors.
+ */
+
+//The part of [-1,1] where clamp(s, -1+delta_x, 1-delta_x) is within
+// delta_x of center. Returns 0 if it is empty
+static int wcSpecularWindow(float center, float delta_x, float *lo,
+    float *hi)
+{
+    float a = center - delta_x;
+    float b = center + delta_x;
+    if(a >= 1.f - delta_x || b <= -1.f + delta_x){
+        return 0;
+    }
+    *lo = a < -1.f + delta_x ? -1.f : a;
+    *hi = b > 1.f - delta_x ? 1.f : b;
+    return *lo < *hi;
+}
+
+//The specular functions swap x and y for weft segments
+static wcVector wcToYarnSpace(wcVector v, wcPatternData data)
+{
+    if(!data.warp_above){
+        return wcvector(-v.y, v.x, v.z);
+    }
+    return v;
+}
+
+static wcVector wcFromYarnSpace(wcVector v, wcPatternData data)
+{
+    if(!data.warp_above){
+        return wcvector(v.y, -v.x, v.z);
+    }
+    return v;
+}
+
+static float wcFilamentUmax(wcIntersectionData intersection_data,
+    wcPatternData data, const wcWeaveParameters *params)
+{
+    if(data.ext_between_parallel){
+        //Same as wcEvalFilamentSpecular
+        return 0.0001f;
+    }
+    return wc_yarn_type_get_umax(params, data.yarn_type,
+        intersection_data.context);
+}
+
+//Returns the pdf of the half vector H, in yarn space, with respect to
+// solid angle
+static float wcSpecularHalfVectorPdf(wcVector H,
+    wcIntersectionData intersection_data, wcPatternData data,
+    const wcWeaveParameters *params)
+{
+    float delta_x = wc_yarn_type_get_delta_x(params, data.yarn_type,
+        intersection_data.context);
+    float psi = wc_yarn_type_get_psi(params, data.yarn_type,
+        intersection_data.context);
+    float lo, hi;
+    if(psi <= 0.001f){
+        float umax = wcFilamentUmax(intersection_data, data, params);
+        float u = atan2f(H.y, H.z);
+        float cos_t = sqrtf(H.y*H.y + H.z*H.z);
+        if(!wcSpecularWindow(data.y, delta_x, &lo, &hi) || cos_t <= 0.f
+            || u <= umax*lo || u >= umax*hi){
+            return 0.f;
+        }
+        return 1.f/(umax*(hi - lo)*M_PI*cos_t);
+    }
+    float k = wc_yarn_type_get_tan_psi(params, data.yarn_type,
+        intersection_data.context, psi);
+    float hy = H.y*cosf(data.u) - H.z*sinf(data.u);
+    float hz = H.y*sinf(data.u) + H.z*cosf(data.u);
+    float rho = sqrtf(H.x*H.x + hz*hz);
+    if(k <= 0.f || rho <= 0.f
+        || !wcSpecularWindow(data.x, delta_x, &lo, &hi)){
         return 0.f;
     }
-	if(!data.yarn_hit){
-        //have not hit a yarn...
+    float D = hy/(rho*k);
+    if(fabsf(D) >= 1.f){
         return 0.f;
-	}
+    }
+    float v = atan2f(-hz, H.x) + acosf(D);
+    if(v <= M_PI_2*lo || v >= M_PI_2*hi){
+        return 0.f;
+    }
+    float sin_psi = wc_yarn_type_get_sin_psi(params, data.yarn_type,
+        intersection_data.context, psi);
+    return 1.f/(M_PI_2*(hi - lo)*2.f*sin_psi);
+}
+
+//Samples the half vector in yarn space. Returns 0 if there is none
+static int wcSampleSpecularHalfVector(wcIntersectionData intersection_data,
+    wcPatternData data, const wcWeaveParameters *params, float sample_x,
+    float sample_y, wcVector *H)
+{
+    float delta_x = wc_yarn_type_get_delta_x(params, data.yarn_type,
+        intersection_data.context);
     float psi = wc_yarn_type_get_psi(params, data.yarn_type,
-		intersection_data.context);
-    if (psi <= 0.001f) {
-        //Filament yarn
-        reflection = wcEvalFilamentSpecular(intersection_data, data, params); 
-    } else {
-        //Staple yarn
-        reflection = wcEvalStapleSpecular(intersection_data, data, params); 
+        intersection_data.context);
+    float lo, hi;
+    if(psi <= 0.001f){
+        float umax = wcFilamentUmax(intersection_data, data, params);
+        if(!wcSpecularWindow(data.y, delta_x, &lo, &hi)){
+            return 0;
+        }
+        float u = umax*(lo + (hi - lo)*sample_x);
+        float t = M_PI*(sample_y - 0.5f);
+        *H = wcvector(sinf(t), cosf(t)*sinf(u), cosf(t)*cosf(u));
+        return 1;
+    }
+    float k = wc_yarn_type_get_tan_psi(params, data.yarn_type,
+        intersection_data.context, psi);
+    if(k <= 0.f || !wcSpecularWindow(data.x, delta_x, &lo, &hi)){
+        return 0;
     }
-	float specular_noise=wc_yarn_type_get_specular_noise(params,
-		data.yarn_type,intersection_data.context);
-	float noise=1.f;
-    if(specular_noise > 0.001f){
-		float iv = intensityVariation(data);
-		noise=(1.f-specular_noise)+specular_noise * iv;
+    float v = M_PI_2*(lo + (hi - lo)*sample_x);
+    float sin_psi = wc_yarn_type_get_sin_psi(params, data.yarn_type,
+        intersection_data.context, psi);
+    float hy = sin_psi*(2.f*sample_y - 1.f);
+    float rho = sqrtf(1.f - hy*hy);
+    float D = hy/(rho*k);
+    D = D < -1.f ? -1.f : (D > 1.f ? 1.f : D);
+    float g = acosf(D) - v;
+    if(g >= M_PI || g < -M_PI){
+        return 0;
     }
-	return reflection * params->specular_normalization * noise;
+    float hx = rho*cosf(g);
+    float hz = rho*sinf(g);
+    *H = wcvector(hx, hy*cosf(data.u) + hz*sinf(data.u),
+        -hy*sinf(data.u) + hz*cosf(data.u));
+    return 1;
 }
 
-wcColor wcShade(wcIntersectionData intersection_data,
-        const wcWeaveParameters *params)
+//The probability of sampling the specular lobe instead of the cosine
+// weighted hemisphere
+static float wcSpecularSampleProbability(wcIntersectionData intersection_data,
+    wcPatternData data, const wcWeaveParameters *params)
 {
-    wcPatternData data = wcGetPatternData(intersection_data,params);
-    wcColor ret = wcEvalDiffuse(intersection_data,data,params);
-    float spec  = wcEvalSpecular(intersection_data,data,params);
+    if(params->pattern == 0 || !data.yarn_hit){
+        return 0.f;
+    }
     float specular_strength = wc_yarn_type_get_specular_strength(params,
-        data.yarn_type,
-		intersection_data.context);
-    ret.r = ret.r*(1.f-specular_strength) + specular_strength*spec;
-    ret.g = ret.g*(1.f-specular_strength) + specular_strength*spec;
-    ret.b = ret.b*(1.f-specular_strength) + specular_strength*spec;
-    return ret;
+        data.yarn_type, intersection_data.context);
+    return specular_strength < 0.f ? 0.f
+        : (specular_strength > 1.f ? 1.f : specular_strength);
+}
+
+float wcPdf(wcIntersectionData intersection_data, wcPatternData data,
+    const wcWeaveParameters *params)
+{
+    if(intersection_data.wi_z <= 0.f || intersection_data.wo_z <= 0.f){
+        return 0.f;
+    }
+    float pdf = intersection_data.wo_z*M_1_PI;
+    float specular_probability = wcSpecularSampleProbability(
+        intersection_data, data, params);
+    if(specular_probability > 0.f){
+        wcVector wi = wcToYarnSpace(wcvector(intersection_data.wi_x,
+            intersection_data.wi_y, intersection_data.wi_z), data);
+        wcVector wo = wcToYarnSpace(wcvector(intersection_data.wo_x,
+            intersection_data.wo_y, intersection_data.wo_z), data);
+        wcVector sum = wcVector_add(wi, wo);
+        float specular_pdf = 0.f;
+        if(wcVector_dot(sum, sum) > 0.f){
+            wcVector H = wcVector_normalize(sum);
+            //Jacobian of the reflection
+            specular_pdf = wcSpecularHalfVectorPdf(H, intersection_data, data,
+                params)/(4.f*wcVector_dot(wi, H));
+        }
+        pdf = specular_probability*specular_pdf
+            + (1.f - specular_probability)*pdf;
+    }
+    return pdf;
+}
+
+float wcSample(wcIntersectionData *intersection_data, wcPatternData data,
+    const wcWeaveParameters *params, float sample_x, float sample_y)
+{
+    if(intersection_data->wi_z <= 0.f){
+        return 0.f;
+    }
+    float specular_probability = wcSpecularSampleProbability(
+        *intersection_data, data, params);
+    if(sample_x < specular_probability){
+        sample_x /= specular_probability;
+        wcVector wi = wcToYarnSpace(wcvector(intersection_data->wi_x,
+            intersection_data->wi_y, intersection_data->wi_z), data);
+        wcVector H;
+        if(!wcSampleSpecularHalfVector(*intersection_data, data, params,
+                sample_x, sample_y, &H)){
+            return 0.f;
+        }
+        float wi_dot_h = wcVector_dot(wi, H);
+        if(wi_dot_h <= 0.f){
+            return 0.f;
+        }
+        wcVector wo = wcvector(2.f*wi_dot_h*H.x - wi.x,
+            2.f*wi_dot_h*H.y - wi.y, 2.f*wi_dot_h*H.z - wi.z);
+        wo = wcFromYarnSpace(wo, data);
+        intersection_data->wo_x = wo.x;
+        intersection_data->wo_y = wo.y;
+        intersection_data->wo_z = wo.z;
+    } else{
+        sample_x = (sample_x - specular_probability)
+            /(1.f - specular_probability);
+        sample_cosine_hemisphere(sample_x, sample_y,
+            &intersection_data->wo_x, &intersection_data->wo_y,
+            &intersection_data->wo_z);
+    }
+    return wcPdf(*intersection_data, data, params);
+}
+
+/* --- Specular table ---
+ * With H the half vector, the filament reflection only needs
+ * sin(specular_u) = H.y/r and cos(specular_u) = H.z/r, with
+ * r = sqrt(H.y^2 + H.z^2), which is also |cross(T,H).x| in Gu. For staple
+ * yarns specular_v = phi + acos(D) with phi = atan2(-a, H.x), so sin and cos
+ * of specular_v follow from sin(phi) = -a/rho, cos(phi) = H.x/rho and
+ * sin(acos(D)) = sqrt(1 - D^2), and the window from wcSpecularWindow is
+ * tested on these sines and cosines. What is left are sin and cos of u and
+ * v, and fc, which are read from the tables.
+ */
+
+static void wcFreeSpecularTable(wcWeaveParameters *params)
+{
+    if(params->specular_table){
+        free(params->specular_table);
+        params->specular_table = 0;
+    }
+}
+
+size_t wcGetSpecularTableMemory(const wcWeaveParameters *params)
+{
+    const wcSpecularTable *table = params->specular_table;
+    if(!table){
+        return 0;
+    }
+    return sizeof(wcSpecularTable) + 2*table->size*sizeof(float)
+        + params->num_yarn_types*(sizeof(wcSpecularTableYarnType)
+        + 3*table->size*sizeof(float));
+}
+
+//Linear interpolation in a table with size entries for s from -1 to 1
+static float wcSpecularTableLookup(const float *values, uint32_t size,
+    float s)
+{
+    float f = (s + 1.f)*0.5f*(float)(size - 1);
+    f = f > 0.f ? f : 0.f;
+    uint32_t i = (uint32_t)f;
+    i = i < size - 2 ? i : size - 2;
+    float t = f - (float)i;
+    return values[i] + t*(values[i + 1] - values[i]);
+}
+
+//True if the angle with sine sin_angle and cosine cos_angle, in
+// (-pi/2, pi/2), is inside the window around center given by
+// wcSpecularWindow. The tables hold sin and cos of the angle for the window
+// edges, which are compared through the sign of sin(angle - edge)
+static int wcSpecularTableWindow(float sin_angle, float cos_angle,
+    float center, float delta_x, const float *sin_table,
+    const float *cos_table, uint32_t size)
+{
+    float lo, hi;
+    if(!wcSpecularWindow(center, delta_x, &lo, &hi)){
+        return 0;
+    }
+    return sin_angle*wcSpecularTableLookup(cos_table, size, lo)
+        - cos_angle*wcSpecularTableLookup(sin_table, size, lo) > 0.f
+        && sin_angle*wcSpecularTableLookup(cos_table, size, hi)
+        - cos_angle*wcSpecularTableLookup(sin_table, size, hi) < 0.f;
+}
+
+static float wcEvalTabulatedSpecular(wcIntersectionData intersection_data,
+    wcPatternData data, const wcWeaveParameters *params)
+{
+    const wcSpecularTable *table = params->specular_table;
+    const wcSpecularTableYarnType *type = table->yarn_types + data.yarn_type;
+    uint32_t size = table->size;
+    wcVector wi = wcToYarnSpace(wcvector(intersection_data.wi_x,
+        intersection_data.wi_y, intersection_data.wi_z), data);
+    wcVector wo = wcToYarnSpace(wcvector(intersection_data.wo_x,
+        intersection_data.wo_y, intersection_data.wo_z), data);
+    wcVector sum = wcVector_add(wi, wo);
+    wcVector H = wcVector_normalize(sum);
+
+    float sin_u, cos_u, sin_v, cos_v, G;
+    if(type->filament){
+        float r = sqrtf(H.y*H.y + H.z*H.z);
+        sin_u = H.y/r;
+        cos_u = H.z/r;
+        if(!(cos_u > 0.f) || !wcSpecularTableWindow(sin_u, cos_u, data.y,
+                type->delta_x, type->sin_u, type->cos_u, size)){
+            return 0.f;
+        }
+        sin_v = wcSpecularTableLookup(table->sin_v, size, data.x);
+        cos_v = wcSpecularTableLookup(table->cos_v, size, data.x);
+        G = (type->radius + cos_v)/(wcVector_magnitude(sum)*r);
+    } else{
+        sin_u = wcSpecularTableLookup(type->sin_u, size, data.y);
+        cos_u = wcSpecularTableLookup(type->cos_u, size, data.y);
+        float a = H.y*sin_u + H.z*cos_u;
+        float rho = sqrtf(H.x*H.x + a*a);
+        float D = (H.y*cos_u - H.z*sin_u)/rho/type->tan_psi;
+        if(!(fabsf(D) < 1.f)){
+            return 0.f;
+        }
+        float sin_phi = -a/rho;
+        float cos_phi = H.x/rho;
+        float sin_acos_d = sqrtf(1.f - D*D);
+        //specular_v is in (-pi, 2pi], and larger than pi when phi is
+        // positive and acos(D) > pi - phi
+        if(sin_phi >= 0.f && D < -cos_phi){
+            return 0.f;
+        }
+        sin_v = sin_phi*D + cos_phi*sin_acos_d;
+        cos_v = cos_phi*D - sin_phi*sin_acos_d;
+        if(!(cos_v > 0.f) || !wcSpecularTableWindow(sin_v, cos_v, data.x,
+                type->delta_x, table->sin_v, table->cos_v, size)){
+            return 0.f;
+        }
+        G = (type->radius + cos_v)/(wcVector_magnitude(sum)
+            *(sin_v*H.x + (sin_u*H.y + cos_u*H.z)*cos_v)*type->sin_psi);
+    }
+    wcVector highlight_normal = wcvector(sin_v, sin_u*cos_v, cos_u*cos_v);
+    float fc = wcSpecularTableLookup(type->fc, size, -wcVector_dot(wi, wo));
+    float widotn = wcVector_dot(wi, highlight_normal);
+    float wodotn = wcVector_dot(wo, highlight_normal);
+    float A = 0.f;
+    if(widotn > 0.f && wodotn > 0.f){
+        A = 1.f / (4.0 * M_PI) * (widotn*wodotn)/(widotn + wodotn);
+    }
+    //Same as 2*l*umax/delta_x and 2*w*umax/delta_x, with l = w = 2
+    return 4.f*type->umax*fc*G*A/type->delta_x;
+}
+
+//Compares the table with the analytic reflection for directions sampled in
+// the highlight, see wcSampleSpecularHalfVector
+static void wcTestSpecularTable(wcWeaveParameters *params)
+{
+    double sum_error = 0.0, sum_value = 0.0, max_error = 0.0;
+    uint32_t num_points = 0;
+    uint32_t yarn_type, i;
+    for(yarn_type = 0; yarn_type < params->num_yarn_types; yarn_type++){
+        for(i = 0; i < WC_SPECULAR_TABLE_TEST_POINTS; i++){
+            float halton_point[4];
+            halton_4(i + 50, halton_point);
+            wcPatternData data;
+            data.x = -1.f + 2.f*halton_point[0];
+            data.y = -1.f + 2.f*halton_point[1];
+            data.length = 1.f;
+            data.width = 1.f;
+            data.warp_above = i & 1;
+            data.yarn_type = yarn_type;
+            data.yarn_hit = 1;
+            data.ext_between_parallel = 0;
+            data.total_index_x = 0;
+            data.total_index_y = 0;
+            wcIntersectionData intersection_data;
+            intersection_data.context = 0;
+            calculate_segment_uv_and_normal(&data, params,
+                &intersection_data);
+            sample_uniform_hemisphere(halton_point[2], halton_point[3],
+                &intersection_data.wi_x, &intersection_data.wi_y,
+                &intersection_data.wi_z);
+            wcVector wi = wcToYarnSpace(wcvector(intersection_data.wi_x,
+                intersection_data.wi_y, intersection_data.wi_z), data);
+            wcVector H;
+            if(!wcSampleSpecularHalfVector(intersection_data, data, params,
+                    sampleTEASingle(i, 2*yarn_type, 8),
+                    sampleTEASingle(i, 2*yarn_type + 1, 8), &H)){
+                continue;
+            }
+            float wi_dot_h = wcVector_dot(wi, H);
+            wcVector wo = wcFromYarnSpace(wcvector(2.f*wi_dot_h*H.x - wi.x,
+                2.f*wi_dot_h*H.y - wi.y, 2.f*wi_dot_h*H.z - wi.z), data);
+            intersection_data.wo_x = wo.x;
+            intersection_data.wo_y = wo.y;
+            intersection_data.wo_z = wo.z;
+            float value;
+            if(params->specular_table->yarn_types[yarn_type].filament){
+                value = wcEvalFilamentSpecular_no_texmaps(intersection_data,
+                    data, params);
+            } else{
+                value = wcEvalStapleSpecular_no_texmaps(intersection_data,
+                    data, params);
+            }
+            double error = fabs((double)wcEvalTabulatedSpecular(
+                intersection_data, data, params) - value);
+            if(error != error){
+                //NaN in either, count it as the whole value
+                error = fabs(value);
+            }
+            sum_error += error;
+            sum_value += fabs(value);
+            max_error = error > max_error ? error : max_error;
+            num_points++;
+        }
+    }
+    params->specular_table_max_error = 0.f;
+    params->specular_table_mean_error = 0.f;
+    if(sum_value > 0.0){
+        double mean_value = sum_value/num_points;
+        params->specular_table_max_error = (float)(max_error/mean_value);
+        params->specular_table_mean_error =
+            (float)(sum_error/num_points/mean_value);
+    }
+}
+
+static void wcBuildSpecularTable(wcWeaveParameters *params)
+{
+    uint32_t size = params->specular_table_size;
+    uint32_t num_yarn_types = params->num_yarn_types;
+    uint32_t yarn_type, i;
+    params->specular_table_max_error = 0.f;
+    params->specular_table_mean_error = 0.f;
+    if(size == 0 || num_yarn_types == 0 || !wcNoTexmaps(params)){
+        return;
     }
+    for(yarn_type = 0; yarn_type < num_yarn_types; yarn_type++){
+        //The window test needs specular_u in (-pi/2, pi/2)
+        if(!(wc_yarn_type_value_umax(params, yarn_type, 0) < M_PI_2)){
+            return;
+        }
+    }
+    size = size < 2 ? 2 : size;
+    //One allocation for the table, the yarn types and the values
+    wcSpecularTable *table = (wcSpecularTable*)malloc(sizeof(wcSpecularTable)
+        + num_yarn_types*sizeof(wcSpecularTableYarnType)
+        + (2 + 3*(size_t)num_yarn_types)*size*sizeof(float));
+    if(!table){
+        //Shaded without the table
+        return;
+    }
+    table->size = size;
+    table->yarn_types = (wcSpecularTableYarnType*)(table + 1);
+    float *values = (float*)(table->yarn_types + num_yarn_types);
+    table->sin_v = values;
+    table->cos_v = values + size;
+    values += 2*size;
+    for(i = 0; i < size; i++){
+        float s = -1.f + 2.f*(float)i/(float)(size - 1);
+        table->sin_v[i] = sinf(s*M_PI_2);
+        table->cos_v[i] = cosf(s*M_PI_2);
+    }
+    for(yarn_type = 0; yarn_type < num_yarn_types; yarn_type++){
+        wcSpecularTableYarnType *type = table->yarn_types + yarn_type;
+        float umax  = wc_yarn_type_value_umax(params, yarn_type, 0);
+        float psi   = wc_yarn_type_value_psi(params, yarn_type, 0);
+        float alpha = wc_yarn_type_value_alpha(params, yarn_type, 0);
+        float beta  = wc_yarn_type_value_beta(params, yarn_type, 0);
+        float log_norm = wc_yarn_type_value_von_mises_log_norm(params,
+            yarn_type, 0, beta);
+        type->umax = umax;
+        type->delta_x = wc_yarn_type_value_delta_x(params, yarn_type, 0);
+        type->radius = wc_yarn_type_value_radius(params, yarn_type, 0,
+            umax);
+        type->tan_psi = wc_yarn_type_value_tan_psi(params, yarn_type, 0,
+            psi);
+        type->sin_psi = wc_yarn_type_value_sin_psi(params, yarn_type, 0,
+            psi);
+        type->filament = psi <= 0.001f;
+        type->fc = values;
+        type->sin_u = values + size;
+        type->cos_u = values + 2*size;
+        values += 3*size;
+        for(i = 0; i < size; i++){
+            float s = -1.f + 2.f*(float)i/(float)(size - 1);
+            type->fc[i] = alpha + vonMises(s, beta, log_norm);
+            type->sin_u[i] = sinf(s*umax);
+            type->cos_u[i] = cosf(s*umax);
+        }
+    }
+    params->specular_table = table;
+    wcTestSpecularTable(params);
+}
@@ -7,9 +7,14 @@
  */
 
 /* --- Basic usage ---
- * Before rendering, call wcWeavePatternFromFile to load a weaving pattern.
+ * Before rendering, call wcInitWeaveParameters to give the parameters and
+ * options their default values, and then wcWeavePatternFromFile to load a
+ * weaving pattern. The loaders finalize the parameters, which reads the
+ * options, so they must not be given a struct which has not been
+ * initialized.
  */
 typedef struct wcWeaveParameters wcWeaveParameters; //Forward decl.
+void wcInitWeaveParameters(wcWeaveParameters *params);
 void wcWeavePatternFromFile(wcWeaveParameters *params, const char *filename);
 #ifdef WC_WCHAR
 void wcWeavePatternFromFile_wchar(wcWeaveParameters *params,
@@ -76,6 +81,19 @@ void wcFreeWeavePattern(wcWeaveParameters *params);
 	WC_FLOAT_PARAM(specular_noise)\
     WC_COLOR_PARAM(color)
 
+/* Constants which only depend on one yarn type parameter, as
+ * WC_DERIVED_PARAM(name, parameter). wcFinalizeWeaveParameters computes them
+ * for each yarn type, so that the shading functions do not have to.
+ * von_mises_log_norm is log(2 pi I0(beta)), the normalization of the von
+ * Mises distribution, radius is 1/sin(umax), sin_psi is |sin(psi)|
+ */
+#define WC_DERIVED_PARAMETERS\
+	WC_DERIVED_PARAM(von_mises_log_norm, beta)\
+	WC_DERIVED_PARAM(radius, umax)\
+	WC_DERIVED_PARAM(tan_psi, psi)\
+	WC_DERIVED_PARAM(sin_psi, psi)\
+	WC_DERIVED_PARAM(inv_delta_x, delta_x)
+
 /* --- Intersection data ---
  * During rendering, before calling wcShade, the wcIntersectionData struct
  * needs to be filled out. This struct looks like this:
@@ -122,6 +140,7 @@ wcColor wc_eval_texmap_color(void *texmap, void *context);
 /* ------------ Implementation --------------------- */
 
 #include <stdint.h>
+#include <stddef.h>
 
 
 typedef struct
@@ -159,6 +178,189 @@ typedef struct
 }PatternEntry;
 #define WC_MAX_YARN_TYPES 256
 
+/* --- Segment lookup ---
+ * wcFinalizeWeaveParameters builds an index of the pattern, which lets
+ * wcGetYarnSegment find the segment under a uv coordinate without walking
+ * along the rows and columns of the pattern. Set
+ * wcWeaveParameters.segment_lookup before finalizing to choose the method.
+ * The per-cell table is the fastest, but uses 20 bytes per pattern cell.
+ * The run length index only stores where warp_above changes along each row
+ * and column, and finds segments with a binary search.
+ * The bitplane index stores warp_above as one bit per cell, both row by row
+ * and column by column, and finds the ends of a segment 64 cells at a time.
+ * wcGetSegmentLookupMemory returns the number of bytes used by the index.
+ */
+#define WC_SEGMENT_LOOKUP_DEFAULT    0 // Table, unless it is larger than
+                                       // WC_SEGMENT_TABLE_MAX_BYTES. Then
+                                       // the smaller of run length and
+                                       // bitplane index
+#define WC_SEGMENT_LOOKUP_WALK       1 // Walk the pattern, no extra memory
+#define WC_SEGMENT_LOOKUP_TABLE      2 // Per-cell table
+#define WC_SEGMENT_LOOKUP_RUN_LENGTH 3 // Run length index
+#define WC_SEGMENT_LOOKUP_BITPLANE   4 // Bitplane index
+#define WC_SEGMENT_TABLE_MAX_BYTES (64*1024*1024)
+
+/* --- SIMD ---
+ * The batch functions use the widest instruction set supported by the cpu,
+ * picked at runtime. Set wcWeaveParameters.simd_level to use a narrower one.
+ */
+#define WC_SIMD_DEFAULT 0 // Best supported by the cpu
+#define WC_SIMD_SCALAR  1
+#define WC_SIMD_SSE41   2
+#define WC_SIMD_AVX2    3
+#define WC_SIMD_AVX512  4
+
+/* --- Specular normalization ---
+ * wcFinalizeWeaveParameters normalizes the specular reflection by sampling
+ * it at a number of locations and directions for each yarn type. Sampling
+ * stops when the result is known within the relative error set by
+ * wcWeaveParameters.normalization_tolerance. This takes fewer samples for
+ * smooth yarns, and more for yarns with a sharp highlight. A negative
+ * tolerance gives the fixed number of samples used by earlier versions.
+ * In all cases the error bound reached is written to
+ * specular_normalization_error.
+ */
+#define WC_NORMALIZATION_DEFAULT_TOLERANCE 0.02f
+#define WC_NORMALIZATION_PREVIEW_TOLERANCE 0.1f // For interactive sessions
+#define WC_NORMALIZATION_FIXED_SAMPLES -1.f
+
+/* --- Normalization cache ---
+ * The specular normalization computed by wcFinalizeWeaveParameters only
+ * depends on umax, psi, alpha, beta and delta_x of the yarn types, and on
+ * normalization_tolerance and fast_math. If
+ * wcWeaveParameters.normalization_cache names a file, finalize looks for
+ * these values there before sampling, and adds the result afterwards.
+ * Entries store all the inputs, so a changed parameter is never a hit.
+ * The cache is not used when any of the parameters has a texmap, since the
+ * texmap can change without the parameters changing.
+ */
+#define WC_NORMALIZATION_CACHE_VERSION 2
+#define WC_NORMALIZATION_CACHE_MAX_BYTES (1024*1024) // Started over when full
+
+typedef struct
+{
+    // Number of cells next to this one with the same warp_above, counted
+    // along x and along y in the same way as calculateLengthOfSegment does.
+    uint32_t steps_x_left, steps_x_right;
+    uint32_t steps_y_left, steps_y_right;
+    // Yarn types of the cells which end the segment of this cell
+    uint8_t border_yarn_type_left, border_yarn_type_right;
+}wcSegmentTableEntry;
+
+typedef struct
+{
+    // Positions where warp_above differs from the previous cell, for each
+    // row and column. The positions for row y are
+    // row_transitions[row_offsets[y]] to row_transitions[row_offsets[y+1]-1]
+    uint32_t *row_offsets, *row_transitions;
+    uint32_t *column_offsets, *column_transitions;
+}wcRunLengthIndex;
+
+typedef struct
+{
+    // Bit x of word x/64 in row y is warp_above of the cell (x,y). Each row
+    // starts on a new word, and the unused bits of the last word are 0.
+    uint64_t *rows;
+    // The same, but transposed, so that bit y of column x is cell (x,y)
+    uint64_t *columns;
+    uint32_t words_per_row, words_per_column;
+    // yarn_type of each cell, in the same order as wcWeaveParameters.pattern
+    uint8_t *yarn_types;
+}wcBitplaneIndex;
+
+/* The yarn type parameters with the defaults from yarn type 0 filled in,
+ * built by wcFinalizeWeaveParameters so that the wc_yarn_type_get_*
+ * functions below do not have to check [param]_enabled. There is one array
+ * per parameter, indexed by yarn type. The texmaps are kept apart from the
+ * values, since they are seldom used.
+ */
+typedef struct
+{
+#define WC_FLOAT_PARAM(name) float *name;
+#define WC_INT_PARAM(name)
+#define WC_COLOR_PARAM(name) wcColor *name;
+WC_YARN_PARAMETERS
+#undef WC_FLOAT_PARAM
+#undef WC_INT_PARAM
+#undef WC_COLOR_PARAM
+
+// Derived from the values above, see WC_DERIVED_PARAMETERS
+#define WC_DERIVED_PARAM(name, param) float *name;
+WC_DERIVED_PARAMETERS
+#undef WC_DERIVED_PARAM
+
+// True if any yarn type has a texmap for the parameter
+#define WC_FLOAT_PARAM(name) uint8_t name##_has_texmap;
+#define WC_INT_PARAM(name)
+#define WC_COLOR_PARAM(name) uint8_t name##_has_texmap;
+WC_YARN_PARAMETERS
+#undef WC_FLOAT_PARAM
+#undef WC_INT_PARAM
+#undef WC_COLOR_PARAM
+
+// True if any parameter has a texmap
+    uint8_t has_texmaps;
+
+#define WC_FLOAT_PARAM(name) void **name##_texmap;
+#define WC_INT_PARAM(name)
+#define WC_COLOR_PARAM(name) void **name##_texmap;
+WC_YARN_PARAMETERS
+#undef WC_FLOAT_PARAM
+#undef WC_INT_PARAM
+#undef WC_COLOR_PARAM
+}wcResolvedYarnTypes;
+
+/* --- Specular table ---
+ * If wcWeaveParameters.specular_table_size is set, wcFinalizeWeaveParameters
+ * bakes the parts of the specular reflection which need exp, sin, cos, tan
+ * and atan2 into tables for each yarn type, and wcEvalSpecular interpolates
+ * in these instead, which takes about half the time. The tables are over the
+ * segment position and over cos_x = -dot(wi,wo). The edges of the highlight
+ * are also found from the tables.
+ * Each yarn type uses 3*specular_table_size floats, and 2*specular_table_size
+ * are shared, see wcGetSpecularTableMemory. The error is inversely
+ * proportional to the square of the size, and is largest for yarns with a
+ * large beta.
+ * After baking, the tables are compared with the analytic reflection for
+ * directions sampled in the highlight. The largest and the mean difference,
+ * relative to the mean reflection, are written to specular_table_max_error
+ * and specular_table_mean_error.
+ * The table is not used for materials with texmaps, for extensions between
+ * parallel yarns, or by wcShadeBatch. It is not built if umax of any yarn
+ * type is pi/2 or more.
+ */
+#define WC_SPECULAR_TABLE_FINAL_SIZE 256 // Max error about 2% for beta 4
+#define WC_SPECULAR_TABLE_TEST_POINTS 4096 // Points per yarn type
+
+/* --- Fast math ---
+ * If wcWeaveParameters.fast_math is set, the shading functions for materials
+ * without texmaps replace atan2f with a branch free polynomial and normalize
+ * the half vector with an rsqrtss estimate. These are within 5 ulp of libm,
+ * and wcEvalSpecular stays within 0.15% of the libm result. The specular
+ * highlights keep their edges. How much time it saves depends on the libm,
+ * tests/benchmark_fast_math measures it.
+ */
+
+typedef struct
+{
+    float umax, delta_x;
+    float radius; // Radius of curvature, 1/sin(umax)
+    float tan_psi, sin_psi;
+    uint8_t filament;
+    // alpha + vonMises(cos_x, beta) for cos_x from -1 to 1
+    float *fc;
+    // sin and cos of u = umax*y for y from -1 to 1
+    float *sin_u, *cos_u;
+}wcSpecularTableYarnType;
+
+typedef struct
+{
+    uint32_t size; // Entries in each table
+    // sin and cos of v = (pi/2)*x for x from -1 to 1
+    float *sin_v, *cos_v;
+    wcSpecularTableYarnType *yarn_types;
+}wcSpecularTable;
+
 //TODO(Vidar): Give all parameters default values
 
 struct wcWeaveParameters
@@ -181,6 +383,49 @@ WC_FABRIC_PARAMETERS
     float specular_normalization;
     float pattern_realheight;
     float pattern_realwidth;
+// 1/pattern_realheight and 1/pattern_realwidth, set by
+// wcFinalizeWeaveParameters
+    float inv_pattern_realheight;
+    float inv_pattern_realwidth;
+// One of the WC_SEGMENT_LOOKUP_* values, read by wcFinalizeWeaveParameters
+    uint8_t segment_lookup;
+// One of the WC_SIMD_* values
+    uint8_t simd_level;
+// Number of threads used by wcFinalizeWeaveParameters, 0 for one per cpu
+    uint32_t finalize_threads;
+// File used to keep the specular normalization between runs, or 0
+    const char *normalization_cache;
+// Error at which the sampling of the specular normalization stops, 0 for
+// WC_NORMALIZATION_DEFAULT_TOLERANCE
+    float normalization_tolerance;
+// Error bound of specular_normalization relative to its value, set by
+// wcFinalizeWeaveParameters
+    float specular_normalization_error;
+// Entries in each table of the specular table, 0 to evaluate the specular
+// reflection analytically
+    uint32_t specular_table_size;
+// Difference between the specular table and the analytic reflection, set by
+// wcFinalizeWeaveParameters
+    float specular_table_max_error;
+    float specular_table_mean_error;
+// Nonzero to shade with the approximations described under Fast math
+    uint8_t fast_math;
+// Built by wcFinalizeWeaveParameters. At most one of these is set, segments
+// are found by walking the pattern when all are 0
+    wcSegmentTableEntry *segment_table;
+    wcRunLengthIndex *run_length_index;
+    wcBitplaneIndex *bitplane_index;
+// Built by wcFinalizeWeaveParameters
+    wcResolvedYarnTypes *resolved_yarn_types;
+// Built by wcFinalizeWeaveParameters if specular_table_size is set
+    wcSpecularTable *specular_table;
+// Set by wcWeavePatternFromFile and wcWeavePatternFromWCBData to the
+// compiled pattern which the pattern and the segment lookup point into, see
+// Compiled patterns and Pattern cache
+    const void *compiled_pattern;
+    size_t compiled_pattern_size;
+    // 0 if compiled_pattern is an allocated copy
+    struct wcPatternCacheEntry *pattern_cache_entry;
 };
 
 typedef struct
@@ -198,16 +443,131 @@ typedef struct
 
 wcPatternData wcGetPatternData(wcIntersectionData intersection_data,
     const wcWeaveParameters *params);
+
+/* --- Batch evaluation ---
+ * wcGetPatternDataBatch gives the same results as calling wcGetPatternData
+ * for each of count shading points. The uv coordinates are given as separate
+ * arrays, and contexts holds the context for the texturing callbacks of each
+ * point, or is 0. The results are written to the arrays in out, which must
+ * all hold count elements.
+ */
+typedef struct
+{
+    uint32_t *yarn_type;
+    float *normal_x, *normal_y, *normal_z;
+    float *u, *v;
+    float *length, *width;
+    float *x, *y;
+    uint32_t *total_index_x, *total_index_y;
+    uint8_t *warp_above;
+    uint8_t *yarn_hit;
+    uint8_t *ext_between_parallel;
+} wcPatternDataBatch;
+
+void wcGetPatternDataBatch(const float *uv_x, const float *uv_y,
+    void * const *contexts, uint32_t count, wcPatternDataBatch *out,
+    const wcWeaveParameters *params);
+
+/* wcShadeBatch gives the same results as calling wcShade for each of count
+ * shading points, up to float precision. The specular highlights use
+ * polynomial approximations of sin, cos, atan2, acos and exp, so points
+ * right at the edge of a highlight may end up on the other side of it.
+ * context is 0 or holds the context for each point. The colors are written
+ * to the arrays in out, which must all hold count elements.
+ */
+typedef struct
+{
+    const float *uv_x, *uv_y;
+    const float *wi_x, *wi_y, *wi_z;
+    const float *wo_x, *wo_y, *wo_z;
+    void * const *context;
+} wcIntersectionDataBatch;
+
+typedef struct
+{
+    float *r, *g, *b;
+} wcColorBatch;
+
+void wcShadeBatch(const wcIntersectionDataBatch *intersection_data,
+    uint32_t count, wcColorBatch *out, const wcWeaveParameters *params);
 wcColor wcEvalDiffuse(wcIntersectionData intersection_data,
     wcPatternData data, const wcWeaveParameters *params);
 float wcEvalSpecular(wcIntersectionData intersection_data,
     wcPatternData data, const wcWeaveParameters *params);
 
+/* --- Importance sampling ---
+ * wcSample picks an outgoing direction for the wi in intersection_data, and
+ * stores it in wo. With probability specular_strength the direction is
+ * sampled along the specular highlight of the yarn, otherwise it is cosine
+ * weighted. sample_x and sample_y are uniform random numbers in [0,1). The
+ * return value is the pdf of wo with respect to solid angle, or 0 if no
+ * direction was sampled. wcPdf returns the same pdf for any wo, for use with
+ * multiple importance sampling. The reflection is symmetric in wi and wo, so
+ * the two can be swapped to sample light directions from the view direction.
+ */
+float wcSample(wcIntersectionData *intersection_data, wcPatternData data,
+    const wcWeaveParameters *params, float sample_x, float sample_y);
+float wcPdf(wcIntersectionData intersection_data, wcPatternData data,
+    const wcWeaveParameters *params);
+
+/* --- Shading points ---
+ * A renderer which evaluates the same shading point for several directions,
+ * for instance once per light, can call wcPrepareShadingPoint once with the
+ * uv coordinates and context of the point. It looks up the pattern data and
+ * reads the yarn type parameters, evaluating any texmaps. The yarn
+ * parameters are those of data.yarn_type, except color, which is that of
+ * yarn type 0 when no yarn was hit, as in wcEvalDiffuse.
+ * wcEvalShadingPoint then gives the same result as wcShade for the
+ * directions wi and wo, and wcEvalShadingPointSpecular the same as
+ * wcEvalSpecular, without calling wcGetPatternData or the texmap callbacks.
+ * The point has to be prepared again if params change. The fast_math flag
+ * is not used by these functions.
+ */
+typedef struct
+{
+    wcPatternData data;
+#define WC_FLOAT_PARAM(name) float name;
+#define WC_INT_PARAM(name)
+#define WC_COLOR_PARAM(name) wcColor name;
+WC_YARN_PARAMETERS
+#undef WC_FLOAT_PARAM
+#undef WC_INT_PARAM
+#undef WC_COLOR_PARAM
+#define WC_DERIVED_PARAM(name, param) float name;
+WC_DERIVED_PARAMETERS
+#undef WC_DERIVED_PARAM
+    float noise; //Factor from specular_noise for the segment
+    void *context;
+} wcShadingPoint;
+
+wcShadingPoint wcPrepareShadingPoint(float uv_x, float uv_y, void *context,
+    const wcWeaveParameters *params);
+wcColor wcEvalShadingPoint(const wcShadingPoint *point, float wi_x,
+    float wi_y, float wi_z, float wo_x, float wo_y, float wo_z,
+    const wcWeaveParameters *params);
+float wcEvalShadingPointSpecular(const wcShadingPoint *point, float wi_x,
+    float wi_y, float wi_z, float wo_x, float wo_y, float wo_z,
+    const wcWeaveParameters *params);
+
+/* wcEvalSpecularMultiDir gives the same results as calling
+ * wcEvalShadingPointSpecular for each of count direction pairs, for
+ * instance one per light sample. The directions are given as separate
+ * arrays, and the reflections are written to out, which must hold count
+ * elements. The parts which only depend on the point are computed once,
+ * and the directions are evaluated with the batch kernels, so the results
+ * differ from the single calls as those of wcShadeBatch do. The specular
+ * table is not used.
+ */
+void wcEvalSpecularMultiDir(const wcShadingPoint *point, const float *wi_x,
+    const float *wi_y, const float *wi_z, const float *wo_x,
+    const float *wo_y, const float *wo_z, uint32_t count, float *out,
+    const wcWeaveParameters *params);
+
 void wcWeavePatternFromData(wcWeaveParameters *params, uint8_t *warp_above,
     float *warp_color, float *weft_color, uint32_t pattern_width,
     uint32_t pattern_height);
-/* wcWeavePatternFromFile calles one of the functions below depending on
- * file extension*/
+/* The functions below read a file without the pattern cache, see Pattern
+ * cache*/
 void wcWeavePatternFromWIF(wcWeaveParameters *params, const char *filename);
 void wcWeavePatternFromWeaveFile(wcWeaveParameters *params, const char *filename);
 #ifdef WC_WCHAR
@@ -217,6 +577,55 @@ void wcWeavePatternFromWeaveFile_wchar(wcWeaveParameters *params,
     const wchar_t *filename);
 #endif
 
+/* --- Compiled patterns ---
+ * A .wcb file holds the pattern of finalized parameters, ready to render:
+ * the pattern, the yarn types, the real world size, the specular
+ * normalization and the segment lookup. wcWeavePatternFromFile recognizes
+ * them by their contents, maps the file into memory and uses the pattern
+ * and the segment lookup where they lie in the file, without reading or
+ * building them. wcFinalizeWeaveParameters
+ * then keeps the stored segment lookup unless segment_lookup asks for
+ * another kind, and only samples the specular normalization again if the
+ * yarn types, normalization_tolerance or fast_math have changed since the
+ * file was compiled. The specular table is built as usual.
+ * The pattern of a compiled pattern is read only. The yarn types are
+ * copied, so they can be changed, and have no texmaps.
+ * All values are stored little endian, so files can be moved between
+ * machines. On big endian machines the segment lookup is built again.
+ * wcCompilePattern writes the file to buffer if size is large enough, and
+ * returns its size in bytes, or 0 if params have no yarn types.
+ * wcWeavePatternFromWCBData loads a copy of such a buffer, and returns 0 if
+ * it is not valid. frontends/wcb_compile converts WIF files to .wcb files.
+ */
+#define WC_WCB_VERSION 1
+size_t wcCompilePattern(const wcWeaveParameters *params, void *buffer,
+    size_t size);
+// Returns 1 if the file was written
+int wcWriteCompiledPattern(const wcWeaveParameters *params,
+    const char *filename);
+void wcWeavePatternFromWCB(wcWeaveParameters *params, const char *filename);
+int wcWeavePatternFromWCBData(wcWeaveParameters *params, const void *data,
+    size_t size);
+#ifdef WC_WCHAR
+void wcWeavePatternFromWCB_wchar(wcWeaveParameters *params,
+    const wchar_t *filename);
+#endif
+
+/* --- Pattern cache ---
+ * wcWeavePatternFromFile and wcWeavePatternFromWCB share the pattern and the
+ * segment lookup between all parameters that load the same file. Entries
+ * are found by path, modification time, size and a hash of the contents, so
+ * a file that has changed is loaded again. A WIF file is compiled the first
+ * time it is loaded, as with wcCompilePattern, and later loads use the
+ * compiled pattern like a .wcb file. Each material still gets its own
+ * yarn types, specular table and normalization. wcFreeWeavePattern releases
+ * the entry, which is freed with its last reference. The cache may be used
+ * from several threads. The shared pattern must not be modified.
+ * wcGetPatternCacheSize returns the number of cached patterns, and sets
+ * bytes, if it is not 0, to their total size.
+ */
+uint32_t wcGetPatternCacheSize(size_t *bytes);
+
 typedef struct
 {
     PatternEntry pattern_entry;
@@ -229,6 +638,76 @@ typedef struct
 
 wcYarnSegment wcGetYarnSegment(float total_u, float total_v,
         const wcWeaveParameters *params);
+size_t wcGetSegmentLookupMemory(const wcWeaveParameters *params);
+size_t wcGetSpecularTableMemory(const wcWeaveParameters *params);
+
+/* --- Segment cache ---
+ * Neighbouring shading points, like camera rays through adjacent pixels,
+ * often hit the same yarn segment. A wcSegmentCache remembers the last
+ * segment that was found and its bounds in uv, and wcGetPatternDataCached
+ * and wcShadeCached skip wcGetYarnSegment when the next point is inside
+ * them. Each thread should use its own cache. Call wcResetSegmentCache before
+ * the first use and after wcFinalizeWeaveParameters. hits and misses count
+ * the lookups since the last reset.
+ */
+typedef struct
+{
+    const wcWeaveParameters *params; //The parameters of the cached segment
+    wcYarnSegment segment;
+    float min_u, max_u, min_v, max_v; //Bounds of segment in total uv
+    uint8_t valid;
+    uint64_t hits, misses;
+} wcSegmentCache;
+
+void wcResetSegmentCache(wcSegmentCache *cache);
+wcPatternData wcGetPatternDataCached(wcIntersectionData intersection_data,
+    const wcWeaveParameters *params, wcSegmentCache *cache);
+wcColor wcShadeCached(wcIntersectionData intersection_data,
+    const wcWeaveParameters *params, wcSegmentCache *cache);
+
+/* --- Statistics ---
+ * When WC_STATS is defined, for woven_cloth.cpp and for the files that
+ * include this header, the shader counts what happens on its hot paths, to
+ * show why a material is slow. Each thread counts into its own counters,
+ * without locks, and wcGetStats adds up the counts of all threads since the
+ * last call to wcResetStats. The counts of threads that are shading while
+ * wcGetStats is called may be a little behind. Without WC_STATS nothing is
+ * counted, and wcGetStats gives zeros. Note that wcFinalizeWeaveParameters
+ * evaluates the specular reflection to normalize it, and those calls are
+ * counted too.
+ * segment_walk_length is a histogram of the lengths, in cells, of the
+ * segments that were measured by walking the pattern, which is done with
+ * WC_SEGMENT_LOOKUP_WALK (see the segment lookup section). Bucket
+ * i counts lengths from 2^i to 2^(i+1)-1, and the last bucket also counts
+ * all longer segments. The specular counters count the calls to the
+ * filament and staple models, and how many of those reached the highlight,
+ * which is the expensive part. The batch functions count their pattern
+ * data lookups, but not their specular evaluations.
+ */
+#define WC_STATS_WALK_BUCKETS 16
+typedef struct
+{
+    uint64_t pattern_data_calls;
+    uint64_t segment_walks;
+    uint64_t segment_walk_length[WC_STATS_WALK_BUCKETS];
+    uint64_t extension_searches; //The yarn was missed, look for an extension
+    uint64_t extension_hits;
+    uint64_t between_parallel; //Searches that passed parallel yarns
+    uint64_t yarn_misses; //Neither the yarn nor an extension was hit
+    uint64_t filament_specular_calls, filament_highlights;
+    uint64_t staple_specular_calls, staple_highlights;
+    uint64_t tabulated_specular_calls; //See the specular table section
+    uint64_t texmap_calls; //Calls to the texturing callbacks
+} wcStats;
+
+void wcGetStats(wcStats *stats);
+void wcResetStats(void);
+#ifdef WC_STATS
+void wcStatsCountTexmapCall(void);
+#define WC_STATS_TEXMAP_CALL() wcStatsCountTexmapCall()
+#else
+#define WC_STATS_TEXMAP_CALL()
+#endif
 
 static const
 wcYarnType wc_default_yarn_type =
@@ -247,35 +726,56 @@ wcYarnType wc_default_yarn_type =
 
 // Getter functions for the yarn type parameters.
 // These take into account whether the parameter is enabled or not
-// and handle the texmaps
+// and handle the texmaps. After wcFinalizeWeaveParameters they read
+// resolved_yarn_types instead of checking each wcYarnType.
 #define WC_FLOAT_PARAM(param) static float wc_yarn_type_get_##param\
     (const wcWeaveParameters *p, uint32_t i, void* context){\
+	const wcResolvedYarnTypes *resolved = p->resolved_yarn_types;\
+	if(resolved){\
+		if(resolved->param##_has_texmap && resolved->param##_texmap[i]){\
+			WC_STATS_TEXMAP_CALL();\
+			return wc_eval_texmap_mono(resolved->param##_texmap[i],context);\
+		}\
+		return resolved->param[i];\
+	}\
 	wcYarnType yarn_type = p->yarn_types[i];\
     float ret;\
 	if(yarn_type.param##_enabled){\
 		ret = yarn_type.param;\
 		if(yarn_type.param##_texmap){\
+			WC_STATS_TEXMAP_CALL();\
 			ret=wc_eval_texmap_mono(yarn_type.param##_texmap,context);\
 		}\
 	} else{\
 		ret = p->yarn_types[0].param;\
 		if(p->yarn_types[0].param##_texmap){\
+			WC_STATS_TEXMAP_CALL();\
 			ret=wc_eval_texmap_mono(p->yarn_types[0].param##_texmap,context);\
 		}\
 	}\
 	return ret;}
 #define WC_COLOR_PARAM(param) static wcColor wc_yarn_type_get_##param\
     (const wcWeaveParameters *p, uint32_t i, void* context){\
+	const wcResolvedYarnTypes *resolved = p->resolved_yarn_types;\
+	if(resolved){\
+		if(resolved->param##_has_texmap && resolved->param##_texmap[i]){\
+			WC_STATS_TEXMAP_CALL();\
+			return wc_eval_texmap_color(resolved->param##_texmap[i],context);\
+		}\
+		return resolved->param[i];\
+	}\
 	wcYarnType yarn_type = p->yarn_types[i];\
     wcColor ret;\
 	if(yarn_type.param##_enabled){\
 		ret = yarn_type.param;\
 		if(yarn_type.param##_texmap){\
+			WC_STATS_TEXMAP_CALL();\
 			ret=wc_eval_texmap_color(yarn_type.param##_texmap,context);\
 		}\
 	} else{\
 		ret = p->yarn_types[0].param;\
 		if(p->yarn_types[0].param##_texmap){\
+			WC_STATS_TEXMAP_CALL();\
 			ret=wc_eval_texmap_color(p->yarn_types[0].param##_texmap,context);\
 		}\
 	}\
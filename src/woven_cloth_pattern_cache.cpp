@@ -0,0 +1,318 @@
+/* Pattern cache, see the pattern cache section of woven_cloth.h.
+ * This file is included by woven_cloth.cpp. Each entry holds the compiled
+ * pattern of one file, which is either the mapped .wcb file itself or a
+ * compiled copy of a WIF file, and counts the parameters that use it. The
+ * entries are kept in a list which is only touched with the lock held.
+ * Files are loaded without the lock, so that several threads can load
+ * different files at the same time. If two threads load the same file at
+ * once, the one that adds it to the list last uses the entry of the other,
+ * and drops its own copy.
+ */
+
+#ifndef WC_NO_FILES
+
+typedef struct wcPatternCacheEntry
+{
+    void *path; // char or wchar_t, not terminated
+    size_t path_size; // In bytes
+    uint64_t mtime, file_size, hash;
+    const uint8_t *data;
+    size_t size;
+    uint8_t mapped; // data is the mapped file, and not an allocated copy
+    uint32_t references;
+    struct wcPatternCacheEntry *next;
+} wcPatternCacheEntry;
+
+static wcPatternCacheEntry *wc_pattern_cache = 0;
+
+#if defined(WC_NO_THREADS)
+#define wcLockPatternCache()
+#define wcUnlockPatternCache()
+#elif defined(_WIN32)
+static SRWLOCK wc_pattern_cache_lock = SRWLOCK_INIT;
+#define wcLockPatternCache() AcquireSRWLockExclusive(&wc_pattern_cache_lock)
+#define wcUnlockPatternCache() \
+    ReleaseSRWLockExclusive(&wc_pattern_cache_lock)
+#else
+static pthread_mutex_t wc_pattern_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#define wcLockPatternCache() pthread_mutex_lock(&wc_pattern_cache_lock)
+#define wcUnlockPatternCache() pthread_mutex_unlock(&wc_pattern_cache_lock)
+#endif
+
+// MurmurHash64A
+static uint64_t wcHashFileContents(const uint8_t *data, size_t size)
+{
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    uint64_t hash = 0x5748ed43ULL ^ (size*m);
+    size_t i;
+    for(i = 0; i + 8 <= size; i += 8){
+        uint64_t k;
+        memcpy(&k, data + i, sizeof(uint64_t));
+        k *= m;
+        k ^= k >> 47;
+        k *= m;
+        hash ^= k;
+        hash *= m;
+    }
+    if(i < size){
+        uint64_t k = 0;
+        memcpy(&k, data + i, size - i);
+        hash ^= k;
+        hash *= m;
+    }
+    hash ^= hash >> 47;
+    hash *= m;
+    hash ^= hash >> 47;
+    return hash;
+}
+
+// Returns the entry with the same key and adds a reference to it, or 0.
+// Must be called with the lock held.
+static wcPatternCacheEntry *wcFindCachedPattern(
+    const wcPatternCacheEntry *key)
+{
+    wcPatternCacheEntry *entry;
+    for(entry = wc_pattern_cache; entry; entry = entry->next){
+        if(entry->hash == key->hash && entry->file_size == key->file_size
+                && entry->mtime == key->mtime
+                && entry->path_size == key->path_size
+                && memcmp(entry->path, key->path, key->path_size) == 0){
+            entry->references++;
+            return entry;
+        }
+    }
+    return 0;
+}
+
+static void wcFreeCachedPatternData(const uint8_t *data, size_t size,
+    uint8_t mapped)
+{
+    if(mapped){
+        wif_unmap_file((const char*)data, size);
+    } else{
+        free((void*)data);
+    }
+}
+
+static void wcReleaseCachedPattern(wcPatternCacheEntry *entry)
+{
+    uint32_t references;
+    wcLockPatternCache();
+    references = --entry->references;
+    if(references == 0){
+        wcPatternCacheEntry **p = &wc_pattern_cache;
+        while(*p != entry){
+            p = &(*p)->next;
+        }
+        *p = entry->next;
+    }
+    wcUnlockPatternCache();
+    if(references == 0){
+        wcFreeCachedPatternData(entry->data, entry->size, entry->mapped);
+        free(entry->path);
+        free(entry);
+    }
+}
+
+// Loads the pattern of the file through the cache. file is the mapped
+// file, which is either kept by the cache or unmapped. load_wif loads the
+// file as a WIF file, and is only called if the file is not a compiled
+// pattern and is not already in the cache. Returns 0 if the file is a
+// compiled pattern which is not valid.
+static int wcWeavePatternFromCache(wcWeaveParameters *params,
+    wcPatternCacheEntry *key, const char *file,
+    void (*load_wif)(wcWeaveParameters *params, const void *filename),
+    const void *filename)
+{
+    const uint8_t *data = (const uint8_t*)file;
+    wcPatternCacheEntry *entry;
+    int ok = 1;
+    key->hash = wcHashFileContents(data, (size_t)key->file_size);
+    wcLockPatternCache();
+    entry = wcFindCachedPattern(key);
+    wcUnlockPatternCache();
+    if(!entry){
+        key->mapped = key->file_size >= 4
+            && wcbGetU32(data + WC_WCB_MAGIC_OFFSET) == WC_WCB_MAGIC;
+        if(key->mapped){
+            key->data = data;
+            key->size = (size_t)key->file_size;
+            data = 0; //Kept by the entry
+            if(!wcbCheckFile(key->data, key->size)
+                    || !wcbCheckContents(key->data)){
+                wcFreeCachedPatternData(key->data, key->size, 1);
+                key->data = 0;
+                ok = wcWeavePatternFromCompiled(params, 0, 0, 0);
+            }
+        } else{
+            //Loaded with the settings of params, and compiled
+            wcWeaveParameters loaded = *params;
+            loaded.specular_table_size = 0;
+            load_wif(&loaded, filename);
+            if(loaded.pattern){
+                key->size = wcCompilePattern(&loaded, 0, 0);
+                key->data = (const uint8_t*)malloc(key->size);
+            }
+            if(key->data){
+                wcCompilePattern(&loaded, (void*)key->data, key->size);
+                wcFreeWeavePattern(&loaded);
+            } else if(!loaded.pattern){
+                //The WIF reader failed, and has printed the error
+                loaded.specular_table_size = params->specular_table_size;
+                *params = loaded;
+            } else{
+                //Out of memory, loaded without the cache
+                wcFreeWeavePattern(&loaded);
+                load_wif(params, filename);
+            }
+        }
+        if(key->data){
+            wcLockPatternCache();
+            entry = wcFindCachedPattern(key);
+            if(!entry){
+                entry = (wcPatternCacheEntry*)malloc(
+                    sizeof(wcPatternCacheEntry));
+                void *path = malloc(key->path_size);
+                if(entry && path){
+                    *entry = *key;
+                    memcpy(path, key->path, key->path_size);
+                    entry->path = path;
+                    entry->references = 1;
+                    entry->next = wc_pattern_cache;
+                    wc_pattern_cache = entry;
+                    key->data = 0; //Kept by the entry
+                } else{
+                    free(entry);
+                    free(path);
+                    entry = 0;
+                }
+            }
+            wcUnlockPatternCache();
+            if(key->data && !entry){
+                //Out of memory, params get their own copy
+                if(key->mapped){
+                    ok = wcWeavePatternFromWCBData(params, key->data,
+                        key->size);
+                } else{
+                    ok = wcWeavePatternFromCompiled(params, key->data,
+                        key->size, 0);
+                    key->data = 0;
+                }
+            }
+            if(key->data){
+                //Another thread added the file first
+                wcFreeCachedPatternData(key->data, key->size, key->mapped);
+            }
+        }
+    }
+    if(data){
+        wif_unmap_file(file, (size_t)key->file_size);
+    }
+    if(entry){
+        ok = wcWeavePatternFromCompiled(params, entry->data, entry->size,
+            entry);
+    }
+    return ok;
+}
+
+static void wcLoadWIF(wcWeaveParameters *params, const void *filename)
+{
+    wcWeavePatternFromWIF(params, (const char*)filename);
+}
+
+void wcWeavePatternFromFile(wcWeaveParameters *params, const char *filename)
+{
+    wcPatternCacheEntry key;
+    size_t size = 0;
+    const char *file = wif_map_file(filename, &size);
+    memset(&key, 0, sizeof(wcPatternCacheEntry));
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    if(GetFileAttributesExA(filename, GetFileExInfoStandard, &attributes)){
+        key.mtime = (uint64_t)attributes.ftLastWriteTime.dwHighDateTime << 32
+            | attributes.ftLastWriteTime.dwLowDateTime;
+    }
+#else
+    struct stat st;
+    if(stat(filename, &st) == 0){
+        key.mtime = (uint64_t)st.st_mtime;
+    }
+#endif
+    if(!file){
+        //Gives the same result and error as before
+        wcWeavePatternFromWIF(params, filename);
+        return;
+    }
+    key.path = (void*)filename;
+    key.path_size = strlen(filename);
+    key.file_size = size;
+    if(!wcWeavePatternFromCache(params, &key, file, wcLoadWIF, filename)){
+        printf("Error reading file \"%s\"\n", filename);
+    }
+}
+
+void wcWeavePatternFromWCB(wcWeaveParameters *params, const char *filename)
+{
+    wcWeavePatternFromFile(params, filename);
+}
+
+#ifdef WC_WCHAR
+static void wcLoadWIF_wchar(wcWeaveParameters *params, const void *filename)
+{
+    wcWeavePatternFromWIF_wchar(params, (const wchar_t*)filename);
+}
+
+void wcWeavePatternFromFile_wchar(wcWeaveParameters *params,
+    const wchar_t *filename)
+{
+    wcPatternCacheEntry key;
+    size_t size = 0;
+    const char *file = 0;
+    memset(&key, 0, sizeof(wcPatternCacheEntry));
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    if(GetFileAttributesExW(filename, GetFileExInfoStandard, &attributes)){
+        key.mtime = (uint64_t)attributes.ftLastWriteTime.dwHighDateTime << 32
+            | attributes.ftLastWriteTime.dwLowDateTime;
+    }
+    file = wif_map_handle(CreateFileW(filename, GENERIC_READ,
+        FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0), &size);
+#endif
+    if(!file){
+        wcWeavePatternFromWIF_wchar(params, filename);
+        return;
+    }
+    key.path = (void*)filename;
+    key.path_size = wcslen(filename)*sizeof(wchar_t);
+    key.file_size = size;
+    if(!wcWeavePatternFromCache(params, &key, file, wcLoadWIF_wchar,
+            filename)){
+        wprintf(L"Error reading file \"%s\"\n", filename);
+    }
+}
+
+void wcWeavePatternFromWCB_wchar(wcWeaveParameters *params,
+    const wchar_t *filename)
+{
+    wcWeavePatternFromFile_wchar(params, filename);
+}
+#endif
+
+uint32_t wcGetPatternCacheSize(size_t *bytes)
+{
+    wcPatternCacheEntry *entry;
+    uint32_t n = 0;
+    size_t total = 0;
+    wcLockPatternCache();
+    for(entry = wc_pattern_cache; entry; entry = entry->next){
+        n++;
+        total += entry->size;
+    }
+    wcUnlockPatternCache();
+    if(bytes){
+        *bytes = total;
+    }
+    return n;
+}
+
+#endif
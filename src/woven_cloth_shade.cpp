@@ -0,0 +1,336 @@
+/* Shading functions.
+ * This file is included by woven_cloth.cpp four times. With WC_TEXMAPS set
+ * to 1 the yarn parameters are read with the wc_yarn_type_get_* functions,
+ * which evaluate the texmaps. With WC_TEXMAPS set to 0 they are read
+ * straight from wcWeaveParameters.resolved_yarn_types, with no calls to the
+ * texmap callbacks, so that the compiler can inline the reads. That version
+ * is used for materials without texmaps. It is included a second time with
+ * WC_FAST_MATH set to 1, which replaces some of the libm calls with the
+ * functions in the fast math section of woven_cloth.cpp. With
+ * WC_SHADING_POINT set to 1 the parameters are read from the wcShadingPoint
+ * which is passed as the context of the intersection data.
+ */
+
+#if WC_SHADING_POINT
+#define WC_SHADE_FN(name) name##_shading_point
+#define WC_YARN_PARAM(param) wc_yarn_type_point_##param
+#elif WC_TEXMAPS
+#define WC_SHADE_FN(name) name##_texmaps
+#define WC_YARN_PARAM(param) wc_yarn_type_get_##param
+#elif WC_FAST_MATH
+#define WC_SHADE_FN(name) name##_fast_math
+#define WC_YARN_PARAM(param) wc_yarn_type_value_##param
+#else
+#define WC_SHADE_FN(name) name##_no_texmaps
+#define WC_YARN_PARAM(param) wc_yarn_type_value_##param
+#endif
+
+#if WC_FAST_MATH
+#define WC_ATAN2(y,x)           wcFastAtan2(y,x)
+#define WC_NORMALIZE(v)         wcFastNormalize(v)
+#else
+#define WC_ATAN2(y,x)           atan2f(y,x)
+#define WC_NORMALIZE(v)         wcVector_normalize(v)
+#endif
+
+static float WC_SHADE_FN(wcEvalFilamentSpecular)(
+    wcIntersectionData intersection_data, wcPatternData data,
+    const wcWeaveParameters *params)
+{
+    wcVector wi = wcvector(intersection_data.wi_x, intersection_data.wi_y,
+        intersection_data.wi_z);
+    wcVector wo = wcvector(intersection_data.wo_x, intersection_data.wo_y,
+        intersection_data.wo_z);
+
+    if(!data.warp_above){
+        float tmp2 = wi.x;
+        float tmp3 = wo.x;
+        wi.x = -wi.y; wi.y = tmp2;
+        wo.x = -wo.y; wo.y = tmp3;
+    }
+    wcVector H = WC_NORMALIZE(wcVector_add(wi,wo));
+    WC_STATS_ADD(filament_specular_calls, 1);
+
+    float v = data.v;
+    float y = data.y;
+
+    //TODO(Peter): explain from where these expressions come.
+    //compute v from x using (11). Already done. We have it from data.
+    //compute u(wi,v,wr) -- u as function of v. using (4)...
+    float specular_u = WC_ATAN2(-H.z, H.y) + M_PI_2; //plus or minus in last t.
+    //TODO(Peter): check that it indeed is just v that should be used 
+    //to calculate Gu (6) in Irawans paper.
+    //calculate yarn tangent.
+
+    float reflection = 0.f;
+    float umax;
+    if (data.ext_between_parallel == 1){
+        //if segment is extension between to parallel yarns -> bend = 0
+        umax = 0.0001;
+    } else {
+        umax = WC_YARN_PARAM(umax)(params,data.yarn_type,
+                intersection_data.context);
+    }
+    
+    if (fabsf(specular_u) < umax){
+        //Each angle gets one sinf and one cosf, which the compiler can
+        // fuse into one sincosf call
+        float sin_v = sinf(v), cos_v = cosf(v);
+        float sin_u = sinf(specular_u), cos_u = cosf(specular_u);
+        // Make normal for highlights, uses v and specular_u
+        wcVector highlight_normal = wcVector_normalize(wcvector(sin_v,
+                    sin_u*cos_v, cos_u*cos_v));
+
+        // Make tangent for highlights, uses v and specular_u
+        wcVector highlight_tangent = wcVector_normalize(wcvector(0.f, 
+                    cos_u, -sin_u));
+
+        //get specular_y, using irawans transformation.
+        float specular_y = specular_u/umax;
+        // our transformation TODO(Peter): Verify!
+        //float specular_y = sinf(specular_u)/sinf(m_umax);
+
+        float delta_x = WC_YARN_PARAM(delta_x)(params, data.yarn_type,
+			intersection_data.context);
+        //Clamp specular_y TODO(Peter): change name of m_delta_x to m_delta_h
+        specular_y = specular_y < 1.f - delta_x ? specular_y :
+            1.f - delta_x;
+        specular_y = specular_y > -1.f + delta_x ? specular_y :
+            -1.f + delta_x;
+
+        //this takes the role of xi in the irawan paper.
+        if (fabsf(specular_y - y) < delta_x) {
+            WC_STATS_ADD(filament_highlights, 1);
+            // --- Set Gu, using (6)
+            float a = 1.f; //radius of yarn
+            //radius of curvature
+            float R = data.ext_between_parallel == 1 ? 1.f/(sin(umax))
+                : WC_YARN_PARAM(radius)(params, data.yarn_type,
+                intersection_data.context, umax);
+            float Gu = a*(R + a*cos_v) /(
+                wcVector_magnitude(wcVector_add(wi,wo)) *
+                fabsf((wcVector_cross(highlight_tangent,H)).x));
+
+            float alpha = WC_YARN_PARAM(alpha)(params, data.yarn_type,
+				intersection_data.context);
+            float beta = WC_YARN_PARAM(beta)(params, data.yarn_type,
+				intersection_data.context);
+            // --- Set fc
+            float cos_x = -wcVector_dot(wi, wo);
+            float fc = alpha + vonMises(cos_x, beta,
+                WC_YARN_PARAM(von_mises_log_norm)(params, data.yarn_type,
+                intersection_data.context, beta));
+
+            // --- Set A
+            float widotn = wcVector_dot(wi, highlight_normal);
+            float wodotn = wcVector_dot(wo, highlight_normal);
+            widotn = (widotn < 0.f) ? 0.f : widotn;   
+            wodotn = (wodotn < 0.f) ? 0.f : wodotn;   
+            float A = 0.f;
+            if(widotn > 0.f && wodotn > 0.f){
+                A = 1.f / (4.0 * M_PI) * (widotn*wodotn)/(widotn + wodotn);
+                //TODO(Peter): Explain from where the 1/4*PI factor comes from
+            }
+            float l = 2.f;
+            //TODO(Peter): Implement As, -- smoothes the dissapeares of the
+            // higlight near the ends. Described in (9)
+            reflection = 2.f*l*umax*fc*Gu*A
+                *WC_YARN_PARAM(inv_delta_x)(params, data.yarn_type,
+                intersection_data.context, delta_x);
+        }
+    }
+    return reflection;
+}
+
+static float WC_SHADE_FN(wcEvalStapleSpecular)(
+    wcIntersectionData intersection_data, wcPatternData data,
+    const wcWeaveParameters *params)
+{
+    wcVector wi = wcvector(intersection_data.wi_x, intersection_data.wi_y,
+        intersection_data.wi_z);
+    wcVector wo = wcvector(intersection_data.wo_x, intersection_data.wo_y,
+        intersection_data.wo_z);
+
+    if(!data.warp_above){
+        float tmp2 = wi.x;
+        float tmp3 = wo.x;
+        wi.x = -wi.y; wi.y = tmp2;
+        wo.x = -wo.y; wo.y = tmp3;
+    }
+    wcVector H = WC_NORMALIZE(wcVector_add(wi, wo));
+    WC_STATS_ADD(staple_specular_calls, 1);
+
+    float psi = WC_YARN_PARAM(psi)(params,data.yarn_type,
+		intersection_data.context);
+    float tan_psi = WC_YARN_PARAM(tan_psi)(params, data.yarn_type,
+        intersection_data.context, psi);
+
+    float u = data.u;
+    float x = data.x;
+    float sin_u = sinf(u), cos_u = cosf(u);
+    float D;
+    {
+        float a = H.y*sin_u + H.z*cos_u;
+        D = (H.y*cos_u-H.z*sin_u)/(sqrtf(H.x*H.x + a*a))/tan_psi;
+    }
+    float reflection = 0.f;
+            
+    //Plus eller minus i sista termen?
+    float specular_v = WC_ATAN2(-H.y*sin_u - H.z*cos_u, H.x) + acosf(D);
+    //TODO(Vidar): Clamp specular_v, do we need it?
+    // Make normal for highlights, uses u and specular_v
+    float sin_v = sinf(specular_v), cos_v = cosf(specular_v);
+    wcVector highlight_normal = wcVector_normalize(wcvector(sin_v,
+        sin_u*cos_v, cos_u*cos_v));
+
+    if (fabsf(specular_v) < M_PI_2 && fabsf(D) < 1.f) {
+        //we have specular reflection
+        //get specular_x, using irawans transformation.
+        float specular_x = specular_v/M_PI_2;
+        // our transformation
+        //float specular_x = sinf(specular_v);
+
+        float delta_x = WC_YARN_PARAM(delta_x)(params,data.yarn_type,
+			intersection_data.context);
+        float umax;
+        if (data.ext_between_parallel){
+            //if segment is extension between to parallel yarns -> bend = 0
+            umax = 0.001;
+        } else {
+            umax = WC_YARN_PARAM(umax)(params,data.yarn_type,
+                    intersection_data.context);
+        }
+
+        //Clamp specular_x
+        specular_x = specular_x < 1.f - delta_x ? specular_x :
+            1.f - delta_x;
+        specular_x = specular_x > -1.f + delta_x ? specular_x :
+            -1.f + delta_x;
+
+        if (fabsf(specular_x - x) < delta_x) {
+            WC_STATS_ADD(staple_highlights, 1);
+
+            float alpha = WC_YARN_PARAM(alpha)(params,data.yarn_type,
+				intersection_data.context);
+            float beta  = WC_YARN_PARAM(beta)( params,data.yarn_type,
+				intersection_data.context);
+
+            // --- Set Gv
+            float a = 1.f; //radius of yarn
+            //radius of curvature
+            float R = data.ext_between_parallel ? 1.f/(sin(umax))
+                : WC_YARN_PARAM(radius)(params, data.yarn_type,
+                intersection_data.context, umax);
+            float sin_psi = WC_YARN_PARAM(sin_psi)(params, data.yarn_type,
+                intersection_data.context, psi);
+            float Gv = a*(R + a*cos_v)/(
+                wcVector_magnitude(wcVector_add(wi,wo)) *
+                wcVector_dot(highlight_normal,H) * sin_psi);
+            // --- Set fc
+            float cos_x = -wcVector_dot(wi, wo);
+            float fc = alpha + vonMises(cos_x, beta,
+                WC_YARN_PARAM(von_mises_log_norm)(params, data.yarn_type,
+                intersection_data.context, beta));
+            // --- Set A
+            float widotn = wcVector_dot(wi, highlight_normal);
+            float wodotn = wcVector_dot(wo, highlight_normal);
+            widotn = (widotn < 0.f) ? 0.f : widotn;   
+            wodotn = (wodotn < 0.f) ? 0.f : wodotn;   
+            //TODO(Vidar): This is where we get the NAN
+            float A = 0.f;
+            if(widotn > 0.f && wodotn > 0.f){
+                A = 1.f / (4.0 * M_PI) * (widotn*wodotn)/(widotn + wodotn);
+                //TODO(Peter): Explain from where the 1/4*PI factor comes from
+            }
+            float w = 2.f;
+            reflection = 2.f*w*umax*fc*Gv*A
+                *WC_YARN_PARAM(inv_delta_x)(params, data.yarn_type,
+                intersection_data.context, delta_x);
+        }
+    }
+    return reflection;
+}
+
+static wcColor WC_SHADE_FN(wcEvalDiffuse)(wcIntersectionData intersection_data,
+        wcPatternData data, const wcWeaveParameters *params)
+{
+    float value = intersection_data.wi_z;
+
+    //The color of yarn type 0 is used between the yarns
+    uint32_t yarn_type = data.yarn_hit ? data.yarn_type : 0;
+    wcColor color = WC_YARN_PARAM(color)(params, yarn_type,
+        intersection_data.context);
+    color.r*=value; color.g*=value; color.b*=value;
+
+    return color;
+}
+
+static float WC_SHADE_FN(wcEvalSpecular)(wcIntersectionData intersection_data,
+        wcPatternData data, const wcWeaveParameters *params)
+{
+    // Depending on the given psi parameter the yarn is considered
+    // staple or filament. They are treated differently in order
+    // to work better numerically. 
+    float reflection = 0.f;
+    if(params->pattern == 0){
+        return 0.f;
+    }
+	if(!data.yarn_hit){
+        //have not hit a yarn...
+        return 0.f;
+	}
+    float psi = WC_YARN_PARAM(psi)(params, data.yarn_type,
+		intersection_data.context);
+#if !WC_TEXMAPS
+    if(params->specular_table && !data.ext_between_parallel){
+        WC_STATS_ADD(tabulated_specular_calls, 1);
+        reflection = wcEvalTabulatedSpecular(intersection_data, data,
+            params);
+    } else
+#endif
+    if (psi <= 0.001f) {
+        //Filament yarn
+        reflection = WC_SHADE_FN(wcEvalFilamentSpecular)(intersection_data,
+            data, params);
+    } else {
+        //Staple yarn
+        reflection = WC_SHADE_FN(wcEvalStapleSpecular)(intersection_data,
+            data, params);
+    }
+#if WC_SHADING_POINT
+    float noise = ((const wcShadingPoint*)intersection_data.context)->noise;
+#else
+	float specular_noise=WC_YARN_PARAM(specular_noise)(params,
+		data.yarn_type,intersection_data.context);
+	float noise=1.f;
+    if(specular_noise > 0.001f){
+		float iv = intensityVariation(data);
+		noise=(1.f-specular_noise)+specular_noise * iv;
+    }
+#endif
+	return reflection * params->specular_normalization * noise;
+}
+
+#if !WC_SHADING_POINT
+static wcColor WC_SHADE_FN(wcShadeCached)(
+        wcIntersectionData intersection_data, const wcWeaveParameters *params,
+        wcSegmentCache *cache)
+{
+    wcPatternData data = wcGetPatternDataCached(intersection_data, params,
+        cache);
+    wcColor ret = WC_SHADE_FN(wcEvalDiffuse)(intersection_data,data,params);
+    float spec  = WC_SHADE_FN(wcEvalSpecular)(intersection_data,data,params);
+    float specular_strength = WC_YARN_PARAM(specular_strength)(params,
+        data.yarn_type,
+		intersection_data.context);
+    ret.r = ret.r*(1.f-specular_strength) + specular_strength*spec;
+    ret.g = ret.g*(1.f-specular_strength) + specular_strength*spec;
+    ret.b = ret.b*(1.f-specular_strength) + specular_strength*spec;
+    return ret;
+}
+#endif
+
+#undef WC_SHADE_FN
+#undef WC_YARN_PARAM
+#undef WC_ATAN2
+#undef WC_NORMALIZE
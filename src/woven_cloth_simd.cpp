@@ -0,0 +1,904 @@
+/* Batch kernels.
+ * This file is included by woven_cloth.cpp once for each instruction set,
+ * with WC_SIMD_ISA set to one of the WC_SIMD_* values. The wcVecf macros
+ * below map to plain floats, SSE4.1, AVX2 or AVX-512, and every function is
+ * named with WC_SIMD_FN so that the different versions can live side by
+ * side.
+ */
+
+#if WC_SIMD_ISA == WC_SIMD_AVX512
+#define WC_SIMD_FN(name) name##_avx512
+#define WC_VEC_WIDTH 16
+#define wcVecf __m512
+#define wcVecm __mmask16
+#define wcVeci __m512i
+#define wcVecf_load(p)        _mm512_loadu_ps(p)
+#define wcVecf_store(p,a)     _mm512_storeu_ps(p,a)
+#define wcVecf_set1(x)        _mm512_set1_ps(x)
+#define wcVecf_add(a,b)       _mm512_add_ps(a,b)
+#define wcVecf_sub(a,b)       _mm512_sub_ps(a,b)
+#define wcVecf_mul(a,b)       _mm512_mul_ps(a,b)
+#define wcVecf_div(a,b)       _mm512_div_ps(a,b)
+#define wcVecf_sqrt(a)        _mm512_sqrt_ps(a)
+#define wcVecf_min(a,b)       _mm512_min_ps(a,b)
+#define wcVecf_max(a,b)       _mm512_max_ps(a,b)
+#define wcVecf_floor(a)       _mm512_roundscale_ps(a,_MM_FROUND_TO_NEG_INF\
+                                  |_MM_FROUND_NO_EXC)
+#define wcVecf_and(a,b)       wcVeci_as_f(_mm512_and_si512(\
+                                  wcVecf_as_i(a),wcVecf_as_i(b)))
+#define wcVecf_andnot(a,b)    wcVeci_as_f(_mm512_andnot_si512(\
+                                  wcVecf_as_i(a),wcVecf_as_i(b)))
+#define wcVecf_xor(a,b)       wcVeci_as_f(_mm512_xor_si512(\
+                                  wcVecf_as_i(a),wcVecf_as_i(b)))
+#define wcVecf_gt(a,b)        _mm512_cmp_ps_mask(a,b,_CMP_GT_OQ)
+#define wcVecf_lt(a,b)        _mm512_cmp_ps_mask(a,b,_CMP_LT_OQ)
+#define wcVecf_le(a,b)        _mm512_cmp_ps_mask(a,b,_CMP_LE_OQ)
+#define wcVecf_select(m,a,b)  _mm512_mask_blend_ps(m,b,a)
+#define wcVecm_and(a,b)       ((wcVecm)((a)&(b)))
+#define wcVecm_any(m)         ((m)!=0)
+#define wcVecm_all(m)         ((m)==0xFFFF)
+#define wcVeci_set1(x)        _mm512_set1_epi32(x)
+#define wcVeci_add(a,b)       _mm512_add_epi32(a,b)
+#define wcVeci_sub(a,b)       _mm512_sub_epi32(a,b)
+#define wcVeci_and(a,b)       _mm512_and_si512(a,b)
+#define wcVeci_andnot(a,b)    _mm512_andnot_si512(a,b)
+#define wcVeci_slli(a,n)      _mm512_slli_epi32(a,n)
+#define wcVeci_eq(a,b)        _mm512_cmpeq_epi32_mask(a,b)
+#define wcVecf_cvtt(a)        _mm512_cvttps_epi32(a)
+#define wcVeci_cvt(a)         _mm512_cvtepi32_ps(a)
+#define wcVeci_as_f(a)        _mm512_castsi512_ps(a)
+#define wcVecf_as_i(a)        _mm512_castps_si512(a)
+#elif WC_SIMD_ISA == WC_SIMD_AVX2
+#define WC_SIMD_FN(name) name##_avx2
+#define WC_VEC_WIDTH 8
+#define wcVecf __m256
+#define wcVecm __m256
+#define wcVeci __m256i
+#define wcVecf_load(p)        _mm256_loadu_ps(p)
+#define wcVecf_store(p,a)     _mm256_storeu_ps(p,a)
+#define wcVecf_set1(x)        _mm256_set1_ps(x)
+#define wcVecf_add(a,b)       _mm256_add_ps(a,b)
+#define wcVecf_sub(a,b)       _mm256_sub_ps(a,b)
+#define wcVecf_mul(a,b)       _mm256_mul_ps(a,b)
+#define wcVecf_div(a,b)       _mm256_div_ps(a,b)
+#define wcVecf_sqrt(a)        _mm256_sqrt_ps(a)
+#define wcVecf_min(a,b)       _mm256_min_ps(a,b)
+#define wcVecf_max(a,b)       _mm256_max_ps(a,b)
+#define wcVecf_floor(a)       _mm256_floor_ps(a)
+#define wcVecf_and(a,b)       _mm256_and_ps(a,b)
+#define wcVecf_andnot(a,b)    _mm256_andnot_ps(a,b)
+#define wcVecf_xor(a,b)       _mm256_xor_ps(a,b)
+#define wcVecf_gt(a,b)        _mm256_cmp_ps(a,b,_CMP_GT_OQ)
+#define wcVecf_lt(a,b)        _mm256_cmp_ps(a,b,_CMP_LT_OQ)
+#define wcVecf_le(a,b)        _mm256_cmp_ps(a,b,_CMP_LE_OQ)
+#define wcVecf_select(m,a,b)  _mm256_blendv_ps(b,a,m)
+#define wcVecm_and(a,b)       _mm256_and_ps(a,b)
+#define wcVecm_any(m)         (_mm256_movemask_ps(m)!=0)
+#define wcVecm_all(m)         (_mm256_movemask_ps(m)==0xFF)
+#define wcVeci_set1(x)        _mm256_set1_epi32(x)
+#define wcVeci_add(a,b)       _mm256_add_epi32(a,b)
+#define wcVeci_sub(a,b)       _mm256_sub_epi32(a,b)
+#define wcVeci_and(a,b)       _mm256_and_si256(a,b)
+#define wcVeci_andnot(a,b)    _mm256_andnot_si256(a,b)
+#define wcVeci_slli(a,n)      _mm256_slli_epi32(a,n)
+#define wcVeci_eq(a,b)        _mm256_castsi256_ps(_mm256_cmpeq_epi32(a,b))
+#define wcVecf_cvtt(a)        _mm256_cvttps_epi32(a)
+#define wcVeci_cvt(a)         _mm256_cvtepi32_ps(a)
+#define wcVeci_as_f(a)        _mm256_castsi256_ps(a)
+#define wcVecf_as_i(a)        _mm256_castps_si256(a)
+#elif WC_SIMD_ISA == WC_SIMD_SSE41
+#define WC_SIMD_FN(name) name##_sse41
+#define WC_VEC_WIDTH 4
+#define wcVecf __m128
+#define wcVecm __m128
+#define wcVeci __m128i
+#define wcVecf_load(p)        _mm_loadu_ps(p)
+#define wcVecf_store(p,a)     _mm_storeu_ps(p,a)
+#define wcVecf_set1(x)        _mm_set1_ps(x)
+#define wcVecf_add(a,b)       _mm_add_ps(a,b)
+#define wcVecf_sub(a,b)       _mm_sub_ps(a,b)
+#define wcVecf_mul(a,b)       _mm_mul_ps(a,b)
+#define wcVecf_div(a,b)       _mm_div_ps(a,b)
+#define wcVecf_sqrt(a)        _mm_sqrt_ps(a)
+#define wcVecf_min(a,b)       _mm_min_ps(a,b)
+#define wcVecf_max(a,b)       _mm_max_ps(a,b)
+#define wcVecf_floor(a)       _mm_floor_ps(a)
+#define wcVecf_and(a,b)       _mm_and_ps(a,b)
+#define wcVecf_andnot(a,b)    _mm_andnot_ps(a,b)
+#define wcVecf_xor(a,b)       _mm_xor_ps(a,b)
+#define wcVecf_gt(a,b)        _mm_cmpgt_ps(a,b)
+#define wcVecf_lt(a,b)        _mm_cmplt_ps(a,b)
+#define wcVecf_le(a,b)        _mm_cmple_ps(a,b)
+#define wcVecf_select(m,a,b)  _mm_blendv_ps(b,a,m)
+#define wcVecm_and(a,b)       _mm_and_ps(a,b)
+#define wcVecm_any(m)         (_mm_movemask_ps(m)!=0)
+#define wcVecm_all(m)         (_mm_movemask_ps(m)==0xF)
+#define wcVeci_set1(x)        _mm_set1_epi32(x)
+#define wcVeci_add(a,b)       _mm_add_epi32(a,b)
+#define wcVeci_sub(a,b)       _mm_sub_epi32(a,b)
+#define wcVeci_and(a,b)       _mm_and_si128(a,b)
+#define wcVeci_andnot(a,b)    _mm_andnot_si128(a,b)
+#define wcVeci_slli(a,n)      _mm_slli_epi32(a,n)
+#define wcVeci_eq(a,b)        _mm_castsi128_ps(_mm_cmpeq_epi32(a,b))
+#define wcVecf_cvtt(a)        _mm_cvttps_epi32(a)
+#define wcVeci_cvt(a)         _mm_cvtepi32_ps(a)
+#define wcVeci_as_f(a)        _mm_castsi128_ps(a)
+#define wcVecf_as_i(a)        _mm_castps_si128(a)
+#else
+#define WC_SIMD_FN(name) name##_scalar
+#define WC_VEC_WIDTH 1
+#define wcVecf float
+#define wcVecm int
+#define wcVecf_load(p)        (*(p))
+#define wcVecf_store(p,a)     (*(p) = (a))
+#define wcVecf_set1(x)        (x)
+#define wcVecf_add(a,b)       ((a)+(b))
+#define wcVecf_sub(a,b)       ((a)-(b))
+#define wcVecf_mul(a,b)       ((a)*(b))
+#define wcVecf_div(a,b)       ((a)/(b))
+#define wcVecf_sqrt(a)        sqrtf(a)
+#define wcVecf_min(a,b)       ((a)<(b)?(a):(b))
+#define wcVecf_max(a,b)       ((a)>(b)?(a):(b))
+#define wcVecf_gt(a,b)        ((a)>(b))
+#define wcVecf_lt(a,b)        ((a)<(b))
+#define wcVecf_le(a,b)        ((a)<=(b))
+#define wcVecf_select(m,a,b)  ((m)?(a):(b))
+#define wcVecm_and(a,b)       ((a)&&(b))
+#define wcVecm_any(m)         (m)
+#define wcVecm_all(m)         (m)
+#endif
+
+#if WC_VEC_WIDTH > 1
+#define wcVecf_neg(a)         wcVecf_xor(a,wcVecf_set1(-0.f))
+#define wcVecf_abs(a)         wcVecf_andnot(wcVecf_set1(-0.f),a)
+#else
+#define wcVecf_neg(a)         (-(a))
+#define wcVecf_abs(a)         fabsf(a)
+#endif
+
+/* Vector versions of the libm functions used by the shader. These are the
+ * single precision polynomial approximations from the Cephes library, with
+ * an error of a few ulp in the ranges used here. The scalar version just
+ * calls libm.
+ */
+#if WC_VEC_WIDTH > 1
+static void WC_SIMD_FN(wcVecSinCos)(wcVecf x, wcVecf *s, wcVecf *c)
+{
+    wcVecf sign_mask = wcVecf_set1(-0.f);
+    wcVecf sign_x = wcVecf_and(x, sign_mask);
+    wcVecf ax = wcVecf_abs(x);
+    //Octant of x, rounded up to an even number
+    wcVeci j = wcVecf_cvtt(wcVecf_mul(ax, wcVecf_set1(1.27323954473516f)));
+    j = wcVeci_and(wcVeci_add(j, wcVeci_set1(1)), wcVeci_set1(~1));
+    wcVecf y = wcVeci_cvt(j);
+    wcVecf sign_sin = wcVecf_xor(sign_x, wcVeci_as_f(wcVeci_slli(
+        wcVeci_and(j, wcVeci_set1(4)), 29)));
+    wcVecf sign_cos = wcVeci_as_f(wcVeci_slli(wcVeci_andnot(
+        wcVeci_sub(j, wcVeci_set1(2)), wcVeci_set1(4)), 29));
+    wcVecm use_sin_poly = wcVeci_eq(wcVeci_and(j, wcVeci_set1(2)),
+        wcVeci_set1(0));
+    //x - y*pi/4 in extended precision
+    ax = wcVecf_sub(ax, wcVecf_mul(y, wcVecf_set1(0.78515625f)));
+    ax = wcVecf_sub(ax, wcVecf_mul(y, wcVecf_set1(2.4187564849853515625e-4f)));
+    ax = wcVecf_sub(ax, wcVecf_mul(y, wcVecf_set1(3.77489497744594108e-8f)));
+    wcVecf z = wcVecf_mul(ax, ax);
+    wcVecf poly_cos = wcVecf_mul(wcVecf_set1(2.443315711809948e-5f), z);
+    poly_cos = wcVecf_add(poly_cos, wcVecf_set1(-1.388731625493765e-3f));
+    poly_cos = wcVecf_mul(poly_cos, z);
+    poly_cos = wcVecf_add(poly_cos, wcVecf_set1(4.166664568298827e-2f));
+    poly_cos = wcVecf_mul(wcVecf_mul(poly_cos, z), z);
+    poly_cos = wcVecf_sub(poly_cos, wcVecf_mul(z, wcVecf_set1(0.5f)));
+    poly_cos = wcVecf_add(poly_cos, wcVecf_set1(1.f));
+    wcVecf poly_sin = wcVecf_mul(wcVecf_set1(-1.9515295891e-4f), z);
+    poly_sin = wcVecf_add(poly_sin, wcVecf_set1(8.3321608736e-3f));
+    poly_sin = wcVecf_mul(poly_sin, z);
+    poly_sin = wcVecf_add(poly_sin, wcVecf_set1(-1.6666654611e-1f));
+    poly_sin = wcVecf_mul(wcVecf_mul(poly_sin, z), ax);
+    poly_sin = wcVecf_add(poly_sin, ax);
+    *s = wcVecf_xor(wcVecf_select(use_sin_poly, poly_sin, poly_cos), sign_sin);
+    *c = wcVecf_xor(wcVecf_select(use_sin_poly, poly_cos, poly_sin), sign_cos);
+}
+
+static wcVecf WC_SIMD_FN(wcVecAtan2)(wcVecf y, wcVecf x)
+{
+    wcVecf ax = wcVecf_abs(x);
+    wcVecf ay = wcVecf_abs(y);
+    wcVecf t = wcVecf_div(ay, ax);
+    //Reduce the argument to [-tan(pi/8), tan(pi/8)]
+    wcVecm big = wcVecf_gt(t, wcVecf_set1(2.414213562373095f));
+    wcVecm mid = wcVecf_gt(t, wcVecf_set1(0.4142135623730950f));
+    wcVecf offset = wcVecf_select(big, wcVecf_set1((float)M_PI_2),
+        wcVecf_select(mid, wcVecf_set1((float)M_PI_4), wcVecf_set1(0.f)));
+    t = wcVecf_select(big, wcVecf_div(wcVecf_set1(-1.f), t),
+        wcVecf_select(mid, wcVecf_div(wcVecf_sub(t, wcVecf_set1(1.f)),
+        wcVecf_add(t, wcVecf_set1(1.f))), t));
+    wcVecf z = wcVecf_mul(t, t);
+    wcVecf poly = wcVecf_mul(wcVecf_set1(8.05374449538e-2f), z);
+    poly = wcVecf_add(poly, wcVecf_set1(-1.38776856032e-1f));
+    poly = wcVecf_mul(poly, z);
+    poly = wcVecf_add(poly, wcVecf_set1(1.99777106478e-1f));
+    poly = wcVecf_mul(poly, z);
+    poly = wcVecf_add(poly, wcVecf_set1(-3.33329491539e-1f));
+    poly = wcVecf_mul(wcVecf_mul(poly, z), t);
+    wcVecf a = wcVecf_add(wcVecf_add(poly, t), offset);
+    //atan2(0,0) is 0
+    a = wcVecf_select(wcVecf_le(wcVecf_max(ax, ay), wcVecf_set1(0.f)),
+        wcVecf_set1(0.f), a);
+    a = wcVecf_select(wcVecf_lt(x, wcVecf_set1(0.f)),
+        wcVecf_sub(wcVecf_set1((float)M_PI), a), a);
+    return wcVecf_xor(a, wcVecf_and(y, wcVecf_set1(-0.f)));
+}
+
+static wcVecf WC_SIMD_FN(wcVecAcos)(wcVecf x)
+{
+    wcVecf ax = wcVecf_abs(x);
+    //acos(x) = 2 asin(sqrt((1-x)/2)) for |x| > 0.5, pi/2 - asin(x) otherwise
+    wcVecm big = wcVecf_gt(ax, wcVecf_set1(0.5f));
+    wcVecf z = wcVecf_select(big,
+        wcVecf_mul(wcVecf_set1(0.5f), wcVecf_sub(wcVecf_set1(1.f), ax)),
+        wcVecf_mul(ax, ax));
+    wcVecf s = wcVecf_select(big, wcVecf_sqrt(z), ax);
+    wcVecf poly = wcVecf_mul(wcVecf_set1(4.2163199048e-2f), z);
+    poly = wcVecf_add(poly, wcVecf_set1(2.4181311049e-2f));
+    poly = wcVecf_mul(poly, z);
+    poly = wcVecf_add(poly, wcVecf_set1(4.5470025998e-2f));
+    poly = wcVecf_mul(poly, z);
+    poly = wcVecf_add(poly, wcVecf_set1(7.4953002686e-2f));
+    poly = wcVecf_mul(poly, z);
+    poly = wcVecf_add(poly, wcVecf_set1(1.6666752422e-1f));
+    poly = wcVecf_mul(wcVecf_mul(poly, z), s);
+    wcVecf asin_s = wcVecf_add(poly, s);
+    wcVecf r_big = wcVecf_mul(wcVecf_set1(2.f), asin_s);
+    r_big = wcVecf_select(wcVecf_lt(x, wcVecf_set1(0.f)),
+        wcVecf_sub(wcVecf_set1((float)M_PI), r_big), r_big);
+    wcVecf r_small = wcVecf_sub(wcVecf_set1((float)M_PI_2),
+        wcVecf_xor(asin_s, wcVecf_and(x, wcVecf_set1(-0.f))));
+    return wcVecf_select(big, r_big, r_small);
+}
+
+static wcVecf WC_SIMD_FN(wcVecExp)(wcVecf x)
+{
+    x = wcVecf_min(x, wcVecf_set1(88.3762626647949f));
+    x = wcVecf_max(x, wcVecf_set1(-88.3762626647949f));
+    //x = n log(2) + r
+    wcVecf n = wcVecf_floor(wcVecf_add(wcVecf_mul(x,
+        wcVecf_set1(1.44269504088896341f)), wcVecf_set1(0.5f)));
+    x = wcVecf_sub(x, wcVecf_mul(n, wcVecf_set1(0.693359375f)));
+    x = wcVecf_sub(x, wcVecf_mul(n, wcVecf_set1(-2.12194440e-4f)));
+    wcVecf z = wcVecf_mul(x, x);
+    wcVecf poly = wcVecf_mul(wcVecf_set1(1.9875691500e-4f), x);
+    poly = wcVecf_add(poly, wcVecf_set1(1.3981999507e-3f));
+    poly = wcVecf_mul(poly, x);
+    poly = wcVecf_add(poly, wcVecf_set1(8.3334519073e-3f));
+    poly = wcVecf_mul(poly, x);
+    poly = wcVecf_add(poly, wcVecf_set1(4.1665795894e-2f));
+    poly = wcVecf_mul(poly, x);
+    poly = wcVecf_add(poly, wcVecf_set1(1.6666665459e-1f));
+    poly = wcVecf_mul(poly, x);
+    poly = wcVecf_add(poly, wcVecf_set1(5.0000001201e-1f));
+    poly = wcVecf_add(wcVecf_add(wcVecf_mul(poly, z), x), wcVecf_set1(1.f));
+    //2^n from the exponent bits
+    wcVecf pow2n = wcVeci_as_f(wcVeci_slli(wcVeci_add(wcVecf_cvtt(n),
+        wcVeci_set1(127)), 23));
+    return wcVecf_mul(poly, pow2n);
+}
+#else
+static void WC_SIMD_FN(wcVecSinCos)(float x, float *s, float *c)
+{
+    *s = sinf(x);
+    *c = cosf(x);
+}
+static float WC_SIMD_FN(wcVecAtan2)(float y, float x) { return atan2f(y, x); }
+static float WC_SIMD_FN(wcVecAcos)(float x) { return acosf(x); }
+static float WC_SIMD_FN(wcVecExp)(float x) { return expf(x); }
+#endif
+
+//Only basic arithmetic is vectorized here, so the results are the same as
+// those of wcGetPatternData
+static void WC_SIMD_FN(wcGetPatternDataBatch)(const float *uv_x,
+        const float *uv_y, void * const *contexts, uint32_t count,
+        wcPatternDataBatch *out, const wcWeaveParameters *params)
+{
+    float u_scale, v_scale;
+    wcUVScale(params, &u_scale, &v_scale);
+    const wcVecf vu_scale = wcVecf_set1(u_scale);
+    const wcVecf vpattern_width  = wcVecf_set1((float)params->pattern_width);
+    const wcVecf vpattern_height = wcVecf_set1((float)params->pattern_height);
+    const wcVecf vzero = wcVecf_set1(0.f);
+    const wcVecf vone  = wcVecf_set1(1.f);
+    const wcVecf vtwo  = wcVecf_set1(2.f);
+
+    //The points are done in chunks, so that the intermediate results fit on
+    // the stack
+    float total_u[WC_BATCH_CHUNK], total_v[WC_BATCH_CHUNK];
+    float start_u[WC_BATCH_CHUNK], start_v[WC_BATCH_CHUNK];
+    float length[WC_BATCH_CHUNK], width[WC_BATCH_CHUNK];
+    float warp_above[WC_BATCH_CHUNK];
+    float x[WC_BATCH_CHUNK], y[WC_BATCH_CHUNK];
+    uint32_t chunk_start;
+    for(chunk_start = 0; chunk_start < count;
+            chunk_start += WC_BATCH_CHUNK){
+        uint32_t n = count - chunk_start;
+        if(n > WC_BATCH_CHUNK){
+            n = WC_BATCH_CHUNK;
+        }
+        uint32_t n_padded = (n + WC_VEC_WIDTH - 1)/WC_VEC_WIDTH*WC_VEC_WIDTH;
+        const float *chunk_uv_x = uv_x + chunk_start;
+        const float *chunk_uv_y = uv_y + chunk_start;
+        uint32_t i;
+
+        //Scaled uv coordinates. Note that wcGetPatternData scales v by
+        // uscale as well
+        for(i = 0; i + WC_VEC_WIDTH <= n; i += WC_VEC_WIDTH){
+            wcVecf_store(total_u + i,
+                wcVecf_mul(wcVecf_load(chunk_uv_x + i), vu_scale));
+            wcVecf_store(total_v + i,
+                wcVecf_mul(wcVecf_load(chunk_uv_y + i), vu_scale));
+        }
+        for(; i < n; i++){
+            total_u[i] = chunk_uv_x[i]*u_scale;
+            total_v[i] = chunk_uv_y[i]*u_scale;
+        }
+
+        //Segment lookup, one point at a time
+        WC_STATS_ADD(pattern_data_calls, n);
+        for(i = 0; i < n; i++){
+            wcYarnSegment yarnsegment = wcGetYarnSegment(total_u[i],
+                total_v[i], params);
+            uint32_t j = chunk_start + i;
+            out->yarn_hit[j] = yarnsegment.yarn_hit;
+            if(yarnsegment.yarn_hit){
+                out->yarn_type[j] = yarnsegment.pattern_entry.yarn_type;
+                out->ext_between_parallel[j] = yarnsegment.between_parallel;
+                out->warp_above[j] = yarnsegment.warp_above;
+                start_u[i] = yarnsegment.start_u;
+                start_v[i] = yarnsegment.start_v;
+                length[i] = yarnsegment.length;
+                width[i] = yarnsegment.width;
+                warp_above[i] = yarnsegment.warp_above ? 1.f : 0.f;
+            } else{
+                out->yarn_type[j] = 0;
+                out->ext_between_parallel[j] = 0;
+                out->warp_above[j] = 0;
+                start_u[i] = start_v[i] = 0.f;
+                length[i] = width[i] = 1.f;
+                warp_above[i] = 0.f;
+            }
+        }
+        for(; i < n_padded; i++){
+            total_u[i] = total_v[i] = start_u[i] = start_v[i] = 0.f;
+            length[i] = width[i] = 1.f;
+            warp_above[i] = 0.f;
+        }
+
+        //Position within the segment, same operations as in
+        // wcGetPatternData
+        for(i = 0; i < n_padded; i += WC_VEC_WIDTH){
+            wcVecf l = wcVecf_load(length + i);
+            wcVecf w = wcVecf_load(width + i);
+            wcVecm warp = wcVecf_gt(wcVecf_load(warp_above + i), vzero);
+            wcVecf vx = wcVecf_div(wcVecf_mul(wcVecf_sub(
+                wcVecf_load(total_u + i), wcVecf_load(start_u + i)),
+                vpattern_width), wcVecf_select(warp, w, l));
+            wcVecf vy = wcVecf_div(wcVecf_mul(wcVecf_sub(
+                wcVecf_load(total_v + i), wcVecf_load(start_v + i)),
+                vpattern_height), wcVecf_select(warp, l, w));
+            vx = wcVecf_sub(wcVecf_mul(vx, vtwo), vone);
+            vy = wcVecf_sub(wcVecf_mul(vy, vtwo), vone);
+            //Swap X and Y for warp, so that we always have the yarn going
+            // along y.
+            wcVecf_store(x + i, wcVecf_select(warp, vx, wcVecf_neg(vy)));
+            wcVecf_store(y + i, wcVecf_select(warp, vy, vx));
+            wcVecf_store(length + i, wcVecf_mul(l, vtwo));
+            wcVecf_store(width + i, wcVecf_mul(w, vtwo));
+        }
+
+        //Segment uv and normal. These use sinf and cosf, which are kept
+        // scalar so that the results match wcGetPatternData exactly.
+        for(i = 0; i < n; i++){
+            uint32_t j = chunk_start + i;
+            if(!out->yarn_hit[j]){
+                out->normal_x[j] = out->normal_y[j] = out->normal_z[j] = 0.f;
+                out->u[j] = out->v[j] = 0.f;
+                out->length[j] = out->width[j] = 0.f;
+                out->x[j] = out->y[j] = 0.f;
+                out->total_index_x[j] = out->total_index_y[j] = 0;
+                continue;
+            }
+            wcPatternData data;
+            data.yarn_type = out->yarn_type[j];
+            data.ext_between_parallel = out->ext_between_parallel[j];
+            data.warp_above = out->warp_above[j];
+            data.x = x[i];
+            data.y = y[i];
+            wcIntersectionData intersection_data;
+            intersection_data.context = contexts ? contexts[j] : 0;
+            calculate_segment_uv_and_normal(&data, params, &intersection_data);
+            out->normal_x[j] = data.normal_x;
+            out->normal_y[j] = data.normal_y;
+            out->normal_z[j] = data.normal_z;
+            out->u[j] = data.u;
+            out->v[j] = data.v;
+            out->length[j] = length[i];
+            out->width[j] = width[i];
+            out->x[j] = x[i];
+            out->y[j] = y[i];
+            out->total_index_x[j] =
+                (uint32_t)(int64_t)(uv_x[j]*u_scale*params->pattern_width);
+            out->total_index_y[j] =
+                (uint32_t)(int64_t)(uv_y[j]*v_scale*params->pattern_height);
+        }
+    }
+}
+
+//log_norm is von_mises_log_norm of b, see WC_DERIVED_PARAMETERS
+static wcVecf WC_SIMD_FN(wcVecVonMises)(wcVecf cos_x, wcVecf b,
+    wcVecf log_norm)
+{
+    return WC_SIMD_FN(wcVecExp)(wcVecf_sub(wcVecf_mul(b, cos_x), log_norm));
+}
+
+/* The values of WC_VEC_WIDTH points which do not depend on the directions.
+ * sin_v and cos_v are only set if any point is filament, and sin_u and cos_u
+ * if any is staple. scale is 4 umax/delta_x, the factor of fc in the
+ * reflection.
+ */
+typedef struct
+{
+    wcVecm warp, filament, staple;
+    wcVecf x, y, sin_u, cos_u, sin_v, cos_v;
+    wcVecf umax, delta_x, alpha, beta, scale;
+    //The derived constants of the parameters above
+    wcVecf tan_psi, sin_psi, radius, von_mises_log_norm;
+} WC_SIMD_FN(wcVecPoint);
+
+/* Specular reflection of WC_VEC_WIDTH direction pairs, the same as
+ * wcEvalFilamentSpecular and wcEvalStapleSpecular but with both evaluated
+ * for every point and masks instead of branches.
+ */
+static wcVecf WC_SIMD_FN(wcVecEvalSpecularDirections)(
+        const WC_SIMD_FN(wcVecPoint) *point, wcVecf wi_x, wcVecf wi_y,
+        wcVecf wi_z, wcVecf wo_x, wcVecf wo_y, wcVecf wo_z)
+{
+    const wcVecf zero = wcVecf_set1(0.f);
+    const wcVecf one = wcVecf_set1(1.f);
+    wcVecm warp = point->warp;
+    wcVecm filament = point->filament;
+    wcVecm staple = point->staple;
+    wcVecf reflection = zero;
+
+    //Swap x and y for wefts
+    wcVecf tmp = wi_x;
+    wi_x = wcVecf_select(warp, wi_x, wcVecf_neg(wi_y));
+    wi_y = wcVecf_select(warp, wi_y, tmp);
+    tmp = wo_x;
+    wo_x = wcVecf_select(warp, wo_x, wcVecf_neg(wo_y));
+    wo_y = wcVecf_select(warp, wo_y, tmp);
+
+    wcVecf sum_x = wcVecf_add(wi_x, wo_x);
+    wcVecf sum_y = wcVecf_add(wi_y, wo_y);
+    wcVecf sum_z = wcVecf_add(wi_z, wo_z);
+    wcVecf sum_magnitude = wcVecf_sqrt(wcVecf_add(wcVecf_add(
+        wcVecf_mul(sum_x, sum_x), wcVecf_mul(sum_y, sum_y)),
+        wcVecf_mul(sum_z, sum_z)));
+    wcVecf inv_magnitude = wcVecf_div(one, sum_magnitude);
+    wcVecf H_x = wcVecf_mul(sum_x, inv_magnitude);
+    wcVecf H_y = wcVecf_mul(sum_y, inv_magnitude);
+    wcVecf H_z = wcVecf_mul(sum_z, inv_magnitude);
+
+    wcVecf umax = point->umax;
+    wcVecf delta_x = point->delta_x;
+    wcVecf R = point->radius; //radius of curvature
+
+    //fc and A do not depend on the yarn model, except through the normal
+    wcVecf cos_x = wcVecf_neg(wcVecf_add(wcVecf_add(wcVecf_mul(wi_x, wo_x),
+        wcVecf_mul(wi_y, wo_y)), wcVecf_mul(wi_z, wo_z)));
+    wcVecf fc = wcVecf_add(point->alpha, WC_SIMD_FN(wcVecVonMises)(cos_x,
+        point->beta, point->von_mises_log_norm));
+    wcVecf scale = wcVecf_mul(point->scale, fc);
+
+    if(wcVecm_any(filament)){
+        wcVecf specular_u = wcVecf_add(WC_SIMD_FN(wcVecAtan2)(
+            wcVecf_neg(H_z), H_y), wcVecf_set1((float)M_PI_2));
+        wcVecm hit = wcVecm_and(filament,
+            wcVecf_lt(wcVecf_abs(specular_u), umax));
+        wcVecf sin_u, cos_u;
+        wcVecf sin_v = point->sin_v, cos_v = point->cos_v;
+        WC_SIMD_FN(wcVecSinCos)(specular_u, &sin_u, &cos_u);
+        wcVecf n_x = sin_v;
+        wcVecf n_y = wcVecf_mul(sin_u, cos_v);
+        wcVecf n_z = wcVecf_mul(cos_u, cos_v);
+        wcVecf inv_n = wcVecf_div(one, wcVecf_sqrt(wcVecf_add(wcVecf_add(
+            wcVecf_mul(n_x, n_x), wcVecf_mul(n_y, n_y)),
+            wcVecf_mul(n_z, n_z))));
+        n_x = wcVecf_mul(n_x, inv_n);
+        n_y = wcVecf_mul(n_y, inv_n);
+        n_z = wcVecf_mul(n_z, inv_n);
+        wcVecf inv_t = wcVecf_div(one, wcVecf_sqrt(wcVecf_add(
+            wcVecf_mul(cos_u, cos_u), wcVecf_mul(sin_u, sin_u))));
+        wcVecf t_y = wcVecf_mul(cos_u, inv_t);
+        wcVecf t_z = wcVecf_mul(wcVecf_neg(sin_u), inv_t);
+
+        wcVecf specular_y = wcVecf_div(specular_u, umax);
+        specular_y = wcVecf_min(specular_y, wcVecf_sub(one, delta_x));
+        specular_y = wcVecf_max(specular_y, wcVecf_sub(delta_x, one));
+        hit = wcVecm_and(hit, wcVecf_lt(wcVecf_abs(wcVecf_sub(specular_y,
+            point->y)), delta_x));
+
+        if(wcVecm_any(hit)){
+            wcVecf cross_x = wcVecf_sub(wcVecf_mul(t_y, H_z),
+                wcVecf_mul(t_z, H_y));
+            wcVecf Gu = wcVecf_div(wcVecf_add(R, cos_v),
+                wcVecf_mul(sum_magnitude, wcVecf_abs(cross_x)));
+            wcVecf widotn = wcVecf_add(wcVecf_add(wcVecf_mul(wi_x, n_x),
+                wcVecf_mul(wi_y, n_y)), wcVecf_mul(wi_z, n_z));
+            wcVecf wodotn = wcVecf_add(wcVecf_add(wcVecf_mul(wo_x, n_x),
+                wcVecf_mul(wo_y, n_y)), wcVecf_mul(wo_z, n_z));
+            hit = wcVecm_and(hit, wcVecm_and(wcVecf_gt(widotn, zero),
+                wcVecf_gt(wodotn, zero)));
+            wcVecf A = wcVecf_mul(wcVecf_set1((float)(1.0/(4.0*M_PI))),
+                wcVecf_div(wcVecf_mul(widotn, wodotn),
+                wcVecf_add(widotn, wodotn)));
+            reflection = wcVecf_select(hit,
+                wcVecf_mul(wcVecf_mul(scale, Gu), A), reflection);
+        }
+    }
+
+    if(wcVecm_any(staple)){
+        wcVecf sin_psi = point->sin_psi;
+        wcVecf sin_u = point->sin_u, cos_u = point->cos_u;
+        wcVecf a = wcVecf_add(wcVecf_mul(H_y, sin_u), wcVecf_mul(H_z, cos_u));
+        wcVecf D = wcVecf_div(wcVecf_sub(wcVecf_mul(H_y, cos_u),
+            wcVecf_mul(H_z, sin_u)), wcVecf_sqrt(wcVecf_add(
+            wcVecf_mul(H_x, H_x), wcVecf_mul(a, a))));
+        D = wcVecf_div(D, point->tan_psi);
+        wcVecm hit = wcVecm_and(staple,
+            wcVecf_lt(wcVecf_abs(D), one));
+        wcVecf specular_v = wcVecf_add(WC_SIMD_FN(wcVecAtan2)(wcVecf_neg(a),
+            H_x), WC_SIMD_FN(wcVecAcos)(D));
+        hit = wcVecm_and(hit, wcVecf_lt(wcVecf_abs(specular_v),
+            wcVecf_set1((float)M_PI_2)));
+        wcVecf specular_x = wcVecf_div(specular_v,
+            wcVecf_set1((float)M_PI_2));
+        specular_x = wcVecf_min(specular_x, wcVecf_sub(one, delta_x));
+        specular_x = wcVecf_max(specular_x, wcVecf_sub(delta_x, one));
+        hit = wcVecm_and(hit, wcVecf_lt(wcVecf_abs(wcVecf_sub(specular_x,
+            point->x)), delta_x));
+
+        if(wcVecm_any(hit)){
+            wcVecf sin_v, cos_v;
+            WC_SIMD_FN(wcVecSinCos)(specular_v, &sin_v, &cos_v);
+            wcVecf n_x = sin_v;
+            wcVecf n_y = wcVecf_mul(sin_u, cos_v);
+            wcVecf n_z = wcVecf_mul(cos_u, cos_v);
+            wcVecf inv_n = wcVecf_div(one, wcVecf_sqrt(wcVecf_add(wcVecf_add(
+                wcVecf_mul(n_x, n_x), wcVecf_mul(n_y, n_y)),
+                wcVecf_mul(n_z, n_z))));
+            n_x = wcVecf_mul(n_x, inv_n);
+            n_y = wcVecf_mul(n_y, inv_n);
+            n_z = wcVecf_mul(n_z, inv_n);
+            wcVecf ndoth = wcVecf_add(wcVecf_add(wcVecf_mul(n_x, H_x),
+                wcVecf_mul(n_y, H_y)), wcVecf_mul(n_z, H_z));
+            wcVecf Gv = wcVecf_div(wcVecf_add(R, cos_v),
+                wcVecf_mul(wcVecf_mul(sum_magnitude, ndoth), sin_psi));
+            wcVecf widotn = wcVecf_add(wcVecf_add(wcVecf_mul(wi_x, n_x),
+                wcVecf_mul(wi_y, n_y)), wcVecf_mul(wi_z, n_z));
+            wcVecf wodotn = wcVecf_add(wcVecf_add(wcVecf_mul(wo_x, n_x),
+                wcVecf_mul(wo_y, n_y)), wcVecf_mul(wo_z, n_z));
+            hit = wcVecm_and(hit, wcVecm_and(wcVecf_gt(widotn, zero),
+                wcVecf_gt(wodotn, zero)));
+            wcVecf A = wcVecf_mul(wcVecf_set1((float)(1.0/(4.0*M_PI))),
+                wcVecf_div(wcVecf_mul(widotn, wodotn),
+                wcVecf_add(widotn, wodotn)));
+            reflection = wcVecf_select(hit,
+                wcVecf_mul(wcVecf_mul(scale, Gv), A), reflection);
+        }
+    }
+    return reflection;
+}
+
+/* Specular reflection of the WC_VEC_WIDTH points starting at i. The input
+ * arrays are the per point values gathered by wcShadeBatch.
+ */
+typedef struct
+{
+    float *wi_x, *wi_y, *wi_z, *wo_x, *wo_y, *wo_z;
+    float *u, *v, *x, *y;
+    float *warp_above, *filament, *staple;
+    float *umax, *delta_x, *alpha, *beta;
+    //The derived constants of the parameters above
+    float *tan_psi, *sin_psi, *radius, *inv_delta_x, *von_mises_log_norm;
+} WC_SIMD_FN(wcShadeLanes);
+
+static wcVecf WC_SIMD_FN(wcVecEvalSpecular)(
+        const WC_SIMD_FN(wcShadeLanes) *lanes, uint32_t i)
+{
+    const wcVecf zero = wcVecf_set1(0.f);
+    WC_SIMD_FN(wcVecPoint) point;
+    point.filament = wcVecf_gt(wcVecf_load(lanes->filament + i), zero);
+    point.staple = wcVecf_gt(wcVecf_load(lanes->staple + i), zero);
+    if(!wcVecm_any(point.filament) && !wcVecm_any(point.staple)){
+        return zero;
+    }
+    point.warp = wcVecf_gt(wcVecf_load(lanes->warp_above + i), zero);
+    point.x = wcVecf_load(lanes->x + i);
+    point.y = wcVecf_load(lanes->y + i);
+    point.sin_u = point.cos_u = point.sin_v = point.cos_v = zero;
+    if(wcVecm_any(point.filament)){
+        WC_SIMD_FN(wcVecSinCos)(wcVecf_load(lanes->v + i), &point.sin_v,
+            &point.cos_v);
+    }
+    if(wcVecm_any(point.staple)){
+        WC_SIMD_FN(wcVecSinCos)(wcVecf_load(lanes->u + i), &point.sin_u,
+            &point.cos_u);
+    }
+    point.umax = wcVecf_load(lanes->umax + i);
+    point.delta_x = wcVecf_load(lanes->delta_x + i);
+    point.alpha = wcVecf_load(lanes->alpha + i);
+    point.beta = wcVecf_load(lanes->beta + i);
+    point.scale = wcVecf_mul(wcVecf_mul(wcVecf_set1(4.f), point.umax),
+        wcVecf_load(lanes->inv_delta_x + i));
+    point.tan_psi = wcVecf_load(lanes->tan_psi + i);
+    point.sin_psi = wcVecf_load(lanes->sin_psi + i);
+    point.radius = wcVecf_load(lanes->radius + i);
+    point.von_mises_log_norm = wcVecf_load(lanes->von_mises_log_norm + i);
+    return WC_SIMD_FN(wcVecEvalSpecularDirections)(&point,
+        wcVecf_load(lanes->wi_x + i), wcVecf_load(lanes->wi_y + i),
+        wcVecf_load(lanes->wi_z + i), wcVecf_load(lanes->wo_x + i),
+        wcVecf_load(lanes->wo_y + i), wcVecf_load(lanes->wo_z + i));
+}
+
+static void WC_SIMD_FN(wcShadeBatch)(const wcIntersectionDataBatch *in,
+        uint32_t count, wcColorBatch *out, const wcWeaveParameters *params)
+{
+    //Pattern data of one chunk
+    uint32_t yarn_type[WC_BATCH_CHUNK];
+    float normal_x[WC_BATCH_CHUNK], normal_y[WC_BATCH_CHUNK],
+        normal_z[WC_BATCH_CHUNK], u[WC_BATCH_CHUNK], v[WC_BATCH_CHUNK],
+        length[WC_BATCH_CHUNK], width[WC_BATCH_CHUNK], x[WC_BATCH_CHUNK],
+        y[WC_BATCH_CHUNK];
+    uint32_t total_index_x[WC_BATCH_CHUNK], total_index_y[WC_BATCH_CHUNK];
+    uint8_t warp_above[WC_BATCH_CHUNK], yarn_hit[WC_BATCH_CHUNK],
+        ext_between_parallel[WC_BATCH_CHUNK];
+    wcPatternDataBatch data = {yarn_type, normal_x, normal_y, normal_z, u, v,
+        length, width, x, y, total_index_x, total_index_y, warp_above,
+        yarn_hit, ext_between_parallel};
+
+    //Per point values for the vectorized specular evaluation
+    float wi_x[WC_BATCH_CHUNK], wi_y[WC_BATCH_CHUNK], wi_z[WC_BATCH_CHUNK],
+        wo_x[WC_BATCH_CHUNK], wo_y[WC_BATCH_CHUNK], wo_z[WC_BATCH_CHUNK],
+        lane_warp_above[WC_BATCH_CHUNK], filament[WC_BATCH_CHUNK],
+        staple[WC_BATCH_CHUNK], umax[WC_BATCH_CHUNK],
+        delta_x[WC_BATCH_CHUNK], alpha[WC_BATCH_CHUNK], beta[WC_BATCH_CHUNK],
+        tan_psi[WC_BATCH_CHUNK], sin_psi[WC_BATCH_CHUNK],
+        radius[WC_BATCH_CHUNK], inv_delta_x[WC_BATCH_CHUNK],
+        von_mises_log_norm[WC_BATCH_CHUNK];
+    WC_SIMD_FN(wcShadeLanes) lanes = {wi_x, wi_y, wi_z, wo_x, wo_y, wo_z,
+        u, v, x, y, lane_warp_above, filament, staple, umax, delta_x,
+        alpha, beta, tan_psi, sin_psi, radius, inv_delta_x,
+        von_mises_log_norm};
+    float noise[WC_BATCH_CHUNK], specular_strength[WC_BATCH_CHUNK];
+    wcColor diffuse[WC_BATCH_CHUNK];
+
+    uint32_t chunk_start;
+    for(chunk_start = 0; chunk_start < count;
+            chunk_start += WC_BATCH_CHUNK){
+        uint32_t n = count - chunk_start;
+        if(n > WC_BATCH_CHUNK){
+            n = WC_BATCH_CHUNK;
+        }
+        uint32_t n_padded = (n + WC_VEC_WIDTH - 1)/WC_VEC_WIDTH*WC_VEC_WIDTH;
+        void * const *contexts = in->context ? in->context + chunk_start : 0;
+        uint32_t i;
+        WC_SIMD_FN(wcGetPatternDataBatch)(in->uv_x + chunk_start,
+            in->uv_y + chunk_start, contexts, n, &data, params);
+
+        //Parameter lookups, these may call the texturing callbacks
+        for(i = 0; i < n; i++){
+            uint32_t j = chunk_start + i;
+            wcIntersectionData intersection_data;
+            intersection_data.wi_z = in->wi_z[j];
+            intersection_data.context = contexts ? contexts[i] : 0;
+            wcPatternData pattern_data;
+            pattern_data.yarn_type = yarn_type[i];
+            pattern_data.yarn_hit = yarn_hit[i];
+            pattern_data.warp_above = warp_above[i];
+            pattern_data.x = x[i];
+            pattern_data.y = y[i];
+            pattern_data.length = length[i];
+            pattern_data.width = width[i];
+            pattern_data.total_index_x = total_index_x[i];
+            pattern_data.total_index_y = total_index_y[i];
+            diffuse[i] = wcEvalDiffuse(intersection_data, pattern_data,
+                params);
+            specular_strength[i] = wc_yarn_type_get_specular_strength(params,
+                yarn_type[i], intersection_data.context);
+            wi_x[i] = in->wi_x[j]; wi_y[i] = in->wi_y[j];
+            wi_z[i] = in->wi_z[j];
+            wo_x[i] = in->wo_x[j]; wo_y[i] = in->wo_y[j];
+            wo_z[i] = in->wo_z[j];
+            lane_warp_above[i] = warp_above[i] ? 1.f : 0.f;
+            if(!yarn_hit[i]){
+                filament[i] = staple[i] = 0.f;
+                umax[i] = delta_x[i] = beta[i] = 1.f;
+                tan_psi[i] = sin_psi[i] = radius[i] = inv_delta_x[i] = 1.f;
+                alpha[i] = von_mises_log_norm[i] = 0.f;
+                noise[i] = 0.f;
+                continue;
+            }
+            float psi = wc_yarn_type_get_psi(params, yarn_type[i],
+                intersection_data.context);
+            filament[i] = psi <= 0.001f ? 1.f : 0.f;
+            staple[i] = 1.f - filament[i];
+            tan_psi[i] = wc_yarn_type_get_tan_psi(params, yarn_type[i],
+                intersection_data.context, psi);
+            sin_psi[i] = wc_yarn_type_get_sin_psi(params, yarn_type[i],
+                intersection_data.context, psi);
+            if(ext_between_parallel[i]){
+                //if segment is extension between to parallel yarns -> bend = 0
+                umax[i] = filament[i] > 0.f ? 0.0001f : 0.001f;
+                radius[i] = 1.f/(sin(umax[i]));
+            } else{
+                umax[i] = wc_yarn_type_get_umax(params, yarn_type[i],
+                    intersection_data.context);
+                radius[i] = wc_yarn_type_get_radius(params, yarn_type[i],
+                    intersection_data.context, umax[i]);
+            }
+            delta_x[i] = wc_yarn_type_get_delta_x(params, yarn_type[i],
+                intersection_data.context);
+            inv_delta_x[i] = wc_yarn_type_get_inv_delta_x(params,
+                yarn_type[i], intersection_data.context, delta_x[i]);
+            alpha[i] = wc_yarn_type_get_alpha(params, yarn_type[i],
+                intersection_data.context);
+            beta[i] = wc_yarn_type_get_beta(params, yarn_type[i],
+                intersection_data.context);
+            von_mises_log_norm[i] = wc_yarn_type_get_von_mises_log_norm(
+                params, yarn_type[i], intersection_data.context, beta[i]);
+            float specular_noise = wc_yarn_type_get_specular_noise(params,
+                yarn_type[i], intersection_data.context);
+            noise[i] = 1.f;
+            if(specular_noise > 0.001f){
+                float iv = intensityVariation(pattern_data);
+                noise[i] = (1.f - specular_noise) + specular_noise * iv;
+            }
+        }
+        for(; i < n_padded; i++){
+            wi_x[i] = wi_y[i] = wo_x[i] = wo_y[i] = 0.f;
+            wi_z[i] = wo_z[i] = 1.f;
+            u[i] = v[i] = x[i] = y[i] = 0.f;
+            lane_warp_above[i] = filament[i] = staple[i] = 0.f;
+            umax[i] = delta_x[i] = beta[i] = 1.f;
+            tan_psi[i] = sin_psi[i] = radius[i] = inv_delta_x[i] = 1.f;
+            alpha[i] = von_mises_log_norm[i] = 0.f;
+        }
+
+        float specular[WC_BATCH_CHUNK];
+        for(i = 0; i < n_padded; i += WC_VEC_WIDTH){
+            wcVecf_store(specular + i, WC_SIMD_FN(wcVecEvalSpecular)(&lanes,
+                i));
+        }
+
+        for(i = 0; i < n; i++){
+            uint32_t j = chunk_start + i;
+            float spec = specular[i] * params->specular_normalization
+                * noise[i];
+            float strength = specular_strength[i];
+            out->r[j] = diffuse[i].r*(1.f-strength) + strength*spec;
+            out->g[j] = diffuse[i].g*(1.f-strength) + strength*spec;
+            out->b[j] = diffuse[i].b*(1.f-strength) + strength*spec;
+        }
+    }
+}
+
+
+//Only called for points where a yarn was hit, see wcEvalSpecularMultiDir
+static void WC_SIMD_FN(wcEvalSpecularMultiDir)(const wcShadingPoint *point,
+    const float *wi_x, const float *wi_y, const float *wi_z,
+    const float *wo_x, const float *wo_y, const float *wo_z, uint32_t count,
+    float *out, const wcWeaveParameters *params)
+{
+    const wcPatternData *data = &point->data;
+    const wcVecf zero = wcVecf_set1(0.f);
+    int filament = point->psi <= 0.001f;
+    float umax = point->umax, radius = point->radius;
+    if(data->ext_between_parallel){
+        //if segment is extension between to parallel yarns -> bend = 0
+        umax = filament ? 0.0001f : 0.001f;
+        radius = 1.f/(sin(umax));
+    }
+    WC_SIMD_FN(wcVecPoint) vec_point;
+    vec_point.warp = wcVecf_gt(wcVecf_set1(data->warp_above ? 1.f : 0.f),
+        zero);
+    vec_point.filament = wcVecf_gt(wcVecf_set1(filament ? 1.f : 0.f), zero);
+    vec_point.staple = wcVecf_gt(wcVecf_set1(filament ? 0.f : 1.f), zero);
+    vec_point.x = wcVecf_set1(data->x);
+    vec_point.y = wcVecf_set1(data->y);
+    vec_point.sin_u = wcVecf_set1(sinf(data->u));
+    vec_point.cos_u = wcVecf_set1(cosf(data->u));
+    vec_point.sin_v = wcVecf_set1(sinf(data->v));
+    vec_point.cos_v = wcVecf_set1(cosf(data->v));
+    vec_point.umax = wcVecf_set1(umax);
+    vec_point.delta_x = wcVecf_set1(point->delta_x);
+    vec_point.alpha = wcVecf_set1(point->alpha);
+    vec_point.beta = wcVecf_set1(point->beta);
+    vec_point.scale = wcVecf_set1(4.f*umax*point->inv_delta_x);
+    vec_point.tan_psi = wcVecf_set1(point->tan_psi);
+    vec_point.sin_psi = wcVecf_set1(point->sin_psi);
+    vec_point.radius = wcVecf_set1(radius);
+    vec_point.von_mises_log_norm = wcVecf_set1(point->von_mises_log_norm);
+    const wcVecf factor = wcVecf_set1(params->specular_normalization
+        *point->noise);
+
+    uint32_t i;
+    for(i = 0; i + WC_VEC_WIDTH <= count; i += WC_VEC_WIDTH){
+        wcVecf reflection = WC_SIMD_FN(wcVecEvalSpecularDirections)(
+            &vec_point, wcVecf_load(wi_x + i), wcVecf_load(wi_y + i),
+            wcVecf_load(wi_z + i), wcVecf_load(wo_x + i),
+            wcVecf_load(wo_y + i), wcVecf_load(wo_z + i));
+        wcVecf_store(out + i, wcVecf_mul(reflection, factor));
+    }
+#if WC_VEC_WIDTH > 1
+    if(i < count){
+        //The last directions, padded with the normal
+        float tail[7][WC_VEC_WIDTH];
+        uint32_t j;
+        for(j = 0; j < WC_VEC_WIDTH; j++){
+            int valid = i + j < count;
+            tail[0][j] = valid ? wi_x[i + j] : 0.f;
+            tail[1][j] = valid ? wi_y[i + j] : 0.f;
+            tail[2][j] = valid ? wi_z[i + j] : 1.f;
+            tail[3][j] = valid ? wo_x[i + j] : 0.f;
+            tail[4][j] = valid ? wo_y[i + j] : 0.f;
+            tail[5][j] = valid ? wo_z[i + j] : 1.f;
+        }
+        wcVecf reflection = WC_SIMD_FN(wcVecEvalSpecularDirections)(
+            &vec_point, wcVecf_load(tail[0]), wcVecf_load(tail[1]),
+            wcVecf_load(tail[2]), wcVecf_load(tail[3]),
+            wcVecf_load(tail[4]), wcVecf_load(tail[5]));
+        wcVecf_store(tail[6], wcVecf_mul(reflection, factor));
+        for(j = 0; i + j < count; j++){
+            out[i + j] = tail[6][j];
+        }
+    }
+#endif
+}
+
+#undef WC_SIMD_FN
+#undef WC_VEC_WIDTH
+#undef wcVecf
+#undef wcVecm
+#undef wcVeci
+#undef wcVecf_load
+#undef wcVecf_store
+#undef wcVecf_set1
+#undef wcVecf_add
+#undef wcVecf_sub
+#undef wcVecf_mul
+#undef wcVecf_div
+#undef wcVecf_sqrt
+#undef wcVecf_min
+#undef wcVecf_max
+#undef wcVecf_floor
+#undef wcVecf_and
+#undef wcVecf_andnot
+#undef wcVecf_xor
+#undef wcVecf_neg
+#undef wcVecf_abs
+#undef wcVecf_gt
+#undef wcVecf_lt
+#undef wcVecf_le
+#undef wcVecf_select
+#undef wcVecm_and
+#undef wcVecm_any
+#undef wcVecm_all
+#undef wcVeci_set1
+#undef wcVeci_add
+#undef wcVeci_sub
+#undef wcVeci_and
+#undef wcVeci_andnot
+#undef wcVeci_slli
+#undef wcVeci_eq
+#undef wcVecf_cvtt
+#undef wcVeci_cvt
+#undef wcVeci_as_f
+#undef wcVecf_as_i
@@ -0,0 +1,126 @@
+/* Statistics counters, see the statistics section of woven_cloth.h.
+ * This file is included by woven_cloth.cpp. Each thread counts into its own
+ * wcStats, which is allocated the first time the thread counts something
+ * and pushed onto a list of all counters with a compare and swap. The
+ * counters are never freed, so the counts of threads that have exited are
+ * kept. Since only the owning thread writes to its counters, no other
+ * synchronization is needed. wcResetStats does not write to the counters of
+ * other threads, it remembers the current totals, which wcGetStats then
+ * subtracts.
+ */
+
+#ifdef WC_STATS
+
+#if defined(WC_NO_THREADS)
+#define WC_THREAD_LOCAL
+#elif defined(_MSC_VER)
+#define WC_THREAD_LOCAL __declspec(thread)
+#else
+#define WC_THREAD_LOCAL __thread
+#endif
+
+typedef struct wcStatsBlock
+{
+    wcStats stats;
+    struct wcStatsBlock *next;
+} wcStatsBlock;
+
+static wcStatsBlock * volatile wc_stats_blocks = 0;
+static WC_THREAD_LOCAL wcStatsBlock *wc_thread_stats_block = 0;
+static wcStats wc_stats_reset_totals;
+
+static wcStats *wcRegisterThreadStats()
+{
+    wcStatsBlock *block = (wcStatsBlock*)calloc(1, sizeof(wcStatsBlock));
+#if defined(WC_NO_THREADS)
+    block->next = wc_stats_blocks;
+    wc_stats_blocks = block;
+#else
+    wcStatsBlock *head;
+    do{
+        head = wc_stats_blocks;
+        block->next = head;
+    }
+#ifdef _WIN32
+    while(InterlockedCompareExchangePointer((PVOID volatile*)&wc_stats_blocks,
+            block, head) != head);
+#else
+    while(!__sync_bool_compare_and_swap(&wc_stats_blocks, head, block));
+#endif
+#endif
+    wc_thread_stats_block = block;
+    return &block->stats;
+}
+
+static wcStats *wcThreadStats()
+{
+    wcStatsBlock *block = wc_thread_stats_block;
+    return block ? &block->stats : wcRegisterThreadStats();
+}
+
+#define WC_STATS_ADD(counter, n) (wcThreadStats()->counter += (n))
+
+void wcStatsCountTexmapCall(void)
+{
+    WC_STATS_ADD(texmap_calls, 1);
+}
+
+static void wcStatsCountSegmentWalk(uint32_t length)
+{
+    uint32_t bucket = 0;
+    while(length > 1 && bucket < WC_STATS_WALK_BUCKETS - 1){
+        length >>= 1;
+        bucket++;
+    }
+    wcStats *stats = wcThreadStats();
+    stats->segment_walks++;
+    stats->segment_walk_length[bucket]++;
+}
+
+//Sums the counters of all threads
+static void wcSumStats(wcStats *total)
+{
+    memset(total, 0, sizeof(wcStats));
+    uint64_t *sum = (uint64_t*)total;
+    const wcStatsBlock *block;
+    for(block = wc_stats_blocks; block; block = block->next){
+        const volatile uint64_t *counters =
+            (const volatile uint64_t*)&block->stats;
+        size_t i;
+        for(i = 0; i < sizeof(wcStats)/sizeof(uint64_t); i++){
+            sum[i] += counters[i];
+        }
+    }
+}
+
+void wcGetStats(wcStats *stats)
+{
+    wcSumStats(stats);
+    uint64_t *counters = (uint64_t*)stats;
+    const uint64_t *reset = (const uint64_t*)&wc_stats_reset_totals;
+    size_t i;
+    for(i = 0; i < sizeof(wcStats)/sizeof(uint64_t); i++){
+        counters[i] -= reset[i];
+    }
+}
+
+void wcResetStats(void)
+{
+    wcSumStats(&wc_stats_reset_totals);
+}
+
+#else
+
+#define WC_STATS_ADD(counter, n)
+#define wcStatsCountSegmentWalk(length)
+
+void wcGetStats(wcStats *stats)
+{
+    memset(stats, 0, sizeof(wcStats));
+}
+
+void wcResetStats(void)
+{
+}
+
+#endif
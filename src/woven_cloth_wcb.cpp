@@ -0,0 +1,705 @@
+/* Compiled patterns, see the compiled patterns section of woven_cloth.h.
+ * This file is included by woven_cloth.cpp.
+ * A .wcb file starts with a header of little endian uint32_t and float
+ * values, followed by a table with the offset and size, as uint64_t, of each
+ * of the sections listed in WC_WCB_SECTIONS. Every section starts on a
+ * multiple of WC_WCB_ALIGNMENT bytes, and holds its array in the same layout
+ * as in memory on a little endian machine, so that the pattern and the
+ * segment lookup can be used where they lie in the file. Sections which are
+ * not used have offset and size 0.
+ * The yarn types are stored one parameter after another, in the order of
+ * WC_YARN_PARAMETERS, each followed by its _enabled byte.
+ * The normalization key holds the inputs of the stored specular
+ * normalization, see wcNormalizationKey. It is empty if the normalization
+ * could not be cached when the pattern was compiled.
+ * The sizes and offsets are checked when loading. So are the values in the
+ * pattern and in the stored segment lookup which are used as indices while
+ * shading, see wcbCheckContents.
+ */
+
+#ifndef WC_NO_FILES
+
+#define WC_WCB_MAGIC 0x00424357 // "WCB"
+#define WC_WCB_ALIGNMENT 64
+#define WC_WCB_SEGMENT_ENTRY_BYTES 20
+#define WC_WCB_SECTIONS\
+    WC_WCB_SECTION(yarn_types)\
+    WC_WCB_SECTION(normalization_key)\
+    WC_WCB_SECTION(pattern)\
+    WC_WCB_SECTION(segment_table)\
+    WC_WCB_SECTION(row_offsets)\
+    WC_WCB_SECTION(row_transitions)\
+    WC_WCB_SECTION(column_offsets)\
+    WC_WCB_SECTION(column_transitions)\
+    WC_WCB_SECTION(bitplane_rows)\
+    WC_WCB_SECTION(bitplane_columns)\
+    WC_WCB_SECTION(bitplane_yarn_types)
+
+enum
+{
+#define WC_WCB_SECTION(name) wc_wcb_##name,
+WC_WCB_SECTIONS
+#undef WC_WCB_SECTION
+    WC_WCB_NUM_SECTIONS
+};
+
+// Byte offsets of the header values
+enum
+{
+    WC_WCB_MAGIC_OFFSET = 0,
+    WC_WCB_VERSION_OFFSET = 4,
+    WC_WCB_HEADER_SIZE_OFFSET = 8,
+    WC_WCB_NUM_SECTIONS_OFFSET = 12,
+    WC_WCB_WIDTH_OFFSET = 16,
+    WC_WCB_HEIGHT_OFFSET = 20,
+    WC_WCB_NUM_YARN_TYPES_OFFSET = 24,
+    WC_WCB_YARN_TYPE_BYTES_OFFSET = 28,
+    WC_WCB_SEGMENT_LOOKUP_OFFSET = 32, // Kind of the stored lookup
+    WC_WCB_REALWIDTH_OFFSET = 36,
+    WC_WCB_REALHEIGHT_OFFSET = 40,
+    WC_WCB_NORMALIZATION_OFFSET = 44,
+    WC_WCB_NORMALIZATION_ERROR_OFFSET = 48,
+    WC_WCB_LOCATIONS_OFFSET = 52, // See wcReadNormalizationCacheHeader
+    WC_WCB_DIRECTIONS_OFFSET = 56,
+    WC_WCB_SECTION_TABLE_OFFSET = 64,
+    WC_WCB_HEADER_SIZE = WC_WCB_SECTION_TABLE_OFFSET
+        + WC_WCB_NUM_SECTIONS*16
+};
+
+static void wcbPutU32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)v; p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16); p[3] = (uint8_t)(v >> 24);
+}
+
+static void wcbPutU64(uint8_t *p, uint64_t v)
+{
+    wcbPutU32(p, (uint32_t)v);
+    wcbPutU32(p + 4, (uint32_t)(v >> 32));
+}
+
+static void wcbPutFloat(uint8_t *p, float f)
+{
+    uint32_t v;
+    memcpy(&v, &f, sizeof(float));
+    wcbPutU32(p, v);
+}
+
+static uint32_t wcbGetU32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16
+        | (uint32_t)p[3] << 24;
+}
+
+static uint64_t wcbGetU64(const uint8_t *p)
+{
+    return (uint64_t)wcbGetU32(p) | (uint64_t)wcbGetU32(p + 4) << 32;
+}
+
+static float wcbGetFloat(const uint8_t *p)
+{
+    uint32_t v = wcbGetU32(p);
+    float f;
+    memcpy(&f, &v, sizeof(float));
+    return f;
+}
+
+// True if the arrays in the file can be used without converting them
+static int wcbNativeLayout()
+{
+    const uint32_t one = 1;
+    return *(const uint8_t*)&one == 1
+        && sizeof(wcSegmentTableEntry) == WC_WCB_SEGMENT_ENTRY_BYTES
+        && offsetof(wcSegmentTableEntry, border_yarn_type_left) == 16;
+}
+
+static uint32_t wcbYarnTypeBytes()
+{
+    uint32_t n = 0;
+#define WC_FLOAT_PARAM(name) n += sizeof(float) + 1;
+#define WC_INT_PARAM(name) n += 2;
+#define WC_COLOR_PARAM(name) n += 3*sizeof(float) + 1;
+WC_YARN_PARAMETERS
+#undef WC_FLOAT_PARAM
+#undef WC_INT_PARAM
+#undef WC_COLOR_PARAM
+    return n;
+}
+
+static void wcbPutYarnType(uint8_t *p, const wcYarnType *yarn_type)
+{
+#define WC_FLOAT_PARAM(name) wcbPutFloat(p, yarn_type->name); p += 4;\
+    *p++ = yarn_type->name##_enabled;
+#define WC_INT_PARAM(name) *p++ = yarn_type->name;\
+    *p++ = yarn_type->name##_enabled;
+#define WC_COLOR_PARAM(name) wcbPutFloat(p, yarn_type->name.r);\
+    wcbPutFloat(p + 4, yarn_type->name.g);\
+    wcbPutFloat(p + 8, yarn_type->name.b); p += 12;\
+    *p++ = yarn_type->name##_enabled;
+WC_YARN_PARAMETERS
+#undef WC_FLOAT_PARAM
+#undef WC_INT_PARAM
+#undef WC_COLOR_PARAM
+}
+
+static void wcbGetYarnType(const uint8_t *p, wcYarnType *yarn_type)
+{
+    memset(yarn_type, 0, sizeof(wcYarnType));
+#define WC_FLOAT_PARAM(name) yarn_type->name = wcbGetFloat(p); p += 4;\
+    yarn_type->name##_enabled = *p++;
+#define WC_INT_PARAM(name) yarn_type->name = *p++;\
+    yarn_type->name##_enabled = *p++;
+#define WC_COLOR_PARAM(name) yarn_type->name.r = wcbGetFloat(p);\
+    yarn_type->name.g = wcbGetFloat(p + 4);\
+    yarn_type->name.b = wcbGetFloat(p + 8); p += 12;\
+    yarn_type->name##_enabled = *p++;
+WC_YARN_PARAMETERS
+#undef WC_FLOAT_PARAM
+#undef WC_INT_PARAM
+#undef WC_COLOR_PARAM
+}
+
+static uint8_t wcbStoredSegmentLookup(const wcWeaveParameters *params)
+{
+    if(params->segment_table){
+        return WC_SEGMENT_LOOKUP_TABLE;
+    }
+    if(params->run_length_index){
+        return WC_SEGMENT_LOOKUP_RUN_LENGTH;
+    }
+    if(params->bitplane_index){
+        return WC_SEGMENT_LOOKUP_BITPLANE;
+    }
+    return WC_SEGMENT_LOOKUP_WALK;
+}
+
+size_t wcCompilePattern(const wcWeaveParameters *params, void *buffer,
+    size_t buffer_size)
+{
+    uint64_t sizes[WC_WCB_NUM_SECTIONS] = {0};
+    uint64_t offsets[WC_WCB_NUM_SECTIONS] = {0};
+    size_t w = params->pattern ? params->pattern_width : 0;
+    size_t h = params->pattern ? params->pattern_height : 0;
+    uint8_t lookup = params->pattern ? wcbStoredSegmentLookup(params)
+        : WC_SEGMENT_LOOKUP_WALK;
+    float *key = 0;
+    uint32_t i, n = 0;
+    if(!params->yarn_types || params->num_yarn_types == 0){
+        return 0;
+    }
+    if(params->pattern){
+        key = (float*)malloc(WC_NORMALIZATION_KEY_MAX*sizeof(float));
+        n = key ? wcNormalizationKey(params, key) : 0;
+    }
+
+    sizes[wc_wcb_yarn_types] = (uint64_t)params->num_yarn_types
+        * wcbYarnTypeBytes();
+    sizes[wc_wcb_normalization_key] = (uint64_t)n*sizeof(float);
+    sizes[wc_wcb_pattern] = (uint64_t)w*h*sizeof(PatternEntry);
+    if(lookup == WC_SEGMENT_LOOKUP_TABLE){
+        sizes[wc_wcb_segment_table] = (uint64_t)w*h
+            * WC_WCB_SEGMENT_ENTRY_BYTES;
+    }
+    if(lookup == WC_SEGMENT_LOOKUP_RUN_LENGTH){
+        const wcRunLengthIndex *index = params->run_length_index;
+        sizes[wc_wcb_row_offsets] = (h + 1)*sizeof(uint32_t);
+        sizes[wc_wcb_row_transitions] = (index->row_offsets[h] + 1)
+            * sizeof(uint32_t);
+        sizes[wc_wcb_column_offsets] = (w + 1)*sizeof(uint32_t);
+        sizes[wc_wcb_column_transitions] = (index->column_offsets[w] + 1)
+            * sizeof(uint32_t);
+    }
+    if(lookup == WC_SEGMENT_LOOKUP_BITPLANE){
+        const wcBitplaneIndex *index = params->bitplane_index;
+        sizes[wc_wcb_bitplane_rows] = (uint64_t)index->words_per_row*h
+            * sizeof(uint64_t);
+        sizes[wc_wcb_bitplane_columns] = (uint64_t)index->words_per_column*w
+            * sizeof(uint64_t);
+        sizes[wc_wcb_bitplane_yarn_types] = (uint64_t)w*h;
+    }
+    uint64_t total = WC_WCB_HEADER_SIZE;
+    for(i = 0; i < WC_WCB_NUM_SECTIONS; i++){
+        if(sizes[i] > 0){
+            total = (total + WC_WCB_ALIGNMENT - 1)
+                / WC_WCB_ALIGNMENT*WC_WCB_ALIGNMENT;
+            offsets[i] = total;
+            total += sizes[i];
+        }
+    }
+    if(!buffer || buffer_size < total){
+        free(key);
+        return (size_t)total;
+    }
+
+    uint8_t *file = (uint8_t*)buffer;
+    memset(file, 0, (size_t)total);
+    wcbPutU32(file + WC_WCB_MAGIC_OFFSET, WC_WCB_MAGIC);
+    wcbPutU32(file + WC_WCB_VERSION_OFFSET, WC_WCB_VERSION);
+    wcbPutU32(file + WC_WCB_HEADER_SIZE_OFFSET, WC_WCB_HEADER_SIZE);
+    wcbPutU32(file + WC_WCB_NUM_SECTIONS_OFFSET, WC_WCB_NUM_SECTIONS);
+    wcbPutU32(file + WC_WCB_WIDTH_OFFSET, (uint32_t)w);
+    wcbPutU32(file + WC_WCB_HEIGHT_OFFSET, (uint32_t)h);
+    wcbPutU32(file + WC_WCB_NUM_YARN_TYPES_OFFSET, params->num_yarn_types);
+    wcbPutU32(file + WC_WCB_YARN_TYPE_BYTES_OFFSET, wcbYarnTypeBytes());
+    wcbPutU32(file + WC_WCB_SEGMENT_LOOKUP_OFFSET, lookup);
+    wcbPutFloat(file + WC_WCB_REALWIDTH_OFFSET, params->pattern_realwidth);
+    wcbPutFloat(file + WC_WCB_REALHEIGHT_OFFSET, params->pattern_realheight);
+    wcbPutFloat(file + WC_WCB_NORMALIZATION_OFFSET,
+        params->specular_normalization);
+    wcbPutFloat(file + WC_WCB_NORMALIZATION_ERROR_OFFSET,
+        params->specular_normalization_error);
+    wcbPutU32(file + WC_WCB_LOCATIONS_OFFSET, WC_NORMALIZATION_LOCATIONS);
+    wcbPutU32(file + WC_WCB_DIRECTIONS_OFFSET, WC_NORMALIZATION_DIRECTIONS);
+    for(i = 0; i < WC_WCB_NUM_SECTIONS; i++){
+        wcbPutU64(file + WC_WCB_SECTION_TABLE_OFFSET + i*16, offsets[i]);
+        wcbPutU64(file + WC_WCB_SECTION_TABLE_OFFSET + i*16 + 8, sizes[i]);
+    }
+
+    size_t j;
+    uint8_t *p = file + offsets[wc_wcb_yarn_types];
+    for(i = 0; i < params->num_yarn_types; i++){
+        wcbPutYarnType(p, params->yarn_types + i);
+        p += wcbYarnTypeBytes();
+    }
+    p = file + offsets[wc_wcb_normalization_key];
+    for(i = 0; i < n; i++){
+        wcbPutFloat(p + i*sizeof(float), key[i]);
+    }
+    p = file + offsets[wc_wcb_pattern];
+    for(j = 0; j < w*h; j++){
+        p[2*j] = params->pattern[j].warp_above;
+        p[2*j + 1] = params->pattern[j].yarn_type;
+    }
+    if(lookup == WC_SEGMENT_LOOKUP_TABLE){
+        p = file + offsets[wc_wcb_segment_table];
+        for(j = 0; j < w*h; j++){
+            const wcSegmentTableEntry *entry = params->segment_table + j;
+            wcbPutU32(p, entry->steps_x_left);
+            wcbPutU32(p + 4, entry->steps_x_right);
+            wcbPutU32(p + 8, entry->steps_y_left);
+            wcbPutU32(p + 12, entry->steps_y_right);
+            p[16] = entry->border_yarn_type_left;
+            p[17] = entry->border_yarn_type_right;
+            p += WC_WCB_SEGMENT_ENTRY_BYTES;
+        }
+    }
+    if(lookup == WC_SEGMENT_LOOKUP_RUN_LENGTH){
+        const wcRunLengthIndex *index = params->run_length_index;
+        const uint32_t *arrays[4] = {index->row_offsets,
+            index->row_transitions, index->column_offsets,
+            index->column_transitions};
+        for(i = 0; i < 4; i++){
+            uint32_t section = wc_wcb_row_offsets + i;
+            p = file + offsets[section];
+            for(j = 0; j < sizes[section]/sizeof(uint32_t); j++){
+                wcbPutU32(p + j*sizeof(uint32_t), arrays[i][j]);
+            }
+        }
+    }
+    if(lookup == WC_SEGMENT_LOOKUP_BITPLANE){
+        const wcBitplaneIndex *index = params->bitplane_index;
+        p = file + offsets[wc_wcb_bitplane_rows];
+        for(j = 0; j < sizes[wc_wcb_bitplane_rows]/sizeof(uint64_t); j++){
+            wcbPutU64(p + j*sizeof(uint64_t), index->rows[j]);
+        }
+        p = file + offsets[wc_wcb_bitplane_columns];
+        for(j = 0; j < sizes[wc_wcb_bitplane_columns]/sizeof(uint64_t); j++){
+            wcbPutU64(p + j*sizeof(uint64_t), index->columns[j]);
+        }
+        memcpy(file + offsets[wc_wcb_bitplane_yarn_types], index->yarn_types,
+            w*h);
+    }
+    free(key);
+    return (size_t)total;
+}
+
+int wcWriteCompiledPattern(const wcWeaveParameters *params,
+    const char *filename)
+{
+    size_t size = wcCompilePattern(params, 0, 0);
+    void *buffer = size ? malloc(size) : 0;
+    int ret = 0;
+    if(buffer){
+        FILE *f = fopen(filename, "wb");
+        wcCompilePattern(params, buffer, size);
+        if(f){
+            ret = fwrite(buffer, 1, size, f) == size;
+            ret = fclose(f) == 0 && ret;
+        }
+        free(buffer);
+    }
+    return ret;
+}
+
+// Returns a pointer to section i, or 0 if it is empty. Sets *size to the
+// size of the section.
+static const uint8_t *wcbSection(const uint8_t *file, uint32_t i,
+    uint64_t *size)
+{
+    uint64_t offset = wcbGetU64(file + WC_WCB_SECTION_TABLE_OFFSET + i*16);
+    *size = wcbGetU64(file + WC_WCB_SECTION_TABLE_OFFSET + i*16 + 8);
+    return *size > 0 ? file + offset : 0;
+}
+
+// Checks that the header is valid and that every section lies in the file
+static int wcbCheckFile(const uint8_t *file, size_t size)
+{
+    uint32_t i;
+    if(size < WC_WCB_HEADER_SIZE
+        || wcbGetU32(file + WC_WCB_MAGIC_OFFSET) != WC_WCB_MAGIC
+        || wcbGetU32(file + WC_WCB_VERSION_OFFSET) != WC_WCB_VERSION
+        || wcbGetU32(file + WC_WCB_HEADER_SIZE_OFFSET) != WC_WCB_HEADER_SIZE
+        || wcbGetU32(file + WC_WCB_NUM_SECTIONS_OFFSET) != WC_WCB_NUM_SECTIONS
+        || wcbGetU32(file + WC_WCB_YARN_TYPE_BYTES_OFFSET)
+            != wcbYarnTypeBytes()){
+        return 0;
+    }
+    for(i = 0; i < WC_WCB_NUM_SECTIONS; i++){
+        uint64_t offset = wcbGetU64(file + WC_WCB_SECTION_TABLE_OFFSET
+            + i*16);
+        uint64_t section_size = wcbGetU64(file + WC_WCB_SECTION_TABLE_OFFSET
+            + i*16 + 8);
+        if(section_size > 0 && (offset % WC_WCB_ALIGNMENT != 0
+                || offset < WC_WCB_HEADER_SIZE || offset > size
+                || section_size > size - offset)){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Checks that the offsets of a run length index grow and end at the number
+// of transitions
+static int wcbCheckOffsets(const uint32_t *offsets, uint32_t num_lines,
+    uint64_t offsets_size, uint64_t transitions_size)
+{
+    uint32_t i;
+    if(!offsets || offsets_size != (uint64_t)(num_lines + 1)*sizeof(uint32_t)
+        || offsets[0] != 0){
+        return 0;
+    }
+    for(i = 0; i < num_lines; i++){
+        if(offsets[i + 1] < offsets[i]){
+            return 0;
+        }
+    }
+    return transitions_size ==
+        ((uint64_t)offsets[num_lines] + 1)*sizeof(uint32_t);
+}
+
+// Checks that the offsets of a run length index grow, that each line has
+// increasing transitions inside the line, and that the transitions fill
+// their section
+static int wcbCheckTransitions(const uint8_t *file, uint32_t offsets_section,
+    uint32_t num_lines, uint32_t n)
+{
+    uint64_t offsets_size, transitions_size;
+    const uint8_t *offsets = wcbSection(file, offsets_section, &offsets_size);
+    const uint8_t *transitions = wcbSection(file, offsets_section + 1,
+        &transitions_size);
+    uint32_t line, i;
+    if(offsets_size != (uint64_t)(num_lines + 1)*sizeof(uint32_t)
+            || wcbGetU32(offsets) != 0){
+        return 0;
+    }
+    for(line = 0; line < num_lines; line++){
+        uint32_t first = wcbGetU32(offsets + line*sizeof(uint32_t));
+        uint32_t last = wcbGetU32(offsets + (line + 1)*sizeof(uint32_t));
+        if(last < first
+                || ((uint64_t)last + 1)*sizeof(uint32_t) > transitions_size){
+            return 0;
+        }
+        for(i = first; i < last; i++){
+            uint32_t t = wcbGetU32(transitions + i*sizeof(uint32_t));
+            if(t >= n || (i > first && t <= wcbGetU32(transitions
+                    + (i - 1)*sizeof(uint32_t)))){
+                return 0;
+            }
+        }
+    }
+    return transitions_size == ((uint64_t)wcbGetU32(offsets
+        + num_lines*sizeof(uint32_t)) + 1)*sizeof(uint32_t);
+}
+
+// Checks the values in the pattern and in the stored segment lookup which
+// are used as indices while shading: yarn types, steps along the yarns and
+// run length transitions. Must be called after wcbCheckFile.
+static int wcbCheckContents(const uint8_t *file)
+{
+    uint32_t w = wcbGetU32(file + WC_WCB_WIDTH_OFFSET);
+    uint32_t h = wcbGetU32(file + WC_WCB_HEIGHT_OFFSET);
+    uint32_t num_yarn_types = wcbGetU32(file + WC_WCB_NUM_YARN_TYPES_OFFSET);
+    uint64_t size, j;
+    const uint8_t *p = wcbSection(file, wc_wcb_pattern, &size);
+    for(j = 0; j < size/2; j++){
+        if(p[2*j] > 1 || p[2*j + 1] >= num_yarn_types){
+            return 0;
+        }
+    }
+    switch(wcbGetU32(file + WC_WCB_SEGMENT_LOOKUP_OFFSET)){
+        case WC_SEGMENT_LOOKUP_TABLE:
+            p = wcbSection(file, wc_wcb_segment_table, &size);
+            if(size != (uint64_t)w*h*WC_WCB_SEGMENT_ENTRY_BYTES){
+                return 0;
+            }
+            for(j = 0; j < (uint64_t)w*h; j++){
+                if(wcbGetU32(p) > w || wcbGetU32(p + 4) > w
+                        || wcbGetU32(p + 8) > h || wcbGetU32(p + 12) > h
+                        || p[16] >= num_yarn_types
+                        || p[17] >= num_yarn_types){
+                    return 0;
+                }
+                p += WC_WCB_SEGMENT_ENTRY_BYTES;
+            }
+            break;
+        case WC_SEGMENT_LOOKUP_RUN_LENGTH:
+            return wcbCheckTransitions(file, wc_wcb_row_offsets, h, w)
+                && wcbCheckTransitions(file, wc_wcb_column_offsets, w, h);
+        case WC_SEGMENT_LOOKUP_BITPLANE:
+            p = wcbSection(file, wc_wcb_bitplane_yarn_types, &size);
+            if(size != (uint64_t)w*h){
+                return 0;
+            }
+            for(j = 0; j < size; j++){
+                if(p[j] >= num_yarn_types){
+                    return 0;
+                }
+            }
+            break;
+    }
+    return 1;
+}
+
+// Points the segment lookup of params into the file. Returns 0 if the file
+// has no lookup, or if it can not be used on this machine.
+static int wcbReadSegmentLookup(wcWeaveParameters *params,
+    const uint8_t *file)
+{
+    uint32_t w = params->pattern_width, h = params->pattern_height;
+    uint64_t size, size2;
+    if(!wcbNativeLayout()){
+        return 0;
+    }
+    switch(wcbGetU32(file + WC_WCB_SEGMENT_LOOKUP_OFFSET)){
+        case WC_SEGMENT_LOOKUP_TABLE:
+        {
+            const uint8_t *table = wcbSection(file, wc_wcb_segment_table,
+                &size);
+            if(!table || size != (uint64_t)w*h*WC_WCB_SEGMENT_ENTRY_BYTES){
+                return 0;
+            }
+            params->segment_table = (wcSegmentTableEntry*)table;
+            return 1;
+        }
+        case WC_SEGMENT_LOOKUP_RUN_LENGTH:
+        {
+            wcRunLengthIndex index;
+            index.row_offsets = (uint32_t*)wcbSection(file,
+                wc_wcb_row_offsets, &size);
+            index.row_transitions = (uint32_t*)wcbSection(file,
+                wc_wcb_row_transitions, &size2);
+            if(!wcbCheckOffsets(index.row_offsets, h, size, size2)){
+                return 0;
+            }
+            index.column_offsets = (uint32_t*)wcbSection(file,
+                wc_wcb_column_offsets, &size);
+            index.column_transitions = (uint32_t*)wcbSection(file,
+                wc_wcb_column_transitions, &size2);
+            if(!wcbCheckOffsets(index.column_offsets, w, size, size2)){
+                return 0;
+            }
+            params->run_length_index =
+                (wcRunLengthIndex*)malloc(sizeof(wcRunLengthIndex));
+            if(!params->run_length_index){
+                return 0;
+            }
+            *params->run_length_index = index;
+            return 1;
+        }
+        case WC_SEGMENT_LOOKUP_BITPLANE:
+        {
+            wcBitplaneIndex index;
+            index.words_per_row = (w + 63)/64;
+            index.words_per_column = (h + 63)/64;
+            index.rows = (uint64_t*)wcbSection(file, wc_wcb_bitplane_rows,
+                &size);
+            if(!index.rows || size != (uint64_t)index.words_per_row*h
+                    *sizeof(uint64_t)){
+                return 0;
+            }
+            index.columns = (uint64_t*)wcbSection(file,
+                wc_wcb_bitplane_columns, &size);
+            if(!index.columns || size != (uint64_t)index.words_per_column*w
+                    *sizeof(uint64_t)){
+                return 0;
+            }
+            index.yarn_types = (uint8_t*)wcbSection(file,
+                wc_wcb_bitplane_yarn_types, &size);
+            if(!index.yarn_types || size != (uint64_t)w*h){
+                return 0;
+            }
+            params->bitplane_index =
+                (wcBitplaneIndex*)malloc(sizeof(wcBitplaneIndex));
+            if(!params->bitplane_index){
+                return 0;
+            }
+            *params->bitplane_index = index;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Used by wcFinalizeWeaveParameters in place of wcBuildSegmentLookup. Points
+// the segment lookup into the compiled pattern, if the pattern is the one
+// from the file and the stored lookup is of the kind asked for.
+static int wcUseCompiledSegmentLookup(wcWeaveParameters *params)
+{
+    const uint8_t *file = (const uint8_t*)params->compiled_pattern;
+    uint64_t size;
+    if(!file || !params->pattern || (const uint8_t*)params->pattern
+            != wcbSection(file, wc_wcb_pattern, &size)){
+        return 0;
+    }
+    uint32_t stored = wcbGetU32(file + WC_WCB_SEGMENT_LOOKUP_OFFSET);
+    if(params->segment_lookup != stored && (params->segment_lookup
+            == WC_SEGMENT_LOOKUP_WALK || params->segment_lookup
+            == WC_SEGMENT_LOOKUP_TABLE || params->segment_lookup
+            == WC_SEGMENT_LOOKUP_RUN_LENGTH || params->segment_lookup
+            == WC_SEGMENT_LOOKUP_BITPLANE)){
+        return 0;
+    }
+    return wcbReadSegmentLookup(params, file);
+}
+
+// Used by wcFinalizeWeaveParameters before sampling the specular
+// normalization. Sets it from the compiled pattern if it was computed from
+// the same key.
+static int wcUseCompiledNormalization(wcWeaveParameters *params)
+{
+    const uint8_t *file = (const uint8_t*)params->compiled_pattern;
+    uint64_t size;
+    uint32_t i, n;
+    if(!file || wcbGetU32(file + WC_WCB_LOCATIONS_OFFSET)
+            != WC_NORMALIZATION_LOCATIONS
+        || wcbGetU32(file + WC_WCB_DIRECTIONS_OFFSET)
+            != WC_NORMALIZATION_DIRECTIONS){
+        return 0;
+    }
+    const uint8_t *stored_key = wcbSection(file, wc_wcb_normalization_key,
+        &size);
+    float *key = (float*)malloc(WC_NORMALIZATION_KEY_MAX*sizeof(float));
+    n = key ? wcNormalizationKey(params, key) : 0;
+    int ok = n > 0 && size == (uint64_t)n*sizeof(float);
+    for(i = 0; ok && i < n; i++){
+        ok = wcbGetFloat(stored_key + i*sizeof(float)) == key[i];
+    }
+    free(key);
+    if(ok){
+        params->specular_normalization =
+            wcbGetFloat(file + WC_WCB_NORMALIZATION_OFFSET);
+        params->specular_normalization_error =
+            wcbGetFloat(file + WC_WCB_NORMALIZATION_ERROR_OFFSET);
+    }
+    return ok;
+}
+
+static void wcReleaseCachedPattern(struct wcPatternCacheEntry *entry);
+
+static void wcFreeCompiledPattern(wcWeaveParameters *params)
+{
+    if(params->pattern_cache_entry){
+        wcReleaseCachedPattern(params->pattern_cache_entry);
+    } else if(params->compiled_pattern){
+        free((void*)params->compiled_pattern);
+    }
+    params->compiled_pattern = 0;
+    params->compiled_pattern_size = 0;
+    params->pattern_cache_entry = 0;
+}
+
+// Sets the pattern and the yarn types from the file, and finalizes the
+// parameters. The file is kept by params, and released by
+// wcFreeWeavePattern. It is either an allocated copy, when entry is 0, or
+// the compiled pattern of a pattern cache entry, of which params then hold
+// a reference. Returns 0 if the file is not valid, in which case it is
+// released and params get an empty pattern, as for an invalid WIF file.
+// The contents of the patterns in the cache are checked when they are added.
+static int wcWeavePatternFromCompiled(wcWeaveParameters *params,
+    const uint8_t *file, size_t size, struct wcPatternCacheEntry *entry)
+{
+    uint64_t yarn_types_size, pattern_size;
+    int ok = file && wcbCheckFile(file, size)
+        && (entry || wcbCheckContents(file));
+    params->pattern = 0;
+    params->yarn_types = 0;
+    params->segment_table = 0;
+    params->run_length_index = 0;
+    params->bitplane_index = 0;
+    params->resolved_yarn_types = 0;
+    params->specular_table = 0;
+    params->compiled_pattern = file;
+    params->compiled_pattern_size = size;
+    params->pattern_cache_entry = entry;
+    if(ok){
+        uint32_t i;
+        uint32_t num_yarn_types =
+            wcbGetU32(file + WC_WCB_NUM_YARN_TYPES_OFFSET);
+        const uint8_t *yarn_types = wcbSection(file, wc_wcb_yarn_types,
+            &yarn_types_size);
+        params->pattern_width = wcbGetU32(file + WC_WCB_WIDTH_OFFSET);
+        params->pattern_height = wcbGetU32(file + WC_WCB_HEIGHT_OFFSET);
+        const uint8_t *pattern = wcbSection(file, wc_wcb_pattern,
+            &pattern_size);
+        ok = num_yarn_types > 0 && yarn_types_size ==
+            (uint64_t)num_yarn_types*wcbYarnTypeBytes()
+            && pattern_size == (uint64_t)params->pattern_width
+            *params->pattern_height*sizeof(PatternEntry)
+            && sizeof(PatternEntry) == 2;
+        if(ok){
+            params->yarn_types = (wcYarnType*)malloc(num_yarn_types
+                * sizeof(wcYarnType));
+            ok = params->yarn_types != 0;
+        }
+        if(ok){
+            for(i = 0; i < num_yarn_types; i++){
+                wcbGetYarnType(yarn_types + i*wcbYarnTypeBytes(),
+                    params->yarn_types + i);
+            }
+            params->num_yarn_types = num_yarn_types;
+            params->pattern = (PatternEntry*)pattern;
+            params->pattern_realwidth =
+                wcbGetFloat(file + WC_WCB_REALWIDTH_OFFSET);
+            params->pattern_realheight =
+                wcbGetFloat(file + WC_WCB_REALHEIGHT_OFFSET);
+            params->specular_normalization =
+                wcbGetFloat(file + WC_WCB_NORMALIZATION_OFFSET);
+        }
+    }
+    if(!ok){
+        wcFreeCompiledPattern(params);
+        wif_get_pattern(params, 0, &params->pattern_width,
+            &params->pattern_height, &params->pattern_realwidth,
+            &params->pattern_realheight);
+    }
+    params->inv_pattern_realwidth = params->inv_pattern_realheight = 0.f;
+    wcFinalizeWeaveParameters(params);
+    return ok;
+}
+
+int wcWeavePatternFromWCBData(wcWeaveParameters *params, const void *data,
+    size_t size)
+{
+    uint8_t *copy = (uint8_t*)malloc(size > 0 ? size : 1);
+    if(copy){
+        memcpy(copy, data, size);
+    }
+    return wcWeavePatternFromCompiled(params, copy, size, 0);
+}
+
+#else
+
+#define wcUseCompiledSegmentLookup(params) 0
+#define wcFreeCompiledPattern(params)
+
+#endif
@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#include "../../src/woven_cloth.h"
+
+/* Accuracy and speed of wcWeaveParameters.fast_math.
+ * Each of the fast math functions is compared with libm over the range
+ * where the shading functions use it, and wcEvalSpecular is compared with
+ * and without fast_math over a grid of yarn parameters, with directions
+ * both uniform and sampled in the highlight. The errors are given in ulp
+ * and relative to the libm result. Last, the time per call is measured.
+ */
+
+float wcFastAtan2(float y, float x);
+float wcFastRsqrt(float x);
+
+float wc_eval_texmap_mono(void *texmap, void *context) { return 1.f; }
+wcColor wc_eval_texmap_color(void *texmap, void *context)
+{
+    wcColor ret = {1.f, 1.f, 1.f};
+    return ret;
+}
+
+static double seconds()
+{
+    return (double)clock()/(double)CLOCKS_PER_SEC;
+}
+
+static uint32_t random_state = 1;
+static float random_float()
+{
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return (float)(random_state >> 8)*(1.f/16777216.f);
+}
+
+//Number of floats between a and b
+static double ulp_distance(float a, float b)
+{
+    if (a == b) {
+        return 0.0;
+    }
+    if (a != a || b != b) {
+        return 4294967296.0;
+    }
+    int32_t ia, ib;
+    memcpy(&ia, &a, sizeof(float));
+    memcpy(&ib, &b, sizeof(float));
+    //Order the negative floats below the positive ones
+    int64_t oa = ia < 0 ? (int64_t)INT32_MIN - ia : ia;
+    int64_t ob = ib < 0 ? (int64_t)INT32_MIN - ib : ib;
+    return (double)(oa > ob ? oa - ob : ob - oa);
+}
+
+typedef struct
+{
+    double max_ulp, max_relative, sum_relative;
+    uint32_t count;
+} Error;
+
+static void add_error(Error *error, float fast, float reference)
+{
+    double ulp = ulp_distance(fast, reference);
+    double relative = reference == 0.f ? fabs(fast)
+        : fabs(((double)fast - reference)/reference);
+    error->max_ulp = ulp > error->max_ulp ? ulp : error->max_ulp;
+    error->max_relative = relative > error->max_relative ? relative
+        : error->max_relative;
+    error->sum_relative += relative;
+    error->count++;
+}
+
+static void print_error(const char *name, Error error)
+{
+    printf("%-32s max %10.0f ulp, max relative %.2e, mean relative %.2e\n",
+        name, error.max_ulp, error.max_relative,
+        error.sum_relative/(error.count > 0 ? error.count : 1));
+}
+
+static void sweep_functions()
+{
+    const int n = 1 << 20;
+    Error atan2_error = {0}, rsqrt_error = {0};
+    for (int i = 0; i <= n; i++) {
+        float t = (float)i/(float)n;
+        float angle = 2.f*M_PI*t;
+        float r = 0.01f + random_float();
+        add_error(&atan2_error, wcFastAtan2(r*sinf(angle), r*cosf(angle)),
+            atan2f(r*sinf(angle), r*cosf(angle)));
+        //Squared magnitudes of the half vectors
+        float x = 1e-3f*powf(1e6f, t);
+        add_error(&rsqrt_error, wcFastRsqrt(x), 1.f/sqrtf(x));
+    }
+    print_error("atan2", atan2_error);
+    print_error("rsqrt", rsqrt_error);
+}
+
+//A plain weave with one yarn type
+static void make_pattern(wcWeaveParameters *params)
+{
+    wcInitWeaveParameters(params);
+    params->pattern_width = params->pattern_height = 2;
+    params->uscale = params->vscale = 1.f;
+    params->normalization_tolerance = WC_NORMALIZATION_PREVIEW_TOLERANCE;
+    params->num_yarn_types = 1;
+    params->yarn_types = (wcYarnType*)calloc(1, sizeof(wcYarnType));
+    params->yarn_types[0] = wc_default_yarn_type;
+    params->pattern = (PatternEntry*)calloc(4, sizeof(PatternEntry));
+    for (int i = 0; i < 4; i++) {
+        params->pattern[i].warp_above = i == 1 || i == 2;
+    }
+}
+
+static void random_point(wcIntersectionData *intersection_data)
+{
+    memset(intersection_data, 0, sizeof(wcIntersectionData));
+    intersection_data->uv_x = random_float();
+    intersection_data->uv_y = random_float();
+    float z = 0.05f + 0.95f*random_float();
+    float phi = 2.f*M_PI*random_float();
+    intersection_data->wi_x = sqrtf(1.f - z*z)*cosf(phi);
+    intersection_data->wi_y = sqrtf(1.f - z*z)*sinf(phi);
+    intersection_data->wi_z = z;
+}
+
+static void sweep_specular()
+{
+    float umaxs[] = {0.1f, 0.5f, 1.2f};
+    float psis[] = {0.f, 0.2f, 0.5f, 1.f};
+    float alphas[] = {0.05f, 0.5f};
+    float betas[] = {0.5f, 4.f, 16.f, 64.f};
+    float delta_xs[] = {0.1f, 0.3f, 0.6f};
+    float noises[] = {0.f, 0.5f};
+    const int points = 2000;
+    Error filament_error = {0}, staple_error = {0};
+    uint32_t flips = 0, evaluations = 0;
+    wcWeaveParameters params;
+    make_pattern(&params);
+    wcYarnType *yarn_type = &params.yarn_types[0];
+    int a, b, c, d, e, f;
+    for (a = 0; a < 3; a++) for (b = 0; b < 4; b++) for (c = 0; c < 2; c++)
+    for (d = 0; d < 4; d++) for (e = 0; e < 3; e++) for (f = 0; f < 2; f++) {
+        yarn_type->umax = umaxs[a];
+        yarn_type->psi = psis[b];
+        yarn_type->alpha = alphas[c];
+        yarn_type->beta = betas[d];
+        yarn_type->delta_x = delta_xs[e];
+        yarn_type->specular_noise = noises[f];
+        yarn_type->specular_strength = 0.5f;
+        params.fast_math = 0;
+        wcFinalizeWeaveParameters(&params);
+        for (int i = 0; i < points; i++) {
+            wcIntersectionData intersection_data;
+            random_point(&intersection_data);
+            wcPatternData data = wcGetPatternData(intersection_data, &params);
+            //Every other direction is sampled in the highlight
+            if (!(i & 1) || wcSample(&intersection_data, data, &params,
+                    0.5f*random_float(), random_float()) == 0.f) {
+                float z = random_float();
+                float phi = 2.f*M_PI*random_float();
+                intersection_data.wo_x = sqrtf(1.f - z*z)*cosf(phi);
+                intersection_data.wo_y = sqrtf(1.f - z*z)*sinf(phi);
+                intersection_data.wo_z = z;
+            }
+            float reference = wcEvalSpecular(intersection_data, data,
+                &params);
+            params.fast_math = 1;
+            float fast = wcEvalSpecular(intersection_data, data, &params);
+            params.fast_math = 0;
+            evaluations++;
+            if ((reference == 0.f) != (fast == 0.f)) {
+                //On the other side of the edge of the highlight
+                flips++;
+            } else if (reference != 0.f) {
+                add_error(psis[b] == 0.f ? &filament_error : &staple_error,
+                    fast, reference);
+            }
+        }
+    }
+    print_error("wcEvalSpecular filament", filament_error);
+    print_error("wcEvalSpecular staple", staple_error);
+    printf("%u of %u evaluations on the other side of a highlight edge\n",
+        flips, evaluations);
+    wcFreeWeavePattern(&params);
+}
+
+static float libm_atan2(float x) { return atan2f(x - 0.5f, 0.3f); }
+static float fast_atan2(float x) { return wcFastAtan2(x - 0.5f, 0.3f); }
+static float libm_rsqrt(float x) { return 1.f/sqrtf(x + 1e-3f); }
+static float fast_rsqrt(float x) { return wcFastRsqrt(x + 1e-3f); }
+
+static double time_function(float (*function)(float), const float *x,
+    int n, float *sum)
+{
+    const int repeats = 64;
+    double start = seconds();
+    for (int r = 0; r < repeats; r++) {
+        for (int i = 0; i < n; i++) {
+            *sum += function(x[i]);
+        }
+    }
+    return (seconds() - start)*1e9/((double)n*repeats);
+}
+
+static void benchmark_functions()
+{
+    const int n = 1 << 16;
+    float *x = (float*)malloc(n*sizeof(float));
+    for (int i = 0; i < n; i++) {
+        x[i] = random_float();
+    }
+    struct
+    {
+        const char *name;
+        float (*libm)(float);
+        float (*fast)(float);
+    } functions[] = {
+        {"atan2", libm_atan2, fast_atan2},
+        {"rsqrt", libm_rsqrt, fast_rsqrt},
+    };
+    float sum = 0.f;
+    for (int i = 0; i < (int)(sizeof(functions)/sizeof(functions[0])); i++) {
+        double libm = time_function(functions[i].libm, x, n, &sum);
+        double fast = time_function(functions[i].fast, x, n, &sum);
+        printf("%-12s libm %5.1f ns, fast math %5.1f ns\n",
+            functions[i].name, libm, fast);
+    }
+    printf("(sum %g)\n", sum);
+    free(x);
+}
+
+static void benchmark_shading()
+{
+    const int n = 1 << 16, repeats = 32;
+    wcIntersectionData *points = (wcIntersectionData*)malloc(
+        n*sizeof(wcIntersectionData));
+    wcPatternData *data = (wcPatternData*)malloc(n*sizeof(wcPatternData));
+    wcWeaveParameters params;
+    make_pattern(&params);
+    params.yarn_types[0].specular_noise = 0.5f;
+    wcFinalizeWeaveParameters(&params);
+    for (int i = 0; i < n; i++) {
+        random_point(&points[i]);
+        data[i] = wcGetPatternData(points[i], &params);
+        if (wcSample(&points[i], data[i], &params, random_float(),
+                random_float()) == 0.f) {
+            points[i].wo_z = 1.f;
+        }
+    }
+    float sum = 0.f;
+    for (int fast_math = 0; fast_math < 2; fast_math++) {
+        params.fast_math = fast_math;
+        double start = seconds();
+        for (int r = 0; r < repeats; r++) {
+            for (int i = 0; i < n; i++) {
+                sum += wcEvalSpecular(points[i], data[i], &params);
+            }
+        }
+        double specular = seconds() - start;
+        start = seconds();
+        for (int r = 0; r < repeats; r++) {
+            for (int i = 0; i < n; i++) {
+                sum += wcShade(points[i], &params).r;
+            }
+        }
+        double shade = seconds() - start;
+        printf("%-9s wcEvalSpecular %6.1f ns, wcShade %6.1f ns\n",
+            fast_math ? "fast_math" : "libm",
+            specular*1e9/((double)n*repeats), shade*1e9/((double)n*repeats));
+    }
+    printf("(sum %g)\n", sum);
+    wcFreeWeavePattern(&params);
+    free(points);
+    free(data);
+}
+
+int main(int argc, char **argv)
+{
+    printf("Fast math functions compared with libm:\n");
+    sweep_functions();
+    printf("\nwcEvalSpecular with fast_math compared with libm:\n");
+    sweep_specular();
+    printf("\nTime per call:\n");
+    benchmark_functions();
+    benchmark_shading();
+    return 0;
+}
@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#include "../../src/woven_cloth.h"
+
+/* Times the wrapping of pattern coordinates and the segment lookup in
+ * wcGetYarnSegment, for a few pattern sizes. The wrapping is compared with
+ * the float fmod wrapping that was used before wcRepeatIndex was made
+ * integer only.
+ */
+
+int32_t wcRepeatIndex(const int32_t coord, const int32_t size);
+
+float wc_eval_texmap_mono(void *texmap, void *context) { return 1.f; }
+wcColor wc_eval_texmap_color(void *texmap, void *context)
+{
+    wcColor ret = {1.f, 1.f, 1.f};
+    return ret;
+}
+
+static double seconds()
+{
+    return (double)clock()/(double)CLOCKS_PER_SEC;
+}
+
+static int32_t repeat_index_fmod(const int32_t coord, const int32_t size) {
+    int32_t tmpcoord = (int32_t)fmod(coord, (float)size);
+    if (tmpcoord < 0.f) {
+        tmpcoord = size + tmpcoord;
+    }
+    return tmpcoord;
+}
+
+//A satin-like pattern with floats of length size-2
+static void make_pattern(wcWeaveParameters *params, uint32_t size)
+{
+    wcInitWeaveParameters(params);
+    params->pattern_width = params->pattern_height = size;
+    params->uscale = params->vscale = 1.f;
+    params->num_yarn_types = 3;
+    params->yarn_types = (wcYarnType*)calloc(3, sizeof(wcYarnType));
+    for (int i = 0; i < 3; i++) {
+        params->yarn_types[i] = wc_default_yarn_type;
+        params->yarn_types[i].yarnsize = 0.8f;
+    }
+    params->pattern = (PatternEntry*)calloc(size*size, sizeof(PatternEntry));
+    for (uint32_t y = 0; y < size; y++) {
+        for (uint32_t x = 0; x < size; x++) {
+            uint8_t warp_above = ((x*7 + y) % size) >= 2;
+            params->pattern[x + y*size].warp_above = warp_above;
+            params->pattern[x + y*size].yarn_type = warp_above ? 1 : 2;
+        }
+    }
+}
+
+static void benchmark_wrap(uint32_t size)
+{
+    const int n = 4000000;
+    int32_t *coords = (int32_t*)malloc(n*sizeof(int32_t));
+    srand(1);
+    for (int i = 0; i < n; i++) {
+        coords[i] = rand() % (3*size) - size;
+    }
+    int64_t sum_fmod = 0, sum_int = 0;
+    double t0 = seconds();
+    for (int i = 0; i < n; i++) {
+        sum_fmod += repeat_index_fmod(coords[i], size);
+    }
+    double t1 = seconds();
+    for (int i = 0; i < n; i++) {
+        sum_int += wcRepeatIndex(coords[i], size);
+    }
+    double t2 = seconds();
+    printf("wrap %5u: fmod %6.2f ns  integer %6.2f ns%s\n", size,
+        (t1 - t0)/n*1e9, (t2 - t1)/n*1e9,
+        sum_fmod == sum_int ? "" : "  (results differ)");
+    free(coords);
+}
+
+static void benchmark_segment(uint32_t size, uint8_t segment_lookup,
+        const char *name)
+{
+    const int n = 1000000;
+    wcWeaveParameters params;
+    make_pattern(&params, size);
+    params.segment_lookup = segment_lookup;
+    //Skip the specular normalization, it is not what is measured here
+    params.num_yarn_types = 0;
+    wcFinalizeWeaveParameters(&params);
+    params.num_yarn_types = 3;
+
+    float *uv = (float*)malloc(2*n*sizeof(float));
+    srand(2);
+    for (int i = 0; i < 2*n; i++) {
+        uv[i] = rand()/(float)RAND_MAX*4.f - 2.f;
+    }
+    float sum = 0.f;
+    double t0 = seconds();
+    for (int i = 0; i < n; i++) {
+        sum += wcGetYarnSegment(uv[2*i], uv[2*i + 1], &params).length;
+    }
+    double t1 = seconds();
+    printf("segment %5u %-10s %8.1f ns (%g)\n", size, name,
+        (t1 - t0)/n*1e9, sum);
+    free(uv);
+    wcFreeWeavePattern(&params);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t sizes[] = {40, 200, 1000};
+    for (int i = 0; i < 3; i++) {
+        benchmark_wrap(sizes[i]);
+    }
+    for (int i = 0; i < 3; i++) {
+        benchmark_segment(sizes[i], WC_SEGMENT_LOOKUP_WALK, "walk");
+        benchmark_segment(sizes[i], WC_SEGMENT_LOOKUP_TABLE, "table");
+        benchmark_segment(sizes[i], WC_SEGMENT_LOOKUP_RUN_LENGTH, "run length");
+        benchmark_segment(sizes[i], WC_SEGMENT_LOOKUP_BITPLANE, "bitplane");
+    }
+    return 0;
+}
@@ -0,0 +1,444 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+
+#include "../../src/woven_cloth.h"
+#include "../../src/wif/wif.h"
+
+/* Times the main entry points of the shader, each on its own, for the
+ * bundled WIF files and for two large synthetic patterns. Every benchmark
+ * is run a number of times, and the median and minimum time per call are
+ * written as CSV, one row per benchmark and input:
+ *     benchmark,input,median_ns,min_ns,calls
+ * where calls is the number of calls in each run.
+ * Usage:
+ *     benchmark_shading.bin [--quick] [--out results.csv]
+ *     benchmark_shading.bin --compare old.csv new.csv [--threshold percent]
+ * The second form compares the median times of two runs, and exits with 1
+ * if any benchmark got slower by more than the threshold, 10% by default.
+ * The shading functions are evaluated at random uv coordinates, with wi
+ * uniform on the hemisphere and wo sampled with wcSample, so that the
+ * specular highlights are hit. The random numbers have a fixed seed, so
+ * two runs of the same version do the same work.
+ */
+
+#define NUM_REPEATS 5
+
+float wc_eval_texmap_mono(void *texmap, void *context) { return 1.f; }
+wcColor wc_eval_texmap_color(void *texmap, void *context)
+{
+    wcColor ret = {1.f, 1.f, 1.f};
+    return ret;
+}
+
+//Wall clock time, since wcFinalizeWeaveParameters uses several threads
+static double seconds()
+{
+#ifdef _WIN32
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (double)count.QuadPart/(double)frequency.QuadPart;
+#else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + 1e-9*(double)t.tv_nsec;
+#endif
+}
+
+static uint32_t random_state = 1;
+static float random_float()
+{
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return (float)(random_state >> 8)*(1.f/16777216.f);
+}
+
+//Keeps the results of the timed calls from being optimized away
+static volatile float sink;
+
+static const char *wif_files[] = {
+    "../../src/wif/data/2229.wif",
+    "../../src/wif/data/41753.wif",
+    "../test_yarn_size/54235plain.wif",
+    "../test_yarn_size/2parallel.wif",
+    "../test_yarn_size/3parallelwarps.wif",
+    "../test_yarn_size/3parallelwefts.wif",
+    "../test_yarn_size/test.wif",
+};
+#define NUM_WIF_FILES (sizeof(wif_files)/sizeof(wif_files[0]))
+static const uint32_t synthetic_sizes[] = {1024, 4096};
+#define NUM_SYNTHETIC (sizeof(synthetic_sizes)/sizeof(synthetic_sizes[0]))
+
+//The pattern and the points that the benchmarks of one input use
+typedef struct
+{
+    const char *name;
+    const char *filename; //0 for synthetic patterns
+    wcWeaveParameters params;
+    int num_points;
+    wcIntersectionData *points;
+    wcPatternData *pattern_data;
+} Input;
+
+typedef double (*BenchmarkFunction)(Input *input);
+
+//A satin-like pattern with floats of length 8
+static void make_pattern(wcWeaveParameters *params, uint32_t size)
+{
+    wcInitWeaveParameters(params);
+    params->pattern_width = params->pattern_height = size;
+    params->uscale = params->vscale = 1.f;
+    params->num_yarn_types = 3;
+    params->yarn_types = (wcYarnType*)calloc(3, sizeof(wcYarnType));
+    for (int i = 0; i < 3; i++) {
+        params->yarn_types[i] = wc_default_yarn_type;
+    }
+    params->pattern = (PatternEntry*)calloc(size*size, sizeof(PatternEntry));
+    for (uint32_t y = 0; y < size; y++) {
+        for (uint32_t x = 0; x < size; x++) {
+            uint8_t warp_above = ((x*3 + y) % 10) >= 2;
+            params->pattern[x + y*size].warp_above = warp_above;
+            params->pattern[x + y*size].yarn_type = warp_above ? 1 : 2;
+        }
+    }
+    wcFinalizeWeaveParameters(params);
+}
+
+//Random uv coordinates over a few repeats of the pattern, with wo sampled
+// in the highlights
+static void make_points(Input *input)
+{
+    wcWeaveParameters *params = &input->params;
+    random_state = 1;
+    for (int i = 0; i < input->num_points; i++) {
+        wcIntersectionData *point = &input->points[i];
+        memset(point, 0, sizeof(wcIntersectionData));
+        point->uv_x = 4.f*random_float() - 2.f;
+        point->uv_y = 4.f*random_float() - 2.f;
+        float cos_theta = 0.05f + 0.95f*random_float();
+        float sin_theta = sqrtf(1.f - cos_theta*cos_theta);
+        float phi = 2.f*(float)M_PI*random_float();
+        point->wi_x = sin_theta*cosf(phi);
+        point->wi_y = sin_theta*sinf(phi);
+        point->wi_z = cos_theta;
+        input->pattern_data[i] = wcGetPatternData(*point, params);
+        if (wcSample(point, input->pattern_data[i], params, random_float(),
+                random_float()) <= 0.f) {
+            point->wo_x = 0.f; point->wo_y = 0.f; point->wo_z = 1.f;
+        }
+    }
+}
+
+//Sets psi of all yarn types and updates the pattern data of the points
+static void set_psi(Input *input, float psi)
+{
+    wcWeaveParameters *params = &input->params;
+    for (uint32_t i = 0; i < params->num_yarn_types; i++) {
+        params->yarn_types[i].psi = psi;
+    }
+    wcFinalizeWeaveParameters(params);
+    make_points(input);
+}
+
+static double benchmark_get_yarn_segment(Input *input)
+{
+    float u_scale = input->params.uscale*input->params.pattern_width;
+    float v_scale = input->params.vscale*input->params.pattern_height;
+    float sum = 0.f;
+    double t0 = seconds();
+    for (int i = 0; i < input->num_points; i++) {
+        sum += wcGetYarnSegment(input->points[i].uv_x*u_scale,
+            input->points[i].uv_y*v_scale, &input->params).length;
+    }
+    double t1 = seconds();
+    sink = sum;
+    return t1 - t0;
+}
+
+static double benchmark_get_pattern_data(Input *input)
+{
+    float sum = 0.f;
+    double t0 = seconds();
+    for (int i = 0; i < input->num_points; i++) {
+        sum += wcGetPatternData(input->points[i], &input->params).x;
+    }
+    double t1 = seconds();
+    sink = sum;
+    return t1 - t0;
+}
+
+static double benchmark_eval_diffuse(Input *input)
+{
+    float sum = 0.f;
+    double t0 = seconds();
+    for (int i = 0; i < input->num_points; i++) {
+        sum += wcEvalDiffuse(input->points[i], input->pattern_data[i],
+            &input->params).r;
+    }
+    double t1 = seconds();
+    sink = sum;
+    return t1 - t0;
+}
+
+static double benchmark_eval_specular(Input *input)
+{
+    float sum = 0.f;
+    double t0 = seconds();
+    for (int i = 0; i < input->num_points; i++) {
+        sum += wcEvalSpecular(input->points[i], input->pattern_data[i],
+            &input->params);
+    }
+    double t1 = seconds();
+    sink = sum;
+    return t1 - t0;
+}
+
+static double benchmark_shade(Input *input)
+{
+    float sum = 0.f;
+    double t0 = seconds();
+    for (int i = 0; i < input->num_points; i++) {
+        sum += wcShade(input->points[i], &input->params).r;
+    }
+    double t1 = seconds();
+    sink = sum;
+    return t1 - t0;
+}
+
+static double benchmark_finalize(Input *input)
+{
+    double t0 = seconds();
+    wcFinalizeWeaveParameters(&input->params);
+    double t1 = seconds();
+    sink = input->params.specular_normalization;
+    return t1 - t0;
+}
+
+static double benchmark_wif_read(Input *input)
+{
+    wcWeaveParameters params;
+    wcInitWeaveParameters(&params);
+    double t0 = seconds();
+    WeaveData *data = wif_read(input->filename);
+    wif_get_pattern(&params, data, &params.pattern_width,
+        &params.pattern_height, &params.pattern_realwidth,
+        &params.pattern_realheight);
+    double t1 = seconds();
+    wif_free_weavedata(data);
+    sink = (float)params.pattern_width;
+    free(params.pattern);
+    free(params.yarn_types);
+    return t1 - t0;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+//Runs the benchmark NUM_REPEATS times and writes its row
+static void measure(FILE *out, const char *name, Input *input,
+    BenchmarkFunction function, int calls)
+{
+    double times[NUM_REPEATS];
+    for (int r = 0; r < NUM_REPEATS; r++) {
+        times[r] = function(input)/calls*1e9;
+    }
+    qsort(times, NUM_REPEATS, sizeof(double), compare_doubles);
+    fprintf(out, "%s,%s,%.2f,%.2f,%d\n", name, input->name,
+        times[NUM_REPEATS/2], times[0], calls);
+    fflush(out);
+}
+
+static void run_input(FILE *out, Input *input)
+{
+    int n = input->num_points;
+    if (input->filename) {
+        measure(out, "wif_read", input, benchmark_wif_read, 1);
+    }
+    measure(out, "wcFinalizeWeaveParameters", input, benchmark_finalize, 1);
+    measure(out, "wcGetYarnSegment", input, benchmark_get_yarn_segment, n);
+    measure(out, "wcGetPatternData", input, benchmark_get_pattern_data, n);
+    measure(out, "wcEvalDiffuse", input, benchmark_eval_diffuse, n);
+    set_psi(input, 0.f);
+    measure(out, "wcEvalSpecular_filament", input, benchmark_eval_specular,
+        n);
+    measure(out, "wcShade_filament", input, benchmark_shade, n);
+    set_psi(input, 0.5f);
+    measure(out, "wcEvalSpecular_staple", input, benchmark_eval_specular, n);
+    measure(out, "wcShade_staple", input, benchmark_shade, n);
+}
+
+static int run_benchmarks(FILE *out, int num_points)
+{
+    Input input;
+    input.num_points = num_points;
+    input.points = (wcIntersectionData*)malloc(num_points
+        *sizeof(wcIntersectionData));
+    input.pattern_data = (wcPatternData*)malloc(num_points
+        *sizeof(wcPatternData));
+    fprintf(out, "benchmark,input,median_ns,min_ns,calls\n");
+    for (uint32_t i = 0; i < NUM_WIF_FILES; i++) {
+        const char *name = strrchr(wif_files[i], '/');
+        input.name = name ? name + 1 : wif_files[i];
+        input.filename = wif_files[i];
+        wcInitWeaveParameters(&input.params);
+        //Not through the pattern cache, which would keep the segment
+        //lookup and the normalization, so finalize is timed in full
+        wcWeavePatternFromWIF(&input.params, wif_files[i]);
+        if (!input.params.pattern) {
+            fprintf(stderr, "Could not load %s\n", wif_files[i]);
+            return 1;
+        }
+        input.params.uscale = input.params.vscale = 1.f;
+        input.params.realworld_uv = 0;
+        wcFinalizeWeaveParameters(&input.params);
+        make_points(&input);
+        run_input(out, &input);
+        wcFreeWeavePattern(&input.params);
+    }
+    for (uint32_t i = 0; i < NUM_SYNTHETIC; i++) {
+        char name[64];
+        sprintf(name, "synthetic_%u", synthetic_sizes[i]);
+        input.name = name;
+        input.filename = 0;
+        make_pattern(&input.params, synthetic_sizes[i]);
+        make_points(&input);
+        run_input(out, &input);
+        wcFreeWeavePattern(&input.params);
+    }
+    free(input.points);
+    free(input.pattern_data);
+    return 0;
+}
+
+/* --- Comparison of two runs --- */
+
+typedef struct
+{
+    char benchmark[64];
+    char input[64];
+    double median_ns;
+} Result;
+
+//Reads the rows of a CSV file written by run_benchmarks. Returns the
+// number of rows, or -1 if the file could not be read
+static int read_results(const char *filename, Result *results,
+    int max_results)
+{
+    FILE *f = fopen(filename, "r");
+    if (!f) {
+        return -1;
+    }
+    char line[256];
+    int n = 0;
+    while (n < max_results && fgets(line, sizeof(line), f)) {
+        Result *result = &results[n];
+        double min_ns;
+        int calls;
+        if (sscanf(line, "%63[^,],%63[^,],%lf,%lf,%d", result->benchmark,
+                result->input, &result->median_ns, &min_ns, &calls) == 5) {
+            n++;
+        }
+    }
+    fclose(f);
+    return n;
+}
+
+static int compare_runs(const char *old_file, const char *new_file,
+    double threshold)
+{
+    #define MAX_RESULTS 1024
+    static Result old_results[MAX_RESULTS], new_results[MAX_RESULTS];
+    int num_old = read_results(old_file, old_results, MAX_RESULTS);
+    int num_new = read_results(new_file, new_results, MAX_RESULTS);
+    if (num_old < 0 || num_new < 0) {
+        fprintf(stderr, "Could not read %s\n", num_old < 0 ? old_file
+            : new_file);
+        return 2;
+    }
+    int regressions = 0;
+    printf("benchmark,input,old_ns,new_ns,change_percent,status\n");
+    for (int i = 0; i < num_new; i++) {
+        const Result *new_result = &new_results[i];
+        const Result *old_result = 0;
+        for (int j = 0; j < num_old; j++) {
+            if (strcmp(old_results[j].benchmark, new_result->benchmark) == 0
+                    && strcmp(old_results[j].input, new_result->input) == 0) {
+                old_result = &old_results[j];
+                break;
+            }
+        }
+        if (!old_result) {
+            printf("%s,%s,,%.2f,,new\n", new_result->benchmark,
+                new_result->input, new_result->median_ns);
+            continue;
+        }
+        double change = 100.0*(new_result->median_ns/old_result->median_ns
+            - 1.0);
+        const char *status = "ok";
+        if (change > threshold) {
+            status = "regression";
+            regressions++;
+        } else if (change < -threshold) {
+            status = "improvement";
+        }
+        printf("%s,%s,%.2f,%.2f,%+.1f,%s\n", new_result->benchmark,
+            new_result->input, old_result->median_ns, new_result->median_ns,
+            change, status);
+    }
+    fprintf(stderr, "%d regression%s above %.1f%%\n", regressions,
+        regressions == 1 ? "" : "s", threshold);
+    return regressions > 0 ? 1 : 0;
+    #undef MAX_RESULTS
+}
+
+int main(int argc, char **argv)
+{
+    const char *out_file = 0;
+    const char *compare_files[2] = {0, 0};
+    double threshold = 10.0;
+    int num_points = 200000;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quick") == 0) {
+            num_points = 20000;
+        } else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+            out_file = argv[++i];
+        } else if (strcmp(argv[i], "--compare") == 0 && i + 2 < argc) {
+            compare_files[0] = argv[++i];
+            compare_files[1] = argv[++i];
+        } else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+            threshold = atof(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s [--quick] [--out results.csv]\n"
+                "       %s --compare old.csv new.csv [--threshold percent]\n",
+                argv[0], argv[0]);
+            return 2;
+        }
+    }
+    if (compare_files[0]) {
+        return compare_runs(compare_files[0], compare_files[1], threshold);
+    }
+    FILE *out = stdout;
+    if (out_file) {
+        out = fopen(out_file, "w");
+        if (!out) {
+            fprintf(stderr, "Could not open %s\n", out_file);
+            return 2;
+        }
+    }
+    int ret = run_benchmarks(out, num_points);
+    if (out != stdout) {
+        fclose(out);
+    }
+    return ret;
+}
@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+
+#include "../../src/woven_cloth.h"
+#include "../../src/wif/wif.h"
+
+/* Times wif_read_threads on large generated WIF files, and prints one CSV
+ * row per file and thread count:
+ *     file,threads,size_mb,median_ms,min_ms,mb_per_s
+ * A thread count of 0 means one thread per CPU.
+ * The dobby file has many threads on few shafts, so it has many short lines.
+ * The jacquard file gives every thread its own shaft and treadle, which
+ * makes the lines of the TIEUP section several kilobytes long. The files are
+ * written to the current directory and removed afterwards.
+ */
+
+#define NUM_REPEATS 5
+
+float wc_eval_texmap_mono(void *texmap, void *context) { return 1.f; }
+wcColor wc_eval_texmap_color(void *texmap, void *context)
+{
+    wcColor ret = {1.f, 1.f, 1.f};
+    return ret;
+}
+
+static double seconds()
+{
+#ifdef _WIN32
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (double)count.QuadPart/(double)frequency.QuadPart;
+#else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + 1e-9*(double)t.tv_nsec;
+#endif
+}
+
+//Writes a WIF file where warp thread x is on shaft x%shafts+1, weft thread
+// y uses treadle y%treadles+1, and the tieup is a satin like pattern
+static void write_wif(const char *filename, uint32_t threads,
+    uint32_t shafts, uint32_t treadles)
+{
+    FILE *f = fopen(filename, "w");
+    uint32_t i, j;
+    fprintf(f, "[WIF]\nVersion=1.1\nSource Program=benchmark_wif_read\n\n");
+    fprintf(f, "[CONTENTS]\nCOLOR PALETTE=yes\nWEAVING=yes\nWARP=yes\n"
+        "WEFT=yes\nCOLOR TABLE=yes\nTHREADING=yes\nWARP COLORS=yes\n"
+        "TIEUP=yes\nWEFT COLORS=yes\nTREADLING=yes\n\n");
+    fprintf(f, "[COLOR PALETTE]\nRange=0,255\nEntries=2\n\n");
+    fprintf(f, "[COLOR TABLE]\n1=255,255,255\n2=0,0,128\n\n");
+    fprintf(f, "[WEAVING]\nShafts=%u\nTreadles=%u\nRising Shed=yes\n\n",
+        shafts, treadles);
+    fprintf(f, "[WARP]\nThreads=%u\nColor=1\nUnits=centimeters\n"
+        "Spacing=0.0185\nThickness=0.0213\n\n", threads);
+    fprintf(f, "[WEFT]\nThreads=%u\nColor=2\nUnits=centimeters\n"
+        "Spacing=0.0185\nThickness=0.0213\n\n", threads);
+    fprintf(f, "[TIEUP]\n");
+    for (i = 0; i < treadles; i++) {
+        uint8_t first = 1;
+        fprintf(f, "%u=", i + 1);
+        for (j = 0; j < shafts; j++) {
+            if ((i*3 + j) % 5 >= 2) {
+                fprintf(f, first ? "%u" : ",%u", j + 1);
+                first = 0;
+            }
+        }
+        fprintf(f, "\n");
+    }
+    fprintf(f, "\n[THREADING]\n");
+    for (i = 0; i < threads; i++) {
+        fprintf(f, "%u=%u\n", i + 1, i % shafts + 1);
+    }
+    fprintf(f, "\n[TREADLING]\n");
+    for (i = 0; i < threads; i++) {
+        fprintf(f, "%u=%u\n", i + 1, i % treadles + 1);
+    }
+    fprintf(f, "\n[WARP COLORS]\n");
+    for (i = 0; i < threads; i++) {
+        fprintf(f, "%u=%u\n", i + 1, (i / 4) % 2 + 1);
+    }
+    fprintf(f, "\n[WEFT COLORS]\n");
+    for (i = 0; i < threads; i++) {
+        fprintf(f, "%u=%u\n", i + 1, (i / 3) % 2 + 1);
+    }
+    fclose(f);
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static void measure(const char *filename, uint32_t num_threads)
+{
+    double times[NUM_REPEATS];
+    FILE *f = fopen(filename, "rb");
+    fseek(f, 0, SEEK_END);
+    double size_mb = (double)ftell(f)/(1024.0*1024.0);
+    fclose(f);
+    for (int r = 0; r < NUM_REPEATS; r++) {
+        double t0 = seconds();
+        WeaveData *data = wif_read_threads(filename, num_threads);
+        times[r] = seconds() - t0;
+        if (!data) {
+            printf("%s,%u,%.2f,failed,failed,0\n", filename, num_threads,
+                size_mb);
+            return;
+        }
+        wif_free_weavedata(data);
+    }
+    qsort(times, NUM_REPEATS, sizeof(double), compare_doubles);
+    printf("%s,%u,%.2f,%.2f,%.2f,%.1f\n", filename, num_threads, size_mb,
+        times[NUM_REPEATS/2]*1e3, times[0]*1e3,
+        size_mb/times[NUM_REPEATS/2]);
+}
+
+int main()
+{
+    const char *dobby = "benchmark_dobby.wif";
+    const char *jacquard = "benchmark_jacquard.wif";
+    write_wif(dobby, 200000, 8, 8);
+    write_wif(jacquard, 2400, 2400, 2400);
+    const uint32_t thread_counts[] = {1, 4, 0};
+    printf("file,threads,size_mb,median_ms,min_ms,mb_per_s\n");
+    for (int i = 0; i < 3; i++) {
+        measure(dobby, thread_counts[i]);
+    }
+    for (int i = 0; i < 3; i++) {
+        measure(jacquard, thread_counts[i]);
+    }
+    remove(dobby);
+    remove(jacquard);
+    return 0;
+}
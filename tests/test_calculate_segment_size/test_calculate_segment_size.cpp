@@ -231,16 +231,106 @@ static void test_calculates_segment_between_parallel_warps_halfsize() {
     assert(yarn.width == 0.5); assert(yarn.length == 0.25 + 0.25);
 }
 
+static void assert_same_segments(const wcWeaveParameters *params_a,
+        const wcWeaveParameters *params_b) {
+    for (int x = -40; x <= 80; x++) {
+        for (int y = -40; y <= 80; y++) {
+            u = x/37.f;
+            v = y/29.f;
+            wcYarnSegment a = wcGetYarnSegment(u, v, params_a);
+            wcYarnSegment b = wcGetYarnSegment(u, v, params_b);
+            assert(a.yarn_hit == b.yarn_hit);
+            assert(a.between_parallel == b.between_parallel);
+            assert(a.warp_above == b.warp_above);
+            assert(a.pattern_entry.yarn_type == b.pattern_entry.yarn_type);
+            assert(a.length == b.length); assert(a.width == b.width);
+            assert(a.start_u == b.start_u); assert(a.start_v == b.start_v);
+        }
+    }
+}
+
+static wcWeaveParameters *all_params[] = {&params_fullsize, &params_halfsize,
+    &params_2parallel_fullsize, &params_2parallel_halfsize,
+    &params_2parallel_full_and_halfsize};
+
+static void test_segment_table_gives_same_segments_as_walking() {
+    for (int i = 0; i < 5; i++) {
+        wcWeaveParameters *params = all_params[i];
+        assert(params->segment_table != NULL);
+        wcWeaveParameters params_walk = *params;
+        params_walk.segment_table = NULL;
+        assert_same_segments(params, &params_walk);
+    }
+}
+
+static void test_segment_index_gives_same_segments_as_walking(
+        uint8_t segment_lookup) {
+    for (int i = 0; i < 5; i++) {
+        wcWeaveParameters *params = all_params[i];
+        wcWeaveParameters params_walk = *params;
+        params_walk.segment_table = NULL;
+        wcWeaveParameters params_index = params_walk;
+        params_index.resolved_yarn_types = NULL;
+        params_index.segment_lookup = segment_lookup;
+        wcFinalizeWeaveParameters(&params_index);
+        assert(params_index.segment_table == NULL);
+        assert(wcGetSegmentLookupMemory(&params_index) > 0);
+        assert_same_segments(&params_index, &params_walk);
+        //Only free the index, the pattern is shared with params
+        params_index.pattern = NULL;
+        params_index.yarn_types = NULL;
+        wcFreeWeavePattern(&params_index);
+    }
+}
+
+static void test_run_length_index_gives_same_segments_as_walking() {
+    test_segment_index_gives_same_segments_as_walking(
+        WC_SEGMENT_LOOKUP_RUN_LENGTH);
+}
+
+static void test_bitplane_index_gives_same_segments_as_walking() {
+    test_segment_index_gives_same_segments_as_walking(
+        WC_SEGMENT_LOOKUP_BITPLANE);
+}
+
+static void test_calculates_segment_size_for_patterns_wider_than_127() {
+    //One warp at x = 0, the rest of the row is a single weft float
+    uint8_t lookups[] = {WC_SEGMENT_LOOKUP_WALK, WC_SEGMENT_LOOKUP_TABLE,
+        WC_SEGMENT_LOOKUP_RUN_LENGTH, WC_SEGMENT_LOOKUP_BITPLANE};
+    for (int i = 0; i < 4; i++) {
+        wcWeaveParameters params;
+        wcInitWeaveParameters(&params);
+        params.uscale = params.vscale = 1.f;
+        params.pattern_width = 300;
+        params.pattern_height = 1;
+        params.pattern = (PatternEntry*)calloc(300, sizeof(PatternEntry));
+        params.pattern[0].warp_above = 1;
+        params.num_yarn_types = 1;
+        params.yarn_types = (wcYarnType*)calloc(1, sizeof(wcYarnType));
+        params.yarn_types[0] = wc_default_yarn_type;
+        params.segment_lookup = lookups[i];
+        wcFinalizeWeaveParameters(&params);
+
+        wcYarnSegment yarn = wcGetYarnSegment(150.5f/300.f, 0.5f, &params);
+        assert(yarn.yarn_hit);
+        assert(yarn.warp_above == 0);
+        assert(yarn.length == 299.f);
+        wcFreeWeavePattern(&params);
+    }
+}
+
 static void setup() {
     intersection_data.wi_z = 1.f;
     intersection_data.context = NULL;
 
     wcWeaveParameters *params = &params_fullsize;
+    wcInitWeaveParameters(params);
     params->realworld_uv = 0;
     params->uscale = params->vscale = 1.f;
     wcWeavePatternFromFile(params,"54235plain.wif");
     
     params = &params_halfsize;
+    wcInitWeaveParameters(params);
     params->realworld_uv = 0;
     params->uscale = params->vscale = 1.f;
     wcWeavePatternFromFile(params,"54235plain.wif");
@@ -248,11 +338,13 @@ static void setup() {
     params->yarn_types[2].yarnsize = 0.5;
     
     params = &params_2parallel_fullsize;
+    wcInitWeaveParameters(params);
     params->realworld_uv = 0;
     params->uscale = params->vscale = 1.f;
     wcWeavePatternFromFile(params,"2parallel.wif");
     
     params = &params_2parallel_halfsize;
+    wcInitWeaveParameters(params);
     params->realworld_uv = 0;
     params->uscale = params->vscale = 1.f;
     wcWeavePatternFromFile(params,"2parallel.wif");
@@ -261,6 +353,7 @@ static void setup() {
     //wcFinalizeWeaveParameters(params);
     
     params = &params_2parallel_full_and_halfsize;
+    wcInitWeaveParameters(params);
     params->realworld_uv = 0;
     params->uscale = params->vscale = 1.f;
     wcWeavePatternFromFile(params,"2parallel.wif");
@@ -280,6 +373,10 @@ int main(int argc, char **argv)
     test(calculateSegmentDim_returns_true_when_hitting_extension);
     test(calculateSegmentDim_returns_false_when_missing_yarn_and_extension);
     test(calculates_segment_between_parallel_warps_halfsize);
+    test(calculates_segment_size_for_patterns_wider_than_127);
+    test(segment_table_gives_same_segments_as_walking);
+    test(run_length_index_gives_same_segments_as_walking);
+    test(bitplane_index_gives_same_segments_as_walking);
 }
 
 //Define dummy wceval for texmaps
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -283,6 +284,7 @@ static void test_extending_with_all_parallel_warps () {
     wcWeaveParameters params_2parallel;
     wcWeaveParameters *params;
     params = &params_2parallel;
+    wcInitWeaveParameters(params);
     params->realworld_uv = 0;
     params->uscale = params->vscale = 1.f;
     wcWeavePatternFromFile(params,"3parallelwarps.wif");
@@ -324,12 +326,14 @@ static void test_extending_with_all_parallel_warps () {
     printf("w: %f, l: %f \n", pattern_data.width, pattern_data.length);
     printf("warp_above: %d, yarn_hit: %d, yarn_type: %d \n", pattern_data.warp_above, pattern_data.yarn_hit, pattern_data.yarn_type);
     */
+    wcFreeWeavePattern(params);
 }
 
 static void test_extending_with_all_parallel_wefts () {
     wcWeaveParameters params_3parallel;
     wcWeaveParameters *params;
     params = &params_3parallel;
+    wcInitWeaveParameters(params);
     params->realworld_uv = 0;
     params->uscale = params->vscale = 1.f;
     wcWeavePatternFromFile(params,"3parallelwefts.wif");
@@ -357,6 +361,7 @@ static void test_extending_with_all_parallel_wefts () {
     intersection_data.uv_x = 3.f/6.f;
     pattern_data = wcGetPatternData(intersection_data, params);
     assert(pattern_data.yarn_hit == 0);
+    wcFreeWeavePattern(params);
 }
 
 static void test_extended_segments_over_border_with_two_parallel_warps_should_work() {
@@ -365,6 +370,7 @@ static void test_extended_segments_over_border_with_two_parallel_warps_should_wo
     wcWeaveParameters params_2parallel;
     wcWeaveParameters *params;
     params = &params_2parallel;
+    wcInitWeaveParameters(params);
     params->realworld_uv = 0;
     params->uscale = params->vscale = 1.f;
     wcWeavePatternFromFile(params,"2parallel.wif");
@@ -408,6 +414,7 @@ static void test_extended_segments_over_border_with_two_parallel_warps_should_wo
     assert(pattern_data.warp_above == 0);
     assert(pattern_data.x == 0.f);
     assert(pattern_data.y > 0.9 && pattern_data.y <= 1.f); //should be at end of segment*/
+    wcFreeWeavePattern(params);
 }
 
 
@@ -421,6 +428,7 @@ static void test_extended_segments_between_two_parallel_warps_should_have_zero_b
     wcWeaveParameters params_2parallel;
     wcWeaveParameters *params;
     params = &params_2parallel;
+    wcInitWeaveParameters(params);
     params->realworld_uv = 0;
     params->uscale = params->vscale = 1.f;
     wcWeavePatternFromFile(params,"2parallel.wif");
@@ -475,6 +483,7 @@ static void test_extended_segments_between_two_parallel_warps_should_have_zero_b
     assert(pattern_data.ext_between_parallel == 1); 
     
     //assert(false); //TODO check bend
+    wcFreeWeavePattern(params);
 }
 
 static void test_extended_segments_between_two_parallel_warps_should_have_zero_bend2() {
@@ -486,6 +495,7 @@ static void test_extended_segments_between_two_parallel_warps_should_have_zero_b
     wcWeaveParameters params_2parallel;
     wcWeaveParameters *params;
     params = &params_2parallel;
+    wcInitWeaveParameters(params);
     params->realworld_uv = 0;
     params->uscale = params->vscale = 1.f;
     wcWeavePatternFromFile(params,"2parallel.wif");
@@ -541,6 +551,7 @@ static void test_extended_segments_between_two_parallel_warps_should_have_zero_b
     
     //debug_print(params, 1, 0.75);
     //assert(false); //TODO check bend
+    wcFreeWeavePattern(params);
 }
 
 //TODO
@@ -549,12 +560,724 @@ static void test_extended_segments_between_two_parallel_wefts_should_have_zero_b
     //just need a wif with two parallel wefts.
 }
 
+static void test_batch_pattern_data_matches_single_calls() {
+    //More points than one batch chunk, and not a multiple of the SIMD width
+    #define NUM_POINTS 150
+    static float uv_x[NUM_POINTS], uv_y[NUM_POINTS];
+    static uint32_t yarn_type[NUM_POINTS];
+    static float normal_x[NUM_POINTS], normal_y[NUM_POINTS],
+        normal_z[NUM_POINTS], u[NUM_POINTS], v[NUM_POINTS],
+        length[NUM_POINTS], width[NUM_POINTS], x[NUM_POINTS], y[NUM_POINTS];
+    static uint32_t total_index_x[NUM_POINTS], total_index_y[NUM_POINTS];
+    static uint8_t warp_above[NUM_POINTS], yarn_hit[NUM_POINTS],
+        ext_between_parallel[NUM_POINTS];
+    wcPatternDataBatch batch = {yarn_type, normal_x, normal_y, normal_z, u, v,
+        length, width, x, y, total_index_x, total_index_y, warp_above,
+        yarn_hit, ext_between_parallel};
+    for (int i = 0; i < NUM_POINTS; i++) {
+        uv_x[i] = (i % 15)/7.f - 1.f;
+        uv_y[i] = (i / 15)/4.f - 0.6f;
+    }
+    wcWeaveParameters *all_params[] = {&params_fullsize, &params_halfsize};
+    for (int p = 0; p < 2; p++) {
+        wcWeaveParameters *params = all_params[p];
+        for (uint8_t level = WC_SIMD_DEFAULT; level <= WC_SIMD_AVX512;
+                level++) {
+            params->simd_level = level;
+            wcGetPatternDataBatch(uv_x, uv_y, NULL, NUM_POINTS, &batch,
+                params);
+            for (int i = 0; i < NUM_POINTS; i++) {
+                intersection_data.uv_x = uv_x[i];
+                intersection_data.uv_y = uv_y[i];
+                wcPatternData data = wcGetPatternData(intersection_data,
+                    params);
+                assert(data.yarn_hit == yarn_hit[i]);
+                assert(data.yarn_type == yarn_type[i]);
+                if (!data.yarn_hit) {
+                    continue;
+                }
+                assert(data.normal_x == normal_x[i]);
+                assert(data.normal_y == normal_y[i]);
+                assert(data.normal_z == normal_z[i]);
+                assert(data.u == u[i]); assert(data.v == v[i]);
+                assert(data.length == length[i]);
+                assert(data.width == width[i]);
+                assert(data.x == x[i]); assert(data.y == y[i]);
+                assert(data.total_index_x == total_index_x[i]);
+                assert(data.total_index_y == total_index_y[i]);
+                assert(data.warp_above == warp_above[i]);
+                assert(data.ext_between_parallel == ext_between_parallel[i]);
+            }
+        }
+        params->simd_level = WC_SIMD_DEFAULT;
+    }
+    #undef NUM_POINTS
+}
+
+static void test_batch_shade_matches_single_calls() {
+    #define NUM_POINTS 150
+    static float uv_x[NUM_POINTS], uv_y[NUM_POINTS];
+    static float wi_x[NUM_POINTS], wi_y[NUM_POINTS], wi_z[NUM_POINTS];
+    static float wo_x[NUM_POINTS], wo_y[NUM_POINTS], wo_z[NUM_POINTS];
+    static float r[NUM_POINTS], g[NUM_POINTS], b[NUM_POINTS];
+    wcIntersectionDataBatch batch = {uv_x, uv_y, wi_x, wi_y, wi_z,
+        wo_x, wo_y, wo_z, NULL};
+    wcColorBatch colors = {r, g, b};
+    for (int i = 0; i < NUM_POINTS; i++) {
+        uv_x[i] = (i % 15)/7.f - 1.f;
+        uv_y[i] = (i / 15)/4.f - 0.6f;
+        float theta_i = 0.1f + 1.3f*(i % 7)/7.f, phi_i = 0.9f*i;
+        float theta_o = 0.1f + 1.3f*(i % 5)/5.f, phi_o = 2.3f*i;
+        wi_x[i] = sinf(theta_i)*cosf(phi_i);
+        wi_y[i] = sinf(theta_i)*sinf(phi_i);
+        wi_z[i] = cosf(theta_i);
+        wo_x[i] = sinf(theta_o)*cosf(phi_o);
+        wo_y[i] = sinf(theta_o)*sinf(phi_o);
+        wo_z[i] = cosf(theta_o);
+    }
+    wcWeaveParameters *all_params[] = {&params_fullsize, &params_halfsize};
+    for (int p = 0; p < 2; p++) {
+        wcWeaveParameters *params = all_params[p];
+        float default_psi = params->yarn_types[0].psi;
+        //Filament and staple yarns
+        float psis[] = {0.f, 0.5f};
+        for (int k = 0; k < 2; k++) {
+            params->yarn_types[0].psi = psis[k];
+            wcFinalizeWeaveParameters(params);
+            for (uint8_t level = WC_SIMD_DEFAULT; level <= WC_SIMD_AVX512;
+                    level++) {
+                params->simd_level = level;
+                wcShadeBatch(&batch, NUM_POINTS, &colors, params);
+                for (int i = 0; i < NUM_POINTS; i++) {
+                    wcIntersectionData data = intersection_data;
+                    data.uv_x = uv_x[i]; data.uv_y = uv_y[i];
+                    data.wi_x = wi_x[i]; data.wi_y = wi_y[i];
+                    data.wi_z = wi_z[i];
+                    data.wo_x = wo_x[i]; data.wo_y = wo_y[i];
+                    data.wo_z = wo_z[i];
+                    wcColor color = wcShade(data, params);
+                    //The batch uses approximations of sin, cos etc.
+                    float tolerance = 1e-3f*fmaxf(fabsf(color.r), 1.f);
+                    assert(fabsf(color.r - r[i]) < tolerance);
+                    assert(fabsf(color.g - g[i]) < tolerance);
+                    assert(fabsf(color.b - b[i]) < tolerance);
+                }
+            }
+        }
+        params->yarn_types[0].psi = default_psi;
+        wcFinalizeWeaveParameters(params);
+        params->simd_level = WC_SIMD_DEFAULT;
+    }
+    #undef NUM_POINTS
+}
+
+static void test_segment_cache_gives_same_pattern_data() {
+    wcWeaveParameters *all_params[] = {&params_fullsize, &params_halfsize};
+    for (int p = 0; p < 2; p++) {
+        wcWeaveParameters *params = all_params[p];
+        wcSegmentCache cache;
+        wcResetSegmentCache(&cache);
+        //Scan lines, like camera rays through neighbouring pixels
+        uint32_t num_points = 0;
+        for (int j = 0; j < 64; j++) {
+            for (int i = 0; i < 64; i++) {
+                intersection_data.uv_x = i/32.f - 1.f;
+                intersection_data.uv_y = j/32.f - 1.f;
+                wcPatternData data = wcGetPatternData(intersection_data,
+                    params);
+                wcPatternData cached = wcGetPatternDataCached(
+                    intersection_data, params, &cache);
+                num_points++;
+                assert(data.yarn_hit == cached.yarn_hit);
+                if (!data.yarn_hit) {
+                    continue;
+                }
+                assert(data.yarn_type == cached.yarn_type);
+                assert(data.warp_above == cached.warp_above);
+                assert(data.length == cached.length);
+                assert(data.width == cached.width);
+                assert(fabsf(data.x - cached.x) < 1e-4f);
+                assert(fabsf(data.y - cached.y) < 1e-4f);
+            }
+        }
+        assert(cache.hits + cache.misses == num_points);
+        assert(cache.hits > 0);
+        wcResetSegmentCache(&cache);
+        assert(cache.hits == 0 && cache.misses == 0);
+    }
+}
+
+static void test_finalize_resolves_yarn_type_parameters() {
+    wcWeaveParameters *params = &params_halfsize;
+    wcYarnType saved[3];
+    memcpy(saved, params->yarn_types, sizeof(saved));
+    params->yarn_types[0].umax = 0.4f;
+    params->yarn_types[1].umax = 0.3f;
+    params->yarn_types[1].umax_enabled = 1;
+    params->yarn_types[2].umax = 0.2f;
+    params->yarn_types[2].umax_enabled = 0;
+    //wc_eval_texmap_mono below returns 1
+    params->yarn_types[2].alpha = 0.1f;
+    params->yarn_types[2].alpha_enabled = 1;
+    params->yarn_types[2].alpha_texmap = (void*)params;
+    wcFinalizeWeaveParameters(params);
+    assert(params->resolved_yarn_types);
+    assert(wc_yarn_type_get_umax(params, 0, NULL) == 0.4f);
+    assert(wc_yarn_type_get_umax(params, 1, NULL) == 0.3f);
+    assert(wc_yarn_type_get_umax(params, 2, NULL) == 0.4f);
+    assert(wc_yarn_type_get_alpha(params, 1, NULL)
+        == params->yarn_types[0].alpha);
+    assert(wc_yarn_type_get_alpha(params, 2, NULL) == 1.f);
+    wcColor color = wc_yarn_type_get_color(params, 0, NULL);
+    assert(color.r == 0.5f && color.g == 0.f && color.b == 0.5f);
+    memcpy(params->yarn_types, saved, sizeof(saved));
+    wcFinalizeWeaveParameters(params);
+}
+
+static void test_diffuse_color_uses_texmaps_only_when_set() {
+    wcWeaveParameters *params = &params_halfsize;
+    //Between the yarns, where the color of yarn type 0 is used
+    intersection_data.uv_x = 0.1f;
+    intersection_data.uv_y = 0.1f;
+    wcPatternData data = wcGetPatternData(intersection_data, params);
+    assert(!data.yarn_hit);
+    assert(!params->resolved_yarn_types->has_texmaps);
+    wcColor color = wcEvalDiffuse(intersection_data, data, params);
+    assert(color.r == 0.5f && color.g == 0.f && color.b == 0.5f);
+
+    //wc_eval_texmap_color below returns white
+    params->yarn_types[0].color_texmap = (void*)params;
+    wcFinalizeWeaveParameters(params);
+    assert(params->resolved_yarn_types->has_texmaps);
+    color = wcEvalDiffuse(intersection_data, data, params);
+    assert(color.r == 1.f && color.g == 1.f && color.b == 1.f);
+
+    params->yarn_types[0].color_texmap = NULL;
+    wcFinalizeWeaveParameters(params);
+}
+
+static void test_specular_normalization_does_not_depend_on_threads() {
+    wcWeaveParameters *params = &params_halfsize;
+    params->finalize_threads = 1;
+    wcFinalizeWeaveParameters(params);
+    float normalization = params->specular_normalization;
+    assert(normalization > 0.f);
+    for (uint32_t threads = 2; threads <= 5; threads++) {
+        params->finalize_threads = threads;
+        wcFinalizeWeaveParameters(params);
+        assert(memcmp(&normalization, &params->specular_normalization,
+            sizeof(float)) == 0);
+    }
+    params->finalize_threads = 0;
+    wcFinalizeWeaveParameters(params);
+    assert(memcmp(&normalization, &params->specular_normalization,
+        sizeof(float)) == 0);
+}
+
+static void test_adaptive_normalization_reaches_tolerance() {
+    wcWeaveParameters *params = &params_halfsize;
+    params->normalization_tolerance = WC_NORMALIZATION_FIXED_SAMPLES;
+    wcFinalizeWeaveParameters(params);
+    float fixed = params->specular_normalization;
+    assert(params->specular_normalization_error > 0.f);
+
+    params->normalization_tolerance = WC_NORMALIZATION_PREVIEW_TOLERANCE;
+    wcFinalizeWeaveParameters(params);
+    float preview = params->specular_normalization;
+    assert(params->specular_normalization_error
+        <= WC_NORMALIZATION_PREVIEW_TOLERANCE);
+
+    params->normalization_tolerance = 0.f;
+    wcFinalizeWeaveParameters(params);
+    float normalization = params->specular_normalization;
+    assert(params->specular_normalization_error
+        <= WC_NORMALIZATION_DEFAULT_TOLERANCE);
+    assert(fabsf(preview/normalization - 1.f)
+        <= WC_NORMALIZATION_PREVIEW_TOLERANCE);
+    assert(fabsf(fixed/normalization - 1.f) <= 0.2f);
+}
+
+static void test_normalization_cache_is_used_only_for_same_parameters() {
+    const char *filename = "normalization_cache.tmp";
+    remove(filename);
+    wcWeaveParameters *params = &params_halfsize;
+    wcFinalizeWeaveParameters(params);
+    float normalization = params->specular_normalization;
+
+    params->normalization_cache = filename;
+    wcFinalizeWeaveParameters(params);
+    assert(params->specular_normalization == normalization);
+
+    // Replace the stored value, so that we can tell when it is used
+    float cached = 123.f;
+    FILE *f = fopen(filename, "r+b");
+    assert(f);
+    fseek(f, 16 + 8 + 4, SEEK_SET);
+    fwrite(&cached, sizeof(float), 1, f);
+    fclose(f);
+    wcFinalizeWeaveParameters(params);
+    assert(params->specular_normalization == cached);
+
+    float psi = params->yarn_types[0].psi;
+    params->yarn_types[0].psi = nextafterf(psi, 1.f);
+    wcFinalizeWeaveParameters(params);
+    assert(params->specular_normalization != cached);
+    params->yarn_types[0].psi = psi;
+    wcFinalizeWeaveParameters(params);
+    assert(params->specular_normalization == cached);
+
+    params->fast_math = 1;
+    wcFinalizeWeaveParameters(params);
+    assert(params->specular_normalization != cached);
+    params->fast_math = 0;
+
+    params->normalization_cache = 0;
+    wcFinalizeWeaveParameters(params);
+    assert(params->specular_normalization == normalization);
+    remove(filename);
+}
+
+static void test_compiled_pattern_loads_the_same_pattern() {
+    wcWeaveParameters *params = &params_halfsize;
+    size_t size = wcCompilePattern(params, NULL, 0);
+    assert(size > 0);
+    uint8_t *buffer = (uint8_t*)malloc(size);
+    assert(wcCompilePattern(params, buffer, size) == size);
+
+    wcWeaveParameters loaded;
+    memset(&loaded, 0, sizeof(loaded));
+    loaded.uscale = loaded.vscale = 1.f;
+    assert(wcWeavePatternFromWCBData(&loaded, buffer, size));
+    wcFinalizeWeaveParameters(&loaded);
+    assert(loaded.pattern_width == params->pattern_width);
+    assert(loaded.pattern_height == params->pattern_height);
+    assert(loaded.pattern_realwidth == params->pattern_realwidth);
+    assert(loaded.pattern_realheight == params->pattern_realheight);
+    assert(memcmp(loaded.pattern, params->pattern, params->pattern_width
+        *params->pattern_height*sizeof(PatternEntry)) == 0);
+    assert(loaded.num_yarn_types == params->num_yarn_types);
+    for (uint32_t i = 0; i < params->num_yarn_types; i++) {
+        wcYarnType *a = &loaded.yarn_types[i], *b = &params->yarn_types[i];
+#define WC_FLOAT_PARAM(name) assert(a->name == b->name \
+        && a->name##_enabled == b->name##_enabled);
+#define WC_COLOR_PARAM(name) assert(memcmp(&a->name, &b->name, \
+        sizeof(wcColor)) == 0 && a->name##_enabled == b->name##_enabled);
+WC_YARN_PARAMETERS
+#undef WC_FLOAT_PARAM
+#undef WC_COLOR_PARAM
+    }
+    assert(loaded.specular_normalization == params->specular_normalization);
+    wcFreeWeavePattern(&loaded);
+
+    // Replace the stored normalization, so that we can tell when it is used
+    float stored = 123.f;
+    memcpy(buffer + 44, &stored, sizeof(float));
+    memset(&loaded, 0, sizeof(loaded));
+    loaded.uscale = loaded.vscale = 1.f;
+    assert(wcWeavePatternFromWCBData(&loaded, buffer, size));
+    wcFinalizeWeaveParameters(&loaded);
+    assert(loaded.specular_normalization == stored);
+    wcFreeWeavePattern(&loaded);
+
+    // A truncated file, and a yarn type past the last one, are rejected
+    memset(&loaded, 0, sizeof(loaded));
+    assert(!wcWeavePatternFromWCBData(&loaded, buffer, size - 1));
+    assert(!loaded.pattern);
+    wcFreeWeavePattern(&loaded);
+    uint64_t pattern_offset;
+    memcpy(&pattern_offset, buffer + 64 + 2*16, sizeof(uint64_t));
+    buffer[pattern_offset + 1] = 250;
+    memset(&loaded, 0, sizeof(loaded));
+    assert(!wcWeavePatternFromWCBData(&loaded, buffer, size));
+    assert(!loaded.pattern);
+    wcFreeWeavePattern(&loaded);
+    free(buffer);
+}
+
+static void test_pattern_cache_shares_loaded_files() {
+    uint32_t cached = wcGetPatternCacheSize(NULL);
+    wcWeaveParameters a, b;
+    wcInitWeaveParameters(&a);
+    wcInitWeaveParameters(&b);
+    a.uscale = a.vscale = b.uscale = b.vscale = 1.f;
+    wcWeavePatternFromFile(&a, "2parallel.wif");
+    wcWeavePatternFromFile(&b, "2parallel.wif");
+    size_t bytes = 0;
+    assert(wcGetPatternCacheSize(&bytes) == cached + 1);
+    assert(bytes > 0);
+    assert(a.pattern && a.pattern == b.pattern);
+    //Each gets its own yarn types
+    assert(a.yarn_types != b.yarn_types);
+    wcFreeWeavePattern(&a);
+    assert(wcGetPatternCacheSize(NULL) == cached + 1);
+    wcFreeWeavePattern(&b);
+    assert(wcGetPatternCacheSize(NULL) == cached);
+}
+
+static void test_freeing_all_patterns_empties_pattern_cache() {
+    wcFreeWeavePattern(&params_fullsize);
+    wcFreeWeavePattern(&params_halfsize);
+    size_t bytes = 1;
+    assert(wcGetPatternCacheSize(&bytes) == 0);
+    assert(bytes == 0);
+}
+
+static uint32_t test_random_state = 1;
+static float test_random() {
+    //xorshift32
+    test_random_state ^= test_random_state << 13;
+    test_random_state ^= test_random_state >> 17;
+    test_random_state ^= test_random_state << 5;
+    return (test_random_state >> 8) * (1.f/16777216.f);
+}
+
+static void test_sampled_directions_match_pdf() {
+    wcWeaveParameters *params = &params_fullsize;
+    float psis[] = {0.f, 0.5f};
+    for (int k = 0; k < 2; k++) {
+        params->yarn_types[0].psi = psis[k];
+        wcFinalizeWeaveParameters(params);
+        wcIntersectionData data = intersection_data;
+        data.uv_x = 0.35f; data.uv_y = 0.82f;
+        data.wi_x = 0.3f; data.wi_y = 0.2f; data.wi_z = sqrtf(0.87f);
+        wcPatternData pattern_data = wcGetPatternData(data, params);
+        assert(pattern_data.yarn_hit);
+
+        //The fraction of successful samples is the integral of the pdf
+        // over the hemisphere, which is estimated with uniform samples
+        const int n = 100000;
+        int num_sampled = 0;
+        double integral = 0.0;
+        for (int i = 0; i < n; i++) {
+            wcIntersectionData sampled = data;
+            float pdf = wcSample(&sampled, pattern_data, params,
+                test_random(), test_random());
+            if (pdf > 0.f) {
+                num_sampled++;
+                assert(fabsf(pdf/wcPdf(sampled, pattern_data, params) - 1.f)
+                    < 1e-5f);
+            }
+            float z = test_random();
+            float phi = 2.f*M_PI*test_random();
+            sampled.wo_x = sqrtf(1.f - z*z)*cosf(phi);
+            sampled.wo_y = sqrtf(1.f - z*z)*sinf(phi);
+            sampled.wo_z = z;
+            integral += wcPdf(sampled, pattern_data, params)*2.0*M_PI;
+        }
+        assert(fabs((double)num_sampled/n - integral/n) < 0.02);
+    }
+    params->yarn_types[0].psi = wc_default_yarn_type.psi;
+    wcFinalizeWeaveParameters(params);
+}
+
+static void test_importance_sampling_reduces_variance() {
+    //A narrow filament highlight
+    wcWeaveParameters *params = &params_fullsize;
+    params->yarn_types[0].psi = 0.f;
+    params->yarn_types[0].beta = 16.f;
+    params->yarn_types[0].delta_x = 0.1f;
+    wcFinalizeWeaveParameters(params);
+    wcIntersectionData data = intersection_data;
+    data.uv_x = 0.35f; data.uv_y = 0.82f;
+    data.wi_x = 0.1f; data.wi_y = -0.8f; data.wi_z = sqrtf(0.35f);
+    wcPatternData pattern_data = wcGetPatternData(data, params);
+
+    //Estimate the reflected specular light from a uniform environment.
+    // With specular_strength at 0 wcSample is cosine weighted.
+    float strengths[] = {0.f, 0.5f};
+    double mean[2], variance[2];
+    const int num_estimates = 100, num_samples = 64;
+    for (int k = 0; k < 2; k++) {
+        params->yarn_types[0].specular_strength = strengths[k];
+        wcFinalizeWeaveParameters(params);
+        double sum = 0.0, sum_sq = 0.0;
+        for (int j = 0; j < num_estimates; j++) {
+            double estimate = 0.0;
+            for (int i = 0; i < num_samples; i++) {
+                wcIntersectionData sampled = data;
+                float pdf = wcSample(&sampled, pattern_data, params,
+                    test_random(), test_random());
+                if (pdf > 0.f) {
+                    estimate += wcEvalSpecular(sampled, pattern_data, params)
+                        *sampled.wo_z/pdf;
+                }
+            }
+            estimate /= num_samples;
+            sum += estimate;
+            sum_sq += estimate*estimate;
+        }
+        mean[k] = sum/num_estimates;
+        variance[k] = sum_sq/num_estimates - mean[k]*mean[k];
+    }
+    assert(mean[0] > 0.0);
+    assert(fabs(mean[0] - mean[1])
+        < 4.0*sqrt((variance[0] + variance[1])/num_estimates));
+    assert(variance[1]*4.0 < variance[0]);
+
+    params->yarn_types[0].psi = wc_default_yarn_type.psi;
+    params->yarn_types[0].beta = wc_default_yarn_type.beta;
+    params->yarn_types[0].delta_x = wc_default_yarn_type.delta_x;
+    params->yarn_types[0].specular_strength =
+        wc_default_yarn_type.specular_strength;
+    wcFinalizeWeaveParameters(params);
+}
+
+static void test_specular_table_matches_analytic_specular() {
+    wcWeaveParameters *params = &params_fullsize;
+    float psis[] = {0.f, 0.5f};
+    for (int k = 0; k < 2; k++) {
+        params->yarn_types[0].psi = psis[k];
+        params->yarn_types[0].specular_strength = 1.f;
+        params->specular_table_size = 0;
+        wcFinalizeWeaveParameters(params);
+        assert(params->specular_table == 0);
+        assert(wcGetSpecularTableMemory(params) == 0);
+
+        //Directions in the highlight, evaluated without the table
+        const int num_points = 2000;
+        wcIntersectionData points[2000];
+        wcPatternData pattern_data[2000];
+        float analytic[2000];
+        for (int i = 0; i < num_points; i++) {
+            points[i] = intersection_data;
+            points[i].uv_x = test_random();
+            points[i].uv_y = test_random();
+            float z = 0.1f + 0.9f*test_random();
+            float phi = 2.f*M_PI*test_random();
+            points[i].wi_x = sqrtf(1.f - z*z)*cosf(phi);
+            points[i].wi_y = sqrtf(1.f - z*z)*sinf(phi);
+            points[i].wi_z = z;
+            pattern_data[i] = wcGetPatternData(points[i], params);
+            if (wcSample(&points[i], pattern_data[i], params, test_random(),
+                    test_random()) == 0.f) {
+                points[i].wo_x = 0.f; points[i].wo_y = 0.f;
+                points[i].wo_z = 1.f;
+            }
+            analytic[i] = wcEvalSpecular(points[i], pattern_data[i], params);
+        }
+
+        params->specular_table_size = WC_SPECULAR_TABLE_FINAL_SIZE;
+        wcFinalizeWeaveParameters(params);
+        assert(params->specular_table != 0);
+        assert(wcGetSpecularTableMemory(params) > 0);
+        assert(params->specular_table_mean_error > 0.f);
+        assert(params->specular_table_mean_error < 1e-3f);
+        assert(params->specular_table_max_error
+            >= params->specular_table_mean_error);
+        double sum_error = 0.0, sum_value = 0.0;
+        for (int i = 0; i < num_points; i++) {
+            sum_error += fabs(wcEvalSpecular(points[i], pattern_data[i],
+                params) - analytic[i]);
+            sum_value += analytic[i];
+        }
+        assert(sum_value > 0.0);
+        assert(sum_error < 1e-3*sum_value);
+
+        //A larger table gives a smaller error
+        float mean_error = params->specular_table_mean_error;
+        params->specular_table_size = 4*WC_SPECULAR_TABLE_FINAL_SIZE;
+        wcFinalizeWeaveParameters(params);
+        assert(params->specular_table_mean_error < mean_error);
+    }
+
+    params->specular_table_size = 0;
+    params->yarn_types[0].psi = wc_default_yarn_type.psi;
+    params->yarn_types[0].specular_strength =
+        wc_default_yarn_type.specular_strength;
+    wcFinalizeWeaveParameters(params);
+    assert(params->specular_table == 0);
+}
+
+static void test_derived_constants_match_texmapped_parameters() {
+    wcWeaveParameters *params = &params_fullsize;
+    wcYarnType *yarn_type = &params->yarn_types[0];
+    wcYarnType saved_yarn_type = *yarn_type;
+    //wc_eval_texmap_mono below returns 1, so the same values are used with
+    // and without the texmaps
+    float psis[] = {0.f, 1.f};
+    for (int k = 0; k < 2; k++) {
+        yarn_type->umax = 1.f;
+        yarn_type->psi = psis[k];
+        yarn_type->beta = 1.f;
+        yarn_type->delta_x = 1.f;
+        yarn_type->specular_strength = 1.f;
+        wcFinalizeWeaveParameters(params);
+        assert(!params->resolved_yarn_types->has_texmaps);
+        assert(fabsf(params->resolved_yarn_types->radius[0]
+            - 1.f/sinf(1.f)) < 1e-6f);
+        assert(params->resolved_yarn_types->inv_delta_x[0] == 1.f);
+
+        const int num_points = 1000;
+        wcIntersectionData points[1000];
+        wcPatternData pattern_data[1000];
+        float values[1000];
+        for (int i = 0; i < num_points; i++) {
+            points[i] = intersection_data;
+            points[i].uv_x = test_random();
+            points[i].uv_y = test_random();
+            points[i].wi_x = 0.3f; points[i].wi_y = 0.2f;
+            points[i].wi_z = sqrtf(1.f - 0.13f);
+            pattern_data[i] = wcGetPatternData(points[i], params);
+            if (wcSample(&points[i], pattern_data[i], params, test_random(),
+                    test_random()) == 0.f) {
+                points[i].wo_x = 0.f; points[i].wo_y = 0.f;
+                points[i].wo_z = 1.f;
+            }
+            values[i] = wcEvalSpecular(points[i], pattern_data[i], params);
+        }
+
+        yarn_type->umax_texmap = yarn_type->psi_texmap = (void*)params;
+        yarn_type->beta_texmap = yarn_type->delta_x_texmap = (void*)params;
+        if (psis[k] == 0.f) {
+            //psi is 0 without the texmap
+            yarn_type->psi_texmap = NULL;
+        }
+        wcFinalizeWeaveParameters(params);
+        assert(params->resolved_yarn_types->has_texmaps);
+        double sum = 0.0;
+        for (int i = 0; i < num_points; i++) {
+            float value = wcEvalSpecular(points[i], pattern_data[i], params);
+            assert(fabsf(value - values[i]) <= 1e-5f*values[i]);
+            sum += value;
+        }
+        assert(sum > 0.0);
+        yarn_type->umax_texmap = yarn_type->psi_texmap = NULL;
+        yarn_type->beta_texmap = yarn_type->delta_x_texmap = NULL;
+    }
+
+    //exp(beta) overflows a float above 88
+    yarn_type->psi = 0.f;
+    yarn_type->beta = 200.f;
+    wcFinalizeWeaveParameters(params);
+    for (int i = 0; i < 1000; i++) {
+        wcIntersectionData point = intersection_data;
+        point.uv_x = test_random();
+        point.uv_y = test_random();
+        point.wi_x = 0.3f; point.wi_y = 0.2f; point.wi_z = sqrtf(1.f - 0.13f);
+        wcPatternData data = wcGetPatternData(point, params);
+        wcSample(&point, data, params, test_random(), test_random());
+        float value = wcEvalSpecular(point, data, params);
+        assert(value == value && value >= 0.f);
+    }
+
+    *yarn_type = saved_yarn_type;
+    wcFinalizeWeaveParameters(params);
+}
+
+static void test_shading_point_matches_shade() {
+    wcWeaveParameters *params = &params_fullsize;
+    wcYarnType *yarn_type = &params->yarn_types[0];
+    wcYarnType saved_yarn_type = *yarn_type;
+    float psis[] = {0.f, 1.f};
+    for (int k = 0; k < 4; k++) {
+        yarn_type->psi = psis[k%2];
+        yarn_type->specular_noise = 0.5f;
+        yarn_type->specular_strength = 0.5f;
+        if (k >= 2) {
+            yarn_type->umax_texmap = yarn_type->beta_texmap = (void*)params;
+        }
+        wcFinalizeWeaveParameters(params);
+        assert(params->resolved_yarn_types->has_texmaps == (k >= 2));
+        double sum = 0.0;
+        for (int i = 0; i < 1000; i++) {
+            wcIntersectionData point = intersection_data;
+            point.uv_x = test_random();
+            point.uv_y = test_random();
+            wcShadingPoint shading_point = wcPrepareShadingPoint(point.uv_x,
+                point.uv_y, point.context, params);
+            //Several directions for each prepared point
+            for (int j = 0; j < 4; j++) {
+                point.wi_x = 0.3f; point.wi_y = 0.2f;
+                point.wi_z = sqrtf(1.f - 0.13f);
+                wcPatternData data = wcGetPatternData(point, params);
+                wcSample(&point, data, params, test_random(), test_random());
+                wcColor expected = wcShade(point, params);
+                wcColor color = wcEvalShadingPoint(&shading_point,
+                    point.wi_x, point.wi_y, point.wi_z,
+                    point.wo_x, point.wo_y, point.wo_z, params);
+                assert(fabsf(color.r - expected.r) <= 1e-5f*expected.r);
+                assert(fabsf(color.g - expected.g) <= 1e-5f*expected.g);
+                assert(fabsf(color.b - expected.b) <= 1e-5f*expected.b);
+                float specular = wcEvalSpecular(point, data, params);
+                float value = wcEvalShadingPointSpecular(&shading_point,
+                    point.wi_x, point.wi_y, point.wi_z,
+                    point.wo_x, point.wo_y, point.wo_z, params);
+                assert(fabsf(value - specular) <= 1e-5f*specular);
+                sum += value;
+            }
+        }
+        assert(sum > 0.0);
+        yarn_type->umax_texmap = yarn_type->beta_texmap = NULL;
+    }
+    *yarn_type = saved_yarn_type;
+    wcFinalizeWeaveParameters(params);
+}
+
+static void test_multi_direction_specular_matches_single_calls() {
+    //Not a multiple of any vector width, to test the last directions
+    #define NUM_DIRECTIONS 37
+    static float wi_x[NUM_DIRECTIONS], wi_y[NUM_DIRECTIONS];
+    static float wi_z[NUM_DIRECTIONS], wo_x[NUM_DIRECTIONS];
+    static float wo_y[NUM_DIRECTIONS], wo_z[NUM_DIRECTIONS];
+    static float out[NUM_DIRECTIONS];
+    wcWeaveParameters *params = &params_fullsize;
+    float default_psi = params->yarn_types[0].psi;
+    float psis[] = {0.f, 0.5f};
+    for (int k = 0; k < 2; k++) {
+        params->yarn_types[0].psi = psis[k];
+        wcFinalizeWeaveParameters(params);
+        double sum = 0.0;
+        for (int p = 0; p < 100; p++) {
+            wcShadingPoint point = wcPrepareShadingPoint(test_random(),
+                test_random(), NULL, params);
+            //The specular highlights are narrow, so most directions are
+            // sampled along them
+            for (int i = 0; i < NUM_DIRECTIONS; i++) {
+                wcIntersectionData data = intersection_data;
+                float theta = 0.1f + 1.3f*test_random();
+                float phi = 6.2f*test_random();
+                data.wi_x = wi_x[i] = sinf(theta)*cosf(phi);
+                data.wi_y = wi_y[i] = sinf(theta)*sinf(phi);
+                data.wi_z = wi_z[i] = cosf(theta);
+                data.wo_x = 0.f; data.wo_y = 0.f; data.wo_z = 1.f;
+                if (i % 4 != 0) {
+                    wcSample(&data, point.data, params, test_random(),
+                        test_random());
+                }
+                wo_x[i] = data.wo_x; wo_y[i] = data.wo_y;
+                wo_z[i] = data.wo_z;
+            }
+            for (uint8_t level = WC_SIMD_DEFAULT; level <= WC_SIMD_AVX512;
+                    level++) {
+                params->simd_level = level;
+                wcEvalSpecularMultiDir(&point, wi_x, wi_y, wi_z, wo_x, wo_y,
+                    wo_z, NUM_DIRECTIONS, out, params);
+                for (int i = 0; i < NUM_DIRECTIONS; i++) {
+                    float value = wcEvalShadingPointSpecular(&point,
+                        wi_x[i], wi_y[i], wi_z[i], wo_x[i], wo_y[i],
+                        wo_z[i], params);
+                    //The batch uses approximations of sin, cos etc.
+                    float tolerance = 1e-3f*fmaxf(fabsf(value), 1.f);
+                    assert(fabsf(value - out[i]) < tolerance);
+                    sum += out[i];
+                }
+            }
+        }
+        assert(sum > 0.0);
+    }
+    params->yarn_types[0].psi = default_psi;
+    params->simd_level = WC_SIMD_DEFAULT;
+    wcFinalizeWeaveParameters(params);
+    #undef NUM_DIRECTIONS
+}
+
 static void setup() {
     intersection_data.wi_z = 1.f;
     intersection_data.context = NULL;
 
     printf("Setup fullsize pattern... \n");
     wcWeaveParameters *params = &params_fullsize;
+    wcInitWeaveParameters(params);
     params->realworld_uv = 0;
     params->uscale = params->vscale = 1.f;
     printf("Params uscale: %f \n", params->uscale);
@@ -584,6 +1307,7 @@ static void setup() {
     
     printf("Setup halfsize pattern... \n");
     params = &params_halfsize;
+    wcInitWeaveParameters(params);
     params->realworld_uv = 0;
     params->uscale = params->vscale = 1.f;
     printf("Params uscale: %f \n", params->uscale);
@@ -640,6 +1364,23 @@ int main(int argc, char **argv)
     test(extended_segments_between_two_parallel_warps_should_have_zero_bend);
     test(extended_segments_between_two_parallel_warps_should_have_zero_bend2);
     test(extended_segments_over_border_with_two_parallel_warps_should_work);
+    test(batch_pattern_data_matches_single_calls);
+    test(batch_shade_matches_single_calls);
+    test(segment_cache_gives_same_pattern_data);
+    test(finalize_resolves_yarn_type_parameters);
+    test(diffuse_color_uses_texmaps_only_when_set);
+    test(specular_normalization_does_not_depend_on_threads);
+    test(adaptive_normalization_reaches_tolerance);
+    test(normalization_cache_is_used_only_for_same_parameters);
+    test(compiled_pattern_loads_the_same_pattern);
+    test(pattern_cache_shares_loaded_files);
+    test(sampled_directions_match_pdf);
+    test(importance_sampling_reduces_variance);
+    test(specular_table_matches_analytic_specular);
+    test(derived_constants_match_texmapped_parameters);
+    test(shading_point_matches_shade);
+    test(multi_direction_specular_matches_single_calls);
+    test(freeing_all_patterns_empties_pattern_cache);
 }
 
 